@@ -1,10 +1,11 @@
 #pragma once
 
-// eah, simple threads emulation (just mutex), compatible with pthread lib
+// eah, simple threads emulation (mutex, threads, condition variables), compatible with pthread lib
 
 #ifdef _WIN32
 #include <windows.h>
 #include <intrin.h>
+#include <stdlib.h>
 
 #ifndef pthread_self
 #define pthread_self GetCurrentThreadId
@@ -21,6 +22,8 @@ typedef struct
 
 } pthread_mutex_t;
 
+#define PTHREAD_MUTEX_INITIALIZER {0}
+
 typedef struct
 {
     int dummy;
@@ -110,3 +113,113 @@ int inline pthread_mutex_destroy (pthread_mutex_t * mutex)
 {
     return 0;
 }
+
+
+// threads and condition variables (semaphore based; signal/broadcast must be called with mutex locked)
+
+typedef HANDLE pthread_t;
+
+typedef struct
+{
+    int dummy;
+
+} pthread_attr_t;
+
+typedef struct
+{
+    HANDLE sema;
+    volatile long waiters;
+
+} pthread_cond_t;
+
+typedef struct
+{
+    int dummy;
+
+} pthread_condattr_t;
+
+typedef struct
+{
+    void *(*start_routine)(void *);
+    void *arg;
+
+} pthread_start_t;
+
+static DWORD WINAPI pthread_start_proc(LPVOID param)
+{
+    pthread_start_t st = *(pthread_start_t *)param;
+    free(param);
+    st.start_routine(st.arg);
+    return 0;
+}
+
+int inline pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg)
+{
+    pthread_start_t *st = (pthread_start_t *)malloc(sizeof(pthread_start_t));
+    if (!st)
+        return 1;
+
+    st->start_routine = start_routine;
+    st->arg = arg;
+
+    *thread = CreateThread(NULL, 0, pthread_start_proc, st, 0, NULL);
+    if (!*thread)
+    {
+        free(st);
+        return 1;
+    }
+
+    return 0;
+}
+
+int inline pthread_join(pthread_t thread, void **retval)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    if (retval)
+        *retval = NULL;
+    return 0;
+}
+
+int inline pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    cond->waiters = 0;
+    cond->sema = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+    return cond->sema ? 0 : 1;
+}
+
+int inline pthread_cond_destroy(pthread_cond_t *cond)
+{
+    CloseHandle(cond->sema);
+    return 0;
+}
+
+int inline pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    ++cond->waiters;
+    pthread_mutex_unlock(mutex);
+    WaitForSingleObject(cond->sema, INFINITE);
+    pthread_mutex_lock(mutex);
+    return 0;
+}
+
+int inline pthread_cond_signal(pthread_cond_t *cond)
+{
+    if (cond->waiters > 0)
+    {
+        --cond->waiters;
+        ReleaseSemaphore(cond->sema, 1, NULL);
+    }
+    return 0;
+}
+
+int inline pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    if (cond->waiters > 0)
+    {
+        long n = cond->waiters;
+        cond->waiters = 0;
+        ReleaseSemaphore(cond->sema, n, NULL);
+    }
+    return 0;
+}
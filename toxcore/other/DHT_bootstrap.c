@@ -29,8 +29,13 @@
 #include "../toxcore/DHT.h"
 #include "../toxcore/LAN_discovery.h"
 #include "../toxcore/friend_requests.h"
+#include "../toxcore/onion_announce.h"
+#include "../toxcore/ping.h"
 #include "../toxcore/util.h"
 
+#include <errno.h>
+#include <pthread.h>
+
 #define TCP_RELAY_ENABLED
 
 #ifdef TCP_RELAY_ENABLED
@@ -57,6 +62,293 @@
 
 #define PORT 33445
 
+/* Seconds between two dumps of the packet handler profile. */
+#define PROFILE_DUMP_INTERVAL 60
+
+/* Most sockets --threads can bind to PORT. */
+#define MAX_SOCKETS 64
+
+/* Most onion relay threads per socket --relay-threads can start. */
+#define MAX_RELAY_THREADS 64
+
+/* Packets a shard can hold for the main thread between two of its loops. */
+#define SHARD_QUEUE_SIZE 256
+
+/* Nodes a shard can hold for ping_add() of the main DHT between two of its
+ * loops. ping_add() only takes a few of them anyway. */
+#define SHARD_PING_ADD_QUEUE_SIZE 32
+
+/* Seconds between two copies of the close list and onion key of the main
+ * thread to the shards. */
+#define SHARD_SYNC_INTERVAL 1
+
+typedef struct {
+    IP_Port ip_port;
+    uint16_t length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+} Shard_Packet;
+
+/* A node that sent a get nodes request or a ping to a shard. */
+typedef struct {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    IP_Port ip_port;
+} Shard_Ping_Add;
+
+/* An extra socket bound to PORT with SO_REUSEPORT, run by a thread of its own.
+ *
+ * The kernel hands each shard the packets of some senders. Requests that can
+ * be answered without state (get nodes, pings, onion packets and announces)
+ * are answered by the DHT, onion and onion announce of the shard, which use
+ * the keys, close list and announce entries of the main thread. Everything
+ * else, mostly replies to requests sent by the main DHT, is queued for the
+ * main thread, which handles it as if its own socket received it. The nodes
+ * that sent the requests are queued separately, since only the main DHT pings
+ * them. That queue is small and holds each node once, so that a request flood
+ * fills it rather than the queue of replies.
+ */
+typedef struct {
+    DHT *dht;
+    Onion *onion;
+    Onion_Announce *onion_a;
+    pthread_t thread;
+
+    /* Held by the shard thread while it polls and by the main thread while it syncs the shard. */
+    pthread_mutex_t mutex;
+
+    pthread_mutex_t queue_mutex;
+    Shard_Packet queue[SHARD_QUEUE_SIZE];
+    uint32_t queue_start;
+    uint32_t queue_size;
+    Shard_Ping_Add ping_adds[SHARD_PING_ADD_QUEUE_SIZE];
+    uint32_t num_ping_adds;
+} Shard;
+
+static int queue_for_main(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Shard *shard = (Shard *)object;
+
+    pthread_mutex_lock(&shard->queue_mutex);
+
+    if (shard->queue_size == SHARD_QUEUE_SIZE) {
+        pthread_mutex_unlock(&shard->queue_mutex);
+        return 1;
+    }
+
+    Shard_Packet *queued = &shard->queue[(shard->queue_start + shard->queue_size) % SHARD_QUEUE_SIZE];
+    queued->ip_port = source;
+    queued->length = length;
+    memcpy(queued->data, packet, length);
+    ++shard->queue_size;
+
+    pthread_mutex_unlock(&shard->queue_mutex);
+    return 0;
+}
+
+static void queue_ping_add(void *object, const uint8_t *public_key, IP_Port ip_port)
+{
+    Shard *shard = (Shard *)object;
+    uint32_t i;
+
+    pthread_mutex_lock(&shard->queue_mutex);
+
+    for (i = 0; i < shard->num_ping_adds; ++i) {
+        if (public_key_cmp(shard->ping_adds[i].public_key, public_key) == 0) {
+            pthread_mutex_unlock(&shard->queue_mutex);
+            return;
+        }
+    }
+
+    if (shard->num_ping_adds < SHARD_PING_ADD_QUEUE_SIZE) {
+        Shard_Ping_Add *queued = &shard->ping_adds[shard->num_ping_adds];
+        memcpy(queued->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        queued->ip_port = ip_port;
+        ++shard->num_ping_adds;
+    }
+
+    pthread_mutex_unlock(&shard->queue_mutex);
+}
+
+/* Handle the packets shard queued with the handlers of the main DHT. */
+static void handle_shard_queue(Shard *shard, DHT *dht)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&shard->queue_mutex);
+
+    while (shard->queue_size) {
+        const Shard_Packet *queued = &shard->queue[shard->queue_start];
+        networking_handle_packet(dht_get_net(dht), queued->ip_port, queued->data, queued->length, NULL);
+        shard->queue_start = (shard->queue_start + 1) % SHARD_QUEUE_SIZE;
+        --shard->queue_size;
+    }
+
+    for (i = 0; i < shard->num_ping_adds; ++i) {
+        ping_add(dht_get_ping(dht), shard->ping_adds[i].public_key, shard->ping_adds[i].ip_port);
+    }
+
+    shard->num_ping_adds = 0;
+    pthread_mutex_unlock(&shard->queue_mutex);
+}
+
+/* Give shard the current close list and onion key of the main thread. */
+static void sync_shard(Shard *shard, const DHT *dht, const Onion *onion)
+{
+    pthread_mutex_lock(&shard->mutex);
+    dht_copy_close_list(shard->dht, dht);
+    memcpy(shard->onion->secret_symmetric_key, onion->secret_symmetric_key, CRYPTO_SYMMETRIC_KEY_SIZE);
+    shard->onion->timestamp = onion->timestamp;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+static void *run_shard(void *arg)
+{
+    Shard *shard = (Shard *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&shard->mutex);
+        networking_poll(dht_get_net(shard->dht), NULL);
+        pthread_mutex_unlock(&shard->mutex);
+
+        c_sleep(1);
+    }
+
+    return NULL;
+}
+
+/* Create a shard sharing the port, keys and announce entries of the main
+ * thread and start its thread.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int start_shard(Shard *shard, IP ip, DHT *dht, Onion *onion, Onion_Announce *onion_a, int relay_threads)
+{
+    Networking_Core *net = new_networking_reuseport(NULL, ip, PORT, NULL);
+
+    if (net == NULL) {
+        return -1;
+    }
+
+    shard->dht = new_DHT(NULL, net, true);
+
+    if (shard->dht == NULL) {
+        kill_networking(net);
+        return -1;
+    }
+
+    dht_set_self_public_key(shard->dht, dht_get_self_public_key(dht));
+    dht_set_self_secret_key(shard->dht, dht_get_self_secret_key(dht));
+
+    shard->onion = new_onion(shard->dht);
+    shard->onion_a = new_onion_announce(shard->dht);
+
+    if (!(shard->onion && shard->onion_a)) {
+        return -1;
+    }
+
+    if (relay_threads >= 0 && onion_set_relay_threads(shard->onion, relay_threads) == -1) {
+        return -1;
+    }
+
+    onion_announce_share(shard->onion_a, onion_a);
+
+    /* One budget per source for the whole node, whichever socket its packets reach. */
+    if (networking_share_rate_limit(net, dht_get_net(dht)) == -1) {
+        return -1;
+    }
+
+    ping_set_add_callback(dht_get_ping(shard->dht), &queue_ping_add, shard);
+
+    networking_registerhandler(net, NET_PACKET_PING_RESPONSE, &queue_for_main, shard);
+    networking_registerhandler(net, NET_PACKET_SEND_NODES_IPV6, &queue_for_main, shard);
+    networking_registerhandler(net, NET_PACKET_CRYPTO, &queue_for_main, shard);
+    networking_registerhandler(net, NET_PACKET_LAN_DISCOVERY, &queue_for_main, shard);
+#ifdef TCP_RELAY_ENABLED
+    /* Responses for clients of the TCP relay, which only the main onion passes on. */
+    networking_registerhandler(net, NET_PACKET_ONION_RECV_1, &queue_for_main, shard);
+#endif
+
+#ifdef DHT_NODE_EXTRA_PACKETS
+    bootstrap_set_callbacks(net, DHT_VERSION_NUMBER, DHT_MOTD, sizeof(DHT_MOTD));
+#endif
+
+    if (pthread_mutex_init(&shard->mutex, NULL) != 0 || pthread_mutex_init(&shard->queue_mutex, NULL) != 0) {
+        return -1;
+    }
+
+    sync_shard(shard, dht, onion);
+
+    if (pthread_create(&shard->thread, NULL, &run_shard, shard) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void print_handler_profile(Networking_Core *net, uint32_t top_n)
+{
+    static const char *const dispatch_names[METRIC_DISPATCH_COUNT] = {"udp", "crypto", "data"};
+    Metric_Handler_Stat *top = (Metric_Handler_Stat *)calloc(top_n, sizeof(Metric_Handler_Stat));
+
+    if (top == NULL) {
+        return;
+    }
+
+    uint32_t num = metrics_handler_top(net_metrics(net), top, top_n);
+    uint32_t i;
+
+    printf("Most expensive packet handlers:\n");
+    printf("  %-7s %-4s %12s %14s %12s %12s\n", "type", "id", "packets", "total us", "avg ns", "p99 ns <=");
+
+    for (i = 0; i < num; ++i) {
+        printf("  %-7s 0x%02x %12llu %14llu %12llu %12llu\n", dispatch_names[top[i].dispatch], top[i].packet_id,
+               (unsigned long long)top[i].count, (unsigned long long)(top[i].total_ns / 1000),
+               (unsigned long long)(top[i].total_ns / top[i].count), (unsigned long long)top[i].p99_ns);
+    }
+
+    fflush(stdout);
+    free(top);
+}
+
+/* Print the packets received and onion packets relayed per second and core
+ * by each of the num_nets sockets since the last call. last holds two totals
+ * per socket and is updated for the next call.
+ */
+static void print_rates(Networking_Core *const *nets, uint32_t num_nets, uint64_t *last, uint64_t seconds,
+                        uint32_t cores_per_socket)
+{
+    uint64_t received = 0;
+    uint64_t relayed = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_nets; ++i) {
+        uint64_t values[METRIC_COUNT];
+        metrics_snapshot(net_metrics(nets[i]), values);
+
+        const uint64_t socket_received = values[METRIC_NET_PACKETS_RECV] - last[i * 2];
+        const uint64_t socket_relayed = values[METRIC_ONION_PACKETS_RELAYED] - last[i * 2 + 1];
+        last[i * 2] = values[METRIC_NET_PACKETS_RECV];
+        last[i * 2 + 1] = values[METRIC_ONION_PACKETS_RELAYED];
+
+        if (seconds && num_nets > 1) {
+            printf("Socket %u: %llu packets/s received, %llu onion packets/s relayed\n", i,
+                   (unsigned long long)(socket_received / seconds), (unsigned long long)(socket_relayed / seconds));
+        }
+
+        received += socket_received;
+        relayed += socket_relayed;
+    }
+
+    if (seconds) {
+        const uint32_t cores = num_nets * cores_per_socket;
+        printf("Packets received: %llu/s on %u cores, %llu/s per core\n",
+               (unsigned long long)(received / seconds), cores, (unsigned long long)(received / seconds / cores));
+        printf("Onion packets relayed: %llu/s on %u cores, %llu/s per core\n",
+               (unsigned long long)(relayed / seconds), cores, (unsigned long long)(relayed / seconds / cores));
+        fflush(stdout);
+    }
+}
+
 
 void manage_keys(DHT *dht)
 {
@@ -75,12 +367,12 @@ void manage_keys(DHT *dht)
             exit(1);
         }
 
-        memcpy(dht->self_public_key, keys, crypto_box_PUBLICKEYBYTES);
-        memcpy(dht->self_secret_key, keys + crypto_box_PUBLICKEYBYTES, crypto_box_SECRETKEYBYTES);
+        dht_set_self_public_key(dht, keys);
+        dht_set_self_secret_key(dht, keys + crypto_box_PUBLICKEYBYTES);
         printf("Keys loaded successfully.\n");
     } else {
-        memcpy(keys, dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-        memcpy(keys + crypto_box_PUBLICKEYBYTES, dht->self_secret_key, crypto_box_SECRETKEYBYTES);
+        memcpy(keys, dht_get_self_public_key(dht), crypto_box_PUBLICKEYBYTES);
+        memcpy(keys + crypto_box_PUBLICKEYBYTES, dht_get_self_secret_key(dht), crypto_box_SECRETKEYBYTES);
         keys_file = fopen("key", "w");
 
         if (keys_file == NULL) {
@@ -99,14 +391,63 @@ void manage_keys(DHT *dht)
     fclose(keys_file);
 }
 
+static void print_usage(const char *name)
+{
+    printf("Usage (connected)  : %s [--profile N] [--relay-threads N] [--threads N] [--ipv4|--ipv6] IP PORT KEY\n",
+           name);
+    printf("Usage (unconnected): %s [--profile N] [--relay-threads N] [--threads N] [--ipv4|--ipv6]\n", name);
+    printf("--profile N prints the N most expensive packet handlers and the packet rates every %u seconds.\n",
+           PROFILE_DUMP_INTERVAL);
+    printf("--relay-threads N relays onion packets in batches, computing keys on N extra threads per socket.\n");
+    printf("--threads N binds N sockets to the port with SO_REUSEPORT, each answering requests on its own thread.\n");
+}
+
+/* Parse the value of option name, a decimal number between min and max.
+ * Prints the usage and exits if it isn't one.
+ */
+static uint32_t parse_option(const char *prog, const char *name, const char *value, uint32_t min, uint32_t max)
+{
+    char *end;
+    errno = 0;
+    const long number = strtol(value, &end, 10);
+
+    if (errno != 0 || end == value || *end != '\0' || number < (long)min || number > (long)max) {
+        printf("%s must be a number between %u and %u.\n", name, min, max);
+        print_usage(prog);
+        exit(1);
+    }
+
+    return number;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc == 2 && !strncasecmp(argv[1], "-h", 3)) {
-        printf("Usage (connected)  : %s [--ipv4|--ipv6] IP PORT KEY\n", argv[0]);
-        printf("Usage (unconnected): %s [--ipv4|--ipv6]\n", argv[0]);
+        print_usage(argv[0]);
         exit(0);
     }
 
+    uint32_t profile_top_n = 0;
+    int relay_threads = -1;
+    uint32_t num_sockets = 1;
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--profile")) {
+            profile_top_n = parse_option(argv[0], argv[1], argv[2], 1, METRIC_DISPATCH_COUNT * 256);
+        } else if (!strcmp(argv[1], "--relay-threads")) {
+            relay_threads = parse_option(argv[0], argv[1], argv[2], 0, MAX_RELAY_THREADS);
+        } else if (!strcmp(argv[1], "--threads")) {
+            num_sockets = parse_option(argv[0], argv[1], argv[2], 1, MAX_SOCKETS);
+        } else {
+            break;
+        }
+
+        /* drop the option so the rest of the command line parses as before */
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
     /* let user override default by cmdline */
     uint8_t ipv6enabled = TOX_ENABLE_IPV6_DEFAULT; /* x */
     int argvoffset = cmdline_parsefor_ipv46(argc, argv, &ipv6enabled);
@@ -119,12 +460,14 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, ipv6enabled);
 
-    DHT *dht = new_DHT(new_networking(ip, PORT));
+    /* With several sockets, the main one must be bound with SO_REUSEPORT as well. */
+    DHT *dht = new_DHT(NULL, num_sockets > 1 ? new_networking_reuseport(NULL, ip, PORT, NULL)
+                       : new_networking(NULL, ip, PORT), true);
     Onion *onion = new_onion(dht);
     Onion_Announce *onion_a = new_onion_announce(dht);
 
 #ifdef DHT_NODE_EXTRA_PACKETS
-    bootstrap_set_callbacks(dht->net, DHT_VERSION_NUMBER, DHT_MOTD, sizeof(DHT_MOTD));
+    bootstrap_set_callbacks(dht_get_net(dht), DHT_VERSION_NUMBER, DHT_MOTD, sizeof(DHT_MOTD));
 #endif
 
     if (!(onion && onion_a)) {
@@ -132,6 +475,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (relay_threads >= 0 && onion_set_relay_threads(onion, relay_threads) == -1) {
+        printf("Failed to start the onion relay threads.\n");
+        exit(1);
+    }
+
     perror("Initialization");
 
     manage_keys(dht);
@@ -141,7 +489,7 @@ int main(int argc, char *argv[])
 #ifdef TCP_RELAY_ENABLED
 #define NUM_PORTS 3
     uint16_t ports[NUM_PORTS] = {443, 3389, PORT};
-    TCP_Server *tcp_s = new_TCP_server(ipv6enabled, NUM_PORTS, ports, dht->self_secret_key, onion);
+    TCP_Server *tcp_s = new_TCP_server(ipv6enabled, NUM_PORTS, ports, dht_get_self_secret_key(dht), onion);
 
     if (tcp_s == NULL) {
         printf("TCP server failed to initialize.\n");
@@ -150,18 +498,42 @@ int main(int argc, char *argv[])
 
 #endif
 
+    /* Started after manage_keys() so that the shards get the loaded keys. */
+    Shard *shards = NULL;
+    Networking_Core *nets[MAX_SOCKETS];
+    uint64_t last_rates[MAX_SOCKETS * 2] = {0};
+    nets[0] = dht_get_net(dht);
+
+    if (num_sockets > 1) {
+        shards = (Shard *)calloc(num_sockets - 1, sizeof(Shard));
+
+        if (shards == NULL) {
+            printf("Failed to allocate the shards.\n");
+            exit(1);
+        }
+    }
+
+    for (i = 1; i < num_sockets; ++i) {
+        if (start_shard(&shards[i - 1], ip, dht, onion, onion_a, relay_threads) == -1) {
+            printf("Failed to start the thread of socket %u.\n", i);
+            exit(1);
+        }
+
+        nets[i] = dht_get_net(shards[i - 1].dht);
+    }
+
     FILE *file;
     file = fopen("PUBLIC_ID.txt", "w");
 
     for (i = 0; i < 32; i++) {
-        printf("%02hhX", dht->self_public_key[i]);
-        fprintf(file, "%02hhX", dht->self_public_key[i]);
+        printf("%02hhX", dht_get_self_public_key(dht)[i]);
+        fprintf(file, "%02hhX", dht_get_self_public_key(dht)[i]);
     }
 
     fclose(file);
 
     printf("\n");
-    printf("Port: %u\n", ntohs(dht->net->port));
+    printf("Port: %u\n", ntohs(net_port(dht_get_net(dht))));
 
     if (argc > argvoffset + 3) {
         printf("Trying to bootstrap into the network...\n");
@@ -179,8 +551,28 @@ int main(int argc, char *argv[])
 
     int is_waiting_for_dht_connection = 1;
 
+    uint64_t last_profile_dump = unix_time();
+    uint64_t last_shard_sync = unix_time();
+
+    /* The shards must not poll while their handler timing is turned on, see metrics_set_handler_timing(). */
+    for (i = 0; i < num_sockets && profile_top_n; ++i) {
+        if (i > 0) {
+            pthread_mutex_lock(&shards[i - 1].mutex);
+        }
+
+        if (metrics_set_handler_timing(net_metrics(nets[i]), 1) == -1) {
+            printf("Failed to enable packet handler timing.\n");
+            profile_top_n = 0;
+        }
+
+        if (i > 0) {
+            pthread_mutex_unlock(&shards[i - 1].mutex);
+        }
+    }
+
     uint64_t last_LANdiscovery = 0;
-    LANdiscovery_init(dht);
+    lan_discovery_init(dht);
+    Lan_Monitor *lan_monitor = new_lan_monitor();
 
     while (1) {
         if (is_waiting_for_dht_connection && DHT_isconnected(dht)) {
@@ -190,15 +582,45 @@ int main(int argc, char *argv[])
 
         do_DHT(dht);
 
+        if (lan_monitor_changed(lan_monitor)) {
+            last_LANdiscovery = 0;
+        }
+
         if (is_timeout(last_LANdiscovery, is_waiting_for_dht_connection ? 5 : LAN_DISCOVERY_INTERVAL)) {
-            send_LANdiscovery(htons(PORT), dht);
+            lan_discovery_send(htons(PORT), dht);
             last_LANdiscovery = unix_time();
         }
 
 #ifdef TCP_RELAY_ENABLED
         do_TCP_server(tcp_s);
 #endif
-        networking_poll(dht->net);
+        networking_poll(dht_get_net(dht), NULL);
+
+        for (i = 1; i < num_sockets; ++i) {
+            handle_shard_queue(&shards[i - 1], dht);
+        }
+
+        if (num_sockets > 1 && is_timeout(last_shard_sync, SHARD_SYNC_INTERVAL)) {
+            for (i = 1; i < num_sockets; ++i) {
+                sync_shard(&shards[i - 1], dht, onion);
+            }
+
+            last_shard_sync = unix_time();
+        }
+
+        if (profile_top_n && is_timeout(last_profile_dump, PROFILE_DUMP_INTERVAL)) {
+            for (i = 0; i < num_sockets; ++i) {
+                if (num_sockets > 1) {
+                    printf("Socket %u:\n", i);
+                }
+
+                print_handler_profile(nets[i], profile_top_n);
+            }
+
+            print_rates(nets, num_sockets, last_rates, unix_time() - last_profile_dump,
+                        relay_threads > 0 ? relay_threads + 1 : 1);
+            last_profile_dump = unix_time();
+        }
 
         c_sleep(1);
     }
@@ -0,0 +1,249 @@
+/* bootstrap_load -- Load generator for bootstrap nodes
+ *
+ * Floods a bootstrap node with get nodes and onion announce requests from
+ * several threads and prints how many of them it answers per second. Run it
+ * from one or more machines other than the node, with more threads than the
+ * node has, and compare the rates for different DHT_bootstrap --threads.
+ *
+ * Every thread has a DHT key of its own and sends announce requests the way
+ * the last node of an onion path would, so the node does all the work of
+ * answering them except for relaying over the path.
+ *
+ * Usage: bootstrap_load [--threads N] [--seconds N] [--cores N] IP PORT KEY
+ *
+ * --threads N  sending threads, 4 by default
+ * --seconds N  how long to send for, 30 by default
+ * --cores N    cores used by the node, to print the rate per core
+ *
+ * To compile it link it against toxcore and its dependencies, e.g.:
+ *   gcc -I../../toxcore bootstrap_load.c -o bootstrap_load -ltoxcore -lsodium -lpthread
+ */
+
+#include "../../testing/misc_tools.c" // hex_string_to_bin
+#include "../../toxcore/DHT.h"
+#include "../../toxcore/onion_announce.h"
+#include "../../toxcore/util.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* Different announce packets sent by each thread, built once so that the
+ * sending threads don't spend their time encrypting them. */
+#define ANNOUNCE_PACKETS 64
+#define ANNOUNCE_PACKET_SIZE (ONION_ANNOUNCE_REQUEST_SIZE + ONION_RETURN_3)
+
+/* Requests of each kind sent between two polls of the socket. */
+#define BURST 16
+
+typedef struct {
+    pthread_t thread;
+    DHT *dht;
+    IP_Port node;
+    const uint8_t *node_public_key;
+    uint8_t announces[ANNOUNCE_PACKETS][ANNOUNCE_PACKET_SIZE];
+} Load_Thread;
+
+static volatile int running = 1;
+
+static int init_load_thread(Load_Thread *load, IP_Port node, const uint8_t *node_public_key)
+{
+    IP ip;
+    ip_init(&ip, node.ip.family == TOX_AF_INET6);
+
+    Networking_Core *net = new_networking_ex(NULL, ip, 0, 0, NULL);
+
+    if (net == NULL) {
+        return -1;
+    }
+
+    load->dht = new_DHT(NULL, net, false);
+
+    if (load->dht == NULL) {
+        return -1;
+    }
+
+    /* Only count the answers, decrypting them would slow the threads down. */
+    networking_registerhandler(net, NET_PACKET_SEND_NODES_IPV6, NULL, NULL);
+
+    load->node = node;
+    load->node_public_key = node_public_key;
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(public_key, secret_key);
+
+    uint32_t i;
+
+    for (i = 0; i < ANNOUNCE_PACKETS; ++i) {
+        uint8_t ping_id[ONION_PING_ID_SIZE] = {0};
+        uint8_t search_id[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t data_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_bytes(search_id, sizeof(search_id));
+        random_bytes(data_public_key, sizeof(data_public_key));
+
+        if (create_announce_request(load->announces[i], ONION_ANNOUNCE_REQUEST_SIZE, node_public_key, public_key,
+                                    secret_key, ping_id, search_id, data_public_key, i) != ONION_ANNOUNCE_REQUEST_SIZE) {
+            return -1;
+        }
+
+        /* Stands in for the return path of the onion, the node only copies it. */
+        random_bytes(load->announces[i] + ONION_ANNOUNCE_REQUEST_SIZE, ONION_RETURN_3);
+    }
+
+    return 0;
+}
+
+static void *run_load_thread(void *arg)
+{
+    Load_Thread *load = (Load_Thread *)arg;
+    Networking_Core *net = dht_get_net(load->dht);
+    uint32_t next_announce = 0;
+
+    while (running) {
+        uint32_t i;
+
+        for (i = 0; i < BURST; ++i) {
+            uint8_t search_id[CRYPTO_PUBLIC_KEY_SIZE];
+            random_bytes(search_id, sizeof(search_id));
+            DHT_getnodes(load->dht, &load->node, load->node_public_key, search_id);
+
+            sendpacket(net, load->node, load->announces[next_announce], ANNOUNCE_PACKET_SIZE);
+            next_announce = (next_announce + 1) % ANNOUNCE_PACKETS;
+        }
+
+        networking_poll(net, NULL);
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    uint64_t getnodes_sent;
+    uint64_t getnodes_answered;
+    uint64_t announces_sent;
+    uint64_t announces_answered;
+} Load_Totals;
+
+static void load_totals(const Load_Thread *loads, uint32_t num, Load_Totals *totals)
+{
+    uint32_t i;
+    memset(totals, 0, sizeof(Load_Totals));
+
+    for (i = 0; i < num; ++i) {
+        const Metrics *metrics = net_metrics(dht_get_net(loads[i].dht));
+        totals->getnodes_sent += metrics_atomic_load(&metrics->packets_sent[NET_PACKET_GET_NODES]);
+        totals->getnodes_answered += metrics_atomic_load(&metrics->packets_recv[NET_PACKET_SEND_NODES_IPV6]);
+        totals->announces_sent += metrics_atomic_load(&metrics->packets_sent[NET_PACKET_ANNOUNCE_REQUEST]);
+        totals->announces_answered += metrics_atomic_load(&metrics->packets_recv[NET_PACKET_ONION_RECV_3]);
+    }
+}
+
+static void print_rate(const char *what, const Load_Totals *now, const Load_Totals *then, uint64_t seconds,
+                       uint32_t cores)
+{
+    const uint64_t getnodes = (now->getnodes_answered - then->getnodes_answered) / seconds;
+    const uint64_t announces = (now->announces_answered - then->announces_answered) / seconds;
+
+    printf("%s: %llu/s get nodes sent, %llu/s answered; %llu/s announces sent, %llu/s answered",
+           what, (unsigned long long)((now->getnodes_sent - then->getnodes_sent) / seconds), (unsigned long long)getnodes,
+           (unsigned long long)((now->announces_sent - then->announces_sent) / seconds), (unsigned long long)announces);
+
+    if (cores) {
+        printf("; %llu/s answered per node core", (unsigned long long)((getnodes + announces) / cores));
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_threads = 4;
+    uint32_t seconds = 30;
+    uint32_t cores = 0;
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--threads")) {
+            num_threads = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--seconds")) {
+            seconds = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--cores")) {
+            cores = atoi(argv[2]);
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 4 || num_threads == 0 || seconds == 0) {
+        printf("Usage: %s [--threads N] [--seconds N] [--cores N] IP PORT KEY\n", argv[0]);
+        return 1;
+    }
+
+    IP_Port node;
+    memset(&node, 0, sizeof(node));
+    node.ip.family = TOX_AF_UNSPEC;
+
+    if (!addr_resolve_or_parse_ip(argv[1], &node.ip, NULL)) {
+        printf("Failed to convert \"%s\" into an IP address.\n", argv[1]);
+        return 1;
+    }
+
+    node.port = net_htons(atoi(argv[2]));
+    uint8_t *node_public_key = hex_string_to_bin(argv[3]);
+
+    Load_Thread *loads = (Load_Thread *)calloc(num_threads, sizeof(Load_Thread));
+
+    if (loads == NULL) {
+        printf("Failed to allocate the threads.\n");
+        return 1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_threads; ++i) {
+        if (init_load_thread(&loads[i], node, node_public_key) == -1) {
+            printf("Failed to set up thread %u.\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(&loads[i].thread, NULL, &run_load_thread, &loads[i]) != 0) {
+            printf("Failed to start thread %u.\n", i);
+            return 1;
+        }
+    }
+
+    Load_Totals start, last, now;
+    load_totals(loads, num_threads, &start);
+    last = start;
+
+    for (i = 1; i <= seconds; ++i) {
+        sleep(1);
+        load_totals(loads, num_threads, &now);
+        print_rate("Last second", &now, &last, 1, cores);
+        last = now;
+    }
+
+    running = 0;
+
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(loads[i].thread, NULL);
+    }
+
+    print_rate("Sustained", &now, &start, seconds, cores);
+
+    for (i = 0; i < num_threads; ++i) {
+        Networking_Core *net = dht_get_net(loads[i].dht);
+        kill_DHT(loads[i].dht);
+        kill_networking(net);
+    }
+
+    free(loads);
+    free(node_public_key);
+    return 0;
+}
@@ -0,0 +1,319 @@
+/* file_transfer_bench -- File transfer throughput between two Tox instances
+ *
+ * Sends a file between two Tox instances over loopback three times: with the
+ * chunk request and file data callbacks, with tox_file_set_buffer on both
+ * ends, and with tox_file_set_fd on both ends. Each way gets a new pair of
+ * instances, so that none starts at the send rate an earlier one reached.
+ *
+ * For each way it prints the throughput in MB/s and the CPU time the process
+ * spent per GB transferred. Both instances run in one thread, which sleeps
+ * for 1 ms between iterations like a client's event loop would.
+ *
+ * Usage: file_transfer_bench [--size MB]
+ *
+ * --size MB  size of the file sent, 64 by default
+ *
+ * To compile it link it against toxcore and its dependencies, e.g.:
+ *   gcc file_transfer_bench.c -o file_transfer_bench -ltoxcore -lsodium -lpthread
+ */
+
+#include "../../toxcore/metrics.h"
+#include "../../toxcore/tox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Seconds to wait for each pair of friends to connect and for each transfer. */
+#define SETUP_TIMEOUT 60
+#define TRANSFER_TIMEOUT 600
+
+typedef enum {
+    MODE_CALLBACKS,
+    MODE_BUFFER,
+    MODE_FD,
+} Mode;
+
+static const char *const mode_names[] = {
+    "Chunk callbacks",
+    "tox_file_set_buffer",
+    "tox_file_set_fd",
+};
+
+typedef struct {
+    Tox *tox[2];
+    Mode mode;
+    uint64_t size;
+    uint8_t *send_data;
+    uint8_t *recv_data;
+    FILE *send_file;
+    FILE *recv_file;
+    int done;
+    int failed;
+} Bench;
+
+static void file_chunk_request_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                                  size_t length, void *user_data)
+{
+    Bench *bench = (Bench *)user_data;
+
+    if (length == 0 || bench->mode != MODE_CALLBACKS) {
+        return;
+    }
+
+    if (!tox_file_send_chunk(tox, friend_number, file_number, position, bench->send_data + position, length, NULL)) {
+        bench->failed = 1;
+    }
+}
+
+static void file_recv_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint32_t kind, uint64_t file_size,
+                         const uint8_t *filename, size_t filename_length, void *user_data)
+{
+    Bench *bench = (Bench *)user_data;
+    bool ok = 1;
+
+    if (bench->mode == MODE_BUFFER) {
+        ok = tox_file_set_buffer(tox, friend_number, file_number, bench->recv_data, bench->size, NULL);
+    } else if (bench->mode == MODE_FD) {
+        ok = tox_file_set_fd(tox, friend_number, file_number, fileno(bench->recv_file), NULL);
+    }
+
+    if (!ok || !tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_RESUME, NULL)) {
+        bench->failed = 1;
+    }
+}
+
+static void file_recv_chunk_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                               const uint8_t *data, size_t length, void *user_data)
+{
+    Bench *bench = (Bench *)user_data;
+
+    if (length == 0) {
+        bench->done = 1;
+        return;
+    }
+
+    if (position + length > bench->size) {
+        bench->failed = 1;
+        return;
+    }
+
+    memcpy(bench->recv_data + position, data, length);
+}
+
+static void file_recv_control_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, TOX_FILE_CONTROL control,
+                                 void *user_data)
+{
+    Bench *bench = (Bench *)user_data;
+
+    if (control == TOX_FILE_CONTROL_CANCEL) {
+        bench->failed = 1;
+    }
+}
+
+static void iterate(Bench *bench)
+{
+    tox_iterate(bench->tox[0], bench);
+    tox_iterate(bench->tox[1], bench);
+    usleep(1000);
+}
+
+static int setup(Bench *bench)
+{
+    struct Tox_Options options;
+    tox_options_default(&options);
+    options.local_discovery_enabled = 0;
+    uint32_t i;
+
+    for (i = 0; i < 2; ++i) {
+        bench->tox[i] = tox_new(&options, NULL);
+
+        if (bench->tox[i] == NULL) {
+            printf("Failed to create Tox instance %u.\n", i);
+            return -1;
+        }
+    }
+
+    tox_callback_file_chunk_request(bench->tox[0], file_chunk_request_cb);
+    tox_callback_file_recv_control(bench->tox[0], file_recv_control_cb);
+    tox_callback_file_recv(bench->tox[1], file_recv_cb);
+    tox_callback_file_recv_chunk(bench->tox[1], file_recv_chunk_cb);
+    tox_callback_file_recv_control(bench->tox[1], file_recv_control_cb);
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(bench->tox[0], dht_key);
+    tox_bootstrap(bench->tox[1], "127.0.0.1", tox_self_get_udp_port(bench->tox[0], NULL), dht_key, NULL);
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(bench->tox[1], public_key);
+    tox_friend_add_norequest(bench->tox[0], public_key, NULL);
+    tox_self_get_public_key(bench->tox[0], public_key);
+    tox_friend_add_norequest(bench->tox[1], public_key, NULL);
+
+    const time_t start = time(NULL);
+
+    while (tox_friend_get_connection_status(bench->tox[0], 0, NULL) != TOX_CONNECTION_UDP
+            || tox_friend_get_connection_status(bench->tox[1], 0, NULL) != TOX_CONNECTION_UDP) {
+        if (time(NULL) - start > SETUP_TIMEOUT) {
+            printf("The friends did not connect within %u seconds.\n", SETUP_TIMEOUT);
+            return -1;
+        }
+
+        iterate(bench);
+    }
+
+    return 0;
+}
+
+/* Compare what was received with what was sent. */
+static int check(Bench *bench)
+{
+    if (bench->mode == MODE_FD) {
+        if (fseek(bench->recv_file, 0, SEEK_SET) != 0
+                || fread(bench->recv_data, 1, bench->size, bench->recv_file) != bench->size) {
+            return -1;
+        }
+    }
+
+    return memcmp(bench->send_data, bench->recv_data, bench->size) == 0 ? 0 : -1;
+}
+
+static void teardown(Bench *bench)
+{
+    uint32_t i;
+
+    for (i = 0; i < 2; ++i) {
+        tox_kill(bench->tox[i]);
+        bench->tox[i] = NULL;
+    }
+
+    if (bench->recv_file != NULL) {
+        fclose(bench->recv_file);
+        bench->recv_file = NULL;
+    }
+}
+
+static int transfer(Bench *bench, Mode mode)
+{
+    const uint64_t start = metrics_time_ns();
+    const clock_t cpu_start = clock();
+
+    TOX_ERR_FILE_SEND error;
+    const uint32_t file_number = tox_file_send(bench->tox[0], 0, TOX_FILE_KIND_DATA, bench->size, NULL,
+                                               (const uint8_t *)"bench", 5, &error);
+    bool ok = error == TOX_ERR_FILE_SEND_OK;
+
+    if (ok && mode == MODE_BUFFER) {
+        ok = tox_file_set_buffer(bench->tox[0], 0, file_number, bench->send_data, bench->size, NULL);
+    } else if (ok && mode == MODE_FD) {
+        ok = tox_file_set_fd(bench->tox[0], 0, file_number, fileno(bench->send_file), NULL);
+    }
+
+    if (!ok) {
+        printf("%s: failed to send the file.\n", mode_names[mode]);
+        return -1;
+    }
+
+    while (!bench->done && !bench->failed) {
+        if ((metrics_time_ns() - start) / 1000000000 > TRANSFER_TIMEOUT) {
+            printf("%s: not done within %u seconds.\n", mode_names[mode], TRANSFER_TIMEOUT);
+            return -1;
+        }
+
+        iterate(bench);
+    }
+
+    const double seconds = (metrics_time_ns() - start) / 1e9;
+    const double cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+    int ret = 0;
+
+    if (bench->failed || check(bench) != 0) {
+        printf("%s: the transfer failed.\n", mode_names[mode]);
+        ret = -1;
+    } else {
+        printf("%s: %.1f MB/s, %.2f s CPU per GB\n", mode_names[mode], bench->size / 1e6 / seconds,
+               cpu / (bench->size / 1e9));
+    }
+
+    return ret;
+}
+
+/* Send the file with a new pair of friends. */
+static int run(Bench *bench, Mode mode)
+{
+    bench->mode = mode;
+    bench->done = 0;
+    bench->failed = 0;
+    memset(bench->recv_data, 0, bench->size);
+
+    if (mode == MODE_FD) {
+        bench->recv_file = tmpfile();
+
+        if (bench->recv_file == NULL) {
+            printf("Failed to create a temporary file.\n");
+            return -1;
+        }
+    }
+
+    const int ret = setup(bench) == 0 ? transfer(bench, mode) : -1;
+    teardown(bench);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t size = 64;
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--size")) {
+            size = atoi(argv[2]);
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 1 || size == 0) {
+        printf("Usage: %s [--size MB]\n", argv[0]);
+        return 1;
+    }
+
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.size = (uint64_t)size * 1000000;
+    bench.send_data = (uint8_t *)malloc(bench.size);
+    bench.recv_data = (uint8_t *)malloc(bench.size);
+    bench.send_file = tmpfile();
+
+    if (bench.send_data == NULL || bench.recv_data == NULL || bench.send_file == NULL) {
+        printf("Failed to allocate the file data.\n");
+        return 1;
+    }
+
+    uint64_t i;
+
+    for (i = 0; i < bench.size; ++i) {
+        bench.send_data[i] = (uint8_t)(i * 31 + i / 4096);
+    }
+
+    if (fwrite(bench.send_data, 1, bench.size, bench.send_file) != bench.size || fflush(bench.send_file) != 0) {
+        printf("Failed to write the file to send.\n");
+        return 1;
+    }
+
+    int ret = 0;
+
+    if (run(&bench, MODE_CALLBACKS) != 0 || run(&bench, MODE_BUFFER) != 0 || run(&bench, MODE_FD) != 0) {
+        ret = 1;
+    }
+
+    fclose(bench.send_file);
+    free(bench.send_data);
+    free(bench.recv_data);
+    return ret;
+}
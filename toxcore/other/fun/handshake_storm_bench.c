@@ -0,0 +1,301 @@
+/* handshake_storm_bench -- New connection handshake storm against one Net_Crypto
+ *
+ * Simulates many peers connecting to one Net_Crypto instance at once, as after
+ * a bootstrap node or a popular client restarts: every peer sends a valid
+ * handshake at a random time within the first second and resends it every
+ * CRYPTO_SEND_PACKET_INTERVAL, up to MAX_NUM_SENDPACKET_TRIES times, until
+ * its connection is accepted. The packets are handed to Net_Crypto directly,
+ * so the per source and total rate limits of the UDP socket don't apply.
+ *
+ * It prints how many peers were accepted, the longest do_net_crypto()
+ * iteration, percentiles of the time from the first handshake of a peer to
+ * its connection being accepted, and the handshake queue metrics.
+ *
+ * Usage: handshake_storm_bench [--peers N] [--seconds N] [--inline]
+ *
+ * --peers N    peers connecting, 5000 by default
+ * --seconds N  how long the storm runs, 12 by default
+ * --inline     handle each handshake as it arrives instead of queueing it,
+ *              the way new connection handshakes were handled before the queue
+ *
+ * The handshakes are built with the static functions of net_crypto.c, which is
+ * included below, so compile it with the toxcore sources other than that one
+ * instead of linking it against toxcore, e.g.:
+ *   gcc handshake_storm_bench.c $(find ../../toxcore -name '*.c' ! -name net_crypto.c) \
+ *       -o handshake_storm_bench -lsodium -lpthread
+ */
+
+#include "../../toxcore/net_crypto.c"
+
+#include <stdio.h>
+#include <unistd.h>
+
+typedef struct {
+    IP_Port source;
+    uint8_t packet[HANDSHAKE_PACKET_LENGTH];
+    uint64_t first_sent;
+    uint64_t next_send;
+    uint64_t accepted; /* 0 until the connection is accepted */
+    uint32_t tries;
+} Peer;
+
+typedef struct {
+    Net_Crypto *net_crypto;
+    Peer *peers;
+    uint32_t num_peers;
+    BS_LIST peer_keys; /* peer numbers by public key */
+} Bench;
+
+static int send_cb(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    return length;
+}
+
+static int recv_cb(void *object, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    return -1;
+}
+
+static int new_connection_cb(void *object, New_Connection *n_c)
+{
+    Bench *bench = (Bench *)object;
+    const int peer = bs_list_find(&bench->peer_keys, n_c->public_key);
+
+    if (peer == -1) {
+        return -1;
+    }
+
+    if (bench->peers[peer].accepted == 0) {
+        bench->peers[peer].accepted = current_time_monotonic();
+    }
+
+    return accept_crypto_connection(bench->net_crypto, n_c) == -1 ? -1 : 0;
+}
+
+/* Give every peer its own key, address and a handshake carrying a cookie of
+ * the instance under test.
+ */
+static int create_peers(Bench *bench)
+{
+    const Net_Crypto *c = bench->net_crypto;
+    Net_Crypto *peer_c = (Net_Crypto *)calloc(1, sizeof(Net_Crypto));
+
+    if (peer_c == NULL) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < bench->num_peers; ++i) {
+        Peer *peer = &bench->peers[i];
+        crypto_new_keypair(peer_c->self_public_key, peer_c->self_secret_key);
+
+        uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+        uint8_t cookie[COOKIE_LENGTH];
+        memcpy(cookie_plain, peer_c->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        random_bytes(cookie_plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_PUBLIC_KEY_SIZE);
+
+        uint8_t nonce[CRYPTO_NONCE_SIZE];
+        uint8_t session_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        uint8_t session_secret_key[CRYPTO_SECRET_KEY_SIZE];
+        random_nonce(nonce);
+        crypto_new_keypair(session_public_key, session_secret_key);
+
+        if (create_cookie(cookie, cookie_plain, c->secret_symmetric_key) != 0
+                || create_crypto_handshake(peer_c, peer->packet, cookie, nonce, session_public_key, c->self_public_key,
+                                           dht_get_self_public_key(c->dht)) != HANDSHAKE_PACKET_LENGTH
+                || !bs_list_add(&bench->peer_keys, peer_c->self_public_key, i)) {
+            free(peer_c);
+            return -1;
+        }
+
+        ip_init(&peer->source.ip, 0);
+        peer->source.ip.ip.v4.uint32 = net_htonl(0x0a000001 + i);
+        peer->source.port = net_htons(33445);
+    }
+
+    crypto_memzero(peer_c, sizeof(Net_Crypto));
+    free(peer_c);
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_results(const Bench *bench, const Metrics *metrics, uint64_t sent, uint64_t iterations,
+                          uint64_t longest)
+{
+    uint64_t *latency = (uint64_t *)malloc(bench->num_peers * sizeof(uint64_t));
+    uint32_t num = 0;
+    uint32_t i;
+
+    if (latency == NULL) {
+        return;
+    }
+
+    for (i = 0; i < bench->num_peers; ++i) {
+        if (bench->peers[i].accepted != 0) {
+            latency[num] = bench->peers[i].accepted - bench->peers[i].first_sent;
+            ++num;
+        }
+    }
+
+    printf("Accepted %u of %u peers, %llu handshakes sent, %llu iterations, longest iteration %llu ms\n", num,
+           bench->num_peers, (unsigned long long)sent, (unsigned long long)iterations, (unsigned long long)longest);
+
+    if (num != 0) {
+        uint64_t total = 0;
+
+        for (i = 0; i < num; ++i) {
+            total += latency[i];
+        }
+
+        qsort(latency, num, sizeof(uint64_t), cmp_u64);
+        printf("Time until accepted: mean %llu ms, p50 %llu ms, p90 %llu ms, p99 %llu ms, max %llu ms\n",
+               (unsigned long long)(total / num), (unsigned long long)latency[num / 2],
+               (unsigned long long)latency[num * 9 / 10], (unsigned long long)latency[num * 99 / 100],
+               (unsigned long long)latency[num - 1]);
+    }
+
+    free(latency);
+
+    const Metric_Histogram *wait = &metrics->histograms[METRIC_HISTOGRAM_CRYPTO_HANDSHAKE_WAIT_MS];
+    const char *separator = "";
+    printf("Handshakes dropped from the queue: %llu\nQueue wait:",
+           (unsigned long long)metrics->values[METRIC_CRYPTO_HANDSHAKES_DROPPED]);
+
+    for (i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+        if (wait->buckets[i] != 0) {
+            printf("%s %llu below %llu ms", separator, (unsigned long long)wait->buckets[i],
+                   (unsigned long long)(1ULL << i));
+            separator = ",";
+        }
+    }
+
+    printf("\n");
+}
+
+static void run(Bench *bench, uint32_t seconds, bool handle_inline)
+{
+    Net_Crypto *c = bench->net_crypto;
+    const uint64_t start = current_time_monotonic();
+    uint64_t sent = 0, iterations = 0, longest = 0;
+    uint32_t i;
+
+    for (i = 0; i < bench->num_peers; ++i) {
+        bench->peers[i].first_sent = start + random_u32() % CRYPTO_SEND_PACKET_INTERVAL;
+        bench->peers[i].next_send = bench->peers[i].first_sent;
+    }
+
+    while (current_time_monotonic() < start + seconds * 1000ULL) {
+        const uint64_t iteration_start = current_time_monotonic();
+        unix_time_update();
+
+        for (i = 0; i < bench->num_peers; ++i) {
+            Peer *peer = &bench->peers[i];
+
+            if (peer->accepted != 0 || peer->tries >= MAX_NUM_SENDPACKET_TRIES || peer->next_send > iteration_start) {
+                continue;
+            }
+
+            ++peer->tries;
+            ++sent;
+            peer->next_send = iteration_start + CRYPTO_SEND_PACKET_INTERVAL;
+
+            if (handle_inline) {
+                handle_new_connection_handshake(c, peer->source, peer->packet, HANDSHAKE_PACKET_LENGTH, NULL);
+            } else {
+                udp_handle_packet(c, peer->source, peer->packet, HANDSHAKE_PACKET_LENGTH, NULL);
+            }
+        }
+
+        do_net_crypto(c, NULL);
+
+        const uint64_t time = current_time_monotonic() - iteration_start;
+        longest = time > longest ? time : longest;
+        ++iterations;
+
+        /* Sleep like a client would, but wake up for the next resends. */
+        uint32_t interval = crypto_run_interval(c);
+        interval = interval < 50 ? interval : 50;
+        usleep(interval * 1000);
+    }
+
+    print_results(bench, net_metrics(dht_get_net(c->dht)), sent, iterations, longest);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_peers = 5000;
+    uint32_t seconds = 12;
+    bool handle_inline = 0;
+
+    while (argc > 1) {
+        if (!strcmp(argv[1], "--inline")) {
+            handle_inline = 1;
+            argv[1] = argv[0];
+            ++argv;
+            --argc;
+            continue;
+        }
+
+        if (argc < 3) {
+            break;
+        }
+
+        if (!strcmp(argv[1], "--peers")) {
+            num_peers = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--seconds")) {
+            seconds = atoi(argv[2]);
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 1 || num_peers == 0 || seconds == 0) {
+        printf("Usage: %s [--peers N] [--seconds N] [--inline]\n", argv[0]);
+        return 1;
+    }
+
+    const Net_Backend backend = {send_cb, recv_cb, NULL, TOX_AF_INET, net_htons(33445)};
+    Networking_Core *net = new_networking_backend(NULL, &backend);
+    DHT *dht = net ? new_DHT(NULL, net, false) : NULL;
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.net_crypto = dht ? new_net_crypto(NULL, dht, &proxy_info) : NULL;
+    bench.num_peers = num_peers;
+    bench.peers = (Peer *)calloc(num_peers, sizeof(Peer));
+
+    if (bench.net_crypto == NULL || bench.peers == NULL
+            || !bs_list_init(&bench.peer_keys, CRYPTO_PUBLIC_KEY_SIZE, num_peers)) {
+        printf("Failed to create the Net_Crypto instance.\n");
+        return 1;
+    }
+
+    new_connection_handler(bench.net_crypto, new_connection_cb, &bench);
+    unix_time_update();
+
+    if (create_peers(&bench) != 0) {
+        printf("Failed to create the handshakes of the peers.\n");
+        return 1;
+    }
+
+    run(&bench, seconds, handle_inline);
+
+    bs_list_free(&bench.peer_keys);
+    free(bench.peers);
+    kill_net_crypto(bench.net_crypto);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
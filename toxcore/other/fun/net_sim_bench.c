@@ -0,0 +1,598 @@
+/* net_sim_bench -- Benchmarks of whole Tox networks on the network simulator
+ *
+ * Runs a network of Messenger instances on net_sim, in virtual time, and
+ * measures in turn:
+ *
+ * - DHT convergence: virtual time until 50%, 90% and all of the nodes are
+ *   connected to the DHT after bootstrapping from the first node.
+ * - DHT lookups: after a warm-up every node adds random other nodes as DHT
+ *   friends, and the virtual time until each node knows the address of each
+ *   of them is measured, with the get nodes requests sent meanwhile and the
+ *   lookup queue metrics. The friends are removed again afterwards.
+ * - Friend connect latency: the nodes are paired up as friends and the
+ *   virtual time until each pair is online is measured.
+ * - File throughput: the first pair sends a file, at what rate it arrives
+ *   in virtual time and the CPU time all nodes spent meanwhile.
+ * - CPU per node: CPU time spent per node and simulated second in each of
+ *   these phases and in an idle phase at the end.
+ *
+ * Runs with the same seed and options give the same virtual times.
+ *
+ * Usage: net_sim_bench [--nodes N] [--seed N] [--latency MS] [--jitter MS] [--loss N] [--bandwidth KBYTE]
+ *                      [--lookups N] [--file-size KBYTE] [--timeout S]
+ *
+ * --nodes N          Messenger instances, 51 by default
+ * --seed N           seed of the simulated network, 1 by default
+ * --latency MS       one way delay of the links, 30 by default
+ * --jitter MS        random delay added to each packet, 10 by default
+ * --loss N           packets lost out of 10000, 100 by default
+ * --bandwidth KBYTE  link bandwidth in kB/s, 0 (unlimited) by default
+ * --lookups N        DHT friends added by each node in the lookup phase, 10 by default, 0 skips it
+ * --file-size KBYTE  size of the file sent, 10240 by default
+ * --timeout S        virtual seconds each phase may take, 300 by default
+ *
+ * To compile it link it against toxcore and its dependencies, e.g.:
+ *   gcc net_sim_bench.c -o net_sim_bench -ltoxcore -lsodium -lpthread
+ */
+
+#include "../../toxcore/Messenger.h"
+#include "../../toxcore/net_sim.h"
+#include "../../toxcore/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Virtual time between two iterations of every instance. */
+#define STEP_MS 20
+
+/* Nodes not connected to the DHT bootstrap again this often, in ms, like
+ * clients do. */
+#define BOOTSTRAP_INTERVAL 5000
+
+/* Virtual time the network runs idle for the last CPU measurement. */
+#define IDLE_TIME 60
+
+/* Virtual time the DHT settles for before the lookup phase adds friends. */
+#define LOOKUP_WARMUP 60
+
+/* IP addresses of the nodes are BASE_IP + node number. */
+#define BASE_IP 0x05060701
+#define PORT 33445
+
+typedef struct {
+    Net_Sim *sim;
+    Messenger **nodes;
+    uint32_t num_nodes;
+    IP_Port bootstrap;
+
+    /* File transfer state, filled in by the callbacks. */
+    uint8_t *recv_buffer;
+    uint64_t file_size;
+    uint64_t file_done;
+} Bench;
+
+typedef struct {
+    clock_t cpu_start;
+    uint64_t time_start;
+} Phase;
+
+static void phase_start(const Bench *bench, Phase *phase)
+{
+    phase->cpu_start = clock();
+    phase->time_start = net_sim_time(bench->sim);
+}
+
+/* Print the CPU time spent per node and simulated second since phase_start(). */
+static void phase_end(const Bench *bench, const Phase *phase, const char *name)
+{
+    const double cpu_ms = (double)(clock() - phase->cpu_start) * 1000 / CLOCKS_PER_SEC;
+    const uint64_t time = net_sim_time(bench->sim) - phase->time_start;
+
+    if (time == 0) {
+        return;
+    }
+
+    printf("%s: %.3f ms CPU per node per simulated second over %.1f s\n", name,
+           cpu_ms / bench->num_nodes / (time / 1000.0), time / 1000.0);
+}
+
+static void step(Bench *bench)
+{
+    uint32_t i;
+
+    net_sim_advance(bench->sim, STEP_MS);
+
+    for (i = 0; i < bench->num_nodes; ++i) {
+        do_messenger(bench->nodes[i], bench);
+    }
+
+    if (net_sim_time(bench->sim) % BOOTSTRAP_INTERVAL != 0) {
+        return;
+    }
+
+    for (i = 1; i < bench->num_nodes; ++i) {
+        if (!DHT_isconnected(bench->nodes[i]->dht)) {
+            DHT_bootstrap(bench->nodes[i]->dht, bench->bootstrap, dht_get_self_public_key(bench->nodes[0]->dht));
+        }
+    }
+}
+
+static double elapsed(const Bench *bench, uint64_t start)
+{
+    return (net_sim_time(bench->sim) - start) / 1000.0;
+}
+
+static void file_sendrequest_cb(Messenger *m, uint32_t friendnumber, uint32_t filenumber, uint32_t filetype,
+                                uint64_t filesize, const uint8_t *filename, size_t filename_length, void *userdata)
+{
+    Bench *bench = (Bench *)userdata;
+
+    if (file_set_buffer(m, friendnumber, filenumber, bench->recv_buffer, bench->file_size) != 0
+            || file_control(m, friendnumber, filenumber, FILECONTROL_ACCEPT) != 0) {
+        printf("Failed to accept the file.\n");
+    }
+}
+
+static void file_data_cb(Messenger *m, uint32_t friendnumber, uint32_t filenumber, uint64_t position,
+                         const uint8_t *data, size_t length, void *userdata)
+{
+    Bench *bench = (Bench *)userdata;
+
+    /* The data goes straight to the buffer, only the end is reported. */
+    if (length == 0) {
+        bench->file_done = 1;
+    }
+}
+
+static int dht_convergence(Bench *bench, uint32_t timeout)
+{
+    const uint64_t start = net_sim_time(bench->sim);
+    const uint32_t half = bench->num_nodes / 2, most = bench->num_nodes * 9 / 10;
+    double time_half = -1, time_most = -1;
+    Phase phase;
+    uint32_t i;
+
+    phase_start(bench, &phase);
+
+    uint32_t connected = 0;
+
+    while (elapsed(bench, start) < timeout) {
+        step(bench);
+
+        connected = 0;
+
+        for (i = 0; i < bench->num_nodes; ++i) {
+            connected += DHT_isconnected(bench->nodes[i]->dht);
+        }
+
+        if (time_half < 0 && connected >= half) {
+            time_half = elapsed(bench, start);
+        }
+
+        if (time_most < 0 && connected >= most) {
+            time_most = elapsed(bench, start);
+        }
+
+        if (connected == bench->num_nodes) {
+            printf("DHT convergence: 50%% connected after %.1f s, 90%% after %.1f s, all after %.1f s\n",
+                   time_half, time_most, elapsed(bench, start));
+            phase_end(bench, &phase, "DHT convergence");
+            return 0;
+        }
+    }
+
+    printf("DHT convergence: %u/%u nodes connected within %u s\n", connected, bench->num_nodes, timeout);
+    return -1;
+}
+
+static uint64_t get_nodes_sent(const Bench *bench)
+{
+    uint64_t sent = 0;
+    uint32_t i;
+
+    for (i = 0; i < bench->num_nodes; ++i) {
+        sent += net_metrics(dht_get_net(bench->nodes[i]->dht))->packets_sent[NET_PACKET_GET_NODES];
+    }
+
+    return sent;
+}
+
+/* return 1 if node is one of the first num friends. */
+static int is_friend(const uint32_t *friends, uint32_t num, uint32_t node)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (friends[i] == node) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Every node looks up num_friends distinct random other nodes. */
+static int dht_lookups(Bench *bench, uint32_t num_friends, uint64_t seed, uint32_t timeout)
+{
+    const uint32_t total = bench->num_nodes * num_friends;
+    uint32_t *friends = (uint32_t *)calloc(total, sizeof(uint32_t));
+    uint16_t *locks = (uint16_t *)calloc(total, sizeof(uint16_t));
+    uint8_t *found = (uint8_t *)calloc(total, sizeof(uint8_t));
+    uint64_t start = net_sim_time(bench->sim);
+    uint32_t i, j;
+
+    if (friends == NULL || locks == NULL || found == NULL) {
+        free(friends);
+        free(locks);
+        free(found);
+        return -1;
+    }
+
+    while (elapsed(bench, start) < LOOKUP_WARMUP) {
+        step(bench);
+    }
+
+    srand(seed);
+
+    for (i = 0; i < bench->num_nodes; ++i) {
+        uint32_t *const node_friends = &friends[i * num_friends];
+
+        for (j = 0; j < num_friends; ++j) {
+            uint32_t f;
+
+            do {
+                f = rand() % bench->num_nodes;
+            } while (f == i || is_friend(node_friends, j, f));
+
+            node_friends[j] = f;
+            DHT_addfriend(bench->nodes[i]->dht, dht_get_self_public_key(bench->nodes[f]->dht), NULL, NULL, 0,
+                          &locks[i * num_friends + j]);
+        }
+    }
+
+    const uint64_t get_nodes_before = get_nodes_sent(bench);
+    uint64_t lookups_before[3] = {0};
+    uint64_t lookups[3] = {0};
+    uint64_t stats[METRIC_COUNT];
+
+    for (i = 0; i < bench->num_nodes; ++i) {
+        metrics_snapshot(net_metrics(dht_get_net(bench->nodes[i]->dht)), stats);
+        lookups_before[0] += stats[METRIC_DHT_LOOKUPS_SENT];
+        lookups_before[1] += stats[METRIC_DHT_LOOKUPS_COALESCED];
+        lookups_before[2] += stats[METRIC_DHT_LOOKUPS_DROPPED];
+    }
+
+    uint32_t num_found = 0;
+    double time_total = 0;
+    Phase phase;
+
+    start = net_sim_time(bench->sim);
+    phase_start(bench, &phase);
+
+    while (num_found < total && elapsed(bench, start) < timeout) {
+        step(bench);
+
+        for (i = 0; i < total; ++i) {
+            IP_Port ip_port;
+
+            if (!found[i] && DHT_getfriendip(bench->nodes[i / num_friends]->dht,
+                                             dht_get_self_public_key(bench->nodes[friends[i]]->dht), &ip_port) == 1) {
+                found[i] = 1;
+                time_total += elapsed(bench, start);
+                ++num_found;
+            }
+        }
+    }
+
+    const uint64_t get_nodes = get_nodes_sent(bench) - get_nodes_before;
+
+    for (i = 0; i < bench->num_nodes; ++i) {
+        metrics_snapshot(net_metrics(dht_get_net(bench->nodes[i]->dht)), stats);
+        lookups[0] += stats[METRIC_DHT_LOOKUPS_SENT];
+        lookups[1] += stats[METRIC_DHT_LOOKUPS_COALESCED];
+        lookups[2] += stats[METRIC_DHT_LOOKUPS_DROPPED];
+    }
+
+    printf("DHT lookups: %u friends per node, found %u/%u in %.1f s, %.2f s mean, "
+           "%.1f get nodes sent per friend found\n", num_friends, num_found, total, elapsed(bench, start), num_found ? time_total / num_found : 0.0,
+           num_found ? (double)get_nodes / num_found : 0.0);
+    printf("DHT lookups: %llu sent, %llu coalesced, %llu dropped from the lookup queues\n",
+           (unsigned long long)(lookups[0] - lookups_before[0]), (unsigned long long)(lookups[1] - lookups_before[1]),
+           (unsigned long long)(lookups[2] - lookups_before[2]));
+    phase_end(bench, &phase, "DHT lookups");
+
+    for (i = 0; i < total; ++i) {
+        DHT_delfriend(bench->nodes[i / num_friends]->dht, dht_get_self_public_key(bench->nodes[friends[i]]->dht),
+                      locks[i]);
+    }
+
+    free(friends);
+    free(locks);
+    free(found);
+    return num_found == total ? 0 : -1;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Node 0 is only the bootstrap node, the others are friends in pairs. */
+static int friend_connect(Bench *bench, uint32_t timeout)
+{
+    const uint32_t pairs = (bench->num_nodes - 1) / 2;
+    double *times = (double *)malloc(pairs * sizeof(double));
+    uint32_t i;
+
+    if (times == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < pairs; ++i) {
+        Messenger *a = bench->nodes[i * 2 + 1], *b = bench->nodes[i * 2 + 2];
+
+        if (m_addfriend_norequest(a, nc_get_self_public_key(b->net_crypto)) != 0
+                || m_addfriend_norequest(b, nc_get_self_public_key(a->net_crypto)) != 0) {
+            printf("Failed to add friends.\n");
+            free(times);
+            return -1;
+        }
+
+        times[i] = -1;
+    }
+
+    const uint64_t start = net_sim_time(bench->sim);
+    uint32_t online = 0;
+    Phase phase;
+
+    phase_start(bench, &phase);
+
+    while (online < pairs && elapsed(bench, start) < timeout) {
+        step(bench);
+
+        for (i = 0; i < pairs; ++i) {
+            if (times[i] < 0 && m_get_friend_connectionstatus(bench->nodes[i * 2 + 1], 0) != CONNECTION_NONE
+                    && m_get_friend_connectionstatus(bench->nodes[i * 2 + 2], 0) != CONNECTION_NONE) {
+                times[i] = elapsed(bench, start);
+                ++online;
+            }
+        }
+    }
+
+    if (online == 0) {
+        printf("Friend connect: no friends connected within %u s\n", timeout);
+        free(times);
+        return -1;
+    }
+
+    /* Pairs that never connected sort first. */
+    qsort(times, pairs, sizeof(double), compare_double);
+    const double *connected = times + (pairs - online);
+    double total = 0;
+
+    for (i = 0; i < online; ++i) {
+        total += connected[i];
+    }
+
+    printf("Friend connect: %u/%u pairs online, %.1f s mean, %.1f s median, %.1f s max\n", online, pairs,
+           total / online, connected[online / 2], connected[online - 1]);
+    phase_end(bench, &phase, "Friend connect");
+    free(times);
+    return 0;
+}
+
+static int file_transfer(Bench *bench, uint64_t size, uint32_t timeout)
+{
+    Messenger *sender = bench->nodes[1];
+    uint8_t *send_buffer = (uint8_t *)malloc(size);
+    bench->recv_buffer = (uint8_t *)malloc(size);
+
+    if (send_buffer == NULL || bench->recv_buffer == NULL) {
+        free(send_buffer);
+        return -1;
+    }
+
+    uint64_t i;
+
+    for (i = 0; i < size; ++i) {
+        send_buffer[i] = (uint8_t)(i * 31 + i / 4096);
+    }
+
+    if (m_get_friend_connectionstatus(sender, 0) == CONNECTION_NONE) {
+        printf("File transfer: the first pair is not online.\n");
+        free(send_buffer);
+        return -1;
+    }
+
+    bench->file_size = size;
+    bench->file_done = 0;
+
+    uint8_t file_id[FILE_ID_LENGTH];
+    random_bytes(file_id, sizeof(file_id));
+
+    const long int filenumber = new_filesender(sender, 0, 0, size, file_id, (const uint8_t *)"bench", 5);
+
+    if (filenumber < 0 || file_set_buffer(sender, 0, filenumber, send_buffer, size) != 0) {
+        printf("Failed to send the file.\n");
+        free(send_buffer);
+        return -1;
+    }
+
+    const uint64_t start = net_sim_time(bench->sim);
+    const clock_t cpu_start = clock();
+    Phase phase;
+
+    phase_start(bench, &phase);
+
+    while (!bench->file_done && elapsed(bench, start) < timeout) {
+        step(bench);
+    }
+
+    const double cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+    int ret = 0;
+
+    if (!bench->file_done) {
+        printf("File transfer: not done within %u s\n", timeout);
+        ret = -1;
+    } else if (memcmp(send_buffer, bench->recv_buffer, size) != 0) {
+        printf("File transfer: received data differs\n");
+        ret = -1;
+    } else {
+        printf("File transfer: %.1f kB in %.1f s, %.1f kB/s in virtual time, %.2f s CPU for all nodes\n",
+               size / 1000.0, elapsed(bench, start), size / 1000.0 / elapsed(bench, start), cpu);
+        phase_end(bench, &phase, "File transfer");
+    }
+
+    free(send_buffer);
+    return ret;
+}
+
+static void idle(Bench *bench)
+{
+    const uint64_t start = net_sim_time(bench->sim);
+    Phase phase;
+
+    phase_start(bench, &phase);
+
+    while (elapsed(bench, start) < IDLE_TIME) {
+        step(bench);
+    }
+
+    phase_end(bench, &phase, "Idle");
+}
+
+static int setup(Bench *bench, uint64_t seed, const Net_Sim_Link *link)
+{
+    bench->sim = new_net_sim(seed);
+
+    if (bench->sim == NULL) {
+        return -1;
+    }
+
+    net_sim_use_clock(bench->sim);
+    net_sim_set_default_link(bench->sim, link);
+    unix_time_update();
+
+    uint32_t i;
+
+    for (i = 0; i < bench->num_nodes; ++i) {
+        IP ip;
+        ip_init(&ip, 0);
+        ip.ip.v4.uint32 = net_htonl(BASE_IP + i);
+
+        Net_Sim_Host *host = net_sim_add_host(bench->sim, ip, PORT, NET_SIM_NAT_NONE);
+
+        if (host == NULL) {
+            return -1;
+        }
+
+        Messenger_Options options = {0};
+        options.net_backend = net_sim_host_backend(host);
+        options.port_range[0] = PORT;
+        options.port_range[1] = PORT;
+
+        unsigned int error;
+        bench->nodes[i] = new_messenger(&options, &error);
+
+        if (bench->nodes[i] == NULL) {
+            printf("Failed to create node %u: %u\n", i, error);
+            return -1;
+        }
+
+        callback_file_sendrequest(bench->nodes[i], file_sendrequest_cb);
+        callback_file_data(bench->nodes[i], file_data_cb);
+    }
+
+    ip_init(&bench->bootstrap.ip, 0);
+    bench->bootstrap.ip.ip.v4.uint32 = net_htonl(BASE_IP);
+    bench->bootstrap.port = net_htons(PORT);
+
+    for (i = 1; i < bench->num_nodes; ++i) {
+        DHT_bootstrap(bench->nodes[i]->dht, bench->bootstrap, dht_get_self_public_key(bench->nodes[0]->dht));
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_nodes = 51;
+    uint64_t seed = 1;
+    Net_Sim_Link link = {30, 10, 100, 0};
+    uint32_t num_lookups = 10;
+    uint32_t file_size = 10240;
+    uint32_t timeout = 300;
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--nodes")) {
+            num_nodes = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--seed")) {
+            seed = strtoull(argv[2], NULL, 10);
+        } else if (!strcmp(argv[1], "--latency")) {
+            link.latency = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--jitter")) {
+            link.jitter = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--loss")) {
+            link.loss = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--bandwidth")) {
+            link.bandwidth = atoi(argv[2]) * 1000;
+        } else if (!strcmp(argv[1], "--lookups")) {
+            num_lookups = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--file-size")) {
+            file_size = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--timeout")) {
+            timeout = atoi(argv[2]);
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 1 || num_nodes < 3 || link.loss > 10000 || num_lookups >= num_nodes || file_size == 0 || timeout == 0) {
+        printf("Usage: %s [--nodes N] [--seed N] [--latency MS] [--jitter MS] [--loss N] [--bandwidth KBYTE]\n"
+               "       [--lookups N] [--file-size KBYTE] [--timeout S]\n", argv[0]);
+        return 1;
+    }
+
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.num_nodes = num_nodes;
+    bench.nodes = (Messenger **)calloc(num_nodes, sizeof(Messenger *));
+
+    if (bench.nodes == NULL || setup(&bench, seed, &link) != 0) {
+        printf("Failed to set up the network.\n");
+        return 1;
+    }
+
+    printf("%u nodes, links with %u ms latency, %u ms jitter, %u/10000 loss, %u B/s bandwidth\n", num_nodes,
+           link.latency, link.jitter, link.loss, link.bandwidth);
+
+    int ret = 0;
+
+    if (dht_convergence(&bench, timeout) != 0
+            || (num_lookups && dht_lookups(&bench, num_lookups, seed, timeout) != 0)
+            || friend_connect(&bench, timeout) != 0
+            || file_transfer(&bench, (uint64_t)file_size * 1000, timeout) != 0) {
+        ret = 1;
+    }
+
+    idle(&bench);
+
+    uint32_t i;
+
+    for (i = 0; i < num_nodes; ++i) {
+        kill_messenger(bench.nodes[i]);
+    }
+
+    kill_net_sim(bench.sim);
+    free(bench.recv_buffer);
+    free(bench.nodes);
+    return ret;
+}
@@ -0,0 +1,217 @@
+/* startup_bench -- Startup time of Tox instances with large friend lists
+ *
+ * Builds a savedata with the given number of friends and then measures
+ * tox_new() loading it, once from a buffer the way clients read their save
+ * file and once with TOX_SAVEDATA_TYPE_TOX_SAVE_FILE, which maps the file.
+ * It also measures the first tox_iterate() calls, which set up the friend
+ * connections that loading defers.
+ *
+ * Usage: startup_bench [--friends N] [--runs N] [--file PATH]
+ *
+ * --friends N  friends in the savedata, 5000 by default
+ * --runs N     instances created per mode, 5 by default
+ * --file PATH  where to write the savedata, startup_bench.tox by default
+ *
+ * To compile it link it against toxcore and its dependencies, e.g.:
+ *   gcc startup_bench.c -o startup_bench -ltoxcore -lsodium -lpthread
+ */
+
+#include "../../toxcore/metrics.h"
+#include "../../toxcore/tox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int write_savedata(const char *path, uint32_t friends)
+{
+    struct Tox_Options options;
+    tox_options_default(&options);
+    options.local_discovery_enabled = 0;
+
+    Tox *tox = tox_new(&options, NULL);
+
+    if (tox == NULL) {
+        printf("Failed to create a Tox instance.\n");
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < friends; ++i) {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+        uint32_t j;
+
+        for (j = 0; j < TOX_PUBLIC_KEY_SIZE; ++j) {
+            public_key[j] = rand();
+        }
+
+        /* The last bit of a valid key is always zero. */
+        public_key[TOX_PUBLIC_KEY_SIZE - 1] &= 0x7f;
+
+        if (tox_friend_add_norequest(tox, public_key, NULL) == UINT32_MAX) {
+            printf("Failed to add friend %u.\n", i);
+            tox_kill(tox);
+            return -1;
+        }
+    }
+
+    const size_t length = tox_get_savedata_size(tox, 1);
+    uint8_t *data = (uint8_t *)malloc(length);
+
+    if (data == NULL) {
+        tox_kill(tox);
+        return -1;
+    }
+
+    tox_get_savedata(tox, data, 1);
+    tox_kill(tox);
+
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL || fwrite(data, 1, length, file) != length) {
+        printf("Failed to write %s.\n", path);
+        free(data);
+
+        if (file) {
+            fclose(file);
+        }
+
+        return -1;
+    }
+
+    fclose(file);
+    free(data);
+    printf("Savedata with %u friends: %zu bytes\n", friends, length);
+    return 0;
+}
+
+/* Read the file the way a client does without the mapped path. */
+static uint8_t *read_file(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = (uint8_t *)malloc(*length);
+
+    if (data != NULL && fread(data, 1, *length, file) != *length) {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+static int run(const char *mode, const char *path, bool mapped, uint32_t friends, uint32_t runs)
+{
+    uint64_t new_total = 0, new_max = 0;
+    uint64_t iterate_total = 0, iterate_max = 0;
+    /* Loading defers friend connections, do_messenger() creates 64 at a time. */
+    const uint32_t iterations = friends / 64 + 1;
+    uint32_t i, j;
+
+    for (i = 0; i < runs; ++i) {
+        struct Tox_Options options;
+        tox_options_default(&options);
+        /* Only the loading is measured, there is nothing to connect to. */
+        options.local_discovery_enabled = 0;
+
+        const uint64_t start = metrics_time_ns();
+        uint8_t *data = NULL;
+
+        if (mapped) {
+            options.savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE_FILE;
+            options.savedata_data = (const uint8_t *)path;
+            options.savedata_length = strlen(path);
+        } else {
+            size_t length;
+            data = read_file(path, &length);
+
+            if (data == NULL) {
+                printf("Failed to read %s.\n", path);
+                return -1;
+            }
+
+            options.savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
+            options.savedata_data = data;
+            options.savedata_length = length;
+        }
+
+        TOX_ERR_NEW error;
+        Tox *tox = tox_new(&options, &error);
+        const uint64_t new_time = metrics_time_ns() - start;
+        free(data);
+
+        if (tox == NULL) {
+            printf("tox_new failed: %d\n", error);
+            return -1;
+        }
+
+        if (tox_self_get_friend_list_size(tox) != friends) {
+            printf("Loaded %zu friends instead of %u.\n", tox_self_get_friend_list_size(tox), friends);
+            tox_kill(tox);
+            return -1;
+        }
+
+        for (j = 0; j < iterations; ++j) {
+            const uint64_t iterate_start = metrics_time_ns();
+            tox_iterate(tox, NULL);
+            const uint64_t time = metrics_time_ns() - iterate_start;
+            iterate_total += time;
+            iterate_max = time > iterate_max ? time : iterate_max;
+        }
+
+        new_total += new_time;
+        new_max = new_time > new_max ? new_time : new_max;
+        tox_kill(tox);
+    }
+
+    printf("%s: tox_new %.2f ms mean, %.2f ms max; first %u tox_iterate calls %.2f ms in total, %.2f ms max per call\n",
+           mode, new_total / 1e6 / runs, new_max / 1e6, iterations, iterate_total / 1e6 / runs, iterate_max / 1e6);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t friends = 5000;
+    uint32_t runs = 5;
+    const char *path = "startup_bench.tox";
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--friends")) {
+            friends = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--runs")) {
+            runs = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--file")) {
+            path = argv[2];
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 1 || runs == 0) {
+        printf("Usage: %s [--friends N] [--runs N] [--file PATH]\n", argv[0]);
+        return 1;
+    }
+
+    if (write_savedata(path, friends) != 0
+            || run("Buffer", path, 0, friends, runs) != 0
+            || run("Mapped file", path, 1, friends, runs) != 0) {
+        return 1;
+    }
+
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/* video_encode_bench -- Video encoder benchmark for toxav
+ *
+ * Encodes a synthetic moving picture with the encoder setup toxav uses for
+ * calls (vc_set_codec_options() and vc_reconfigure_encoder()) and prints the
+ * encode time per frame and the resulting bit rate for VP8 and VP9 at a few
+ * common resolutions.
+ *
+ * Usage: video_encode_bench [--frames N] [--threads N] [--tiles N] [--cpu-used N] [--bitrate KBIT]
+ *
+ * --frames N    frames encoded per configuration, 300 by default
+ * --threads N   encoder threads, 0 (toxav's default) by default
+ * --tiles N     log2 of the VP9 tile columns, 2 by default
+ * --cpu-used N  libvpx speed setting, 16 (toxav's default) by default
+ * --bitrate N   target bit rate in kbit/s, 2000 by default
+ *
+ * To compile it link it against toxav, toxcore and their dependencies, e.g.:
+ *   gcc video_encode_bench.c -o video_encode_bench -ltoxav -ltoxcore -lvpx -lopus -lsodium -lpthread
+ */
+
+#include "../../toxav/video.h"
+#include "../../toxcore/metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Same deadline as toxav_video_send_frame() uses. */
+#define ENCODE_DEADLINE_US (1000000 / 40)
+
+/* Key frames forced at the start of a call, as toxav does. */
+#define KEYFRAMES_FIRST 7
+
+typedef struct {
+    uint16_t width;
+    uint16_t height;
+} Resolution;
+
+static const Resolution resolutions[] = {
+    {320, 240},
+    {640, 480},
+    {1280, 720},
+    {1920, 1080},
+};
+
+/* A gradient moving diagonally with a square moving across it, so that the
+ * encoder has both global motion and an object to track. */
+static void fill_frame(uint8_t *y, uint8_t *u, uint8_t *v, uint16_t width, uint16_t height, uint32_t frame)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < height; ++i) {
+        for (j = 0; j < width; ++j) {
+            y[i * width + j] = (uint8_t)(i + j + frame * 2);
+        }
+    }
+
+    const uint32_t size = height / 4;
+    const uint32_t x0 = (frame * 4) % (width - size);
+    const uint32_t y0 = (frame * 2) % (height - size);
+
+    for (i = y0; i < y0 + size; ++i) {
+        memset(y + i * width + x0, 235, size);
+    }
+
+    for (i = 0; i < height / 2u; ++i) {
+        for (j = 0; j < width / 2u; ++j) {
+            u[i * (width / 2) + j] = (uint8_t)(128 + i - frame);
+            v[i * (width / 2) + j] = (uint8_t)(128 + j + frame);
+        }
+    }
+}
+
+static int run(TOXAV_VIDEO_CODEC codec, Resolution res, uint32_t frames, uint8_t threads, uint8_t tiles,
+               int8_t cpu_used, uint32_t bit_rate)
+{
+    VCSession *vc = vc_new(NULL, NULL, 0, NULL, NULL);
+
+    if (vc == NULL) {
+        printf("Failed to create the video session.\n");
+        return -1;
+    }
+
+    if (vc_set_codec_options(vc, codec, threads, tiles, cpu_used, 0) != 0
+            || vc_reconfigure_encoder(vc, codec, bit_rate * 1000, res.width, res.height, -1) != 0) {
+        printf("Failed to set up the %s encoder.\n", codec == TOXAV_VIDEO_CODEC_VP9 ? "VP9" : "VP8");
+        vc_kill(vc);
+        return -1;
+    }
+
+    const size_t y_size = (size_t)res.width * res.height;
+    uint8_t *planes = (uint8_t *)malloc(y_size + y_size / 2);
+
+    if (planes == NULL) {
+        vc_kill(vc);
+        return -1;
+    }
+
+    uint8_t *y = planes;
+    uint8_t *u = planes + y_size;
+    uint8_t *v = u + y_size / 4;
+
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t bytes = 0;
+    uint32_t i;
+
+    for (i = 0; i < frames; ++i) {
+        fill_frame(y, u, v, res.width, res.height, i);
+
+        vpx_image_t img;
+        vpx_img_wrap(&img, VPX_IMG_FMT_I420, res.width, res.height, 1, planes);
+
+        const uint64_t start = metrics_time_ns();
+        vpx_codec_err_t rc = vpx_codec_encode(vc->encoder, &img, vc->frame_counter, 1,
+                                              i < KEYFRAMES_FIRST ? VPX_EFLAG_FORCE_KF : 0, ENCODE_DEADLINE_US);
+        const uint64_t time = metrics_time_ns() - start;
+
+        if (rc != VPX_CODEC_OK) {
+            printf("Failed to encode frame %u: %s\n", i, vpx_codec_err_to_string(rc));
+            break;
+        }
+
+        ++vc->frame_counter;
+        total_ns += time;
+        max_ns = time > max_ns ? time : max_ns;
+
+        vpx_codec_iter_t iter = NULL;
+        const vpx_codec_cx_pkt_t *pkt;
+
+        while ((pkt = vpx_codec_get_cx_data(vc->encoder, &iter)) != NULL) {
+            if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
+                bytes += pkt->data.frame.sz;
+            }
+        }
+    }
+
+    if (i > 0) {
+        /* Bit rate as if the frames were sent at 25 frames per second. */
+        printf("%s %4ux%-4u %6.2f ms/frame mean, %6.2f ms max, %6.1f frames/s, %6llu kbit/s at 25 fps\n",
+               codec == TOXAV_VIDEO_CODEC_VP9 ? "VP9" : "VP8", res.width, res.height,
+               total_ns / 1e6 / i, max_ns / 1e6, i * 1e9 / total_ns,
+               (unsigned long long)(bytes * 8 * 25 / i / 1000));
+    }
+
+    free(planes);
+    vc_kill(vc);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t frames = 300;
+    uint8_t threads = 0;
+    uint8_t tiles = 2;
+    int8_t cpu_used = 16;
+    uint32_t bit_rate = 2000;
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--frames")) {
+            frames = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--threads")) {
+            threads = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--tiles")) {
+            tiles = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--cpu-used")) {
+            cpu_used = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--bitrate")) {
+            bit_rate = atoi(argv[2]);
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 1 || frames == 0 || bit_rate == 0) {
+        printf("Usage: %s [--frames N] [--threads N] [--tiles N] [--cpu-used N] [--bitrate KBIT]\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); ++i) {
+        if (run(TOXAV_VIDEO_CODEC_VP8, resolutions[i], frames, threads, tiles, cpu_used, bit_rate) != 0
+                || run(TOXAV_VIDEO_CODEC_VP9, resolutions[i], frames, threads, tiles, cpu_used, bit_rate) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
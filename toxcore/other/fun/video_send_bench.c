@@ -0,0 +1,332 @@
+/* video_send_bench -- Latency of sending video frames with toxav
+ *
+ * Sets up a video call between two Tox instances over loopback and feeds
+ * frames to the caller at a fixed frame rate, like a camera would, first with
+ * toxav_video_send_frame and then with the asynchronous encoder
+ * (toxav_video_set_async and toxav_video_send_frame_async).
+ *
+ * For each mode it prints how long the capturing thread was blocked per frame
+ * and, for the asynchronous mode, the queue and encode times and the number of
+ * frames dropped reported to the video_send_done callback.
+ *
+ * Usage: video_send_bench [--frames N] [--fps N] [--size WxH] [--queue N] [--bitrate KBIT]
+ *
+ * --frames N   frames sent in each mode, 300 by default
+ * --fps N      frames per second fed to toxav, 30 by default
+ * --size WxH   frame size, 1280x720 by default
+ * --queue N    asynchronous encoder queue size, 2 by default
+ * --bitrate N  video bit rate in kbit/s, 2000 by default
+ *
+ * To compile it link it against toxav, toxcore and their dependencies, e.g.:
+ *   gcc video_send_bench.c -o video_send_bench -ltoxav -ltoxcore -lvpx -lopus -lsodium -lpthread
+ */
+
+#include "../../toxav/toxav.h"
+#include "../../toxcore/metrics.h"
+#include "../../toxcore/tox.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Seconds to wait for the friends to connect and the call to start. */
+#define SETUP_TIMEOUT 60
+
+typedef struct {
+    Tox *tox[2];
+    ToxAV *av[2];
+    pthread_mutex_t mutex;
+    volatile int running;
+    volatile int answered;
+
+    /* Reported by the video_send_done callback. */
+    uint32_t done;
+    uint32_t dropped;
+    uint64_t queue_total;
+    uint32_t queue_max;
+    uint64_t encode_total;
+    uint32_t encode_max;
+} Bench;
+
+static void call_cb(ToxAV *av, uint32_t friend_number, bool audio_enabled, bool video_enabled, void *user_data)
+{
+    Bench *bench = (Bench *)user_data;
+
+    /* The callee only receives. */
+    if (toxav_answer(av, friend_number, 0, 0, NULL)) {
+        bench->answered = 1;
+    }
+}
+
+static void video_send_done_cb(ToxAV *av, uint32_t friend_number, const uint8_t *y, const uint8_t *u,
+                               const uint8_t *v, TOXAV_ERR_SEND_FRAME error, uint32_t queue_time,
+                               uint32_t encode_time, uint32_t dropped, void *user_data)
+{
+    Bench *bench = (Bench *)user_data;
+
+    pthread_mutex_lock(&bench->mutex);
+    ++bench->done;
+    bench->dropped = dropped;
+
+    if (error == TOXAV_ERR_SEND_FRAME_OK) {
+        bench->queue_total += queue_time;
+        bench->queue_max = queue_time > bench->queue_max ? queue_time : bench->queue_max;
+        bench->encode_total += encode_time;
+        bench->encode_max = encode_time > bench->encode_max ? encode_time : bench->encode_max;
+    }
+
+    pthread_mutex_unlock(&bench->mutex);
+}
+
+/* Runs the event loops of both instances, like a client's main thread. */
+static void *iterate_thread(void *arg)
+{
+    Bench *bench = (Bench *)arg;
+
+    while (bench->running) {
+        uint32_t i;
+
+        for (i = 0; i < 2; ++i) {
+            tox_iterate(bench->tox[i], bench);
+            toxav_iterate(bench->av[i]);
+        }
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_blocked(const char *mode, uint64_t *times, uint32_t num)
+{
+    uint64_t total = 0;
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        total += times[i];
+    }
+
+    qsort(times, num, sizeof(uint64_t), compare_u64);
+    printf("%s: capture thread blocked %.2f ms mean, %.2f ms median, %.2f ms p99, %.2f ms max per frame\n",
+           mode, total / 1e6 / num, times[num / 2] / 1e6, times[num - num / 100 - 1] / 1e6, times[num - 1] / 1e6);
+}
+
+/* Feed frames at fps and record how long each send call took. */
+static int send_frames(Bench *bench, bool async, uint32_t frames, uint32_t fps, uint16_t width, uint16_t height,
+                       uint64_t *times)
+{
+    const size_t y_size = (size_t)width * height;
+    uint8_t *planes = (uint8_t *)malloc(y_size + y_size / 2);
+
+    if (planes == NULL) {
+        return -1;
+    }
+
+    const uint64_t interval = 1000000000ULL / fps;
+    uint64_t next = metrics_time_ns();
+    uint32_t i;
+
+    for (i = 0; i < frames; ++i) {
+        /* Some motion so that frames don't encode to nothing. */
+        memset(planes, (int)(i * 7), y_size);
+        memset(planes + y_size, 128, y_size / 2);
+        memset(planes + (i * 4096) % (y_size - 4096), 235, 4096);
+
+        TOXAV_ERR_SEND_FRAME error;
+        const uint64_t start = metrics_time_ns();
+
+        if (async) {
+            toxav_video_send_frame_async(bench->av[0], 0, width, height, planes, planes + y_size,
+                                         planes + y_size + y_size / 4, 1, &error);
+        } else {
+            toxav_video_send_frame(bench->av[0], 0, width, height, planes, planes + y_size,
+                                   planes + y_size + y_size / 4, &error);
+        }
+
+        times[i] = metrics_time_ns() - start;
+
+        if (error != TOXAV_ERR_SEND_FRAME_OK) {
+            printf("Sending frame %u failed: %d\n", i, error);
+            free(planes);
+            return -1;
+        }
+
+        next += interval;
+        const uint64_t now = metrics_time_ns();
+
+        if (next > now) {
+            usleep((next - now) / 1000);
+        }
+    }
+
+    free(planes);
+    return 0;
+}
+
+static int setup(Bench *bench, uint32_t bit_rate)
+{
+    struct Tox_Options options;
+    tox_options_default(&options);
+    uint32_t i;
+
+    for (i = 0; i < 2; ++i) {
+        bench->tox[i] = tox_new(&options, NULL);
+
+        if (bench->tox[i] == NULL) {
+            printf("Failed to create Tox instance %u.\n", i);
+            return -1;
+        }
+
+        bench->av[i] = toxav_new(bench->tox[i], NULL);
+
+        if (bench->av[i] == NULL) {
+            printf("Failed to create ToxAV instance %u.\n", i);
+            return -1;
+        }
+    }
+
+    toxav_callback_call(bench->av[1], call_cb, bench);
+    toxav_callback_video_send_done(bench->av[0], video_send_done_cb, bench);
+
+    uint8_t dht_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_dht_id(bench->tox[0], dht_key);
+    tox_bootstrap(bench->tox[1], "127.0.0.1", tox_self_get_udp_port(bench->tox[0], NULL), dht_key, NULL);
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(bench->tox[1], public_key);
+    tox_friend_add_norequest(bench->tox[0], public_key, NULL);
+    tox_self_get_public_key(bench->tox[0], public_key);
+    tox_friend_add_norequest(bench->tox[1], public_key, NULL);
+
+    bench->running = 1;
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, iterate_thread, bench) != 0) {
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    for (i = 0; i < SETUP_TIMEOUT * 10; ++i) {
+        if (tox_friend_get_connection_status(bench->tox[0], 0, NULL) != TOX_CONNECTION_NONE
+                && tox_friend_get_connection_status(bench->tox[1], 0, NULL) != TOX_CONNECTION_NONE) {
+            break;
+        }
+
+        usleep(100000);
+    }
+
+    if (!toxav_call(bench->av[0], 0, 0, bit_rate, NULL)) {
+        printf("The friends did not connect within %u seconds.\n", SETUP_TIMEOUT);
+        return -1;
+    }
+
+    for (i = 0; i < SETUP_TIMEOUT * 10 && !bench->answered; ++i) {
+        usleep(100000);
+    }
+
+    if (!bench->answered) {
+        printf("The call was not answered within %u seconds.\n", SETUP_TIMEOUT);
+        return -1;
+    }
+
+    /* Let the answer reach the caller. */
+    sleep(1);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t frames = 300;
+    uint32_t fps = 30;
+    unsigned int width = 1280;
+    unsigned int height = 720;
+    uint32_t queue_size = 2;
+    uint32_t bit_rate = 2000;
+
+    while (argc > 2) {
+        if (!strcmp(argv[1], "--frames")) {
+            frames = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--fps")) {
+            fps = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--size")) {
+            if (sscanf(argv[2], "%ux%u", &width, &height) != 2) {
+                width = 0;
+            }
+        } else if (!strcmp(argv[1], "--queue")) {
+            queue_size = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--bitrate")) {
+            bit_rate = atoi(argv[2]);
+        } else {
+            break;
+        }
+
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 1 || frames < 2 || fps == 0 || width < 64 || height < 64 || width > UINT16_MAX
+            || height > UINT16_MAX || queue_size == 0 || bit_rate == 0) {
+        printf("Usage: %s [--frames N] [--fps N] [--size WxH] [--queue N] [--bitrate KBIT]\n", argv[0]);
+        return 1;
+    }
+
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    pthread_mutex_init(&bench.mutex, NULL);
+
+    uint64_t *times = (uint64_t *)calloc(frames, sizeof(uint64_t));
+
+    if (times == NULL || setup(&bench, bit_rate) != 0) {
+        return 1;
+    }
+
+    if (send_frames(&bench, 0, frames, fps, width, height, times) != 0) {
+        return 1;
+    }
+
+    print_blocked("toxav_video_send_frame", times, frames);
+
+    if (!toxav_video_set_async(bench.av[0], queue_size)) {
+        printf("Failed to start the asynchronous encoder.\n");
+        return 1;
+    }
+
+    if (send_frames(&bench, 1, frames, fps, width, height, times) != 0) {
+        return 1;
+    }
+
+    /* Stopping the encoder reports the frames still queued as dropped. */
+    toxav_video_set_async(bench.av[0], 0);
+    print_blocked("toxav_video_send_frame_async", times, frames);
+
+    pthread_mutex_lock(&bench.mutex);
+    const uint32_t sent = bench.done - bench.dropped;
+    printf("toxav_video_send_frame_async: %u frames sent, %u dropped, queued %.1f ms mean, %u ms max, "
+           "encoded %.1f ms mean, %u ms max\n", sent, bench.dropped, sent ? (double)bench.queue_total / sent : 0.0,
+           bench.queue_max, sent ? (double)bench.encode_total / sent : 0.0, bench.encode_max);
+    pthread_mutex_unlock(&bench.mutex);
+
+    bench.running = 0;
+    usleep(100000);
+
+    uint32_t i;
+
+    for (i = 0; i < 2; ++i) {
+        toxav_kill(bench.av[i]);
+        tox_kill(bench.tox[i]);
+    }
+
+    free(times);
+    return 0;
+}
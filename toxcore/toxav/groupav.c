@@ -24,11 +24,34 @@
 #include "groupav.h"
 
 #include "../toxcore/logger.h"
+#include "../toxcore/thread_pool.h"
 #include "../toxcore/util.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GROUP_MIX_SSE2
+#endif
+
 #define GROUP_JBUF_SIZE 6
 #define GROUP_JBUF_DEAD_SECONDS 4
 
+/* Length in ms of the frames produced by the built-in mixer. */
+#define GROUP_MIX_FRAME_MS 20
+/* Decoded audio kept per peer: the longest opus packet (120 ms) plus one frame. */
+#define GROUP_MIX_PEER_BUFFER_MS (120 + GROUP_MIX_FRAME_MS)
+/* Max number of frames mixed in one iteration when catching up. */
+#define GROUP_MIX_MAX_CATCHUP_FRAMES 10
+#define GROUP_MIX_JOB_QUEUE_SIZE 64
+
+/* Audio level extension of GROUP_AUDIO_LEVEL_PACKET_ID packets (RFC 6464 style):
+ * bit 7 is set if the frame contains voice, bits 0..6 are the level in -dBov. */
+#define GROUP_AUDIO_LEVEL_VOICE 0x80
+#define GROUP_AUDIO_LEVEL_SILENCE 127
+/* Voiced frames quieter than this (in -dBov) don't make their sender an active speaker. */
+#define GROUP_AUDIO_LEVEL_THRESHOLD 60
+/* Milliseconds a speaker stays active after its last voiced frame. */
+#define GROUP_SPEAKER_TIMEOUT 1000
+
 typedef struct {
     uint16_t sequnum;
     uint16_t length;
@@ -155,6 +178,25 @@ static Group_Audio_Packet *dequeue(Group_JitterBuffer *q, int *success)
     return nullptr;
 }
 
+typedef struct {
+    Group_JitterBuffer *buffer;
+
+    OpusDecoder *audio_decoder;
+    int decoder_channels;
+    unsigned int decoder_sample_rate;
+    unsigned int last_packet_samples;
+
+    /* Decoded audio waiting to be mixed, mix_fill samples (per channel) at the mixer rate. */
+    int16_t *mix_pcm;
+    unsigned int mix_fill;
+    unsigned mix_silent : 1; /* everything in mix_pcm is DTX silence */
+    unsigned dtx : 1; /* last received packet was a DTX (silence) frame */
+
+    /* Speaker selection, see group_av_set_max_speakers(). */
+    uint64_t last_voice_time;
+    uint8_t level; /* smoothed level of voiced frames in -dBov */
+} Group_Peer_AV;
+
 typedef struct {
     Logger *log;
     Group_Chats *g_c;
@@ -167,15 +209,42 @@ typedef struct {
     void (*audio_data)(Messenger *m, uint32_t groupnumber, uint32_t peernumber, const int16_t *pcm, uint32_t samples,
                        uint8_t channels, unsigned int sample_rate, void *userdata);
     void *userdata;
-} Group_AV;
 
-typedef struct {
-    Group_JitterBuffer *buffer;
+    Group_Peer_AV **peers;
+    uint32_t num_peers;
+
+    /* Built-in mixer, enabled by group_av_enable_mixer(). */
+    void (*mixed_audio_data)(Messenger *m, uint32_t groupnumber, const int16_t *pcm, uint32_t samples,
+                             uint8_t channels, unsigned int sample_rate, void *userdata);
+    Thread_Pool *mix_pool;
+    int16_t *mix_buffer;
+    unsigned int mix_sample_rate;
+    unsigned int mix_channels;
+    unsigned int mix_frame_samples;
+    unsigned int mix_peer_capacity;
+    uint64_t mix_next_time;
+
+    /* Speaker selection: send level tagged audio and play/relay only the max_speakers loudest peers. */
+    uint32_t max_speakers;
+    bool last_sent_silent;
+} Group_AV;
 
-    OpusDecoder *audio_decoder;
-    int decoder_channels;
-    unsigned int last_packet_samples;
-} Group_Peer_AV;
+static void disable_mixer(Group_AV *group_av)
+{
+    kill_thread_pool(group_av->mix_pool);
+    group_av->mix_pool = nullptr;
+    free(group_av->mix_buffer);
+    group_av->mix_buffer = nullptr;
+    group_av->mixed_audio_data = nullptr;
+
+    uint32_t i;
+
+    for (i = 0; i < group_av->num_peers; ++i) {
+        free(group_av->peers[i]->mix_pcm);
+        group_av->peers[i]->mix_pcm = nullptr;
+        group_av->peers[i]->mix_fill = 0;
+    }
+}
 
 static void kill_group_av(Group_AV *group_av)
 {
@@ -183,6 +252,8 @@ static void kill_group_av(Group_AV *group_av)
         opus_encoder_destroy(group_av->audio_encoder);
     }
 
+    disable_mixer(group_av);
+    free(group_av->peers);
     free(group_av);
 }
 
@@ -221,6 +292,16 @@ static int recreate_encoder(Group_AV *group_av)
         return -1;
     }
 
+    /* Silence is sent as tiny DTX frames which mixing receivers don't need to decode. */
+    rc = opus_encoder_ctl(group_av->audio_encoder, OPUS_SET_DTX(1));
+
+    if (rc != OPUS_OK) {
+        LOGGER_ERROR(group_av->log, "Error while setting encoder ctl: %s", opus_strerror(rc));
+        opus_encoder_destroy(group_av->audio_encoder);
+        group_av->audio_encoder = nullptr;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -255,26 +336,84 @@ static void group_av_peer_new(void *object, uint32_t groupnumber, uint32_t frien
         return;
     }
 
+    Group_Peer_AV **temp = (Group_Peer_AV **)realloc(group_av->peers, sizeof(Group_Peer_AV *) * (group_av->num_peers + 1));
+
+    if (!temp) {
+        free(peer_av);
+        return;
+    }
+
+    group_av->peers = temp;
+    group_av->peers[group_av->num_peers] = peer_av;
+    ++group_av->num_peers;
+
     peer_av->buffer = create_queue(GROUP_JBUF_SIZE);
+    peer_av->mix_silent = 1;
     group_peer_set_object(group_av->g_c, groupnumber, friendgroupnumber, peer_av);
 }
 
 static void group_av_peer_delete(void *object, uint32_t groupnumber, void *peer_object)
 {
+    Group_AV *group_av = (Group_AV *)object;
     Group_Peer_AV *peer_av = (Group_Peer_AV *)peer_object;
 
     if (!peer_av) {
         return;
     }
 
+    if (group_av) {
+        uint32_t i;
+
+        for (i = 0; i < group_av->num_peers; ++i) {
+            if (group_av->peers[i] == peer_av) {
+                --group_av->num_peers;
+                group_av->peers[i] = group_av->peers[group_av->num_peers];
+                break;
+            }
+        }
+    }
+
     if (peer_av->audio_decoder) {
         opus_decoder_destroy(peer_av->audio_decoder);
     }
 
     terminate_queue(peer_av->buffer);
+    free(peer_av->mix_pcm);
     free(peer_object);
 }
 
+/* (Re)create the peer's decoder if it doesn't output sample_rate and channels.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int prepare_decoder(Group_AV *group_av, Group_Peer_AV *peer_av, unsigned int sample_rate, int channels)
+{
+    if (peer_av->audio_decoder && channels == peer_av->decoder_channels && sample_rate == peer_av->decoder_sample_rate) {
+        return 0;
+    }
+
+    if (peer_av->audio_decoder) {
+        opus_decoder_destroy(peer_av->audio_decoder);
+        peer_av->audio_decoder = nullptr;
+    }
+
+    int rc;
+    peer_av->audio_decoder = opus_decoder_create(sample_rate, channels, &rc);
+
+    if (rc != OPUS_OK) {
+        LOGGER_ERROR(group_av->log, "Error while starting audio decoder: %s", opus_strerror(rc));
+        peer_av->audio_decoder = nullptr;
+        peer_av->decoder_channels = 0;
+        return -1;
+    }
+
+    peer_av->decoder_channels = channels;
+    peer_av->decoder_sample_rate = sample_rate;
+    peer_av->last_packet_samples = 0;
+    return 0;
+}
+
 static void group_av_groupchat_delete(void *object, uint32_t groupnumber)
 {
     if (object) {
@@ -314,22 +453,9 @@ static int decode_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, uint3
             return -1;
         }
 
-        if (channels != peer_av->decoder_channels) {
-            if (peer_av->audio_decoder) {
-                opus_decoder_destroy(peer_av->audio_decoder);
-                peer_av->audio_decoder = nullptr;
-            }
-
-            int rc;
-            peer_av->audio_decoder = opus_decoder_create(sample_rate, channels, &rc);
-
-            if (rc != OPUS_OK) {
-                LOGGER_ERROR(group_av->log, "Error while starting audio decoder: %s", opus_strerror(rc));
-                free(pk);
-                return -1;
-            }
-
-            peer_av->decoder_channels = channels;
+        if (prepare_decoder(group_av, peer_av, sample_rate, channels) == -1) {
+            free(pk);
+            return -1;
         }
 
         int num_samples = opus_decoder_get_nb_samples(peer_av->audio_decoder, pk->data, pk->length);
@@ -388,6 +514,41 @@ static int decode_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, uint3
     return -1;
 }
 
+/* Queue opus data of length with sequence number sequnum and play what is ready.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int play_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, uint32_t groupnumber,
+                             uint32_t friendgroupnumber, uint16_t sequnum, const uint8_t *data, uint16_t length)
+{
+    Group_Audio_Packet *pk = (Group_Audio_Packet *)calloc(1, sizeof(Group_Audio_Packet) + length);
+
+    if (!pk) {
+        return -1;
+    }
+
+    pk->sequnum = sequnum;
+    pk->length = length;
+    memcpy(pk->data, data, length);
+
+    if (queue(peer_av->buffer, pk) == -1) {
+        free(pk);
+        return -1;
+    }
+
+    if (group_av->mixed_audio_data) {
+        /* Decoded later by the mixer. */
+        return 0;
+    }
+
+    while (decode_audio_packet(group_av, peer_av, groupnumber, friendgroupnumber) == 0) {
+        ;
+    }
+
+    return 0;
+}
+
 static int handle_group_audio_packet(void *object, uint32_t groupnumber, uint32_t friendgroupnumber, void *peer_object,
                                      const uint8_t *packet, uint16_t length)
 {
@@ -395,30 +556,289 @@ static int handle_group_audio_packet(void *object, uint32_t groupnumber, uint32_
         return -1;
     }
 
-    Group_Peer_AV *peer_av = (Group_Peer_AV *)peer_object;
+    uint16_t sequnum;
+    memcpy(&sequnum, packet, sizeof(sequnum));
 
-    Group_Audio_Packet *pk = (Group_Audio_Packet *)calloc(1, sizeof(Group_Audio_Packet) + (length - sizeof(uint16_t)));
+    return play_audio_packet((Group_AV *)object, (Group_Peer_AV *)peer_object, groupnumber, friendgroupnumber,
+                             net_ntohs(sequnum), packet + sizeof(uint16_t), length - sizeof(uint16_t));
+}
 
-    if (!pk) {
+static bool speaker_active(const Group_Peer_AV *peer_av, uint64_t now)
+{
+    return peer_av->last_voice_time && peer_av->last_voice_time + GROUP_SPEAKER_TIMEOUT > now;
+}
+
+/* return true if peer_av is one of the max_speakers loudest active speakers of the group.
+ */
+static bool is_selected_speaker(const Group_AV *group_av, const Group_Peer_AV *peer_av, uint64_t now)
+{
+    if (group_av->max_speakers == 0) {
+        return 1;
+    }
+
+    uint32_t i, louder = 0;
+
+    for (i = 0; i < group_av->num_peers; ++i) {
+        const Group_Peer_AV *other = group_av->peers[i];
+
+        if (other == peer_av || !speaker_active(other, now)) {
+            continue;
+        }
+
+        /* lower -dBov is louder, ties are broken consistently by address */
+        if (other->level < peer_av->level || (other->level == peer_av->level && other < peer_av)) {
+            if (++louder >= group_av->max_speakers) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* Audio with a level extension.
+ *
+ * Silent frames are played (so decoding them can be skipped) but never relayed. Voiced frames are played and relayed
+ * only while their sender is one of the max_speakers loudest active speakers.
+ */
+static int handle_group_audio_level_packet(void *object, int groupnumber, int friendgroupnumber,
+        void *peer_object, const uint8_t *packet, uint16_t length)
+{
+    if (!peer_object || !object || length <= sizeof(uint16_t) + 1) {
         return -1;
     }
 
+    Group_AV *group_av = (Group_AV *)object;
+    Group_Peer_AV *peer_av = (Group_Peer_AV *)peer_object;
+
     uint16_t sequnum;
     memcpy(&sequnum, packet, sizeof(sequnum));
-    pk->sequnum = net_ntohs(sequnum);
-    pk->length = length - sizeof(uint16_t);
-    memcpy(pk->data, packet + sizeof(uint16_t), length - sizeof(uint16_t));
+    const uint8_t level = packet[sizeof(uint16_t)] & ~GROUP_AUDIO_LEVEL_VOICE;
+    const bool voice = (packet[sizeof(uint16_t)] & GROUP_AUDIO_LEVEL_VOICE) && level < GROUP_AUDIO_LEVEL_THRESHOLD;
+    bool selected = 0;
 
-    if (queue(peer_av->buffer, pk) == -1) {
-        free(pk);
+    if (voice) {
+        uint64_t now = current_time_monotonic();
+
+        if (speaker_active(peer_av, now)) {
+            peer_av->level = (peer_av->level * 3 + level) / 4;
+        } else {
+            peer_av->level = level;
+        }
+
+        peer_av->last_voice_time = now;
+        selected = is_selected_speaker(group_av, peer_av, now);
+
+        if (!selected) {
+            return -1;
+        }
+    }
+
+    if (play_audio_packet(group_av, peer_av, groupnumber, friendgroupnumber, net_ntohs(sequnum),
+                          packet + sizeof(uint16_t) + 1, length - (sizeof(uint16_t) + 1)) == -1) {
         return -1;
     }
 
-    while (decode_audio_packet((Group_AV *)object, peer_av, groupnumber, friendgroupnumber) == 0) {
-        ;
+    return selected ? 0 : -1;
+}
+
+/* out = saturate(out + in) for count samples.
+ */
+static void mix_add_pcm(int16_t *out, const int16_t *in, unsigned int count)
+{
+    unsigned int i = 0;
+
+#ifdef GROUP_MIX_SSE2
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(out + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_adds_epi16(a, b));
     }
 
-    return 0;
+#endif
+
+    for (; i < count; ++i) {
+        int32_t sum = (int32_t)out[i] + in[i];
+
+        if (sum > INT16_MAX) {
+            sum = INT16_MAX;
+        } else if (sum < INT16_MIN) {
+            sum = INT16_MIN;
+        }
+
+        out[i] = (int16_t)sum;
+    }
+}
+
+/* Decode queued packets of one peer until it has a full mixer frame or runs dry.
+ * Runs on the mixer workers; DTX frames and concealment of lost DTX frames are not decoded.
+ */
+static void mix_decode_peer(void *object, void *data)
+{
+    Group_AV *group_av = (Group_AV *)object;
+    Group_Peer_AV *peer_av = (Group_Peer_AV *)data;
+    const unsigned int channels = group_av->mix_channels;
+
+    while (peer_av->mix_fill < group_av->mix_frame_samples) {
+        int success;
+        Group_Audio_Packet *pk = dequeue(peer_av->buffer, &success);
+
+        if (success == 0) {
+            break;
+        }
+
+        int16_t *out = peer_av->mix_pcm + peer_av->mix_fill * channels;
+        const unsigned int room = group_av->mix_peer_capacity - peer_av->mix_fill;
+        int samples;
+
+        if (success == 1) {
+            samples = opus_packet_get_nb_samples(pk->data, pk->length, group_av->mix_sample_rate);
+
+            if (samples <= 0 || (unsigned int)samples > room) {
+                free(pk);
+                continue;
+            }
+
+            if (pk->length <= 2) {
+                memset(out, 0, samples * channels * sizeof(int16_t));
+                peer_av->dtx = 1;
+            } else {
+                samples = opus_decode(peer_av->audio_decoder, pk->data, pk->length, out, room, 0);
+
+                if (samples <= 0) {
+                    free(pk);
+                    continue;
+                }
+
+                peer_av->dtx = 0;
+                peer_av->mix_silent = 0;
+            }
+
+            peer_av->last_packet_samples = samples;
+            free(pk);
+        } else {
+            if (!peer_av->last_packet_samples) {
+                continue;
+            }
+
+            samples = MIN(peer_av->last_packet_samples, room);
+
+            if (peer_av->dtx) {
+                memset(out, 0, samples * channels * sizeof(int16_t));
+            } else {
+                samples = opus_decode(peer_av->audio_decoder, nullptr, 0, out, samples, 1);
+
+                if (samples <= 0) {
+                    continue;
+                }
+
+                peer_av->mix_silent = 0;
+            }
+        }
+
+        peer_av->mix_fill += samples;
+    }
+}
+
+/* Produce one mixed frame out of every peer that has audio for it.
+ */
+static void mix_frame(Group_AV *group_av, uint32_t groupnumber)
+{
+    const unsigned int channels = group_av->mix_channels;
+    const unsigned int frame_samples = group_av->mix_frame_samples;
+    uint32_t i;
+
+    for (i = 0; i < group_av->num_peers; ++i) {
+        Group_Peer_AV *peer_av = group_av->peers[i];
+
+        if (peer_av->mix_fill >= frame_samples || !peer_av->buffer || peer_av->buffer->top == peer_av->buffer->bottom) {
+            continue;
+        }
+
+        if (!peer_av->mix_pcm) {
+            peer_av->mix_pcm = (int16_t *)malloc(group_av->mix_peer_capacity * channels * sizeof(int16_t));
+
+            if (!peer_av->mix_pcm) {
+                continue;
+            }
+        }
+
+        if (prepare_decoder(group_av, peer_av, group_av->mix_sample_rate, channels) == -1) {
+            continue;
+        }
+
+        if (thread_pool_add_job(group_av->mix_pool, mix_decode_peer, group_av, peer_av) == -1) {
+            mix_decode_peer(group_av, peer_av);
+        }
+    }
+
+    thread_pool_wait(group_av->mix_pool);
+
+    bool have_audio = 0;
+    memset(group_av->mix_buffer, 0, frame_samples * channels * sizeof(int16_t));
+
+    for (i = 0; i < group_av->num_peers; ++i) {
+        Group_Peer_AV *peer_av = group_av->peers[i];
+
+        if (peer_av->mix_fill == 0) {
+            continue;
+        }
+
+        have_audio = 1;
+
+        if (peer_av->mix_fill < frame_samples) {
+            /* late packets, the missing part is silence */
+            memset(peer_av->mix_pcm + peer_av->mix_fill * channels, 0,
+                   (frame_samples - peer_av->mix_fill) * channels * sizeof(int16_t));
+            peer_av->mix_fill = frame_samples;
+        }
+
+        if (!peer_av->mix_silent) {
+            mix_add_pcm(group_av->mix_buffer, peer_av->mix_pcm, frame_samples * channels);
+        }
+
+        peer_av->mix_fill -= frame_samples;
+
+        if (peer_av->mix_fill) {
+            memmove(peer_av->mix_pcm, peer_av->mix_pcm + frame_samples * channels,
+                    peer_av->mix_fill * channels * sizeof(int16_t));
+        } else {
+            peer_av->mix_silent = 1;
+        }
+    }
+
+    if (have_audio) {
+        group_av->mixed_audio_data(group_av->g_c->m, groupnumber, group_av->mix_buffer, frame_samples, channels,
+                                   group_av->mix_sample_rate, group_av->userdata);
+    }
+}
+
+static void group_av_mix_iterate(void *object, int groupnumber, void *userdata)
+{
+    Group_AV *group_av = (Group_AV *)object;
+
+    if (!group_av || !group_av->mixed_audio_data) {
+        return;
+    }
+
+    uint64_t now = current_time_monotonic();
+    unsigned int frames = 0;
+
+    if (group_av->mix_next_time == 0) {
+        group_av->mix_next_time = now;
+    }
+
+    while (group_av->mix_next_time <= now && frames < GROUP_MIX_MAX_CATCHUP_FRAMES) {
+        mix_frame(group_av, groupnumber);
+        group_av->mix_next_time += GROUP_MIX_FRAME_MS;
+        ++frames;
+    }
+
+    if (group_av->mix_next_time <= now) {
+        /* too far behind, drop the backlog instead of bursting */
+        group_av->mix_next_time = now + GROUP_MIX_FRAME_MS;
+    }
 }
 
 /* Convert groupchat to an A/V groupchat.
@@ -445,6 +865,7 @@ static int groupchat_enable_av(Logger *log, Group_Chats *g_c, uint32_t groupnumb
     }
 
     group_lossy_packet_registerhandler(g_c, GROUP_AUDIO_PACKET_ID, &handle_group_audio_packet);
+    group_lossy_packet_registerhandler(g_c, GROUP_AUDIO_LEVEL_PACKET_ID, &handle_group_audio_level_packet);
     return 0;
 }
 
@@ -495,18 +916,126 @@ int join_av_groupchat(Logger *log, Group_Chats *g_c, uint32_t friendnumber, cons
     return groupnumber;
 }
 
+/* Enable or disable the built-in mixer of an A/V group.
+ *
+ * While enabled, peers are decoded on num_threads worker threads (0 decodes them on the tox_iterate() thread),
+ * resampled to sample_rate and channels and mixed into a single 20 ms frame which is passed to mixed_callback
+ * instead of calling the per-peer audio callback. A NULL mixed_callback disables mixing.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int group_av_enable_mixer(Group_Chats *g_c, uint32_t groupnumber, uint32_t sample_rate, uint8_t channels,
+                          uint32_t num_threads, void (*mixed_callback)(Messenger *, uint32_t, const int16_t *, unsigned int, uint8_t,
+                                  uint32_t, void *))
+{
+    Group_AV *group_av = (Group_AV *)group_get_object(g_c, groupnumber);
+
+    if (!group_av) {
+        return -1;
+    }
+
+    disable_mixer(group_av);
+
+    if (!mixed_callback) {
+        return callback_groupchat_iterate(g_c, groupnumber, nullptr);
+    }
+
+    if (channels != 1 && channels != 2) {
+        return -1;
+    }
+
+    if (sample_rate != 8000 && sample_rate != 12000 && sample_rate != 16000 && sample_rate != 24000
+            && sample_rate != 48000) {
+        return -1;
+    }
+
+    group_av->mix_sample_rate = sample_rate;
+    group_av->mix_channels = channels;
+    group_av->mix_frame_samples = sample_rate * GROUP_MIX_FRAME_MS / 1000;
+    group_av->mix_peer_capacity = sample_rate * GROUP_MIX_PEER_BUFFER_MS / 1000;
+    group_av->mix_next_time = 0;
+
+    group_av->mix_buffer = (int16_t *)malloc(group_av->mix_frame_samples * channels * sizeof(int16_t));
+    group_av->mix_pool = new_thread_pool(num_threads, GROUP_MIX_JOB_QUEUE_SIZE);
+
+    if (!group_av->mix_buffer || !group_av->mix_pool
+            || callback_groupchat_iterate(g_c, groupnumber, group_av_mix_iterate) == -1) {
+        disable_mixer(group_av);
+        return -1;
+    }
+
+    group_av->mixed_audio_data = mixed_callback;
+    return 0;
+}
+
+/* Enable speaker selection for an A/V group.
+ *
+ * Our audio is sent tagged with its level, silence is suppressed and of the tagged audio only the max_speakers
+ * loudest active speakers are played and relayed to other peers. 0 disables it and sends untagged audio again.
+ *
+ * All peers of the group need to understand tagged audio (GROUP_AUDIO_LEVEL_PACKET_ID) to hear us while enabled.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int group_av_set_max_speakers(Group_Chats *g_c, uint32_t groupnumber, uint32_t max_speakers)
+{
+    Group_AV *group_av = (Group_AV *)group_get_object(g_c, groupnumber);
+
+    if (!group_av) {
+        return -1;
+    }
+
+    group_av->max_speakers = max_speakers;
+    group_av->last_sent_silent = 0;
+    return 0;
+}
+
+/* return the level of pcm in -dBov (0 is full scale, 127 is digital silence).
+ */
+static uint8_t audio_level(const int16_t *pcm, unsigned int count)
+{
+    if (!count) {
+        return GROUP_AUDIO_LEVEL_SILENCE;
+    }
+
+    double energy = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; ++i) {
+        energy += (double)pcm[i] * pcm[i];
+    }
+
+    energy /= count;
+
+    /* every step down is 1 dB */
+    double threshold = 32768.0 * 32768.0;
+    uint8_t level = 0;
+
+    while (energy < threshold && level < GROUP_AUDIO_LEVEL_SILENCE) {
+        threshold /= 1.2589254117941673; /* 10^(1/10) */
+        ++level;
+    }
+
+    return level;
+}
+
 /* Send an encoded audio packet to the group chat.
+ *
+ * level is the audio level extension byte or -1 to send untagged audio.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-static int send_audio_packet(Group_Chats *g_c, uint32_t groupnumber, uint8_t *packet, uint16_t length)
+static int send_audio_packet(Group_Chats *g_c, uint32_t groupnumber, uint8_t *packet, uint16_t length, int level)
 {
     if (!length) {
         return -1;
     }
 
-    size_t plen = 1 + sizeof(uint16_t) + length;
+    const size_t header_len = 1 + sizeof(uint16_t) + (level == -1 ? 0 : 1);
+    size_t plen = header_len + length;
 
     if (plen > MAX_CRYPTO_DATA_SIZE) {
         return -1;
@@ -519,11 +1048,16 @@ static int send_audio_packet(Group_Chats *g_c, uint32_t groupnumber, uint8_t *pa
     }
 
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    data[0] = GROUP_AUDIO_PACKET_ID;
+    data[0] = level == -1 ? GROUP_AUDIO_PACKET_ID : GROUP_AUDIO_LEVEL_PACKET_ID;
 
     uint16_t sequnum = net_htons(group_av->audio_sequnum);
     memcpy(data + 1, &sequnum, sizeof(sequnum));
-    memcpy(data + 1 + sizeof(sequnum), packet, length);
+
+    if (level != -1) {
+        data[1 + sizeof(sequnum)] = (uint8_t)level;
+    }
+
+    memcpy(data + header_len, packet, length);
 
     if (send_group_lossy_packet(g_c, groupnumber, data, (uint16_t)plen) == -1) {
         return -1;
@@ -578,5 +1112,27 @@ int group_send_audio(Group_Chats *g_c, uint32_t groupnumber, const int16_t *pcm,
         return -1;
     }
 
-    return send_audio_packet(g_c, groupnumber, encoded, size);
+    if (!group_av->max_speakers) {
+        return send_audio_packet(g_c, groupnumber, encoded, size, -1);
+    }
+
+    /* 1 or 2 bytes is a DTX frame, only the first one after speech is sent */
+    const bool silent = size <= 2;
+
+    if (silent && group_av->last_sent_silent) {
+        return 0;
+    }
+
+    int level = audio_level(pcm, samples * channels);
+
+    if (!silent) {
+        level |= GROUP_AUDIO_LEVEL_VOICE;
+    }
+
+    if (send_audio_packet(g_c, groupnumber, encoded, size, level) == -1) {
+        return -1;
+    }
+
+    group_av->last_sent_silent = silent;
+    return 0;
 }
@@ -23,6 +23,8 @@
 #include <opus.h>
 
 #define GROUP_AUDIO_PACKET_ID 192
+/* Like GROUP_AUDIO_PACKET_ID with a one byte audio level extension after the sequence number. */
+#define GROUP_AUDIO_LEVEL_PACKET_ID 193
 
 /* Create a new toxav group.
  *
@@ -41,6 +43,30 @@ int join_av_groupchat(Logger *log, Group_Chats *g_c, uint32_t friendnumber, cons
                       void (*audio_callback)(Messenger *, uint32_t, uint32_t, const int16_t *, unsigned int, uint8_t, uint32_t, void *),
                       void *userdata);
 
+/* Enable or disable the built-in mixer of an A/V group.
+ *
+ * While enabled, peers are decoded on num_threads worker threads (0 decodes them on the tox_iterate() thread),
+ * resampled to sample_rate and channels and mixed into a single 20 ms frame which is passed to mixed_callback
+ * instead of calling the per-peer audio callback. A NULL mixed_callback disables mixing.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int group_av_enable_mixer(Group_Chats *g_c, uint32_t groupnumber, uint32_t sample_rate, uint8_t channels,
+                          uint32_t num_threads, void (*mixed_callback)(Messenger *, uint32_t, const int16_t *, unsigned int, uint8_t,
+                                  uint32_t, void *));
+
+/* Enable speaker selection for an A/V group.
+ *
+ * Our audio is sent tagged with its level, silence is suppressed and of the tagged audio only the max_speakers
+ * loudest active speakers are played and relayed to other peers. 0 disables it and sends untagged audio again.
+ *
+ * All peers of the group need to understand tagged audio (GROUP_AUDIO_LEVEL_PACKET_ID) to hear us while enabled.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int group_av_set_max_speakers(Group_Chats *g_c, uint32_t groupnumber, uint32_t max_speakers);
 
 /* Send audio to the group chat.
  *
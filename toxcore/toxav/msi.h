@@ -51,6 +51,7 @@ typedef enum {
     msi_CapSVideo = 8,  /* sending video */
     msi_CapRAudio = 16, /* receiving audio */
     msi_CapRVideo = 32, /* receiving video */
+    msi_CapVP9 = 64,    /* decoding VP9 video, never passed to the call state callback */
 } MSICapabilities;
 
 
@@ -31,6 +31,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 
 enum {
@@ -39,8 +40,125 @@ enum {
      * even though there are no free slots for incoming frames.
      */
     VIDEO_KEEP_KEYFRAME_IN_BUFFER_FOR_MS = 15,
+    /**
+     * The number of free frame buffers kept around for reuse. Enough for
+     * every work buffer slot plus the frames queued for the decoder.
+     */
+    RTP_FRAME_POOL_SIZE = USED_RTP_WORKBUFFER_COUNT + 5,
+    /**
+     * Frame buffer sizes are rounded up to this, so a buffer can be reused
+     * for a slightly larger frame.
+     */
+    RTP_FRAME_POOL_ROUND = 4096,
+};
+
+struct RTPFramePool {
+    pthread_mutex_t mutex;
+    struct RTPMessage *free_msgs[RTP_FRAME_POOL_SIZE];
+    uint8_t num_free;
 };
 
+RTPFramePool *rtp_frame_pool_new(void)
+{
+    RTPFramePool *pool = (RTPFramePool *)calloc(1, sizeof(RTPFramePool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        free(pool);
+        return nullptr;
+    }
+
+    return pool;
+}
+
+void rtp_frame_pool_kill(RTPFramePool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    for (uint8_t i = 0; i < pool->num_free; ++i) {
+        free(pool->free_msgs[i]);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/**
+ * Get a message with room for allocate_len bytes of data. Reused buffers are
+ * not cleared, so missing pieces of an incomplete frame contain stale data
+ * instead of zeros. The decoder treats both as corrupt.
+ */
+static struct RTPMessage *rtp_frame_pool_get(RTPFramePool *pool, uint32_t allocate_len)
+{
+    if (pool == nullptr) {
+        return (struct RTPMessage *)calloc(1, sizeof(struct RTPMessage) + allocate_len);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    int best = -1;
+
+    for (uint8_t i = 0; i < pool->num_free; ++i) {
+        if (pool->free_msgs[i]->capacity >= allocate_len
+                && (best == -1 || pool->free_msgs[i]->capacity < pool->free_msgs[best]->capacity)) {
+            best = i;
+        }
+    }
+
+    struct RTPMessage *msg = nullptr;
+
+    if (best != -1) {
+        msg = pool->free_msgs[best];
+        pool->free_msgs[best] = pool->free_msgs[--pool->num_free];
+    } else if (pool->num_free == RTP_FRAME_POOL_SIZE) {
+        /* Every pooled buffer is too small, drop one to make room for a bigger one */
+        free(pool->free_msgs[--pool->num_free]);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (msg == nullptr) {
+        const uint32_t capacity = (allocate_len + RTP_FRAME_POOL_ROUND - 1) / RTP_FRAME_POOL_ROUND * RTP_FRAME_POOL_ROUND;
+        msg = (struct RTPMessage *)calloc(1, sizeof(struct RTPMessage) + capacity);
+
+        if (msg == nullptr) {
+            return nullptr;
+        }
+
+        msg->capacity = capacity;
+    }
+
+    return msg;
+}
+
+void rtp_message_free(RTPFramePool *pool, struct RTPMessage *msg)
+{
+    if (msg == nullptr) {
+        return;
+    }
+
+    if (pool == nullptr || msg->capacity == 0) {
+        free(msg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->num_free < RTP_FRAME_POOL_SIZE) {
+        pool->free_msgs[pool->num_free] = msg;
+        ++pool->num_free;
+        msg = nullptr;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    free(msg);
+}
+
 // allocate_len is NOT including header!
 static struct RTPMessage *new_message(const struct RTPHeader *header, size_t allocate_len, const uint8_t *data,
                                       uint16_t data_length)
@@ -195,7 +313,7 @@ static int8_t get_slot(Logger *log, struct RTPWorkBufferList *wkbl, bool is_keyf
  *
  * If there are no frames ready, we return NULL. If this function returns
  * non-NULL, it transfers ownership of the message to the caller, i.e. the
- * caller is responsible for storing it elsewhere or calling free().
+ * caller is responsible for storing it elsewhere or calling rtp_message_free().
  */
 static struct RTPMessage *process_frame(Logger *log, struct RTPWorkBufferList *wkbl, uint8_t slot_id)
 {
@@ -245,6 +363,7 @@ static struct RTPMessage *process_frame(Logger *log, struct RTPWorkBufferList *w
 
 /**
  * @param log A logger.
+ * @param pool The pool to take the frame buffer from, may be NULL.
  * @param wkbl The list of in-progress frames, i.e. all the slots.
  * @param slot_id The slot we want to fill the data into.
  * @param is_keyframe Whether the data is part of a key frame.
@@ -252,8 +371,9 @@ static struct RTPMessage *process_frame(Logger *log, struct RTPWorkBufferList *w
  * @param incoming_data The pure payload without header.
  * @param incoming_data_length The length in bytes of the incoming data payload.
  */
-static bool fill_data_into_slot(Logger *log, struct RTPWorkBufferList *wkbl, const uint8_t slot_id, bool is_keyframe,
-                                const struct RTPHeader *header, const uint8_t *incoming_data, uint16_t incoming_data_length)
+static bool fill_data_into_slot(Logger *log, RTPFramePool *pool, struct RTPWorkBufferList *wkbl, const uint8_t slot_id,
+                                bool is_keyframe, const struct RTPHeader *header, const uint8_t *incoming_data,
+                                uint16_t incoming_data_length)
 {
     // We're either filling the data into an existing slot, or in a new one that
     // is the next free entry.
@@ -266,9 +386,9 @@ static bool fill_data_into_slot(Logger *log, struct RTPWorkBufferList *wkbl, con
     if (slot->received_len == 0) {
         assert(slot->buf == nullptr);
 
-        // No data for this slot has been received, yet, so we create a new
+        // No data for this slot has been received, yet, so we take a
         // message for it with enough memory for the entire frame.
-        struct RTPMessage *msg = (struct RTPMessage *)calloc(1, sizeof(struct RTPMessage) + header->data_length_full);
+        struct RTPMessage *msg = rtp_frame_pool_get(pool, header->data_length_full);
 
         if (msg == nullptr) {
             LOGGER_ERROR(log, "Out of memory while trying to allocate for frame of size %u\n",
@@ -411,6 +531,7 @@ static int handle_video_packet(RTPSession *session, const struct RTPHeader *head
     // fill in this part into the slot buffer at the correct offset
     if (!fill_data_into_slot(
                 log,
+                session->frame_pool,
                 session->work_buffer_list,
                 slot_id,
                 is_keyframe,
@@ -700,6 +821,10 @@ void rtp_kill(RTPSession *session)
     LOGGER_DEBUG(session->m->log, "Terminated RTP session V3 work_buffer_list->next_free_entry: %d",
                  (int)session->work_buffer_list->next_free_entry);
 
+    for (int8_t i = 0; i < session->work_buffer_list->next_free_entry; ++i) {
+        rtp_message_free(session->frame_pool, session->work_buffer_list->work_buffer[i].buf);
+    }
+
     free(session->work_buffer_list);
     free(session);
 }
@@ -737,7 +862,7 @@ int rtp_stop_receiving(RTPSession *session)
  * @param length is the length of the raw data.
  */
 int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
-                  bool is_keyframe, Logger *log)
+                  uint64_t flags, Logger *log)
 {
     if (!session) {
         LOGGER_ERROR(log, "No session!");
@@ -769,7 +894,7 @@ int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
     // here the highest bits gets stripped anyway, no need to do keyframe bit magic here!
     header.data_length_lower = length;
 
-    header.flags = RTP_LARGE_FRAME;
+    header.flags = RTP_LARGE_FRAME | flags;
 
     uint16_t length_safe = (uint16_t)length;
 
@@ -782,62 +907,31 @@ int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
     header.offset_lower = 0;
     header.offset_full = 0;
 
-    if (is_keyframe) {
-        header.flags |= RTP_KEY_FRAME;
-    }
-
-    VLA(uint8_t, rdata, length + RTP_HEADER_SIZE + 1);
-    memset(rdata, 0, SIZEOF_VLA(rdata));
+    /* Only the packet id and RTP header are built here, the frame data is
+     * passed down to the encryption slice by slice without being copied.
+     */
+    uint8_t rdata[1 + RTP_HEADER_SIZE];
     rdata[0] = session->payload_type;  // packet id == payload_type
 
-    if (MAX_CRYPTO_DATA_SIZE > (length + RTP_HEADER_SIZE + 1)) {
-        /**
-         * The length is lesser than the maximum allowed length (including header)
-         * Send the packet in single piece.
-         */
-        rtp_header_pack(rdata + 1, &header);
-        memcpy(rdata + 1 + RTP_HEADER_SIZE, data, length);
-
-        if (-1 == m_send_custom_lossy_packet(session->m, session->friend_number, rdata, SIZEOF_VLA(rdata))) {
-            LOGGER_WARNING(session->m->log, "RTP send failed (len: %zu)! std error: %s", SIZEOF_VLA(rdata), strerror(errno));
-        }
-    } else {
-        /**
-         * The length is greater than the maximum allowed length (including header)
-         * Send the packet in multiple pieces.
-         */
-        uint32_t sent = 0;
-        uint16_t piece = MAX_CRYPTO_DATA_SIZE - (RTP_HEADER_SIZE + 1);
+    /* Maximum payload carried by one packet after packet id and header */
+    const uint16_t max_piece = MAX_CRYPTO_DATA_SIZE - (RTP_HEADER_SIZE + 1);
+    uint32_t sent = 0;
 
-        while ((length - sent) + RTP_HEADER_SIZE + 1 > MAX_CRYPTO_DATA_SIZE) {
-            rtp_header_pack(rdata + 1, &header);
-            memcpy(rdata + 1 + RTP_HEADER_SIZE, data + sent, piece);
+    do {
+        const uint16_t piece = length - sent > max_piece ? max_piece : length - sent;
 
-            if (-1 == m_send_custom_lossy_packet(session->m, session->friend_number,
-                                                 rdata, piece + RTP_HEADER_SIZE + 1)) {
-                LOGGER_WARNING(session->m->log, "RTP send failed (len: %d)! std error: %s",
-                               piece + RTP_HEADER_SIZE + 1, strerror(errno));
-            }
+        rtp_header_pack(rdata + 1, &header);
 
-            sent += piece;
-            header.offset_lower = sent;
-            header.offset_full = sent; // raw data offset, without any header
+        if (-1 == m_send_custom_lossy_packet_split(session->m, session->friend_number, rdata, sizeof(rdata),
+                data + sent, piece)) {
+            LOGGER_WARNING(session->m->log, "RTP send failed (len: %d)! std error: %s",
+                           piece + RTP_HEADER_SIZE + 1, strerror(errno));
         }
 
-        /* Send remaining */
-        piece = length - sent;
-
-        if (piece) {
-            rtp_header_pack(rdata + 1, &header);
-            memcpy(rdata + 1 + RTP_HEADER_SIZE, data + sent, piece);
-
-            if (-1 == m_send_custom_lossy_packet(session->m, session->friend_number, rdata,
-                                                 piece + RTP_HEADER_SIZE + 1)) {
-                LOGGER_WARNING(session->m->log, "RTP send failed (len: %d)! std error: %s",
-                               piece + RTP_HEADER_SIZE + 1, strerror(errno));
-            }
-        }
-    }
+        sent += piece;
+        header.offset_lower = sent;
+        header.offset_full = sent; // raw data offset, without any header
+    } while (sent < length);
 
     session->sequnum ++;
     return 0;
@@ -64,6 +64,11 @@ enum RTPFlags {
      * Whether the packet is part of a key frame.
      */
     RTP_KEY_FRAME = 1 << 1,
+    /**
+     * Whether the video frame is encoded with VP9 instead of VP8. Only set
+     * when the peer announced VP9 support with msi_CapVP9.
+     */
+    RTP_VP9_FRAME = 1 << 2,
 };
 
 
@@ -124,10 +129,23 @@ struct RTPMessage {
      */
     uint16_t len;
 
+    /**
+     * Size of the data array for messages taken from an \ref RTPFramePool.
+     * Zero for messages allocated on their own.
+     */
+    uint32_t capacity;
+
     struct RTPHeader header;
     uint8_t data[];
 };
 
+/**
+ * Pool of reassembly buffers for video frames. Assembled frames are handed
+ * back to the pool once they are decoded and reused for later frames, instead
+ * of allocating and zeroing a new buffer for every frame.
+ */
+typedef struct RTPFramePool RTPFramePool;
+
 #define USED_RTP_WORKBUFFER_COUNT 3
 
 /**
@@ -176,6 +194,7 @@ typedef struct RTPSession {
     BWController *bwc;
     void *cs;
     int (*mcb)(void *, struct RTPMessage *msg);
+    RTPFramePool *frame_pool; /* Reassembly buffers for video frames, may be NULL */
 } RTPSession;
 
 
@@ -197,6 +216,14 @@ size_t rtp_header_pack(uint8_t *rdata, const struct RTPHeader *header);
  */
 size_t rtp_header_unpack(const uint8_t *data, struct RTPHeader *header);
 
+RTPFramePool *rtp_frame_pool_new(void);
+void rtp_frame_pool_kill(RTPFramePool *pool);
+/**
+ * Free a message passed to the session callback. Messages taken from pool are
+ * returned to it, all others are freed. pool and msg may be NULL.
+ */
+void rtp_message_free(RTPFramePool *pool, struct RTPMessage *msg);
+
 RTPSession *rtp_new(int payload_type, Messenger *m, uint32_t friendnumber,
                     BWController *bwc, void *cs,
                     int (*mcb)(void *, struct RTPMessage *));
@@ -209,11 +236,11 @@ int rtp_stop_receiving(RTPSession *session);
  * @param session The A/V session to send the data for.
  * @param data A byte array of length \p length.
  * @param length The number of bytes to send from @p data.
- * @param is_keyframe Whether this video frame is a key frame. If it is an
- *   audio frame, this parameter is ignored.
+ * @param flags Additional \ref RTPFlags for this frame, e.g. RTP_KEY_FRAME if
+ *   this video frame is a key frame. Pass 0 for audio frames.
  */
 int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
-                  bool is_keyframe, Logger *log);
+                  uint64_t flags, Logger *log);
 
 #ifdef __cplusplus
 }  // extern "C"
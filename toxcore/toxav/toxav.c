@@ -76,6 +76,32 @@ typedef struct ToxAVCall_s {
     struct ToxAVCall_s *next;
 } ToxAVCall;
 
+typedef struct ToxAVVideoFrame_s {
+    uint32_t friend_number;
+    uint16_t width;
+    uint16_t height;
+    const uint8_t *y; /* Planes as passed to toxav_video_send_frame_async */
+    const uint8_t *u;
+    const uint8_t *v;
+    uint8_t *copy; /* Copy of all three planes, nullptr if the caller owns them */
+    uint64_t queued_time;
+} ToxAVVideoFrame;
+
+typedef struct ToxAVVideoEncoder_s {
+    ToxAV *av;
+    pthread_t thread;
+    pthread_mutex_t mutex[1];
+    pthread_cond_t cond;
+
+    /* Ring buffer of frames waiting to be encoded */
+    ToxAVVideoFrame *queue;
+    uint32_t size;
+    uint32_t bottom;
+    uint32_t count;
+
+    bool stop;
+} ToxAVVideoEncoder;
+
 struct ToxAV {
     Messenger *m;
     MSISession *msi;
@@ -92,6 +118,11 @@ struct ToxAV {
     PAIR(toxav_video_receive_frame_cb *, void *) vcb; /* Video frame receive callback */
     PAIR(toxav_audio_bit_rate_cb *, void *) abcb; /* Bit rate control callback */
     PAIR(toxav_video_bit_rate_cb *, void *) vbcb; /* Bit rate control callback */
+    PAIR(toxav_video_send_done_cb *, void *) vdcb; /* Video send done callback */
+
+    /** Asynchronous video encoder, nullptr unless enabled with toxav_video_set_async() */
+    ToxAVVideoEncoder *video_encoder;
+    uint32_t video_frames_dropped;
 
     /** Decode time measures */
     int32_t dmssc; /** Measure count */
@@ -186,6 +217,9 @@ void toxav_kill(ToxAV *av)
         return;
     }
 
+    /* Stop the encoder thread before the calls it encodes for go away */
+    toxav_video_set_async(av, 0);
+
     pthread_mutex_lock(av->mutex);
 
     /* To avoid possible deadlocks */
@@ -297,7 +331,7 @@ bool toxav_call(ToxAV *av, uint32_t friend_number, uint32_t audio_bit_rate, uint
     call->audio_bit_rate = audio_bit_rate;
     call->video_bit_rate = video_bit_rate;
 
-    call->previous_self_capabilities = msi_CapRAudio | msi_CapRVideo;
+    call->previous_self_capabilities = msi_CapRAudio | msi_CapRVideo | msi_CapVP9;
 
     call->previous_self_capabilities |= audio_bit_rate > 0 ? msi_CapSAudio : 0;
     call->previous_self_capabilities |= video_bit_rate > 0 ? msi_CapSVideo : 0;
@@ -361,7 +395,7 @@ bool toxav_answer(ToxAV *av, uint32_t friend_number, uint32_t audio_bit_rate, ui
     call->audio_bit_rate = audio_bit_rate;
     call->video_bit_rate = video_bit_rate;
 
-    call->previous_self_capabilities = msi_CapRAudio | msi_CapRVideo;
+    call->previous_self_capabilities = msi_CapRAudio | msi_CapRVideo | msi_CapVP9;
 
     call->previous_self_capabilities |= audio_bit_rate > 0 ? msi_CapSAudio : 0;
     call->previous_self_capabilities |= video_bit_rate > 0 ? msi_CapSVideo : 0;
@@ -753,8 +787,11 @@ bool toxav_audio_send_frame(ToxAV *av, uint32_t friend_number, const int16_t *pc
 
         sampling_rate = net_htonl(sampling_rate);
         memcpy(dest, &sampling_rate, sizeof(sampling_rate));
+        Metrics *metrics = net_metrics(av->m->net);
+        const uint64_t encode_start = metrics_time_ns();
         int vrc = opus_encode(call->audio.second->encoder, pcm, sample_count,
                               dest + sizeof(sampling_rate), SIZEOF_VLA(dest) - sizeof(sampling_rate));
+        metrics_observe(metrics, METRIC_HISTOGRAM_AV_AUDIO_ENCODE_US, (metrics_time_ns() - encode_start) / 1000);
 
         if (vrc < 0) {
             LOGGER_WARNING(av->m->log, "Failed to encode frame %s", opus_strerror(vrc));
@@ -763,9 +800,12 @@ bool toxav_audio_send_frame(ToxAV *av, uint32_t friend_number, const int16_t *pc
             goto END;
         }
 
-        if (rtp_send_data(call->audio.first, dest, vrc + sizeof(sampling_rate), false, av->m->log) != 0) {
+        if (rtp_send_data(call->audio.first, dest, vrc + sizeof(sampling_rate), 0, av->m->log) != 0) {
             LOGGER_WARNING(av->m->log, "Failed to send audio packet");
+            metrics_inc(metrics, METRIC_AV_SEND_FAILURES);
             rc = TOXAV_ERR_SEND_FRAME_RTP_FAILED;
+        } else {
+            metrics_inc(metrics, METRIC_AV_AUDIO_FRAMES_SENT);
         }
     }
 
@@ -780,53 +820,37 @@ END:
     return rc == TOXAV_ERR_SEND_FRAME_OK;
 }
 
-bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height, const uint8_t *y,
-                            const uint8_t *u, const uint8_t *v, TOXAV_ERR_SEND_FRAME *error)
+/**
+ * return TOXAV_ERR_SEND_FRAME_OK if video can be sent on the call.
+ */
+static TOXAV_ERR_SEND_FRAME video_send_check(const ToxAVCall *call)
 {
-    TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
-    ToxAVCall *call;
-
-    int vpx_encode_flags = 0;
-
-    if (m_friend_exists(av->m, friend_number) == 0) {
-        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
-        goto END;
-    }
-
-    if (pthread_mutex_trylock(av->mutex) != 0) {
-        rc = TOXAV_ERR_SEND_FRAME_SYNC;
-        goto END;
-    }
-
-    call = call_get(av, friend_number);
-
+    /* Assumes mutex locked */
     if (call == nullptr || !call->active || call->msi_call->state != msi_CallActive) {
-        pthread_mutex_unlock(av->mutex);
-        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_IN_CALL;
-        goto END;
+        return TOXAV_ERR_SEND_FRAME_FRIEND_NOT_IN_CALL;
     }
 
     if (call->video_bit_rate == 0 ||
             !(call->msi_call->self_capabilities & msi_CapSVideo) ||
             !(call->msi_call->peer_capabilities & msi_CapRVideo)) {
-        pthread_mutex_unlock(av->mutex);
-        rc = TOXAV_ERR_SEND_FRAME_PAYLOAD_TYPE_DISABLED;
-        goto END;
+        return TOXAV_ERR_SEND_FRAME_PAYLOAD_TYPE_DISABLED;
     }
 
-    pthread_mutex_lock(call->mutex_video);
-    pthread_mutex_unlock(av->mutex);
+    return TOXAV_ERR_SEND_FRAME_OK;
+}
+static TOXAV_ERR_SEND_FRAME video_encode_and_send(ToxAV *av, ToxAVCall *call, uint16_t width, uint16_t height,
+        const uint8_t *y, const uint8_t *u, const uint8_t *v)
+{
+    /* Assumes call->mutex_video locked */
+    Metrics *metrics = net_metrics(av->m->net);
+    int vpx_encode_flags = 0;
 
-    if (y == nullptr || u == nullptr || v == nullptr) {
-        pthread_mutex_unlock(call->mutex_video);
-        rc = TOXAV_ERR_SEND_FRAME_NULL;
-        goto END;
-    }
+    /* Only send VP9 if the friend told us it can decode it */
+    const TOXAV_VIDEO_CODEC codec = (call->msi_call->peer_capabilities & msi_CapVP9) ?
+                                    call->video.second->send_codec : TOXAV_VIDEO_CODEC_VP8;
 
-    if (vc_reconfigure_encoder(call->video.second, call->video_bit_rate * 1000, width, height, -1) != 0) {
-        pthread_mutex_unlock(call->mutex_video);
-        rc = TOXAV_ERR_SEND_FRAME_INVALID;
-        goto END;
+    if (vc_reconfigure_encoder(call->video.second, codec, call->video_bit_rate * 1000, width, height, -1) != 0) {
+        return TOXAV_ERR_SEND_FRAME_INVALID;
     }
 
     if (call->video.first->ssrc < VIDEO_SEND_X_KEYFRAMES_FIRST) {
@@ -848,16 +872,16 @@ bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, u
     { /* Encode */
         vpx_image_t img = { VPX_IMG_FMT_I420, VPX_CS_UNKNOWN, VPX_CR_STUDIO_RANGE, 
             width, height, 8, width, height, 0, 0, 1, 1,
-            y,u,v,nullptr, width,width/2,width/2,width, 12 };
+            (uint8_t *)y, (uint8_t *)u, (uint8_t *)v, nullptr, width, width / 2, width / 2, width, 12 };
 
+        const uint64_t encode_start = metrics_time_ns();
         vpx_codec_err_t vrc = vpx_codec_encode(call->video.second->encoder, &img,
                                                call->video.second->frame_counter, 1, vpx_encode_flags, MAX_ENCODE_TIME_US);
+        metrics_observe(metrics, METRIC_HISTOGRAM_AV_VIDEO_ENCODE_US, (metrics_time_ns() - encode_start) / 1000);
 
         if (vrc != VPX_CODEC_OK) {
-            pthread_mutex_unlock(call->mutex_video);
             LOGGER_ERROR(av->m->log, "Could not encode video frame: %s\n", vpx_codec_err_to_string(vrc));
-            rc = TOXAV_ERR_SEND_FRAME_INVALID;
-            goto END;
+            return TOXAV_ERR_SEND_FRAME_INVALID;
         }
     }
 
@@ -870,6 +894,11 @@ bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, u
         while ((pkt = vpx_codec_get_cx_data(call->video.second->encoder, &iter)) != nullptr) {
             if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
                 const bool is_keyframe = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
+                uint64_t flags = is_keyframe ? RTP_KEY_FRAME : 0;
+
+                if (codec == TOXAV_VIDEO_CODEC_VP9) {
+                    flags |= RTP_VP9_FRAME;
+                }
 
                 // https://www.webmproject.org/docs/webm-sdk/structvpx__codec__cx__pkt.html
                 // pkt->data.frame.sz -> size_t
@@ -879,7 +908,7 @@ bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, u
                                     call->video.first,
                                     (const uint8_t *)pkt->data.frame.buf,
                                     frame_length_in_bytes,
-                                    is_keyframe,
+                                    flags,
                                     av->m->log);
 
                 LOGGER_DEBUG(av->m->log, "+ _sending_FRAME_TYPE_==%s bytes=%d frame_len=%d", is_keyframe ? "K" : ".",
@@ -888,15 +917,51 @@ bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, u
                              ((const uint8_t *)pkt->data.frame.buf)[1]);
 
                 if (res < 0) {
-                    pthread_mutex_unlock(call->mutex_video);
                     LOGGER_WARNING(av->m->log, "Could not send video frame: %s", strerror(errno));
-                    rc = TOXAV_ERR_SEND_FRAME_RTP_FAILED;
-                    goto END;
+                    metrics_inc(metrics, METRIC_AV_SEND_FAILURES);
+                    return TOXAV_ERR_SEND_FRAME_RTP_FAILED;
                 }
             }
         }
     }
 
+    metrics_inc(metrics, METRIC_AV_VIDEO_FRAMES_SENT);
+    return TOXAV_ERR_SEND_FRAME_OK;
+}
+bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height, const uint8_t *y,
+                            const uint8_t *u, const uint8_t *v, TOXAV_ERR_SEND_FRAME *error)
+{
+    TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
+    ToxAVCall *call;
+
+    if (m_friend_exists(av->m, friend_number) == 0) {
+        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
+        goto END;
+    }
+
+    if (pthread_mutex_trylock(av->mutex) != 0) {
+        rc = TOXAV_ERR_SEND_FRAME_SYNC;
+        goto END;
+    }
+
+    call = call_get(av, friend_number);
+    rc = video_send_check(call);
+
+    if (rc != TOXAV_ERR_SEND_FRAME_OK) {
+        pthread_mutex_unlock(av->mutex);
+        goto END;
+    }
+
+    pthread_mutex_lock(call->mutex_video);
+    pthread_mutex_unlock(av->mutex);
+
+    if (y == nullptr || u == nullptr || v == nullptr) {
+        pthread_mutex_unlock(call->mutex_video);
+        rc = TOXAV_ERR_SEND_FRAME_NULL;
+        goto END;
+    }
+
+    rc = video_encode_and_send(av, call, width, height, y, u, v);
     pthread_mutex_unlock(call->mutex_video);
 
 END:
@@ -907,7 +972,330 @@ END:
 
     return rc == TOXAV_ERR_SEND_FRAME_OK;
 }
+static void video_frame_done(ToxAV *av, toxav_video_send_done_cb *cb, void *cb_data, ToxAVVideoFrame *frame,
+                             TOXAV_ERR_SEND_FRAME rc, uint32_t queue_time, uint32_t encode_time, uint32_t dropped)
+{
+    if (cb) {
+        cb(av, frame->friend_number, frame->y, frame->u, frame->v, rc, queue_time, encode_time, dropped, cb_data);
+    }
+
+    free(frame->copy);
+}
+static void *video_encoder_thread(void *arg)
+{
+    ToxAVVideoEncoder *enc = (ToxAVVideoEncoder *)arg;
+    ToxAV *av = enc->av;
+
+    pthread_mutex_lock(enc->mutex);
+
+    while (1) {
+        while (enc->count == 0 && !enc->stop) {
+            pthread_cond_wait(&enc->cond, enc->mutex);
+        }
+
+        if (enc->stop) {
+            /* Queued frames are dropped by the thread stopping us */
+            break;
+        }
+
+        ToxAVVideoFrame frame = enc->queue[enc->bottom];
+        enc->bottom = (enc->bottom + 1) % enc->size;
+        --enc->count;
+        pthread_mutex_unlock(enc->mutex);
+
+        const uint64_t start = current_time_monotonic();
+        const uint8_t *y = frame.y;
+        const uint8_t *u = frame.u;
+        const uint8_t *v = frame.v;
+
+        if (frame.copy) {
+            y = frame.copy;
+            u = y + frame.width * frame.height;
+            v = u + (frame.width / 2) * (frame.height / 2);
+        }
+
+        pthread_mutex_lock(av->mutex);
+        toxav_video_send_done_cb *cb = av->vdcb.first;
+        void *cb_data = av->vdcb.second;
+        const uint32_t dropped = av->video_frames_dropped;
+        ToxAVCall *call = call_get(av, frame.friend_number);
+        TOXAV_ERR_SEND_FRAME rc = video_send_check(call);
+
+        if (rc == TOXAV_ERR_SEND_FRAME_OK) {
+            pthread_mutex_lock(call->mutex_video);
+            pthread_mutex_unlock(av->mutex);
+            rc = video_encode_and_send(av, call, frame.width, frame.height, y, u, v);
+            pthread_mutex_unlock(call->mutex_video);
+        } else {
+            pthread_mutex_unlock(av->mutex);
+        }
+
+        const uint64_t end = current_time_monotonic();
+        video_frame_done(av, cb, cb_data, &frame, rc, start - frame.queued_time, end - start, dropped);
+
+        pthread_mutex_lock(enc->mutex);
+    }
+
+    pthread_mutex_unlock(enc->mutex);
+    return nullptr;
+}
+static ToxAVVideoEncoder *video_encoder_new(ToxAV *av, uint32_t queue_size)
+{
+    ToxAVVideoEncoder *enc = (ToxAVVideoEncoder *)calloc(1, sizeof(ToxAVVideoEncoder));
+
+    if (enc == nullptr) {
+        return nullptr;
+    }
+
+    enc->queue = (ToxAVVideoFrame *)calloc(queue_size, sizeof(ToxAVVideoFrame));
+
+    if (enc->queue == nullptr) {
+        free(enc);
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(enc->mutex, nullptr) != 0) {
+        goto FAILURE_2;
+    }
+
+    if (pthread_cond_init(&enc->cond, nullptr) != 0) {
+        goto FAILURE_1;
+    }
+
+    enc->av = av;
+    enc->size = queue_size;
+
+    if (pthread_create(&enc->thread, nullptr, video_encoder_thread, enc) != 0) {
+        pthread_cond_destroy(&enc->cond);
+        goto FAILURE_1;
+    }
+
+    return enc;
+
+FAILURE_1:
+    pthread_mutex_destroy(enc->mutex);
+FAILURE_2:
+    free(enc->queue);
+    free(enc);
+    return nullptr;
+}
+static void video_encoder_kill(ToxAV *av, ToxAVVideoEncoder *enc)
+{
+    /* Assumes av->mutex unlocked, the encoder thread needs it */
+    pthread_mutex_lock(enc->mutex);
+    enc->stop = 1;
+    pthread_cond_signal(&enc->cond);
+    pthread_mutex_unlock(enc->mutex);
+
+    pthread_join(enc->thread, nullptr);
+
+    pthread_mutex_lock(av->mutex);
+    av->video_frames_dropped += enc->count;
+    metrics_add(net_metrics(av->m->net), METRIC_AV_VIDEO_FRAMES_DROPPED, enc->count);
+    const uint32_t dropped = av->video_frames_dropped;
+    toxav_video_send_done_cb *cb = av->vdcb.first;
+    void *cb_data = av->vdcb.second;
+    pthread_mutex_unlock(av->mutex);
+
+    for (; enc->count; --enc->count) {
+        video_frame_done(av, cb, cb_data, &enc->queue[enc->bottom], TOXAV_ERR_SEND_FRAME_DROPPED, 0, 0, dropped);
+        enc->bottom = (enc->bottom + 1) % enc->size;
+    }
+
+    pthread_cond_destroy(&enc->cond);
+    pthread_mutex_destroy(enc->mutex);
+    free(enc->queue);
+    free(enc);
+}
+bool toxav_video_set_async(ToxAV *av, uint32_t queue_size)
+{
+    pthread_mutex_lock(av->mutex);
+    ToxAVVideoEncoder *old = av->video_encoder;
+    av->video_encoder = nullptr;
+    pthread_mutex_unlock(av->mutex);
+
+    if (old) {
+        video_encoder_kill(av, old);
+    }
+
+    if (queue_size == 0) {
+        return true;
+    }
+
+    ToxAVVideoEncoder *enc = video_encoder_new(av, queue_size);
+
+    if (enc == nullptr) {
+        LOGGER_WARNING(av->m->log, "Failed to start video encoder thread");
+        return false;
+    }
+
+    pthread_mutex_lock(av->mutex);
+
+    if (av->video_encoder) {
+        /* Someone else started an encoder in the meantime */
+        pthread_mutex_unlock(av->mutex);
+        video_encoder_kill(av, enc);
+        return false;
+    }
+
+    av->video_encoder = enc;
+    pthread_mutex_unlock(av->mutex);
+    return true;
+}
+bool toxav_video_send_frame_async(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height,
+                                  const uint8_t *y, const uint8_t *u, const uint8_t *v, bool copy,
+                                  TOXAV_ERR_SEND_FRAME *error)
+{
+    TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
+    ToxAVVideoFrame frame = {0};
+    ToxAVVideoFrame dropped_frame = {0};
+    bool have_dropped = 0;
+
+    if (m_friend_exists(av->m, friend_number) == 0) {
+        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
+        goto END;
+    }
+
+    if (y == nullptr || u == nullptr || v == nullptr) {
+        rc = TOXAV_ERR_SEND_FRAME_NULL;
+        goto END;
+    }
+
+    frame.friend_number = friend_number;
+    frame.width = width;
+    frame.height = height;
+    frame.y = y;
+    frame.u = u;
+    frame.v = v;
+
+    if (copy) {
+        const size_t y_size = (size_t)width * height;
+        const size_t uv_size = (size_t)(width / 2) * (height / 2);
+
+        frame.copy = (uint8_t *)malloc(y_size + uv_size * 2);
+
+        if (frame.copy == nullptr) {
+            rc = TOXAV_ERR_SEND_FRAME_MALLOC;
+            goto END;
+        }
+
+        memcpy(frame.copy, y, y_size);
+        memcpy(frame.copy + y_size, u, uv_size);
+        memcpy(frame.copy + y_size + uv_size, v, uv_size);
+    }
+
+    pthread_mutex_lock(av->mutex);
+
+    ToxAVVideoEncoder *enc = av->video_encoder;
+
+    if (enc == nullptr) {
+        /* Not running asynchronously, send right away */
+        toxav_video_send_done_cb *cb = av->vdcb.first;
+        void *cb_data = av->vdcb.second;
+        const uint32_t dropped = av->video_frames_dropped;
+        pthread_mutex_unlock(av->mutex);
+
+        const uint64_t start = current_time_monotonic();
+        toxav_video_send_frame(av, friend_number, width, height, y, u, v, &rc);
+        video_frame_done(av, cb, cb_data, &frame, rc, 0, current_time_monotonic() - start, dropped);
+        goto END;
+    }
+
+    rc = video_send_check(call_get(av, friend_number));
+
+    if (rc != TOXAV_ERR_SEND_FRAME_OK) {
+        pthread_mutex_unlock(av->mutex);
+        free(frame.copy);
+        goto END;
+    }
+
+    frame.queued_time = current_time_monotonic();
+
+    pthread_mutex_lock(enc->mutex);
+
+    if (enc->count == enc->size) {
+        /* Drop the oldest frame, the newest one is worth more for live video */
+        dropped_frame = enc->queue[enc->bottom];
+        enc->bottom = (enc->bottom + 1) % enc->size;
+        --enc->count;
+        ++av->video_frames_dropped;
+        metrics_inc(net_metrics(av->m->net), METRIC_AV_VIDEO_FRAMES_DROPPED);
+        have_dropped = 1;
+    }
+
+    enc->queue[(enc->bottom + enc->count) % enc->size] = frame;
+    ++enc->count;
+    pthread_cond_signal(&enc->cond);
+    pthread_mutex_unlock(enc->mutex);
+
+    toxav_video_send_done_cb *cb = av->vdcb.first;
+    void *cb_data = av->vdcb.second;
+    const uint32_t dropped = av->video_frames_dropped;
+    pthread_mutex_unlock(av->mutex);
+
+    if (have_dropped) {
+        LOGGER_DEBUG(av->m->log, "Video send queue full, dropped oldest frame (%u dropped)", dropped);
+        video_frame_done(av, cb, cb_data, &dropped_frame, TOXAV_ERR_SEND_FRAME_DROPPED,
+                         frame.queued_time - dropped_frame.queued_time, 0, dropped);
+    }
+
+END:
+
+    if (error) {
+        *error = rc;
+    }
+
+    return rc == TOXAV_ERR_SEND_FRAME_OK;
+}
+void toxav_callback_video_send_done(ToxAV *av, toxav_video_send_done_cb *callback, void *user_data)
+{
+    pthread_mutex_lock(av->mutex);
+    av->vdcb.first = callback;
+    av->vdcb.second = user_data;
+    pthread_mutex_unlock(av->mutex);
+}
+bool toxav_video_set_codec(ToxAV *av, uint32_t friend_number, TOXAV_VIDEO_CODEC codec, uint8_t encoder_threads,
+                           uint8_t tile_columns, int8_t cpu_used, uint8_t decoder_threads,
+                           TOXAV_ERR_VIDEO_CODEC_SET *error)
+{
+    TOXAV_ERR_VIDEO_CODEC_SET rc = TOXAV_ERR_VIDEO_CODEC_SET_OK;
+    ToxAVCall *call;
+
+    if (m_friend_exists(av->m, friend_number) == 0) {
+        rc = TOXAV_ERR_VIDEO_CODEC_SET_FRIEND_NOT_FOUND;
+        goto END;
+    }
+
+    pthread_mutex_lock(av->mutex);
+    call = call_get(av, friend_number);
+
+    if (call == nullptr || !call->active || call->msi_call->state != msi_CallActive) {
+        pthread_mutex_unlock(av->mutex);
+        rc = TOXAV_ERR_VIDEO_CODEC_SET_FRIEND_NOT_IN_CALL;
+        goto END;
+    }
 
+    pthread_mutex_lock(call->mutex);
+    pthread_mutex_lock(call->mutex_video);
+    pthread_mutex_unlock(av->mutex);
+
+    if (vc_set_codec_options(call->video.second, codec, encoder_threads, tile_columns, cpu_used,
+                             decoder_threads) != 0) {
+        rc = TOXAV_ERR_VIDEO_CODEC_SET_INVALID;
+    } else {
+        LOGGER_DEBUG(av->m->log, "Set video codec %d for friend %u", codec, friend_number);
+    }
+
+    pthread_mutex_unlock(call->mutex_video);
+    pthread_mutex_unlock(call->mutex);
+END:
+
+    if (error) {
+        *error = rc;
+    }
+
+    return rc == TOXAV_ERR_VIDEO_CODEC_SET_OK;
+}
 void toxav_callback_audio_receive_frame(ToxAV *av, toxav_audio_receive_frame_cb *callback, void *user_data)
 {
     pthread_mutex_lock(av->mutex);
@@ -1021,7 +1409,7 @@ int callback_start(void *toxav_inst, MSICall *call)
         return -1;
     }
 
-    if (!invoke_call_state_callback(toxav, call->friend_number, call->peer_capabilities)) {
+    if (!invoke_call_state_callback(toxav, call->friend_number, call->peer_capabilities & ~msi_CapVP9)) {
         callback_error(toxav_inst, call);
         pthread_mutex_unlock(toxav->mutex);
         return -1;
@@ -1077,7 +1465,7 @@ int callback_capabilites(void *toxav_inst, MSICall *call)
         rtp_stop_receiving(((ToxAVCall *)call->av_call)->video.first);
     }
 
-    invoke_call_state_callback(toxav, call->friend_number, call->peer_capabilities);
+    invoke_call_state_callback(toxav, call->friend_number, call->peer_capabilities & ~msi_CapVP9);
 
     pthread_mutex_unlock(toxav->mutex);
     return 0;
@@ -1317,6 +1705,8 @@ bool call_prepare_transmission(ToxAVCall *call)
             LOGGER_ERROR(av->m->log, "Failed to create video rtp session");
             goto FAILURE;
         }
+
+        call->video.first->frame_pool = call->video.second->frame_pool;
     }
 
     call->active = 1;
@@ -565,6 +565,18 @@ typedef enum TOXAV_ERR_SEND_FRAME {
      */
     TOXAV_ERR_SEND_FRAME_RTP_FAILED,
 
+    /**
+     * The frame was dropped from the asynchronous video send queue because it
+     * was full. Only reported to the video_send_done callback.
+     */
+    TOXAV_ERR_SEND_FRAME_DROPPED,
+
+    /**
+     * Memory allocation failure while trying to copy the frame for the
+     * asynchronous encoder.
+     */
+    TOXAV_ERR_SEND_FRAME_MALLOC,
+
 } TOXAV_ERR_SEND_FRAME;
 
 
@@ -638,6 +650,66 @@ void toxav_callback_audio_bit_rate(ToxAV *av, toxav_audio_bit_rate_cb *callback,
 bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height, const uint8_t *y,
                             const uint8_t *u, const uint8_t *v, TOXAV_ERR_SEND_FRAME *error);
 
+/**
+ * Start or stop the asynchronous video encoder.
+ *
+ * While it runs, frames passed to toxav_video_send_frame_async are queued and
+ * encoded and sent by a dedicated encoder thread, so a slow encode does not
+ * block the capturing thread. If the queue is full the oldest queued frame is
+ * dropped.
+ *
+ * Stopping the encoder drops every frame still queued.
+ *
+ * @param queue_size Maximum number of queued frames. 0 stops the encoder.
+ *
+ * @return true on success.
+ */
+bool toxav_video_set_async(ToxAV *av, uint32_t queue_size);
+
+/**
+ * Queue a video frame to be sent to a friend by the asynchronous encoder.
+ *
+ * The plane layout is the same as for toxav_video_send_frame. The outcome of
+ * every queued frame is reported to the video_send_done callback.
+ *
+ * If copy is false the planes are not copied and must stay valid and unchanged
+ * until the video_send_done callback reported the frame.
+ *
+ * If the asynchronous encoder is not running the frame is sent right away,
+ * like with toxav_video_send_frame.
+ *
+ * @param copy Whether to copy the planes before returning.
+ *
+ * @return true if the frame was queued or sent.
+ */
+bool toxav_video_send_frame_async(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height,
+                                  const uint8_t *y, const uint8_t *u, const uint8_t *v, bool copy,
+                                  TOXAV_ERR_SEND_FRAME *error);
+
+/**
+ * The function type for the video_send_done callback. The event is triggered
+ * once for every frame passed to toxav_video_send_frame_async, either from the
+ * encoder thread or, for dropped frames, from the thread queueing a new frame.
+ *
+ * @param friend_number The friend number of the friend the frame was for.
+ * @param y, u, v The plane pointers passed to toxav_video_send_frame_async.
+ * @param error TOXAV_ERR_SEND_FRAME_OK if the frame was sent,
+ *   TOXAV_ERR_SEND_FRAME_DROPPED if it was dropped from the queue.
+ * @param queue_time Time in milliseconds the frame spent in the queue.
+ * @param encode_time Time in milliseconds spent encoding and sending the frame.
+ * @param dropped Total number of frames dropped from the queue so far.
+ */
+typedef void toxav_video_send_done_cb(ToxAV *av, uint32_t friend_number, const uint8_t *y, const uint8_t *u,
+                                      const uint8_t *v, TOXAV_ERR_SEND_FRAME error, uint32_t queue_time,
+                                      uint32_t encode_time, uint32_t dropped, void *user_data);
+
+
+/**
+ * Set the callback for the `video_send_done` event. Pass NULL to unset.
+ *
+ */
+void toxav_callback_video_send_done(ToxAV *av, toxav_video_send_done_cb *callback, void *user_data);
+
 /**
  * Set the bit rate to be used in subsequent video frames.
  *
@@ -668,6 +740,88 @@ typedef void toxav_video_bit_rate_cb(ToxAV *av, uint32_t friend_number, uint32_t
 void toxav_callback_video_bit_rate(ToxAV *av, toxav_video_bit_rate_cb *callback, void *user_data);
 
 
+/*******************************************************************************
+ *
+ * :: Video codec
+ *
+ ******************************************************************************/
+
+
+
+typedef enum TOXAV_VIDEO_CODEC {
+
+    /**
+     * VP8, supported by every client.
+     */
+    TOXAV_VIDEO_CODEC_VP8,
+
+    /**
+     * VP9, only used if the friend announced support for it when the call was
+     * set up. Otherwise VP8 is used.
+     */
+    TOXAV_VIDEO_CODEC_VP9,
+
+} TOXAV_VIDEO_CODEC;
+
+
+typedef enum TOXAV_ERR_VIDEO_CODEC_SET {
+
+    /**
+     * The function returned successfully.
+     */
+    TOXAV_ERR_VIDEO_CODEC_SET_OK,
+
+    /**
+     * Synchronization error occurred.
+     */
+    TOXAV_ERR_VIDEO_CODEC_SET_SYNC,
+
+    /**
+     * The codec or one of the options passed was not valid.
+     */
+    TOXAV_ERR_VIDEO_CODEC_SET_INVALID,
+
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    TOXAV_ERR_VIDEO_CODEC_SET_FRIEND_NOT_FOUND,
+
+    /**
+     * This client is currently not in a call with the friend.
+     */
+    TOXAV_ERR_VIDEO_CODEC_SET_FRIEND_NOT_IN_CALL,
+
+} TOXAV_ERR_VIDEO_CODEC_SET;
+
+
+/**
+ * Set the video codec and encoder/decoder options used for a call. The new
+ * settings take effect with the next sent or received frame.
+ *
+ * Every client announces VP9 support when calling or answering. Unless this
+ * function selected VP8, video is sent as VP9 whenever the friend announced
+ * that it can decode it, and as VP8 otherwise. Received frames carry the codec
+ * they were encoded with, so the friend may use a different codec than we do.
+ *
+ * @param friend_number The friend number of the friend for which to set the
+ * codec.
+ * @param codec The preferred codec for sending video.
+ * @param encoder_threads Number of encoder threads, 0 for the default (4).
+ * Must not be larger than 64.
+ * @param tile_columns log2 of the number of tile columns (VP9 only). VP9 can
+ * only use one encoder thread per tile column. Must not be larger than 6.
+ * @param cpu_used Encoder speed setting. Larger values trade quality for
+ * speed. Must be in -16..16, clamped to -8..8 for VP9. Use 16 for the default.
+ * @param decoder_threads Number of decoder threads, 0 for the default (4).
+ * Must not be larger than 64.
+ *
+ * @return true on success.
+ */
+bool toxav_video_set_codec(ToxAV *av, uint32_t friend_number, TOXAV_VIDEO_CODEC codec, uint8_t encoder_threads,
+                           uint8_t tile_columns, int8_t cpu_used, uint8_t decoder_threads,
+                           TOXAV_ERR_VIDEO_CODEC_SET *error);
+
+
 /*******************************************************************************
  *
  * :: A/V receiving
@@ -778,6 +932,41 @@ int toxav_join_av_groupchat(Tox *tox, uint32_t friendnumber, const uint8_t *data
 int toxav_group_send_audio(Tox *tox, uint32_t groupnumber, const int16_t *pcm, unsigned int samples, uint8_t channels,
                            uint32_t sample_rate);
 
+/* Enable or disable built-in mixing of the AV group's audio.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ *
+ * When enabled, the audio callback passed to toxav_add_av_groupchat()/toxav_join_av_groupchat() is no longer
+ * called. Instead every peer is decoded on one of num_threads worker threads (0 means on the tox_iterate() thread),
+ * converted to sample_rate and channels, and all peers are mixed into one frame of 20 ms which is passed to
+ * mixed_callback from within tox_iterate(). Peers sending silence (opus DTX) are not decoded.
+ *
+ * Mixed audio callback format:
+ *   mixed_callback(Tox *tox, uint32_t groupnumber, const int16_t *pcm, unsigned int samples, uint8_t channels, uint32_t sample_rate, void *userdata)
+ *
+ * Pass NULL as mixed_callback to go back to per-peer audio callbacks.
+ *
+ * Valid number of channels are 1 or 2.
+ * Valid sample rates are 8000, 12000, 16000, 24000, or 48000.
+ */
+int toxav_group_enable_mixer(Tox *tox, uint32_t groupnumber, uint32_t sample_rate, uint8_t channels,
+                             uint32_t num_threads,
+                             void (*mixed_callback)(void *, uint32_t, const int16_t *, unsigned int, uint8_t, uint32_t, void *));
+
+/* Enable speaker selection (selective forwarding) for the AV group.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ *
+ * While enabled our audio is sent tagged with its audio level, silence after the first silent frame is not sent
+ * at all, and of all level tagged audio only the max_speakers loudest active speakers are played and relayed to
+ * other peers. Silent frames are never relayed. Pass 0 as max_speakers to send untagged audio again.
+ *
+ * All peers of the group need a client supporting level tagged audio to hear us while this is enabled.
+ */
+int toxav_group_set_max_speakers(Tox *tox, uint32_t groupnumber, uint32_t max_speakers);
+
 #ifdef __cplusplus
 }
 #endif
@@ -83,4 +83,32 @@ int toxav_group_send_audio(Tox *tox, uint32_t groupnumber, const int16_t *pcm, u
 {
     Messenger *m = (Messenger *)tox;
     return group_send_audio((Group_Chats *)m->conferences_object, groupnumber, pcm, samples, channels, sample_rate);
-}
\ No newline at end of file
+}
+
+/* Enable or disable built-in mixing of the AV group's audio.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ *
+ * Mixed audio callback format:
+ *   mixed_callback(Tox *tox, uint32_t groupnumber, const int16_t *pcm, unsigned int samples, uint8_t channels, uint32_t sample_rate, void *userdata)
+ */
+int toxav_group_enable_mixer(Tox *tox, uint32_t groupnumber, uint32_t sample_rate, uint8_t channels,
+                             uint32_t num_threads,
+                             void (*mixed_callback)(void *, uint32_t, const int16_t *, unsigned int, uint8_t, uint32_t, void *))
+{
+    Messenger *m = (Messenger *)tox;
+    return group_av_enable_mixer((Group_Chats *)m->conferences_object, groupnumber, sample_rate, channels, num_threads,
+                                 (void (*)(Messenger *, uint32_t, const int16_t *, unsigned int, uint8_t, uint32_t, void *))mixed_callback);
+}
+
+/* Enable speaker selection (selective forwarding) for the AV group.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int toxav_group_set_max_speakers(Tox *tox, uint32_t groupnumber, uint32_t max_speakers)
+{
+    Messenger *m = (Messenger *)tox;
+    return group_av_set_max_speakers((Group_Chats *)m->conferences_object, groupnumber, max_speakers);
+}
@@ -60,9 +60,18 @@
  * estimation methods. Values greater than 0 will increase encoder speed at the
  * expense of quality.
  *
- * Note Valid range for VP8: -16..16
+ * Note Valid range for VP8: -16..16, for VP9: -8..8
  */
 #define VP8E_SET_CPUUSED_VALUE 16
+#define VP9E_CPUUSED_MAX 8
+
+/**
+ * log2 of the number of tile columns a VP9 frame is split into. libvpx 1.5
+ * has no row based multi-threading, so VP9 can only use one encoder thread per
+ * tile column. The encoder reduces this if the frame is too narrow.
+ */
+#define VP9E_SET_TILE_COLUMNS_VALUE 2
+#define VP9E_MAX_TILE_COLUMNS 6
 
 /**
  * Initialize encoder with this value. Target bandwidth to use for this stream, in kilobits per second.
@@ -70,8 +79,9 @@
 #define VIDEO_BITRATE_INITIAL_VALUE 5000
 #define VIDEO_DECODE_BUFFER_SIZE 5 // this buffer has normally max. 1 entry
 
-#define VIDEO_CODEC_DECODER_INTERFACE (vpx_codec_vp8_dx())
-#define VIDEO_CODEC_ENCODER_INTERFACE (vpx_codec_vp8_cx())
+#define VIDEO_CODEC_DECODER_INTERFACE(codec) ((codec) == TOXAV_VIDEO_CODEC_VP9 ? vpx_codec_vp9_dx() : vpx_codec_vp8_dx())
+#define VIDEO_CODEC_ENCODER_INTERFACE(codec) ((codec) == TOXAV_VIDEO_CODEC_VP9 ? vpx_codec_vp9_cx() : vpx_codec_vp8_cx())
+#define VIDEO_CODEC_NAME(codec) ((codec) == TOXAV_VIDEO_CODEC_VP9 ? "VP9" : "VP8")
 
 #define VIDEO_CODEC_DECODER_MAX_WIDTH  800 // its a dummy value, because the struct needs a value there
 #define VIDEO_CODEC_DECODER_MAX_HEIGHT 600 // its a dummy value, because the struct needs a value there
@@ -80,11 +90,13 @@
 
 #define VPX_MAX_ENCODER_THREADS 4
 #define VPX_MAX_DECODER_THREADS 4
+#define VPX_THREADS_LIMIT 64
 #define VIDEO__VP8_DECODER_POST_PROCESSING_ENABLED 0
 
-static void vc_init_encoder_cfg(Logger *log, vpx_codec_enc_cfg_t *cfg, int16_t kf_max_dist)
+static void vc_init_encoder_cfg(Logger *log, vpx_codec_enc_cfg_t *cfg, TOXAV_VIDEO_CODEC codec, uint8_t threads,
+                                int16_t kf_max_dist)
 {
-    vpx_codec_err_t rc = vpx_codec_enc_config_default(VIDEO_CODEC_ENCODER_INTERFACE, cfg, 0);
+    vpx_codec_err_t rc = vpx_codec_enc_config_default(VIDEO_CODEC_ENCODER_INTERFACE(codec), cfg, 0);
 
     if (rc != VPX_CODEC_OK) {
         LOGGER_ERROR(log, "vc_init_encoder_cfg:Failed to get config: %s", vpx_codec_err_to_string(rc));
@@ -128,7 +140,7 @@ static void vc_init_encoder_cfg(Logger *log, vpx_codec_enc_cfg_t *cfg, int16_t k
         LOGGER_DEBUG(log, "kf_max_dist=%d (2)", cfg->kf_max_dist);
     }
 
-    cfg->g_threads = VPX_MAX_ENCODER_THREADS; // Maximum number of threads to use
+    cfg->g_threads = threads; // Maximum number of threads to use
     /* TODO: set these to something reasonable */
     // cfg->g_timebase.num = 1;
     // cfg->g_timebase.den = 60; // 60 fps
@@ -151,28 +163,14 @@ static void vc_init_encoder_cfg(Logger *log, vpx_codec_enc_cfg_t *cfg, int16_t k
 #endif
 }
 
-VCSession *vc_new(Logger *log, ToxAV *av, uint32_t friend_number, toxav_video_receive_frame_cb *cb, void *cb_data)
+/**
+ * Initialize decoder for codec using up to threads threads.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int vc_init_decoder(VCSession *vc, vpx_codec_ctx_t *decoder, TOXAV_VIDEO_CODEC codec, uint8_t threads)
 {
-    VCSession *vc = (VCSession *)calloc(sizeof(VCSession), 1);
-    vpx_codec_err_t rc;
-
-    if (!vc) {
-        LOGGER_WARNING(log, "Allocation failed! Application might misbehave!");
-        return nullptr;
-    }
-
-    if (create_recursive_mutex(vc->queue_mutex) != 0) {
-        LOGGER_WARNING(log, "Failed to create recursive mutex!");
-        free(vc);
-        return nullptr;
-    }
-
-    int cpu_used_value = VP8E_SET_CPUUSED_VALUE;
-
-    if (!(vc->vbuf_raw = rb_new(VIDEO_DECODE_BUFFER_SIZE))) {
-        goto BASE_CLEANUP;
-    }
-
     /*
      * VPX_CODEC_USE_FRAME_THREADING
      *    Enable frame-based multi-threading
@@ -181,63 +179,95 @@ VCSession *vc_new(Logger *log, ToxAV *av, uint32_t friend_number, toxav_video_re
      *    Conceal errors in decoded frames
      */
     vpx_codec_dec_cfg_t  dec_cfg;
-    dec_cfg.threads = VPX_MAX_DECODER_THREADS; // Maximum number of threads to use
+    dec_cfg.threads = threads; // Maximum number of threads to use
     dec_cfg.w = VIDEO_CODEC_DECODER_MAX_WIDTH;
     dec_cfg.h = VIDEO_CODEC_DECODER_MAX_HEIGHT;
 
-    LOGGER_DEBUG(log, "Using VP8 codec for decoder (0)");
-    rc = vpx_codec_dec_init(vc->decoder, VIDEO_CODEC_DECODER_INTERFACE, &dec_cfg,
-                            VPX_CODEC_USE_FRAME_THREADING | VPX_CODEC_USE_POSTPROC);
+    /* Frame threading adds a frame of latency per thread in VP9, it uses
+     * tile based threading instead.
+     */
+    const vpx_codec_flags_t flags = codec == TOXAV_VIDEO_CODEC_VP9 ? 0 : VPX_CODEC_USE_FRAME_THREADING;
+
+    LOGGER_DEBUG(vc->log, "Using %s codec for decoder", VIDEO_CODEC_NAME(codec));
+    vpx_codec_err_t rc = vpx_codec_dec_init(decoder, VIDEO_CODEC_DECODER_INTERFACE(codec), &dec_cfg,
+                                            flags | VPX_CODEC_USE_POSTPROC);
 
     if (rc == VPX_CODEC_INCAPABLE) {
-        LOGGER_WARNING(log, "Postproc not supported by this decoder (0)");
-        rc = vpx_codec_dec_init(vc->decoder, VIDEO_CODEC_DECODER_INTERFACE, &dec_cfg, VPX_CODEC_USE_FRAME_THREADING);
+        LOGGER_WARNING(vc->log, "Postproc not supported by this decoder (0)");
+        rc = vpx_codec_dec_init(decoder, VIDEO_CODEC_DECODER_INTERFACE(codec), &dec_cfg, flags);
     }
 
     if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR(log, "Init video_decoder failed: %s", vpx_codec_err_to_string(rc));
-        goto BASE_CLEANUP;
+        LOGGER_ERROR(vc->log, "Init video_decoder failed: %s", vpx_codec_err_to_string(rc));
+        return -1;
     }
 
     if (VIDEO__VP8_DECODER_POST_PROCESSING_ENABLED == 1) {
         vp8_postproc_cfg_t pp = {VP8_DEBLOCK, 1, 0};
-        vpx_codec_err_t cc_res = vpx_codec_control(vc->decoder, VP8_SET_POSTPROC, &pp);
+        vpx_codec_err_t cc_res = vpx_codec_control(decoder, VP8_SET_POSTPROC, &pp);
 
         if (cc_res != VPX_CODEC_OK) {
-            LOGGER_WARNING(log, "Failed to turn on postproc");
+            LOGGER_WARNING(vc->log, "Failed to turn on postproc");
         } else {
-            LOGGER_DEBUG(log, "turn on postproc: OK");
+            LOGGER_DEBUG(vc->log, "turn on postproc: OK");
         }
     } else {
         vp8_postproc_cfg_t pp = {0, 0, 0};
-        vpx_codec_err_t cc_res = vpx_codec_control(vc->decoder, VP8_SET_POSTPROC, &pp);
+        vpx_codec_err_t cc_res = vpx_codec_control(decoder, VP8_SET_POSTPROC, &pp);
 
         if (cc_res != VPX_CODEC_OK) {
-            LOGGER_WARNING(log, "Failed to turn OFF postproc");
+            LOGGER_WARNING(vc->log, "Failed to turn OFF postproc");
         } else {
-            LOGGER_DEBUG(log, "Disable postproc: OK");
+            LOGGER_DEBUG(vc->log, "Disable postproc: OK");
         }
     }
 
-    /* Set encoder to some initial values
-     */
-    vpx_codec_enc_cfg_t  cfg;
-    vc_init_encoder_cfg(log, &cfg, 1);
+    return 0;
+}
 
-    LOGGER_DEBUG(log, "Using VP8 codec for encoder (0.1)");
-    rc = vpx_codec_enc_init(vc->encoder, VIDEO_CODEC_ENCODER_INTERFACE, &cfg, VPX_CODEC_USE_FRAME_THREADING);
+/**
+ * Initialize encoder for codec with cfg and apply the speed and tiling
+ * settings of the session.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int vc_init_encoder(VCSession *vc, vpx_codec_ctx_t *encoder, TOXAV_VIDEO_CODEC codec,
+                           const vpx_codec_enc_cfg_t *cfg)
+{
+    LOGGER_DEBUG(vc->log, "Using %s codec for encoder", VIDEO_CODEC_NAME(codec));
+    vpx_codec_err_t rc = vpx_codec_enc_init(encoder, VIDEO_CODEC_ENCODER_INTERFACE(codec), cfg,
+                                            VPX_CODEC_USE_FRAME_THREADING);
 
     if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR(log, "Failed to initialize encoder: %s", vpx_codec_err_to_string(rc));
-        goto BASE_CLEANUP_1;
+        LOGGER_ERROR(vc->log, "Failed to initialize encoder: %s", vpx_codec_err_to_string(rc));
+        return -1;
     }
 
-    rc = vpx_codec_control(vc->encoder, VP8E_SET_CPUUSED, cpu_used_value);
+    int cpu_used_value = vc->encoder_cpu_used;
+
+    if (codec == TOXAV_VIDEO_CODEC_VP9) {
+        if (cpu_used_value > VP9E_CPUUSED_MAX) {
+            cpu_used_value = VP9E_CPUUSED_MAX;
+        } else if (cpu_used_value < -VP9E_CPUUSED_MAX) {
+            cpu_used_value = -VP9E_CPUUSED_MAX;
+        }
+    }
+
+    rc = vpx_codec_control(encoder, VP8E_SET_CPUUSED, cpu_used_value);
 
     if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR(log, "Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
-        vpx_codec_destroy(vc->encoder);
-        goto BASE_CLEANUP_1;
+        LOGGER_ERROR(vc->log, "Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
+        vpx_codec_destroy(encoder);
+        return -1;
+    }
+
+    if (codec == TOXAV_VIDEO_CODEC_VP9) {
+        rc = vpx_codec_control(encoder, VP9E_SET_TILE_COLUMNS, (int)vc->encoder_tile_columns);
+
+        if (rc != VPX_CODEC_OK) {
+            LOGGER_WARNING(vc->log, "Failed to set tile columns: %s", vpx_codec_err_to_string(rc));
+        }
     }
 
     /*
@@ -246,27 +276,75 @@ VCSession *vc_new(Logger *log, ToxAV *av, uint32_t friend_number, toxav_video_re
       0: off, 1: OnYOnly, 2: OnYUV, 3: OnYUVAggressive, 4: Adaptive
     */
     /*
-      rc = vpx_codec_control(vc->encoder, VP8E_SET_NOISE_SENSITIVITY, 2);
+      rc = vpx_codec_control(encoder, VP8E_SET_NOISE_SENSITIVITY, 2);
 
       if (rc != VPX_CODEC_OK) {
-          LOGGER_ERROR(log, "Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
-          vpx_codec_destroy(vc->encoder);
-          goto BASE_CLEANUP_1;
+          LOGGER_ERROR(vc->log, "Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
+          vpx_codec_destroy(encoder);
+          return -1;
       }
      */
+    return 0;
+}
+
+VCSession *vc_new(Logger *log, ToxAV *av, uint32_t friend_number, toxav_video_receive_frame_cb *cb, void *cb_data)
+{
+    VCSession *vc = (VCSession *)calloc(sizeof(VCSession), 1);
+
+    if (!vc) {
+        LOGGER_WARNING(log, "Allocation failed! Application might misbehave!");
+        return nullptr;
+    }
+
+    if (create_recursive_mutex(vc->queue_mutex) != 0) {
+        LOGGER_WARNING(log, "Failed to create recursive mutex!");
+        free(vc);
+        return nullptr;
+    }
+
+    vc->log = log;
+    vc->encoder_codec = TOXAV_VIDEO_CODEC_VP8;
+    vc->send_codec = TOXAV_VIDEO_CODEC_VP9;
+    vc->encoder_threads = VPX_MAX_ENCODER_THREADS;
+    vc->encoder_tile_columns = VP9E_SET_TILE_COLUMNS_VALUE;
+    vc->encoder_cpu_used = VP8E_SET_CPUUSED_VALUE;
+    vc->decoder_codec = TOXAV_VIDEO_CODEC_VP8;
+    vc->decoder_threads = VPX_MAX_DECODER_THREADS;
+
+    if (!(vc->vbuf_raw = rb_new(VIDEO_DECODE_BUFFER_SIZE))) {
+        goto BASE_CLEANUP;
+    }
+
+    if (!(vc->frame_pool = rtp_frame_pool_new())) {
+        goto BASE_CLEANUP;
+    }
+
+    if (vc_init_decoder(vc, vc->decoder, vc->decoder_codec, vc->decoder_threads) != 0) {
+        goto BASE_CLEANUP;
+    }
+
+    /* Set encoder to some initial values
+     */
+    vpx_codec_enc_cfg_t  cfg;
+    vc_init_encoder_cfg(log, &cfg, vc->encoder_codec, vc->encoder_threads, 1);
+
+    if (vc_init_encoder(vc, vc->encoder, vc->encoder_codec, &cfg) != 0) {
+        goto BASE_CLEANUP_1;
+    }
+
     vc->linfts = current_time_monotonic();
     vc->lcfd = 60;
     vc->vcb.first = cb;
     vc->vcb.second = cb_data;
     vc->friend_number = friend_number;
     vc->av = av;
-    vc->log = log;
     return vc;
 BASE_CLEANUP_1:
     vpx_codec_destroy(vc->decoder);
 BASE_CLEANUP:
     pthread_mutex_destroy(vc->queue_mutex);
     rb_kill((RingBuffer *)vc->vbuf_raw);
+    rtp_frame_pool_kill(vc->frame_pool);
     free(vc);
     return nullptr;
 }
@@ -282,10 +360,11 @@ void vc_kill(VCSession *vc)
     void *p;
 
     while (rb_read((RingBuffer *)vc->vbuf_raw, &p)) {
-        free(p);
+        rtp_message_free(vc->frame_pool, (struct RTPMessage *)p);
     }
 
     rb_kill((RingBuffer *)vc->vbuf_raw);
+    rtp_frame_pool_kill(vc->frame_pool);
     pthread_mutex_destroy(vc->queue_mutex);
     LOGGER_DEBUG(vc->log, "Terminated video handler: %p", (void *)vc);
     free(vc);
@@ -306,6 +385,10 @@ void vc_iterate(VCSession *vc)
     uint32_t full_data_len;
 
     if (rb_read((RingBuffer *)vc->vbuf_raw, (void **)&p)) {
+        /* vc_set_codec_options() changes these from the API thread. */
+        const bool decoder_reinit = vc->decoder_reinit;
+        const uint8_t decoder_threads = vc->decoder_threads;
+        vc->decoder_reinit = 0;
         pthread_mutex_unlock(vc->queue_mutex);
         const struct RTPHeader *const header = &p->header;
 
@@ -319,8 +402,34 @@ void vc_iterate(VCSession *vc)
 
         LOGGER_DEBUG(vc->log, "vc_iterate: rb_read p->len=%d p->header.xe=%d", (int)full_data_len, p->header.xe);
         LOGGER_DEBUG(vc->log, "vc_iterate: rb_read rb size=%d", (int)rb_size((RingBuffer *)vc->vbuf_raw));
+
+        /* The peer may switch codecs at any time, e.g. after it learned that
+         * we support VP9, so every frame says which decoder it needs.
+         */
+        const TOXAV_VIDEO_CODEC codec = (header->flags & RTP_VP9_FRAME) ? TOXAV_VIDEO_CODEC_VP9 : TOXAV_VIDEO_CODEC_VP8;
+
+        if (codec != vc->decoder_codec || decoder_reinit) {
+            vpx_codec_ctx_t new_d;
+
+            if (vc_init_decoder(vc, &new_d, codec, decoder_threads) != 0) {
+                rtp_message_free(vc->frame_pool, p);
+
+                if (decoder_reinit) {
+                    pthread_mutex_lock(vc->queue_mutex);
+                    vc->decoder_reinit = 1;
+                    pthread_mutex_unlock(vc->queue_mutex);
+                }
+
+                return;
+            }
+
+            vpx_codec_destroy(vc->decoder);
+            memcpy(vc->decoder, &new_d, sizeof(new_d));
+            vc->decoder_codec = codec;
+        }
+
         rc = vpx_codec_decode(vc->decoder, p->data, full_data_len, nullptr, MAX_DECODE_TIME_US);
-        free(p);
+        rtp_message_free(vc->frame_pool, p);
 
         if (rc != VPX_CODEC_OK) {
             LOGGER_ERROR(vc->log, "Error decoding video: %d %s", (int)rc, vpx_codec_err_to_string(rc));
@@ -363,13 +472,13 @@ int vc_queue_message(void *vcp, struct RTPMessage *msg)
 
     if (msg->header.pt == (rtp_TypeVideo + 2) % 128) {
         LOGGER_WARNING(vc->log, "Got dummy!");
-        free(msg);
+        rtp_message_free(vc->frame_pool, msg);
         return 0;
     }
 
     if (msg->header.pt != rtp_TypeVideo % 128) {
         LOGGER_WARNING(vc->log, "Invalid payload type! pt=%d", (int)msg->header.pt);
-        free(msg);
+        rtp_message_free(vc->frame_pool, msg);
         return -1;
     }
 
@@ -379,7 +488,7 @@ int vc_queue_message(void *vcp, struct RTPMessage *msg)
         LOGGER_DEBUG(vc->log, "rb_write msg->len=%d b0=%d b1=%d", (int)msg->len, (int)msg->data[0], (int)msg->data[1]);
     }
 
-    free(rb_write((RingBuffer *)vc->vbuf_raw, msg));
+    rtp_message_free(vc->frame_pool, (struct RTPMessage *)rb_write((RingBuffer *)vc->vbuf_raw, msg));
 
     /* Calculate time it took for peer to send us this frame */
     uint32_t t_lcfd = current_time_monotonic() - vc->linfts;
@@ -389,7 +498,8 @@ int vc_queue_message(void *vcp, struct RTPMessage *msg)
     return 0;
 }
 
-int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uint16_t height, int16_t kf_max_dist)
+int vc_reconfigure_encoder(VCSession *vc, TOXAV_VIDEO_CODEC codec, uint32_t bit_rate, uint16_t width, uint16_t height,
+                           int16_t kf_max_dist)
 {
     if (!vc) {
         return -1;
@@ -397,12 +507,14 @@ int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uin
 
     vpx_codec_enc_cfg_t cfg2 = *vc->encoder->config.enc;
     vpx_codec_err_t rc;
+    const bool same_encoder = codec == vc->encoder_codec && !vc->encoder_reinit;
 
-    if (cfg2.rc_target_bitrate == bit_rate && cfg2.g_w == width && cfg2.g_h == height && kf_max_dist == -1) {
+    if (same_encoder && cfg2.rc_target_bitrate == bit_rate && cfg2.g_w == width && cfg2.g_h == height
+            && kf_max_dist == -1) {
         return 0; /* Nothing changed */
     }
 
-    if (cfg2.g_w == width && cfg2.g_h == height && kf_max_dist == -1) {
+    if (same_encoder && cfg2.g_w == width && cfg2.g_h == height && kf_max_dist == -1) {
         /* Only bit rate changed */
         LOGGER_INFO(vc->log, "bitrate change from: %u to: %u", (uint32_t)cfg2.rc_target_bitrate, (uint32_t)bit_rate);
         cfg2.rc_target_bitrate = bit_rate;
@@ -413,38 +525,70 @@ int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uin
             return -1;
         }
     } else {
-        /* Resolution is changed, must reinitialize encoder since libvpx v1.4 doesn't support
-         * reconfiguring encoder to use resolutions greater than initially set.
+        /* Resolution, codec or encoder options changed, must reinitialize encoder since libvpx v1.4
+         * doesn't support reconfiguring encoder to use resolutions greater than initially set.
          */
         LOGGER_DEBUG(vc->log, "Have to reinitialize vpx encoder on session %p", (void *)vc);
         vpx_codec_ctx_t new_c;
         vpx_codec_enc_cfg_t  cfg;
-        vc_init_encoder_cfg(vc->log, &cfg, kf_max_dist);
+        vc_init_encoder_cfg(vc->log, &cfg, codec, vc->encoder_threads, kf_max_dist);
         cfg.rc_target_bitrate = bit_rate;
         cfg.g_w = width;
         cfg.g_h = height;
 
-        LOGGER_DEBUG(vc->log, "Using VP8 codec for encoder");
-        rc = vpx_codec_enc_init(&new_c, VIDEO_CODEC_ENCODER_INTERFACE, &cfg, VPX_CODEC_USE_FRAME_THREADING);
-
-        if (rc != VPX_CODEC_OK) {
-            LOGGER_ERROR(vc->log, "Failed to initialize encoder: %s", vpx_codec_err_to_string(rc));
+        if (vc_init_encoder(vc, &new_c, codec, &cfg) != 0) {
             return -1;
         }
 
-        int cpu_used_value = VP8E_SET_CPUUSED_VALUE;
+        vpx_codec_destroy(vc->encoder);
+        memcpy(vc->encoder, &new_c, sizeof(new_c));
+        vc->encoder_codec = codec;
+        vc->encoder_reinit = 0;
+    }
 
-        rc = vpx_codec_control(&new_c, VP8E_SET_CPUUSED, cpu_used_value);
+    return 0;
+}
 
-        if (rc != VPX_CODEC_OK) {
-            LOGGER_ERROR(vc->log, "Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
-            vpx_codec_destroy(&new_c);
-            return -1;
-        }
+int vc_set_codec_options(VCSession *vc, TOXAV_VIDEO_CODEC codec, uint8_t encoder_threads, uint8_t tile_columns,
+                         int8_t cpu_used, uint8_t decoder_threads)
+{
+    if (!vc) {
+        return -1;
+    }
 
-        vpx_codec_destroy(vc->encoder);
-        memcpy(vc->encoder, &new_c, sizeof(new_c));
+    if ((codec != TOXAV_VIDEO_CODEC_VP8 && codec != TOXAV_VIDEO_CODEC_VP9)
+            || encoder_threads > VPX_THREADS_LIMIT || decoder_threads > VPX_THREADS_LIMIT
+            || tile_columns > VP9E_MAX_TILE_COLUMNS
+            || cpu_used < -VP8E_SET_CPUUSED_VALUE || cpu_used > VP8E_SET_CPUUSED_VALUE) {
+        return -1;
+    }
+
+    if (encoder_threads == 0) {
+        encoder_threads = VPX_MAX_ENCODER_THREADS;
+    }
+
+    if (decoder_threads == 0) {
+        decoder_threads = VPX_MAX_DECODER_THREADS;
     }
 
+    if (vc->encoder_threads != encoder_threads || vc->encoder_tile_columns != tile_columns
+            || vc->encoder_cpu_used != cpu_used) {
+        vc->encoder_threads = encoder_threads;
+        vc->encoder_tile_columns = tile_columns;
+        vc->encoder_cpu_used = cpu_used;
+        vc->encoder_reinit = 1;
+    }
+
+    /* vc_iterate() reads these under queue_mutex on the iterate thread. */
+    pthread_mutex_lock(vc->queue_mutex);
+
+    if (vc->decoder_threads != decoder_threads) {
+        vc->decoder_threads = decoder_threads;
+        vc->decoder_reinit = 1;
+    }
+
+    pthread_mutex_unlock(vc->queue_mutex);
+
+    vc->send_codec = codec;
     return 0;
 }
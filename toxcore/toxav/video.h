@@ -35,6 +35,7 @@
 
 #include <pthread.h>
 
+struct RTPFramePool;
 struct RTPMessage;
 struct RingBuffer;
 
@@ -42,10 +43,20 @@ typedef struct VCSession_s {
     /* encoding */
     vpx_codec_ctx_t encoder[1];
     uint32_t frame_counter;
+    TOXAV_VIDEO_CODEC encoder_codec; /* Codec the encoder is currently initialized with */
+    TOXAV_VIDEO_CODEC send_codec; /* Preferred codec, only used if the peer supports it */
+    uint8_t encoder_threads;
+    uint8_t encoder_tile_columns; /* log2 of the number of VP9 tile columns */
+    int8_t encoder_cpu_used;
+    bool encoder_reinit; /* Options changed, encoder must be reinitialized */
 
     /* decoding */
     vpx_codec_ctx_t decoder[1];
+    TOXAV_VIDEO_CODEC decoder_codec; /* Codec the decoder is currently initialized with */
+    uint8_t decoder_threads;
+    bool decoder_reinit; /* Options changed, decoder must be reinitialized */
     struct RingBuffer *vbuf_raw; /* Un-decoded data */
+    struct RTPFramePool *frame_pool; /* Reassembly buffers reused across frames */
 
     uint64_t linfts; /* Last received frame time stamp */
     uint32_t lcfd; /* Last calculated frame duration for incoming video payload */
@@ -63,6 +74,9 @@ VCSession *vc_new(Logger *log, ToxAV *av, uint32_t friend_number, toxav_video_re
 void vc_kill(VCSession *vc);
 void vc_iterate(VCSession *vc);
 int vc_queue_message(void *vcp, struct RTPMessage *msg);
-int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uint16_t height, int16_t kf_max_dist);
+int vc_reconfigure_encoder(VCSession *vc, TOXAV_VIDEO_CODEC codec, uint32_t bit_rate, uint16_t width, uint16_t height,
+                           int16_t kf_max_dist);
+int vc_set_codec_options(VCSession *vc, TOXAV_VIDEO_CODEC codec, uint8_t encoder_threads, uint8_t tile_columns,
+                         int8_t cpu_used, uint8_t decoder_threads);
 
 #endif /* VIDEO_H */
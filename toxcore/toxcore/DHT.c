@@ -59,6 +59,29 @@
 
 #define ASSOC_COUNT 2
 
+/* Get nodes requests that walk towards a key (to the to_bootstrap nodes and
+ * the random GET_NODE_INTERVAL one) of all friends and the close list go
+ * through one queue. A random request is dropped when the node is still to
+ * answer one about a key in the same region. Requests to to_bootstrap nodes
+ * are the next steps of a walk and are always sent, dropping them made finding
+ * friends slower. At most DHT_LOOKUP_MAX_OUTSTANDING wait
+ * for an answer at a time. Requests still queued after DHT_LOOKUP_TIMEOUT are
+ * dropped. While the queue is full, requests stay with their friend or the
+ * close list until the next do_DHT(). Requests that keep nodes alive are sent
+ * directly.
+ */
+#define DHT_LOOKUP_QUEUE_SIZE 256
+#define DHT_LOOKUP_MAX_OUTSTANDING 128
+#define DHT_LOOKUP_TIMEOUT PING_TIMEOUT
+
+typedef struct DHT_Lookup {
+    Node_format node;
+    uint8_t target[CRYPTO_PUBLIC_KEY_SIZE];
+    uint64_t queued;
+    uint64_t sent;
+    bool coalesce; /* may be dropped when an outstanding request covers it */
+} DHT_Lookup;
+
 struct DHT {
     Logger *log;
     Networking_Core *net;
@@ -92,6 +115,11 @@ struct DHT {
 
     Node_format to_bootstrap[MAX_CLOSE_TO_BOOTSTRAP_NODES];
     unsigned int num_to_bootstrap;
+
+    DHT_Lookup lookup_queue[DHT_LOOKUP_QUEUE_SIZE];
+    uint32_t lookup_queue_size;
+    DHT_Lookup lookups_outstanding[DHT_LOOKUP_MAX_OUTSTANDING];
+    uint32_t num_lookups_outstanding;
 };
 
 const uint8_t *dht_get_self_public_key(const DHT *dht)
@@ -201,23 +229,43 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
  * If shared key is already in shared_keys, copy it to shared_key.
  * else generate it into shared_key and copy it to shared_keys
  */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
+bool get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
+{
+    if (find_shared_key(shared_keys, shared_key, public_key)) {
+        return 1;
+    }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+    store_shared_key(shared_keys, shared_key, public_key);
+    return 0;
+}
+
+bool find_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key)
+{
+    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
+        Shared_Key *const key = &shared_keys->keys[public_key[30] * MAX_KEYS_PER_SLOT + i];
+
+        if (key->stored && id_equal(public_key, key->public_key)) {
+            memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
+            ++key->times_requested;
+            key->time_last_requested = unix_time();
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void store_shared_key(Shared_Keys *shared_keys, const uint8_t *shared_key, const uint8_t *public_key)
 {
     uint32_t num = ~0;
     uint32_t curr = 0;
 
     for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
         const int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *const key = &shared_keys->keys[index];
+        const Shared_Key *const key = &shared_keys->keys[index];
 
         if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = unix_time();
-                return;
-            }
-
             if (num != 0) {
                 if (is_timeout(key->time_last_requested, KEYS_TIMEOUT)) {
                     num = 0;
@@ -233,8 +281,6 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
         }
     }
 
-    encrypt_precompute(public_key, secret_key, shared_key);
-
     if (num != UINT32_MAX) {
         Shared_Key *const key = &shared_keys->keys[curr];
         key->stored = 1;
@@ -245,12 +291,19 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
     }
 }
 
+/* Count a get_shared_key() lookup in the metrics of net. */
+void count_shared_key_lookup(Networking_Core *net, bool hit)
+{
+    metrics_inc(net_metrics(net), hit ? METRIC_DHT_SHARED_KEY_HITS : METRIC_DHT_SHARED_KEY_MISSES);
+}
+
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
 void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(&dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    const bool hit = get_shared_key(&dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    count_shared_key_lookup(dht->net, hit);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -258,7 +311,8 @@ void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(&dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    const bool hit = get_shared_key(&dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    count_shared_key_lookup(dht->net, hit);
 }
 
 #define CRYPTO_SIZE 1 + CRYPTO_PUBLIC_KEY_SIZE * 2 + CRYPTO_NONCE_SIZE
@@ -809,6 +863,28 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
     *num_nodes_ptr = num_nodes;
 }
 
+/* return the number of leading bits that all nodes in nodes_list share with public_key.
+ * return 0 if the list is not full yet.
+ */
+static unsigned int nodes_min_prefix(const uint8_t *public_key, const Node_format *nodes_list, uint32_t num_nodes)
+{
+    if (num_nodes < MAX_SENT_NODES) {
+        return 0;
+    }
+
+    unsigned int min_prefix = CRYPTO_PUBLIC_KEY_SIZE * 8;
+
+    for (uint32_t i = 0; i < num_nodes; ++i) {
+        const unsigned int prefix = bit_by_bit_cmp(public_key, nodes_list[i].public_key);
+
+        if (prefix < min_prefix) {
+            min_prefix = prefix;
+        }
+    }
+
+    return min_prefix;
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -835,10 +911,29 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
 
 #endif
 
+    /* Leading bits the farthest node found so far shares with public_key. */
+    unsigned int worst_prefix = nodes_min_prefix(public_key, nodes_list, num_nodes);
+
     for (uint32_t i = 0; i < dht->num_friends; ++i) {
+        const DHT_Friend *const dht_friend = &dht->friends_list[i];
+
+        /* If public_key leaves the friend's key before the friend's nodes do,
+         * all of them share exactly that many bits with it, which makes them
+         * farther than every node we have.
+         */
+        if (worst_prefix != 0) {
+            const unsigned int friend_prefix = bit_by_bit_cmp(public_key, dht_friend->public_key);
+
+            if (friend_prefix < dht_friend->nodes_prefix && friend_prefix < worst_prefix) {
+                continue;
+            }
+        }
+
         get_close_nodes_inner(public_key, nodes_list, sa_family,
-                              dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS,
+                              dht_friend->client_list, MAX_FRIEND_CLIENTS,
                               &num_nodes, is_LAN, 0);
+
+        worst_prefix = nodes_min_prefix(public_key, nodes_list, num_nodes);
     }
 
     return num_nodes;
@@ -1171,6 +1266,11 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
         if (in_list || replace_all(dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS, public_key,
                                    ip_port, dht->friends_list[i].public_key)) {
             DHT_Friend *dht_friend = &dht->friends_list[i];
+            const unsigned int prefix = bit_by_bit_cmp(public_key, dht_friend->public_key);
+
+            if (prefix < dht_friend->nodes_prefix) {
+                dht_friend->nodes_prefix = prefix;
+            }
 
             if (id_equal(public_key, dht_friend->public_key)) {
                 friend_foundip = dht_friend;
@@ -1295,6 +1395,137 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
     return sendpacket(dht->net, ip_port, data, len);
 }
 
+/* Queue a get nodes request asking the node for nodes close to target. If
+ * coalesce is set, it is dropped when an outstanding request covers it.
+ *
+ *  return true if it was queued.
+ *  return false if the queue is full, the caller should try again later.
+ */
+static bool queue_lookup(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const uint8_t *target,
+                         bool coalesce)
+{
+    if (dht->lookup_queue_size == DHT_LOOKUP_QUEUE_SIZE) {
+        return 0;
+    }
+
+    DHT_Lookup *const lookup = &dht->lookup_queue[dht->lookup_queue_size];
+    memcpy(lookup->node.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    lookup->node.ip_port = ip_port;
+    memcpy(lookup->target, target, CRYPTO_PUBLIC_KEY_SIZE);
+    lookup->queued = unix_time();
+    lookup->coalesce = coalesce;
+    ++dht->lookup_queue_size;
+    return 1;
+}
+
+/* Queue lookups of target to the num nodes, keeping the ones that didn't fit
+ * at the start of nodes.
+ *
+ * return the number of nodes kept.
+ */
+static unsigned int queue_to_bootstrap(DHT *dht, Node_format *nodes, unsigned int num, const uint8_t *target)
+{
+    unsigned int kept = 0;
+
+    for (unsigned int i = 0; i < num; ++i) {
+        if (!queue_lookup(dht, nodes[i].ip_port, nodes[i].public_key, target, 0)) {
+            nodes[kept] = nodes[i];
+            ++kept;
+        }
+    }
+
+    return kept;
+}
+
+/* return true if an outstanding request to the same node is about a target
+ * that shares more leading bits with this one than the node does. The node
+ * answers both from the same part of its lists, and every answer is offered
+ * to all friends.
+ */
+static bool lookup_covered(const DHT *dht, const DHT_Lookup *lookup)
+{
+    for (uint32_t i = 0; i < dht->num_lookups_outstanding; ++i) {
+        const DHT_Lookup *const sent = &dht->lookups_outstanding[i];
+
+        if (!id_equal(sent->node.public_key, lookup->node.public_key)) {
+            continue;
+        }
+
+        if (bit_by_bit_cmp(sent->target, lookup->target) > bit_by_bit_cmp(lookup->node.public_key, lookup->target)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Remove the outstanding requests to the node public_key, or all that timed
+ * out if public_key is NULL.
+ *
+ * return the number of requests removed.
+ */
+static uint32_t remove_lookups(DHT *dht, const uint8_t *public_key)
+{
+    uint32_t removed = 0;
+    uint32_t i = 0;
+
+    while (i < dht->num_lookups_outstanding) {
+        const DHT_Lookup *const sent = &dht->lookups_outstanding[i];
+
+        if (public_key ? id_equal(sent->node.public_key, public_key) : is_timeout(sent->sent, DHT_LOOKUP_TIMEOUT)) {
+            --dht->num_lookups_outstanding;
+            dht->lookups_outstanding[i] = dht->lookups_outstanding[dht->num_lookups_outstanding];
+            ++removed;
+        } else {
+            ++i;
+        }
+    }
+
+    return removed;
+}
+
+/* Send queued requests, oldest first, until DHT_LOOKUP_MAX_OUTSTANDING wait
+ * for an answer. The rest stay queued, unless they are too old.
+ */
+static void send_lookups(DHT *dht)
+{
+    Metrics *const metrics = net_metrics(dht->net);
+    uint32_t done;
+
+    remove_lookups(dht, nullptr);
+
+    for (done = 0; done < dht->lookup_queue_size; ++done) {
+        DHT_Lookup *const lookup = &dht->lookup_queue[done];
+
+        /* The node may be gone by now, and later requests walk towards the same keys. */
+        if (is_timeout(lookup->queued, DHT_LOOKUP_TIMEOUT)) {
+            metrics_inc(metrics, METRIC_DHT_LOOKUPS_DROPPED);
+            continue;
+        }
+
+        if (lookup->coalesce && lookup_covered(dht, lookup)) {
+            metrics_inc(metrics, METRIC_DHT_LOOKUPS_COALESCED);
+            continue;
+        }
+
+        if (dht->num_lookups_outstanding == DHT_LOOKUP_MAX_OUTSTANDING) {
+            break;
+        }
+
+        if (getnodes(dht, lookup->node.ip_port, lookup->node.public_key, lookup->target, nullptr) == -1) {
+            continue;
+        }
+
+        lookup->sent = unix_time();
+        dht->lookups_outstanding[dht->num_lookups_outstanding] = *lookup;
+        ++dht->num_lookups_outstanding;
+        metrics_inc(metrics, METRIC_DHT_LOOKUPS_SENT);
+    }
+
+    dht->lookup_queue_size -= done;
+    memmove(dht->lookup_queue, dht->lookup_queue + done, dht->lookup_queue_size * sizeof(DHT_Lookup));
+}
+
 typedef void node_f(const uint8_t *public_key);
 node_f *node_responce = nullptr;
 
@@ -1460,6 +1691,10 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
         return 1;
     }
 
+    if (remove_lookups(dht, packet + 1) != 0 && dht->lookup_queue_size != 0) {
+        send_lookups(dht);
+    }
+
     uint16_t length_nodes = 0;
     const int num_nodes = unpack_nodes(plain_nodes, plain[0], &length_nodes, plain + 1, data_size, 0);
 
@@ -1703,10 +1938,10 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
             rand_node += rand() % (num_nodes - (rand_node + 1));
         }
 
-        getnodes(dht, assoc_list[rand_node]->ip_port, client_list[rand_node]->public_key, public_key, nullptr);
-
-        *lastgetnode = temp_time;
-        ++*bootstrap_times;
+        if (queue_lookup(dht, assoc_list[rand_node]->ip_port, client_list[rand_node]->public_key, public_key, 1)) {
+            *lastgetnode = temp_time;
+            ++*bootstrap_times;
+        }
     }
 
     return not_kill;
@@ -1720,12 +1955,28 @@ static void do_DHT_friends(DHT *dht)
     for (size_t i = 0; i < dht->num_friends; ++i) {
         DHT_Friend *const dht_friend = &dht->friends_list[i];
 
-        for (size_t j = 0; j < dht_friend->num_to_bootstrap; ++j) {
-            getnodes(dht, dht_friend->to_bootstrap[j].ip_port, dht_friend->to_bootstrap[j].public_key, dht_friend->public_key,
-                     nullptr);
-        }
+        dht_friend->num_to_bootstrap = queue_to_bootstrap(dht, dht_friend->to_bootstrap, dht_friend->num_to_bootstrap,
+                                                          dht_friend->public_key);
+
+        /* Nodes only become good again through addto_lists(), which lowers
+         * nodes_prefix, so the bound may be raised to what the good ones share.
+         */
+        dht_friend->nodes_prefix = CRYPTO_PUBLIC_KEY_SIZE * 8;
+
+        for (size_t j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+            const Client_data *const client = &dht_friend->client_list[j];
+
+            if (is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT)
+                    && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
+                continue;
+            }
 
-        dht_friend->num_to_bootstrap = 0;
+            const unsigned int prefix = bit_by_bit_cmp(client->public_key, dht_friend->public_key);
+
+            if (prefix < dht_friend->nodes_prefix) {
+                dht_friend->nodes_prefix = prefix;
+            }
+        }
 
         do_ping_and_sendnode_requests(dht, &dht_friend->lastgetnode, dht_friend->public_key, dht_friend->client_list,
                                       MAX_FRIEND_CLIENTS,
@@ -1738,11 +1989,7 @@ static void do_DHT_friends(DHT *dht)
  */
 static void do_Close(DHT *dht)
 {
-    for (size_t i = 0; i < dht->num_to_bootstrap; ++i) {
-        getnodes(dht, dht->to_bootstrap[i].ip_port, dht->to_bootstrap[i].public_key, dht->self_public_key, nullptr);
-    }
-
-    dht->num_to_bootstrap = 0;
+    dht->num_to_bootstrap = queue_to_bootstrap(dht, dht->to_bootstrap, dht->num_to_bootstrap, dht->self_public_key);
 
     uint8_t not_killed = do_ping_and_sendnode_requests(
                              dht, &dht->close_lastgetnodes, dht->self_public_key, dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times,
@@ -2628,9 +2875,13 @@ static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *pack
             return 1;
         }
 
-        return dht->cryptopackethandlers[number].function(
-                   dht->cryptopackethandlers[number].object, source, public_key,
-                   data, len, userdata);
+        Metrics *metrics = net_metrics(dht->net);
+        const uint64_t start = metrics_handler_start(metrics);
+        const int ret = dht->cryptopackethandlers[number].function(
+                            dht->cryptopackethandlers[number].object, source, public_key,
+                            data, len, userdata);
+        metrics_handler_done(metrics, METRIC_DISPATCH_CRYPTO, number, start);
+        return ret;
     }
 
     /* If request is not for us, try routing it. */
@@ -2675,13 +2926,16 @@ DHT *new_DHT(Logger *log, Networking_Core *net, bool holepunching_enabled)
     networking_registerhandler(dht->net, NET_PACKET_GET_NODES, &handle_getnodes, dht);
     networking_registerhandler(dht->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes_ipv6, dht);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO, &cryptopacket_handle, dht);
+    networking_set_rate_limit(dht->net, NET_PACKET_GET_NODES, DHT_GET_NODES_RATE, DHT_GET_NODES_BURST,
+                              DHT_GET_NODES_TOTAL_RATE);
     cryptopacket_registerhandler(dht, CRYPTO_PACKET_NAT_PING, &handle_NATping, dht);
     cryptopacket_registerhandler(dht, CRYPTO_PACKET_HARDENING, &handle_hardening, dht);
 
     crypto_new_keypair(dht->self_public_key, dht->self_secret_key);
 
-    dht->dht_ping_array = ping_array_new(DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
-    dht->dht_harden_ping_array = ping_array_new(DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
+    dht->dht_ping_array = ping_array_new(DHT_PING_ARRAY_SIZE, PING_TIMEOUT, sizeof(Node_format), net_metrics(net));
+    dht->dht_harden_ping_array = ping_array_new(DHT_PING_ARRAY_SIZE, PING_TIMEOUT, sizeof(Node_format) * 2,
+                                 net_metrics(net));
 
     for (uint32_t i = 0; i < DHT_FAKE_FRIEND_NUMBER; ++i) {
         uint8_t random_key_bytes[CRYPTO_PUBLIC_KEY_SIZE];
@@ -2711,6 +2965,7 @@ void do_DHT(DHT *dht)
 
     do_Close(dht);
     do_DHT_friends(dht);
+    send_lookups(dht);
     do_NAT(dht);
     ping_iterate(dht->ping);
 #if DHT_HARDENING
@@ -2955,3 +3210,8 @@ bool DHT_non_lan_connected(const DHT *dht)
 
     return false;
 }
+
+void dht_copy_close_list(DHT *dht, const DHT *src)
+{
+    memcpy(dht->close_clientlist, src->close_clientlist, sizeof(dht->close_clientlist));
+}
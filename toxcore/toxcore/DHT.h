@@ -45,10 +45,19 @@
 /* The max number of nodes to send with send nodes. */
 #define MAX_SENT_NODES 4
 
+/* Get nodes requests answered per second from one source, see
+ * networking_set_rate_limit(). Generous because many hosts can share an IPv4
+ * address behind a NAT. The total bounds the work a flood from many sources
+ * can cause.
+ */
+#define DHT_GET_NODES_RATE 64
+#define DHT_GET_NODES_BURST 256
+#define DHT_GET_NODES_TOTAL_RATE 8192
+
 /* Ping timeout in seconds */
 #define PING_TIMEOUT 5
 
-/* size of DHT ping arrays. */
+/* Initial size of DHT ping arrays, see PING_ARRAY_MAX_GROWTH. */
 #define DHT_PING_ARRAY_SIZE 512
 
 /* Ping interval in seconds for each node in our lists. */
@@ -173,6 +182,11 @@ typedef struct {
 
     Node_format to_bootstrap[MAX_SENT_NODES];
     unsigned int num_to_bootstrap;
+
+    /* Leading bits that every node in client_list which can be good has in
+     * common with public_key, at least. Lets get_close_nodes() skip the list.
+     */
+    unsigned int nodes_prefix;
 } DHT_Friend;
 
 /* Return packet size of packed node with ip_family on success.
@@ -263,10 +277,29 @@ const uint8_t *dht_get_friend_public_key(const DHT *dht, uint32_t friend_num);
  *
  * If shared key is already in shared_keys, copy it to shared_key.
  * else generate it into shared_key and copy it to shared_keys
+ *
+ * return true if the key was found in shared_keys.
+ * return false if it had to be generated.
  */
-void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
+bool get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
                     const uint8_t *public_key);
 
+/* If shared key is already in shared_keys, copy it to shared_key.
+ *
+ * return true if it was found.
+ * return false if it was not, shared_key is left untouched.
+ */
+bool find_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *public_key);
+
+/* Add shared_key, computed elsewhere for public_key, to shared_keys. It replaces
+ * the same entry get_shared_key() would have replaced. The key must not be in
+ * shared_keys already.
+ */
+void store_shared_key(Shared_Keys *shared_keys, const uint8_t *shared_key, const uint8_t *public_key);
+
+/* Count a get_shared_key() lookup in the metrics of net. */
+void count_shared_key_lookup(Networking_Core *net, bool hit);
+
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -437,6 +470,11 @@ bool DHT_isconnected(const DHT *dht);
  */
 bool DHT_non_lan_connected(const DHT *dht);
 
+/* Replace the close list of dht with the one of src. Used to let several DHT
+ * instances with the same key answer get nodes requests from one list, the
+ * caller must make sure neither is in use by another thread.
+ */
+void dht_copy_close_list(DHT *dht, const DHT *src);
 
 uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key);
 
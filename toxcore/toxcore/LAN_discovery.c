@@ -29,25 +29,38 @@
 
 #include "util.h"
 
+#include <pthread.h>
+
 #define MAX_INTERFACES 16
 
 
-/* TODO: multiple threads might concurrently try to set these, and it isn't clear that this couldn't lead to undesirable
- * behaviour. Consider storing the data in per-instance variables instead. */
-static int     broadcast_count = -1;
-static IP_Port broadcast_ip_ports[MAX_INTERFACES];
+/* Shared by all instances in the process. broadcast_mutex guards them, so that a rescan in one thread never
+ * leaves another thread sending to a half updated list.
+ * broadcast_generation is incremented whenever a rescan finds different addresses. Each Lan_Monitor remembers
+ * the generation it last reported, so every instance sees a change whichever instance rescanned first. */
+static pthread_mutex_t broadcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int broadcast_count = -1;
+static IP  broadcast_ips[MAX_INTERFACES];
+static uint32_t broadcast_generation;
+
+/* Seconds between rescans of the interfaces where no change events are available. */
+#define LAN_MONITOR_POLL_INTERVAL 2
 
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
 
 #include <iphlpapi.h>
 
-static void fetch_broadcast_info(uint16_t port)
+/* Fill ips with the broadcast addresses of up to MAX_INTERFACES interfaces.
+ *
+ * return the number of addresses found.
+ */
+static int fetch_broadcast_info(IP *ips)
 {
     IP_ADAPTER_INFO *pAdapterInfo = (IP_ADAPTER_INFO *)malloc(sizeof(IP_ADAPTER_INFO));
     unsigned long ulOutBufLen = sizeof(IP_ADAPTER_INFO);
 
     if (pAdapterInfo == nullptr) {
-        return;
+        return 0;
     }
 
     if (GetAdaptersInfo(pAdapterInfo, &ulOutBufLen) == ERROR_BUFFER_OVERFLOW) {
@@ -55,17 +68,11 @@ static void fetch_broadcast_info(uint16_t port)
         pAdapterInfo = (IP_ADAPTER_INFO *)malloc(ulOutBufLen);
 
         if (pAdapterInfo == nullptr) {
-            return;
+            return 0;
         }
     }
 
-    /* We copy these to the static variables broadcast_* only at the end of fetch_broadcast_info().
-     * The intention is to ensure that even if multiple threads enter fetch_broadcast_info() concurrently, only valid
-     * interfaces will be set to be broadcast to.
-     * */
     int count = 0;
-    IP_Port ip_ports[MAX_INTERFACES];
-
     int ret;
 
     if ((ret = GetAdaptersInfo(pAdapterInfo, &ulOutBufLen)) == NO_ERROR) {
@@ -77,12 +84,11 @@ static void fetch_broadcast_info(uint16_t port)
             if (addr_parse_ip(pAdapter->IpAddressList.IpMask.String, &subnet_mask)
                     && addr_parse_ip(pAdapter->GatewayList.IpAddress.String, &gateway)) {
                 if (gateway.family == TOX_AF_INET && subnet_mask.family == TOX_AF_INET) {
-                    IP_Port *ip_port = &ip_ports[count];
-                    ip_port->ip.family = TOX_AF_INET;
+                    IP *ip = &ips[count];
+                    ip->family = TOX_AF_INET;
                     uint32_t gateway_ip = net_ntohl(gateway.ip.v4.uint32), subnet_ip = net_ntohl(subnet_mask.ip.v4.uint32);
                     uint32_t broadcast_ip = gateway_ip + ~subnet_ip - 1;
-                    ip_port->ip.ip.v4.uint32 = net_htonl(broadcast_ip);
-                    ip_port->port = port;
+                    ip->ip.v4.uint32 = net_htonl(broadcast_ip);
                     count++;
 
                     if (count >= MAX_INTERFACES) {
@@ -99,36 +105,34 @@ static void fetch_broadcast_info(uint16_t port)
         free(pAdapterInfo);
     }
 
-    broadcast_count = count;
-
-    for (uint32_t i = 0; i < count; i++) {
-        broadcast_ip_ports[i] = ip_ports[i];
-    }
+    return count;
 }
 
 #elif defined(__linux__) || defined(__FreeBSD__)
 
 #ifdef __linux__
 #include <linux/netdevice.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #endif
 
 #ifdef __FreeBSD__
 #include <net/if.h>
 #endif
 
+#include <errno.h>
 #include <sys/ioctl.h>
 
-static void fetch_broadcast_info(uint16_t port)
+static int fetch_broadcast_info(IP *ips)
 {
     /* Not sure how many platforms this will run on,
      * so it's wrapped in __linux for now.
      * Definitely won't work like this on Windows...
      */
-    broadcast_count = 0;
     const Socket sock = net_socket(TOX_AF_INET, TOX_SOCK_STREAM, 0);
 
     if (sock < 0) {
-        return;
+        return 0;
     }
 
     /* Configure ifconf for the ioctl call. */
@@ -141,15 +145,10 @@ static void fetch_broadcast_info(uint16_t port)
 
     if (ioctl(sock, SIOCGIFCONF, &ifconf) < 0) {
         close(sock);
-        return;
+        return 0;
     }
 
-    /* We copy these to the static variables broadcast_* only at the end of fetch_broadcast_info().
-     * The intention is to ensure that even if multiple threads enter fetch_broadcast_info() concurrently, only valid
-     * interfaces will be set to be broadcast to.
-     * */
     int count = 0;
-    IP_Port ip_ports[MAX_INTERFACES];
 
     /* ifconf.ifc_len is set by the ioctl() to the actual length used;
      * on usage of the complete array the call should be repeated with
@@ -175,35 +174,61 @@ static void fetch_broadcast_info(uint16_t port)
             break;
         }
 
-        IP_Port *ip_port = &ip_ports[count];
-        ip_port->ip.family = TOX_AF_INET;
-        ip_port->ip.ip.v4.uint32 = sock4->sin_addr.s_addr;
+        IP *ip = &ips[count];
+        ip->family = TOX_AF_INET;
+        ip->ip.v4.uint32 = sock4->sin_addr.s_addr;
 
-        if (ip_port->ip.ip.v4.uint32 == 0) {
+        if (ip->ip.v4.uint32 == 0) {
             continue;
         }
 
-        ip_port->port = port;
         count++;
     }
 
     close(sock);
 
-    broadcast_count = count;
-
-    for (uint32_t i = 0; i < count; i++) {
-        broadcast_ip_ports[i] = ip_ports[i];
-    }
+    return count;
 }
 
 #else // TODO(irungentoo): Other platforms?
 
-static void fetch_broadcast_info(uint16_t port)
+static int fetch_broadcast_info(IP *ips)
 {
-    broadcast_count = 0;
+    return 0;
 }
 
 #endif
+
+/* Rescan the interfaces and replace the cached broadcast addresses.
+ *
+ *  return the generation of the addresses after the rescan.
+ */
+static uint32_t refresh_broadcast_info(void)
+{
+    /* The scan fills a local array, which is published under broadcast_mutex in one step. */
+    IP ips[MAX_INTERFACES];
+    const int count = fetch_broadcast_info(ips);
+
+    pthread_mutex_lock(&broadcast_mutex);
+    bool changed = broadcast_count >= 0 && count != broadcast_count;
+
+    for (int i = 0; i < count && broadcast_count >= 0 && !changed; i++) {
+        if (!ip_equal(&broadcast_ips[i], &ips[i])) {
+            changed = 1;
+        }
+    }
+
+    if (changed) {
+        ++broadcast_generation;
+    }
+
+    memcpy(broadcast_ips, ips, count * sizeof(IP));
+    broadcast_count = count;
+    const uint32_t generation = broadcast_generation;
+    pthread_mutex_unlock(&broadcast_mutex);
+    return generation;
+}
+
 /* Send packet to all IPv4 broadcast addresses
  *
  *  return 1 if sent to at least one broadcast target.
@@ -211,18 +236,32 @@ static void fetch_broadcast_info(uint16_t port)
  */
 static uint32_t send_broadcasts(Networking_Core *net, uint16_t port, const uint8_t *data, uint16_t length)
 {
-    /* fetch only once? on every packet? every X seconds?
-     * old: every packet, new: once */
-    if (broadcast_count < 0) {
-        fetch_broadcast_info(port);
+    IP ips[MAX_INTERFACES];
+
+    pthread_mutex_lock(&broadcast_mutex);
+    int count = broadcast_count;
+    pthread_mutex_unlock(&broadcast_mutex);
+
+    /* Fetched once, then again whenever a Lan_Monitor sees the interfaces change. */
+    if (count < 0) {
+        refresh_broadcast_info();
     }
 
-    if (!broadcast_count) {
+    /* Send from a copy so that the lock isn't held during sendpacket(). */
+    pthread_mutex_lock(&broadcast_mutex);
+    count = broadcast_count;
+    memcpy(ips, broadcast_ips, count * sizeof(IP));
+    pthread_mutex_unlock(&broadcast_mutex);
+
+    if (count <= 0) {
         return 0;
     }
 
-    for (int i = 0; i < broadcast_count; i++) {
-        sendpacket(net, broadcast_ip_ports[i], data, length);
+    for (int i = 0; i < count; i++) {
+        IP_Port ip_port;
+        ip_port.ip = ips[i];
+        ip_port.port = port;
+        sendpacket(net, ip_port, data, length);
     }
 
     return 1;
@@ -348,9 +387,6 @@ static int handle_LANdiscovery(void *object, IP_Port source, const uint8_t *pack
 {
     DHT *dht = (DHT *)object;
 
-    char ip_str[IP_NTOA_LEN] = { 0 };
-    ip_ntoa(&source.ip, ip_str, sizeof(ip_str));
-
     if (ip_is_lan(source.ip) == -1) {
         return 1;
     }
@@ -409,3 +445,148 @@ void lan_discovery_kill(DHT *dht)
 {
     networking_registerhandler(dht_get_net(dht), NET_PACKET_LAN_DISCOVERY, nullptr, nullptr);
 }
+
+
+struct Lan_Monitor {
+    /* Netlink socket with address and route change events, -1 if the
+     * interfaces are rescanned every LAN_MONITOR_POLL_INTERVAL seconds instead. */
+    Socket sock;
+    uint64_t last_poll;
+    /* broadcast_generation when lan_monitor_changed() last returned. */
+    uint32_t generation;
+};
+
+#ifdef __linux__
+
+static Socket lan_monitor_socket(void)
+{
+    const Socket sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+
+    if (!sock_valid(sock)) {
+        return -1;
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !set_socket_nonblock(sock)) {
+        kill_sock(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Read all pending events from the netlink socket.
+ *
+ *  return true if an address or a route of the main table was added or removed.
+ */
+static bool lan_monitor_events(Socket sock)
+{
+    bool changed = 0;
+    uint32_t buf[2048];
+
+    while (1) {
+        int len = recv(sock, (char *)buf, sizeof(buf), 0);
+
+        if (len < 0) {
+            /* The kernel dropped events, we can't tell what changed. */
+            if (errno == ENOBUFS) {
+                changed = 1;
+                continue;
+            }
+
+            break;
+        }
+
+        for (const struct nlmsghdr *nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR) {
+                changed = 1;
+            } else if (nh->nlmsg_type == RTM_NEWROUTE || nh->nlmsg_type == RTM_DELROUTE) {
+                const struct rtmsg *rt = (const struct rtmsg *)NLMSG_DATA(nh);
+
+                if (nh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct rtmsg)) && rt->rtm_table == RT_TABLE_MAIN) {
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+#else
+
+static Socket lan_monitor_socket(void)
+{
+    return -1;
+}
+
+static bool lan_monitor_events(Socket sock)
+{
+    return 0;
+}
+
+#endif
+
+Lan_Monitor *new_lan_monitor(void)
+{
+    Lan_Monitor *monitor = (Lan_Monitor *)calloc(1, sizeof(Lan_Monitor));
+
+    if (monitor == nullptr) {
+        return nullptr;
+    }
+
+    monitor->sock = lan_monitor_socket();
+    monitor->last_poll = unix_time();
+
+    pthread_mutex_lock(&broadcast_mutex);
+    monitor->generation = broadcast_generation;
+    pthread_mutex_unlock(&broadcast_mutex);
+    return monitor;
+}
+
+bool lan_monitor_changed(Lan_Monitor *monitor)
+{
+    if (monitor == nullptr) {
+        return 0;
+    }
+
+    if (sock_valid(monitor->sock)) {
+        if (!lan_monitor_events(monitor->sock)) {
+            return 0;
+        }
+
+        monitor->generation = refresh_broadcast_info();
+        return 1;
+    }
+
+    if (!is_timeout(monitor->last_poll, LAN_MONITOR_POLL_INTERVAL)) {
+        return 0;
+    }
+
+    monitor->last_poll = unix_time();
+    const uint32_t generation = refresh_broadcast_info();
+
+    if (generation == monitor->generation) {
+        return 0;
+    }
+
+    monitor->generation = generation;
+    return 1;
+}
+
+void kill_lan_monitor(Lan_Monitor *monitor)
+{
+    if (monitor == nullptr) {
+        return;
+    }
+
+    if (sock_valid(monitor->sock)) {
+        kill_sock(monitor->sock);
+    }
+
+    free(monitor);
+}
@@ -48,6 +48,25 @@ uint32_t lan_discovery_interval(void);
  */
 int32_t lan_discovery_send(uint16_t port, DHT *dht);
 
+/**
+ * Watches the network interfaces so LAN discovery can be redone as soon as
+ * we join a new network. Uses netlink address and route events on Linux and
+ * rescans the interfaces every few seconds elsewhere.
+ */
+typedef struct Lan_Monitor Lan_Monitor;
+
+Lan_Monitor *new_lan_monitor(void);
+
+/**
+ * Read the pending interface events and update the broadcast addresses
+ * lan_discovery_send uses.
+ *
+ * return true if the addresses or routes changed since the last call.
+ */
+bool lan_monitor_changed(Lan_Monitor *monitor);
+
+void kill_lan_monitor(Lan_Monitor *monitor);
+
 /**
  * Sets up packet handlers.
  */
@@ -57,6 +57,7 @@ static int realloc_friendlist(Messenger *m, uint32_t num)
     if (num == 0) {
         free(m->friendlist);
         m->friendlist = nullptr;
+        m->friendlist_size = 0;
         return 0;
     }
 
@@ -67,6 +68,7 @@ static int realloc_friendlist(Messenger *m, uint32_t num)
     }
 
     m->friendlist = newfriendlist;
+    m->friendlist_size = num;
     return 0;
 }
 
@@ -180,25 +182,45 @@ static int m_handle_status(void *object, int i, uint8_t status, void *userdata);
 static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t len, void *userdata);
 static int m_handle_custom_lossy_packet(void *object, int friend_num, const uint8_t *packet, uint16_t length,
                                         void *userdata);
+static void journal_friend(Messenger *m, int32_t friendnumber, uint16_t type);
+static void journal_self(Messenger *m, uint16_t type);
+static void journal_nodes(Messenger *m);
+
+static void set_friend_connection_callbacks(Messenger *m, int32_t friendnumber)
+{
+    const int friendcon_id = m->friendlist[friendnumber].friendcon_id;
+
+    friend_connection_callbacks(m->fr_c, friendcon_id, MESSENGER_CALLBACK_INDEX, &m_handle_status, &m_handle_packet,
+                                &m_handle_custom_lossy_packet, m, friendnumber);
+
+    if (friend_con_connected(m->fr_c, friendcon_id) == FRIENDCONN_STATUS_CONNECTED) {
+        send_online_packet(m, friendnumber);
+    }
+}
 
 static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t status)
 {
     /* Resize the friend list if necessary. */
-    if (realloc_friendlist(m, m->numfriends + 1) != 0) {
+    if (m->friendlist_size <= m->numfriends && realloc_friendlist(m, m->numfriends + 1) != 0) {
         return FAERR_NOMEM;
     }
 
     memset(&m->friendlist[m->numfriends], 0, sizeof(Friend));
 
-    int friendcon_id = new_friend_connection(m->fr_c, real_pk);
+    int friendcon_id = -1;
 
-    if (friendcon_id == -1) {
-        return FAERR_NOMEM;
+    if (!m->defer_friend_connections) {
+        friendcon_id = new_friend_connection(m->fr_c, real_pk);
+
+        if (friendcon_id == -1) {
+            return FAERR_NOMEM;
+        }
     }
 
-    uint32_t i;
+    /* Without free entries the scan would only find the new one at the end. */
+    uint32_t i = m->friendlist_free == 0 ? m->numfriends : 0;
 
-    for (i = 0; i <= m->numfriends; ++i) {
+    for (; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
             m->friendlist[i].status = status;
             m->friendlist[i].friendcon_id = friendcon_id;
@@ -208,15 +230,19 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
             m->friendlist[i].userstatus = USERSTATUS_NONE;
             m->friendlist[i].is_typing = 0;
             m->friendlist[i].message_id = 0;
-            friend_connection_callbacks(m->fr_c, friendcon_id, MESSENGER_CALLBACK_INDEX, &m_handle_status, &m_handle_packet,
-                                        &m_handle_custom_lossy_packet, m, i);
 
             if (m->numfriends == i) {
                 ++m->numfriends;
+            } else {
+                --m->friendlist_free;
             }
 
-            if (friend_con_connected(m->fr_c, friendcon_id) == FRIENDCONN_STATUS_CONNECTED) {
-                send_online_packet(m, i);
+            if (friendcon_id == -1) {
+                /* Created by activate_deferred_friends(). */
+                m->friendlist[i].connection_deferred = 1;
+                ++m->num_deferred_friends;
+            } else {
+                set_friend_connection_callbacks(m, i);
             }
 
             return i;
@@ -226,23 +252,10 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
     return FAERR_NOMEM;
 }
 
-/*
- * Add a friend.
- * Set the data that will be sent along with friend request.
- * Address is the address of the friend (returned by getaddress of the friend you wish to add) it must be FRIEND_ADDRESS_SIZE bytes.
- * data is the data and length is the length.
- *
- *  return the friend number if success.
- *  return FA_TOOLONG if message length is too long.
- *  return FAERR_NOMESSAGE if no message (message length must be >= 1 byte).
- *  return FAERR_OWNKEY if user's own key.
- *  return FAERR_ALREADYSENT if friend request already sent or already a friend.
- *  return FAERR_BADCHECKSUM if bad checksum in address.
- *  return FAERR_SETNEWNOSPAM if the friend was already there but the nospam was different.
- *  (the nospam for that friend was set to the new one).
- *  return FAERR_NOMEM if increasing the friend list size fails.
+/* m_addfriend() where friend_id is the friend number of the key in address, or -1.
  */
-int32_t m_addfriend(Messenger *m, const uint8_t *address, const uint8_t *data, uint16_t length)
+static int32_t add_friend(Messenger *m, const uint8_t *address, const uint8_t *data, uint16_t length,
+                          int32_t friend_id)
 {
     if (length > MAX_FRIEND_REQUEST_DATA_SIZE) {
         return FAERR_TOOLONG;
@@ -270,8 +283,6 @@ int32_t m_addfriend(Messenger *m, const uint8_t *address, const uint8_t *data, u
         return FAERR_OWNKEY;
     }
 
-    int32_t friend_id = getfriend_id(m, real_pk);
-
     if (friend_id != -1) {
         if (m->friendlist[friend_id].status >= FRIEND_CONFIRMED) {
             return FAERR_ALREADYSENT;
@@ -285,6 +296,7 @@ int32_t m_addfriend(Messenger *m, const uint8_t *address, const uint8_t *data, u
         }
 
         m->friendlist[friend_id].friendrequest_nospam = nospam;
+        journal_friend(m, friend_id, MESSENGER_JOURNAL_TYPE_FRIEND);
         return FAERR_SETNEWNOSPAM;
     }
 
@@ -299,15 +311,34 @@ int32_t m_addfriend(Messenger *m, const uint8_t *address, const uint8_t *data, u
     m->friendlist[ret].info_size = length;
     memcpy(&m->friendlist[ret].friendrequest_nospam, address + CRYPTO_PUBLIC_KEY_SIZE, sizeof(uint32_t));
 
+    journal_friend(m, ret, MESSENGER_JOURNAL_TYPE_FRIEND);
     return ret;
 }
 
-int32_t m_addfriend_norequest(Messenger *m, const uint8_t *real_pk)
+/*
+ * Add a friend.
+ * Set the data that will be sent along with friend request.
+ * Address is the address of the friend (returned by getaddress of the friend you wish to add) it must be FRIEND_ADDRESS_SIZE bytes.
+ * data is the data and length is the length.
+ *
+ *  return the friend number if success.
+ *  return FA_TOOLONG if message length is too long.
+ *  return FAERR_NOMESSAGE if no message (message length must be >= 1 byte).
+ *  return FAERR_OWNKEY if user's own key.
+ *  return FAERR_ALREADYSENT if friend request already sent or already a friend.
+ *  return FAERR_BADCHECKSUM if bad checksum in address.
+ *  return FAERR_SETNEWNOSPAM if the friend was already there but the nospam was different.
+ *  (the nospam for that friend was set to the new one).
+ *  return FAERR_NOMEM if increasing the friend list size fails.
+ */
+int32_t m_addfriend(Messenger *m, const uint8_t *address, const uint8_t *data, uint16_t length)
 {
-    if (getfriend_id(m, real_pk) != -1) {
-        return FAERR_ALREADYSENT;
-    }
+    return add_friend(m, address, data, length, getfriend_id(m, address));
+}
 
+/* m_addfriend_norequest() for a real_pk that is known not to be a friend yet. */
+static int32_t add_friend_norequest(Messenger *m, const uint8_t *real_pk)
+{
     if (!public_key_valid(real_pk)) {
         return FAERR_BADCHECKSUM;
     }
@@ -316,51 +347,71 @@ int32_t m_addfriend_norequest(Messenger *m, const uint8_t *real_pk)
         return FAERR_OWNKEY;
     }
 
-    return init_new_friend(m, real_pk, FRIEND_CONFIRMED);
+    const int32_t ret = init_new_friend(m, real_pk, FRIEND_CONFIRMED);
+
+    if (ret >= 0) {
+        journal_friend(m, ret, MESSENGER_JOURNAL_TYPE_FRIEND);
+    }
+
+    return ret;
 }
 
-static int clear_receipts(Messenger *m, int32_t friendnumber)
+int32_t m_addfriend_norequest(Messenger *m, const uint8_t *real_pk)
 {
-    if (friend_not_valid(m, friendnumber)) {
-        return -1;
+    if (getfriend_id(m, real_pk) != -1) {
+        return FAERR_ALREADYSENT;
     }
 
-    struct Receipts *receipts = m->friendlist[friendnumber].receipts_start;
+    return add_friend_norequest(m, real_pk);
+}
 
-    while (receipts) {
-        struct Receipts *temp_r = receipts->next;
-        free(receipts);
-        receipts = temp_r;
+static int clear_receipts(Messenger *m, int32_t friendnumber)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
     }
 
-    m->friendlist[friendnumber].receipts_start = nullptr;
-    m->friendlist[friendnumber].receipts_end = nullptr;
+    Friend *const f = &m->friendlist[friendnumber];
+    free(f->receipts);
+    f->receipts = nullptr;
+    f->receipts_size = 0;
+    f->receipts_start = 0;
+    f->receipts_end = 0;
     return 0;
 }
 
+#define MIN_RECEIPTS_SIZE 16
+
 static int add_receipt(Messenger *m, int32_t friendnumber, uint32_t packet_num, uint32_t msg_id)
 {
     if (friend_not_valid(m, friendnumber)) {
         return -1;
     }
 
-    struct Receipts *new_receipts = (struct Receipts *)calloc(1, sizeof(struct Receipts));
+    Friend *const f = &m->friendlist[friendnumber];
 
-    if (!new_receipts) {
-        return -1;
-    }
+    if (f->receipts_end - f->receipts_start == f->receipts_size) {
+        const uint32_t new_size = f->receipts_size ? f->receipts_size * 2 : MIN_RECEIPTS_SIZE;
+        struct Receipt *new_receipts = (struct Receipt *)malloc(new_size * sizeof(struct Receipt));
+
+        if (!new_receipts) {
+            return -1;
+        }
 
-    new_receipts->packet_num = packet_num;
-    new_receipts->msg_id = msg_id;
+        /* Entries keep their (unmasked) position, only the mask changes. */
+        for (uint32_t i = f->receipts_start; i != f->receipts_end; ++i) {
+            new_receipts[i & (new_size - 1)] = f->receipts[i & (f->receipts_size - 1)];
+        }
 
-    if (!m->friendlist[friendnumber].receipts_start) {
-        m->friendlist[friendnumber].receipts_start = new_receipts;
-    } else {
-        m->friendlist[friendnumber].receipts_end->next = new_receipts;
+        free(f->receipts);
+        f->receipts = new_receipts;
+        f->receipts_size = new_size;
     }
 
-    m->friendlist[friendnumber].receipts_end = new_receipts;
-    new_receipts->next = nullptr;
+    struct Receipt *receipt = &f->receipts[f->receipts_end & (f->receipts_size - 1)];
+    receipt->packet_num = packet_num;
+    receipt->msg_id = msg_id;
+    ++f->receipts_end;
     return 0;
 }
 /*
@@ -383,33 +434,46 @@ static int do_receipts(Messenger *m, int32_t friendnumber, void *userdata)
         return -1;
     }
 
-    struct Receipts *receipts = m->friendlist[friendnumber].receipts_start;
-
-    while (receipts) {
-        if (friend_received_packet(m, friendnumber, receipts->packet_num) == -1) {
-            break;
-        }
+    const Friend *f = &m->friendlist[friendnumber];
 
-        if (m->read_receipt) {
-            (*m->read_receipt)(m, friendnumber, receipts->msg_id, userdata);
-        }
+    if (f->receipts_start == f->receipts_end) {
+        return 0;
+    }
 
-        struct Receipts *r_next = receipts->next;
+    uint32_t buffer_start, buffer_end;
 
-        free(receipts);
+    if (crypto_send_window(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c, f->friendcon_id),
+                           &buffer_start, &buffer_end) == -1) {
+        return -1;
+    }
 
-        m->friendlist[friendnumber].receipts_start = r_next;
+    /* Receipts are in sending order, so the acknowledged ones are the ones up
+     * to the first packet still in the send window. */
+    const uint32_t window = buffer_end - buffer_start;
+    uint32_t done = f->receipts_start;
 
-        receipts = r_next;
+    while (done != f->receipts_end
+            && f->receipts[done & (f->receipts_size - 1)].packet_num - buffer_start > window) {
+        ++done;
     }
 
-    if (!m->friendlist[friendnumber].receipts_start) {
-        m->friendlist[friendnumber].receipts_end = nullptr;
+    /* The callback may send messages (growing the ring) or delete the friend. */
+    while (!friend_not_valid(m, friendnumber) && m->friendlist[friendnumber].receipts_start != done
+            && m->friendlist[friendnumber].receipts_end != m->friendlist[friendnumber].receipts_start) {
+        f = &m->friendlist[friendnumber];
+        const uint32_t msg_id = f->receipts[f->receipts_start & (f->receipts_size - 1)].msg_id;
+        ++m->friendlist[friendnumber].receipts_start;
+
+        if (m->read_receipt) {
+            (*m->read_receipt)(m, friendnumber, msg_id, userdata);
+        }
     }
 
     return 0;
 }
 
+static void clear_file_resume(Friend *f);
+
 /* Remove a friend.
  *
  *  return 0 if success.
@@ -427,6 +491,11 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
 
     clear_receipts(m, friendnumber);
     remove_request_received(m->fr, m->friendlist[friendnumber].real_pk);
+
+    if (m->friendlist[friendnumber].connection_deferred) {
+        --m->num_deferred_friends;
+    }
+
     friend_connection_callbacks(m->fr_c, m->friendlist[friendnumber].friendcon_id, MESSENGER_CALLBACK_INDEX, nullptr,
                                 nullptr, nullptr, nullptr, 0);
 
@@ -435,6 +504,8 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
     }
 
     kill_friend_connection(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    journal_friend(m, friendnumber, MESSENGER_JOURNAL_TYPE_FRIEND_REMOVED);
+    clear_file_resume(&m->friendlist[friendnumber]);
     memset(&m->friendlist[friendnumber], 0, sizeof(Friend));
     uint32_t i;
 
@@ -444,6 +515,13 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
         }
     }
 
+    /* The entries cut off at the end were free, apart from this one. */
+    if ((uint32_t)friendnumber < i) {
+        ++m->friendlist_free;
+    } else {
+        m->friendlist_free -= m->numfriends - i - 1;
+    }
+
     m->numfriends = i;
 
     if (realloc_friendlist(m, m->numfriends) != 0) {
@@ -568,8 +646,14 @@ int setfriendname(Messenger *m, int32_t friendnumber, const uint8_t *name, uint1
         return -1;
     }
 
+    if (m->friendlist[friendnumber].name_length == length
+            && memcmp(m->friendlist[friendnumber].name, name, length) == 0) {
+        return 0;
+    }
+
     m->friendlist[friendnumber].name_length = length;
     memcpy(m->friendlist[friendnumber].name, name, length);
+    journal_friend(m, friendnumber, MESSENGER_JOURNAL_TYPE_FRIEND_NAME);
     return 0;
 }
 
@@ -602,6 +686,7 @@ int setname(Messenger *m, const uint8_t *name, uint16_t length)
         m->friendlist[i].name_sent = 0;
     }
 
+    journal_self(m, MESSENGER_STATE_TYPE_NAME);
     return 0;
 }
 
@@ -673,6 +758,7 @@ int m_set_statusmessage(Messenger *m, const uint8_t *status, uint16_t length)
         m->friendlist[i].statusmessage_sent = 0;
     }
 
+    journal_self(m, MESSENGER_STATE_TYPE_STATUSMESSAGE);
     return 0;
 }
 
@@ -693,6 +779,7 @@ int m_set_userstatus(Messenger *m, uint8_t status)
         m->friendlist[i].userstatus_sent = 0;
     }
 
+    journal_self(m, MESSENGER_STATE_TYPE_STATUS);
     return 0;
 }
 
@@ -821,7 +908,7 @@ static int send_user_istyping(const Messenger *m, int32_t friendnumber, uint8_t
     return write_cryptpacket_id(m, friendnumber, PACKET_ID_TYPING, &typing, sizeof(typing), 0);
 }
 
-static int set_friend_statusmessage(const Messenger *m, int32_t friendnumber, const uint8_t *status, uint16_t length)
+static int set_friend_statusmessage(Messenger *m, int32_t friendnumber, const uint8_t *status, uint16_t length)
 {
     if (friend_not_valid(m, friendnumber)) {
         return -1;
@@ -831,17 +918,28 @@ static int set_friend_statusmessage(const Messenger *m, int32_t friendnumber, co
         return -1;
     }
 
+    if (m->friendlist[friendnumber].statusmessage_length == length
+            && (length == 0 || memcmp(m->friendlist[friendnumber].statusmessage, status, length) == 0)) {
+        return 0;
+    }
+
     if (length) {
         memcpy(m->friendlist[friendnumber].statusmessage, status, length);
     }
 
     m->friendlist[friendnumber].statusmessage_length = length;
+    journal_friend(m, friendnumber, MESSENGER_JOURNAL_TYPE_FRIEND_STATUSMESSAGE);
     return 0;
 }
 
-static void set_friend_userstatus(const Messenger *m, int32_t friendnumber, uint8_t status)
+static void set_friend_userstatus(Messenger *m, int32_t friendnumber, uint8_t status)
 {
+    if (m->friendlist[friendnumber].userstatus == (USERSTATUS)status) {
+        return;
+    }
+
     m->friendlist[friendnumber].userstatus = (USERSTATUS)status;
+    journal_friend(m, friendnumber, MESSENGER_JOURNAL_TYPE_FRIEND_STATUS);
 }
 
 static void set_friend_typing(const Messenger *m, int32_t friendnumber, uint8_t is_typing)
@@ -944,6 +1042,7 @@ static void check_friend_tcp_udp(Messenger *m, int32_t friendnumber, void *userd
 }
 
 static void break_files(const Messenger *m, int32_t friendnumber);
+static void resume_file_senders(Messenger *m, int32_t friendnumber, void *userdata);
 static void check_friend_connectionstatus(Messenger *m, int32_t friendnumber, uint8_t status, void *userdata)
 {
     if (status == NOFRIEND) {
@@ -972,13 +1071,26 @@ static void check_friend_connectionstatus(Messenger *m, int32_t friendnumber, ui
             m->friend_connectionstatuschange_internal(m, friendnumber, is_online,
                     m->friend_connectionstatuschange_internal_userdata);
         }
+
+        if (is_online) {
+            resume_file_senders(m, friendnumber, userdata);
+        }
     }
 }
 
 static void set_friend_status(Messenger *m, int32_t friendnumber, uint8_t status, void *userdata)
 {
+    const uint8_t old_status = m->friendlist[friendnumber].status;
+
     check_friend_connectionstatus(m, friendnumber, status, userdata);
     m->friendlist[friendnumber].status = status;
+
+    if ((old_status >= FRIEND_CONFIRMED) != (status >= FRIEND_CONFIRMED)) {
+        /* Saved differently depending on whether the friend is confirmed. */
+        journal_friend(m, friendnumber, MESSENGER_JOURNAL_TYPE_FRIEND);
+    } else if (old_status == FRIEND_ONLINE && status != FRIEND_ONLINE) {
+        journal_friend(m, friendnumber, MESSENGER_JOURNAL_TYPE_FRIEND_STATUS);
+    }
 }
 
 static int write_cryptpacket_id(const Messenger *m, int32_t friendnumber, uint8_t packet_id, const uint8_t *data,
@@ -1081,167 +1193,573 @@ void callback_file_reqchunk(Messenger *m, void (*function)(Messenger *m, uint32_
     m->file_reqchunk = function;
 }
 
-#define MAX_FILENAME_LENGTH 255
-
-/* Copy the file transfer file id to file_id
- *
- * return 0 on success.
- * return -1 if friend not valid.
- * return -2 if filenumber not valid
- */
-int file_get_id(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t *file_id)
+void callback_file_resume(Messenger *m, void (*function)(Messenger *m, uint32_t, uint32_t, uint64_t, void *))
 {
-    if (friend_not_valid(m, friendnumber)) {
-        return -1;
-    }
+    m->file_resume = function;
+}
 
-    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
-        return -2;
-    }
+/* Adler-32 of data, continuing from hash (1 for a new hash). */
+static uint32_t resume_hash(uint32_t hash, const uint8_t *data, uint64_t length)
+{
+    uint32_t a = hash & 0xffff;
+    uint32_t b = hash >> 16;
 
-    uint32_t temp_filenum;
-    uint8_t send_receive, file_number;
+    while (length > 0) {
+        /* The most bytes that can be summed before b may overflow. */
+        uint32_t n = min_u64(length, 5552);
+        length -= n;
 
-    if (filenumber >= (1 << 16)) {
-        send_receive = 1;
-        temp_filenum = (filenumber >> 16) - 1;
-    } else {
-        send_receive = 0;
-        temp_filenum = filenumber;
-    }
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
 
-    if (temp_filenum >= MAX_CONCURRENT_FILE_PIPES) {
-        return -2;
+        a %= 65521;
+        b %= 65521;
     }
 
-    file_number = temp_filenum;
+    return (b << 16) | a;
+}
 
-    struct File_Transfers *ft;
+/* return the size of the blocks the data of a file is hashed in. */
+static uint64_t resume_block_size(uint64_t file_size)
+{
+    uint64_t block_size = FILE_RESUME_BLOCK_SIZE;
 
-    if (send_receive) {
-        ft = &m->friendlist[friendnumber].file_receiving[file_number];
-    } else {
-        ft = &m->friendlist[friendnumber].file_sending[file_number];
+    while (file_size / block_size >= FILE_RESUME_MAX_BLOCKS) {
+        block_size *= 2;
     }
 
-    if (ft->status == FILESTATUS_NONE) {
-        return -2;
-    }
+    return block_size;
+}
 
-    memcpy(file_id, ft->id, FILE_ID_LENGTH);
-    return 0;
+static uint32_t resume_num_blocks(uint64_t file_size)
+{
+    const uint64_t block_size = resume_block_size(file_size);
+    return (file_size + block_size - 1) / block_size;
 }
 
-/* Send a file send request.
- * Maximum filename length is 255 bytes.
- *  return 1 on success
- *  return 0 on failure
+static void free_file_resume(struct File_Resume *resume)
+{
+    if (resume) {
+        free(resume->hashes);
+        free(resume);
+    }
+}
+
+/* return a new resume record for a transfer.
+ * return NULL if the transfer can't be resumed or resuming is off.
  */
-static int file_sendrequest(const Messenger *m, int32_t friendnumber, uint8_t filenumber, uint32_t file_type,
-                            uint64_t filesize, const uint8_t *file_id, const uint8_t *filename, uint16_t filename_length)
+static struct File_Resume *new_file_resume(const Messenger *m, uint8_t send_receive, uint32_t file_type,
+        uint64_t size, const uint8_t *file_id, const uint8_t *filename, uint16_t filename_length)
 {
-    if (friend_not_valid(m, friendnumber)) {
-        return 0;
+    if (!m->file_resume || file_type == FILEKIND_AVATAR || size == 0 || size == UINT64_MAX) {
+        return nullptr;
     }
 
-    if (filename_length > MAX_FILENAME_LENGTH) {
-        return 0;
+    struct File_Resume *resume = (struct File_Resume *)calloc(1, sizeof(struct File_Resume));
+
+    if (!resume) {
+        return nullptr;
     }
 
-    VLA(uint8_t, packet, 1 + sizeof(file_type) + sizeof(filesize) + FILE_ID_LENGTH + filename_length);
-    packet[0] = filenumber;
-    file_type = net_htonl(file_type);
-    memcpy(packet + 1, &file_type, sizeof(file_type));
-    host_to_net((uint8_t *)&filesize, sizeof(filesize));
-    memcpy(packet + 1 + sizeof(file_type), &filesize, sizeof(filesize));
-    memcpy(packet + 1 + sizeof(file_type) + sizeof(filesize), file_id, FILE_ID_LENGTH);
+    memcpy(resume->id, file_id, FILE_ID_LENGTH);
+    resume->send_receive = send_receive;
+    resume->file_type = file_type;
+    resume->size = size;
 
     if (filename_length) {
-        memcpy(packet + 1 + sizeof(file_type) + sizeof(filesize) + FILE_ID_LENGTH, filename, filename_length);
+        memcpy(resume->filename, filename, filename_length);
     }
 
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_SENDREQUEST, packet, SIZEOF_VLA(packet), 0);
+    resume->filename_length = filename_length;
+    resume->block_hash = 1;
+    return resume;
 }
 
-/* Send a file send request.
- * Maximum filename length is 255 bytes.
- *  return file number on success
- *  return -1 if friend not found.
- *  return -2 if filename length invalid.
- *  return -3 if no more file sending slots left.
- *  return -4 if could not send packet (friend offline).
- *
- */
-long int new_filesender(const Messenger *m, int32_t friendnumber, uint32_t file_type, uint64_t filesize,
-                        const uint8_t *file_id, const uint8_t *filename, uint16_t filename_length)
+static void remove_file_resume(Friend *f, uint32_t index)
 {
-    if (friend_not_valid(m, friendnumber)) {
-        return -1;
-    }
+    --f->num_file_resume;
+    memmove(&f->file_resume[index], &f->file_resume[index + 1],
+            (f->num_file_resume - index) * sizeof(struct File_Resume *));
+}
 
-    if (filename_length > MAX_FILENAME_LENGTH) {
-        return -2;
+static void add_file_resume(Friend *f, struct File_Resume *resume)
+{
+    if (f->num_file_resume == MAX_FILE_RESUME_RECORDS) {
+        free_file_resume(f->file_resume[0]);
+        remove_file_resume(f, 0);
     }
 
-    uint32_t i;
+    f->file_resume[f->num_file_resume] = resume;
+    ++f->num_file_resume;
+}
 
-    for (i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
-        if (m->friendlist[friendnumber].file_sending[i].status == FILESTATUS_NONE) {
-            break;
+/* return the kept record of the interrupted transfer with this file id,
+ * removed from the list of the friend.
+ * return NULL if there is none.
+ */
+static struct File_Resume *take_file_resume(Friend *f, uint8_t send_receive, const uint8_t *file_id, uint64_t size)
+{
+    for (uint32_t i = 0; i < f->num_file_resume; ++i) {
+        struct File_Resume *resume = f->file_resume[i];
+
+        if (resume->send_receive == send_receive && resume->size == size
+                && crypto_memcmp(resume->id, file_id, FILE_ID_LENGTH) == 0) {
+            remove_file_resume(f, i);
+            return resume;
         }
     }
 
-    if (i == MAX_CONCURRENT_FILE_PIPES) {
-        return -3;
-    }
+    return nullptr;
+}
 
-    if (file_sendrequest(m, friendnumber, i, file_type, filesize, file_id, filename, filename_length) == 0) {
-        return -4;
+/* return true if the transfer can be resumed after an interruption: an
+ * incoming one once it was accepted, an outgoing one until all data was sent.
+ */
+static bool file_resumable(const struct File_Transfers *ft)
+{
+    if (!ft->resume) {
+        return 0;
     }
 
-    struct File_Transfers *ft = &m->friendlist[friendnumber].file_sending[i];
-
-    ft->status = FILESTATUS_NOT_ACCEPTED;
-
-    ft->size = filesize;
+    if (ft->resume->send_receive) {
+        return ft->status == FILESTATUS_TRANSFERRING;
+    }
 
-    ft->transferred = 0;
+    return ft->status == FILESTATUS_NOT_ACCEPTED || ft->status == FILESTATUS_TRANSFERRING;
+}
 
-    ft->requested = 0;
+/* Keep the resume record of an interrupted transfer in the friend's list. */
+static void keep_file_resume(Friend *f, struct File_Transfers *ft)
+{
+    struct File_Resume *resume = ft->resume;
 
-    ft->slots_allocated = 0;
+    if (!file_resumable(ft)) {
+        free_file_resume(resume);
+        ft->resume = nullptr;
+        return;
+    }
 
-    ft->paused = FILE_PAUSE_NOT;
+    /* The data source or destination is not kept, the client may free it
+     * before the transfer is resumed. */
+    resume->position = ft->transferred;
+    ft->resume = nullptr;
+    add_file_resume(f, resume);
+}
 
-    memcpy(ft->id, file_id, FILE_ID_LENGTH);
+/* Free the resume records of the transfers of a friend and the kept ones. */
+static void clear_file_resume(Friend *f)
+{
+    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        free_file_resume(f->file_sending[i].resume);
+        f->file_sending[i].resume = nullptr;
+        free_file_resume(f->file_receiving[i].resume);
+        f->file_receiving[i].resume = nullptr;
+    }
 
-    ++m->friendlist[friendnumber].num_sending_files;
+    for (uint32_t i = 0; i < f->num_file_resume; ++i) {
+        free_file_resume(f->file_resume[i]);
+    }
 
-    return i;
+    f->num_file_resume = 0;
 }
 
-static int send_file_control_packet(const Messenger *m, int32_t friendnumber, uint8_t send_receive, uint8_t filenumber,
-                                    uint8_t control_type, uint8_t *data, uint16_t data_length)
+/* Hash data received at the current position of ft, so that it can be checked
+ * when resuming.
+ */
+static void hash_received_file_data(struct File_Transfers *ft, const uint8_t *data, uint16_t length)
 {
-    if ((unsigned int)(1 + 3 + data_length) > MAX_CRYPTO_DATA_SIZE) {
-        return -1;
+    struct File_Resume *resume = ft->resume;
+
+    /* Hashing stops if the client seeks elsewhere. */
+    if (!resume || resume->hashed != ft->transferred) {
+        return;
     }
 
-    VLA(uint8_t, packet, 3 + data_length);
+    const uint64_t block_size = resume_block_size(ft->size);
 
-    packet[0] = send_receive;
-    packet[1] = filenumber;
-    packet[2] = control_type;
+    if (!resume->hashes) {
+        resume->hashes = (uint32_t *)calloc(resume_num_blocks(ft->size), sizeof(uint32_t));
 
-    if (data_length) {
-        memcpy(packet + 3, data, data_length);
+        if (!resume->hashes) {
+            return;
+        }
     }
 
-    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_CONTROL, packet, SIZEOF_VLA(packet), 0);
+    while (length > 0) {
+        const uint64_t in_block = resume->hashed % block_size;
+        const uint16_t n = min_u64(length, block_size - in_block);
+
+        resume->block_hash = resume_hash(resume->block_hash, data, n);
+        resume->hashed += n;
+        data += n;
+        length -= n;
+
+        if (in_block + n == block_size) {
+            resume->hashes[resume->num_hashes] = resume->block_hash;
+            ++resume->num_hashes;
+            resume->block_hash = 1;
+        }
+    }
 }
 
-/* Send a file control request.
- *
+#define RESUME_VERIFY_CHUNK_SIZE 65536
+
+/* return the number of leading blocks, up to max_blocks, of the data in the
+ * buffer or file of ft that match their hashes.
+ */
+static uint32_t verify_file_resume(const struct File_Transfers *ft, uint32_t max_blocks)
+{
+    const struct File_Resume *resume = ft->resume;
+    const uint64_t block_size = resume_block_size(ft->size);
+    uint8_t *chunk = nullptr;
+
+    if (ft->direct == FILE_DIRECT_FD) {
+        chunk = (uint8_t *)malloc(RESUME_VERIFY_CHUNK_SIZE);
+
+        if (!chunk) {
+            return 0;
+        }
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < max_blocks; ++i) {
+        const uint64_t start = i * block_size;
+        uint32_t hash = 1;
+
+        if (ft->direct == FILE_DIRECT_BUFFER) {
+            hash = resume_hash(hash, ft->buffer + start, block_size);
+        } else {
+            for (uint64_t done = 0; done < block_size;) {
+                const uint32_t n = min_u64(block_size - done, RESUME_VERIFY_CHUNK_SIZE);
+
+                if (read_file_at(ft->fd, chunk, n, start + done) == -1) {
+                    hash = ~resume->hashes[i];
+                    break;
+                }
+
+                hash = resume_hash(hash, chunk, n);
+                done += n;
+            }
+        }
+
+        if (hash != resume->hashes[i]) {
+            break;
+        }
+    }
+
+    free(chunk);
+    return i;
+}
+
+/* Accept an incoming transfer the friend offered again, past the data
+ * received before the interruption that is still intact.
+ */
+static void resume_file_receiving(Messenger *m, int32_t friendnumber, uint8_t filenumber, void *userdata)
+{
+    struct File_Transfers *ft = &m->friendlist[friendnumber].file_receiving[filenumber];
+    struct File_Resume *resume = ft->resume;
+    const uint32_t real_filenumber = (filenumber + 1) << 16;
+    const uint64_t block_size = resume_block_size(ft->size);
+
+    /* Only whole hashed blocks are kept. */
+    ft->transferred = min_u64(resume->position, resume->num_hashes * block_size);
+
+    m->file_resume(m, friendnumber, real_filenumber, ft->transferred, userdata);
+
+    if (ft->status != FILESTATUS_NOT_ACCEPTED) {
+        /* Cancelled by the client. */
+        return;
+    }
+
+    /* The client may have seeked back. */
+    uint32_t blocks = min_u64(ft->transferred / block_size, resume->num_hashes);
+
+    if (ft->direct != FILE_DIRECT_NONE) {
+        blocks = verify_file_resume(ft, blocks);
+    }
+
+    uint64_t position = blocks * block_size;
+
+    if (position > 0 && file_seek(m, friendnumber, real_filenumber, position) != 0) {
+        position = 0;
+        blocks = 0;
+    }
+
+    ft->transferred = position;
+    resume->num_hashes = blocks;
+    resume->hashed = position;
+    resume->block_hash = 1;
+
+    file_control(m, friendnumber, real_filenumber, FILECONTROL_ACCEPT);
+}
+
+/* Offer the outgoing transfers that were interrupted again. */
+static void resume_file_senders(Messenger *m, int32_t friendnumber, void *userdata)
+{
+    Friend *f = &m->friendlist[friendnumber];
+    uint32_t i = 0;
+
+    if (!m->file_resume) {
+        return;
+    }
+
+    while (i < f->num_file_resume) {
+        struct File_Resume *resume = f->file_resume[i];
+
+        if (resume->send_receive) {
+            ++i;
+            continue;
+        }
+
+        const long int filenumber = new_filesender(m, friendnumber, resume->file_type, resume->size, resume->id,
+                                    resume->filename, resume->filename_length);
+
+        if (filenumber < 0) {
+            return;
+        }
+
+        remove_file_resume(f, i);
+
+        struct File_Transfers *ft = &f->file_sending[filenumber];
+        free_file_resume(ft->resume);
+        ft->resume = resume;
+
+        /* The client sets the source again here, or gets chunk requests. */
+        m->file_resume(m, friendnumber, filenumber, 0, userdata);
+    }
+}
+
+/* Copy the file transfer file id to file_id
+ *
+ * return 0 on success.
+ * return -1 if friend not valid.
+ * return -2 if filenumber not valid
+ */
+int file_get_id(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t *file_id)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
+        return -2;
+    }
+
+    uint32_t temp_filenum;
+    uint8_t send_receive, file_number;
+
+    if (filenumber >= (1 << 16)) {
+        send_receive = 1;
+        temp_filenum = (filenumber >> 16) - 1;
+    } else {
+        send_receive = 0;
+        temp_filenum = filenumber;
+    }
+
+    if (temp_filenum >= MAX_CONCURRENT_FILE_PIPES) {
+        return -2;
+    }
+
+    file_number = temp_filenum;
+
+    struct File_Transfers *ft;
+
+    if (send_receive) {
+        ft = &m->friendlist[friendnumber].file_receiving[file_number];
+    } else {
+        ft = &m->friendlist[friendnumber].file_sending[file_number];
+    }
+
+    if (ft->status == FILESTATUS_NONE) {
+        return -2;
+    }
+
+    memcpy(file_id, ft->id, FILE_ID_LENGTH);
+    return 0;
+}
+
+/* Send a file send request.
+ * Maximum filename length is 255 bytes.
+ *  return 1 on success
+ *  return 0 on failure
+ */
+static int file_sendrequest(const Messenger *m, int32_t friendnumber, uint8_t filenumber, uint32_t file_type,
+                            uint64_t filesize, const uint8_t *file_id, const uint8_t *filename, uint16_t filename_length)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return 0;
+    }
+
+    if (filename_length > MAX_FILENAME_LENGTH) {
+        return 0;
+    }
+
+    VLA(uint8_t, packet, 1 + sizeof(file_type) + sizeof(filesize) + FILE_ID_LENGTH + filename_length);
+    packet[0] = filenumber;
+    file_type = net_htonl(file_type);
+    memcpy(packet + 1, &file_type, sizeof(file_type));
+    host_to_net((uint8_t *)&filesize, sizeof(filesize));
+    memcpy(packet + 1 + sizeof(file_type), &filesize, sizeof(filesize));
+    memcpy(packet + 1 + sizeof(file_type) + sizeof(filesize), file_id, FILE_ID_LENGTH);
+
+    if (filename_length) {
+        memcpy(packet + 1 + sizeof(file_type) + sizeof(filesize) + FILE_ID_LENGTH, filename, filename_length);
+    }
+
+    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_SENDREQUEST, packet, SIZEOF_VLA(packet), 0);
+}
+
+/* Files up to this size are sent with high priority by default. */
+#define FILE_SMALL_SIZE (64 * 1024)
+
+static void file_queue_remove(Friend *f, uint8_t priority, uint32_t index)
+{
+    --f->file_queue_length[priority];
+    memmove(&f->file_queue[priority][index], &f->file_queue[priority][index + 1],
+            f->file_queue_length[priority] - index);
+
+    if (f->file_queue_next[priority] > index) {
+        --f->file_queue_next[priority];
+    }
+}
+
+/* Put outgoing transfer filenumber in the queue of its priority class.
+ * Transfers that ended are taken out of the queues by the scheduler.
+ */
+static void file_queue_set(Friend *f, uint8_t filenumber, uint8_t priority)
+{
+    struct File_Transfers *ft = &f->file_sending[filenumber];
+
+    if (ft->queued && ft->priority != priority) {
+        for (uint32_t i = 0; i < f->file_queue_length[ft->priority]; ++i) {
+            if (f->file_queue[ft->priority][i] == filenumber) {
+                file_queue_remove(f, ft->priority, i);
+                break;
+            }
+        }
+
+        ft->queued = 0;
+    }
+
+    if (!ft->queued) {
+        f->file_queue[priority][f->file_queue_length[priority]] = filenumber;
+        ++f->file_queue_length[priority];
+        ft->queued = 1;
+    }
+
+    ft->priority = priority;
+    ft->deficit = 0;
+}
+
+int file_set_priority(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t priority)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (filenumber >= MAX_CONCURRENT_FILE_PIPES
+            || m->friendlist[friendnumber].file_sending[filenumber].status == FILESTATUS_NONE) {
+        return -2;
+    }
+
+    if (priority >= FILE_PRIORITY_CLASSES) {
+        return -3;
+    }
+
+    file_queue_set(&m->friendlist[friendnumber], filenumber, priority);
+    return 0;
+}
+
+/* Send a file send request.
+ * Maximum filename length is 255 bytes.
+ *  return file number on success
+ *  return -1 if friend not found.
+ *  return -2 if filename length invalid.
+ *  return -3 if no more file sending slots left.
+ *  return -4 if could not send packet (friend offline).
+ *
+ */
+long int new_filesender(const Messenger *m, int32_t friendnumber, uint32_t file_type, uint64_t filesize,
+                        const uint8_t *file_id, const uint8_t *filename, uint16_t filename_length)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (filename_length > MAX_FILENAME_LENGTH) {
+        return -2;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        if (m->friendlist[friendnumber].file_sending[i].status == FILESTATUS_NONE) {
+            break;
+        }
+    }
+
+    if (i == MAX_CONCURRENT_FILE_PIPES) {
+        return -3;
+    }
+
+    if (file_sendrequest(m, friendnumber, i, file_type, filesize, file_id, filename, filename_length) == 0) {
+        return -4;
+    }
+
+    struct File_Transfers *ft = &m->friendlist[friendnumber].file_sending[i];
+
+    ft->status = FILESTATUS_NOT_ACCEPTED;
+
+    ft->size = filesize;
+
+    ft->transferred = 0;
+
+    ft->requested = 0;
+
+    ft->slots_allocated = 0;
+
+    ft->paused = FILE_PAUSE_NOT;
+
+    ft->direct = FILE_DIRECT_NONE;
+
+    memcpy(ft->id, file_id, FILE_ID_LENGTH);
+
+    free_file_resume(ft->resume);
+    ft->resume = new_file_resume(m, 0, file_type, filesize, file_id, filename, filename_length);
+
+    file_queue_set(&m->friendlist[friendnumber], i, file_type == FILEKIND_AVATAR
+                   || filesize <= FILE_SMALL_SIZE ? FILE_PRIORITY_HIGH : FILE_PRIORITY_NORMAL);
+
+    ++m->friendlist[friendnumber].num_sending_files;
+
+    return i;
+}
+
+static int send_file_control_packet(const Messenger *m, int32_t friendnumber, uint8_t send_receive, uint8_t filenumber,
+                                    uint8_t control_type, uint8_t *data, uint16_t data_length)
+{
+    if ((unsigned int)(1 + 3 + data_length) > MAX_CRYPTO_DATA_SIZE) {
+        return -1;
+    }
+
+    VLA(uint8_t, packet, 3 + data_length);
+
+    packet[0] = send_receive;
+    packet[1] = filenumber;
+    packet[2] = control_type;
+
+    if (data_length) {
+        memcpy(packet + 3, data, data_length);
+    }
+
+    return write_cryptpacket_id(m, friendnumber, PACKET_ID_FILE_CONTROL, packet, SIZEOF_VLA(packet), 0);
+}
+
+/* Send a file control request.
+ *
  *  return 0 on success
  *  return -1 if friend not valid.
  *  return -2 if friend not online.
@@ -1405,6 +1923,84 @@ int file_seek(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
     return 0;
 }
 
+/* Shared checks of file_set_buffer() and file_set_fd().
+ *
+ * return the transfer on success.
+ * return NULL and set error to the error code on failure.
+ */
+static struct File_Transfers *get_direct_file_transfer(const Messenger *m, int32_t friendnumber, uint32_t filenumber,
+        int *error)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        *error = -1;
+        return nullptr;
+    }
+
+    const uint8_t send_receive = filenumber >= (1 << 16);
+    const uint32_t temp_filenum = send_receive ? (filenumber >> 16) - 1 : filenumber;
+
+    if (temp_filenum >= MAX_CONCURRENT_FILE_PIPES) {
+        *error = -2;
+        return nullptr;
+    }
+
+    struct File_Transfers *ft = send_receive ? &m->friendlist[friendnumber].file_receiving[temp_filenum]
+                                : &m->friendlist[friendnumber].file_sending[temp_filenum];
+
+    if (ft->status == FILESTATUS_NONE) {
+        *error = -2;
+        return nullptr;
+    }
+
+    if (ft->status != FILESTATUS_NOT_ACCEPTED) {
+        *error = -3;
+        return nullptr;
+    }
+
+    if (ft->size == UINT64_MAX) {
+        *error = -4;
+        return nullptr;
+    }
+
+    return ft;
+}
+
+int file_set_buffer(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t *buffer, uint64_t length)
+{
+    int error;
+    struct File_Transfers *ft = get_direct_file_transfer(m, friendnumber, filenumber, &error);
+
+    if (!ft) {
+        return error;
+    }
+
+    if (length < ft->size || (ft->size && !buffer)) {
+        return -4;
+    }
+
+    ft->direct = FILE_DIRECT_BUFFER;
+    ft->buffer = buffer;
+    return 0;
+}
+
+int file_set_fd(const Messenger *m, int32_t friendnumber, uint32_t filenumber, int fd)
+{
+    int error;
+    struct File_Transfers *ft = get_direct_file_transfer(m, friendnumber, filenumber, &error);
+
+    if (!ft) {
+        return error;
+    }
+
+    if (fd < 0) {
+        return -4;
+    }
+
+    ft->direct = FILE_DIRECT_FD;
+    ft->fd = fd;
+    return 0;
+}
+
 /* return packet number on success.
  * return -1 on failure.
  */
@@ -1537,95 +2133,203 @@ uint64_t file_dataremaining(const Messenger *m, int32_t friendnumber, uint8_t fi
     return receiving->size - receiving->transferred;
 }
 
-/**
- * Iterate over all file transfers and request chunks (from the client) for each
- * of them.
+/* Send the next piece of a transfer set up with file_set_buffer() or
+ * file_set_fd() straight from its source, without asking the client.
  *
- * The free_slots parameter is updated by this function.
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int send_direct_file_piece(Messenger *m, int32_t friendnumber, uint8_t filenumber, void *userdata)
+{
+    struct File_Transfers *const ft = &m->friendlist[friendnumber].file_sending[filenumber];
+    const uint16_t length = min_u64(ft->size - ft->transferred, MAX_FILE_DATA_SIZE);
+    const uint64_t position = ft->transferred;
+
+    uint8_t packet[2 + MAX_FILE_DATA_SIZE];
+    packet[0] = PACKET_ID_FILE_DATA;
+    packet[1] = filenumber;
+
+    if (ft->direct == FILE_DIRECT_BUFFER) {
+        memcpy(packet + 2, ft->buffer + position, length);
+    } else if (read_file_at(ft->fd, packet + 2, length, position) == -1) {
+        LOGGER_WARNING(m->log, "reading file %u for friend %d failed, cancelling it", filenumber, friendnumber);
+        file_control(m, friendnumber, filenumber, FILECONTROL_KILL);
+
+        if (m->file_filecontrol) {
+            m->file_filecontrol(m, friendnumber, filenumber, FILECONTROL_KILL, userdata);
+        }
+
+        return -1;
+    }
+
+    const int64_t ret = write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                          m->friendlist[friendnumber].friendcon_id), packet, 2 + length, 1);
+
+    if (ret == -1) {
+        return -1;
+    }
+
+    ft->transferred += length;
+    ft->requested = ft->transferred;
+
+    if (length != MAX_FILE_DATA_SIZE || ft->size == ft->transferred) {
+        ft->status = FILESTATUS_FINISHED;
+        ft->last_packet_number = ret;
+    }
+
+    return 0;
+}
+
+/* return true if the outgoing transfer has a piece to send. */
+static bool file_wants_piece(const struct File_Transfers *ft)
+{
+    return ft->status == FILESTATUS_TRANSFERRING && ft->paused == FILE_PAUSE_NOT
+           && (ft->size == 0 || ft->size != ft->requested);
+}
+
+/* Request the next piece of an outgoing transfer from the client, or send it
+ * directly.
  *
- * @param m Our messenger object.
- * @param friendnumber The friend we're sending files to.
- * @param userdata The client userdata to pass along to chunk request callbacks.
- * @param free_slots A pointer to the number of free send queue slots in the
- *   crypto connection.
+ * return true if a send queue slot was used.
+ */
+static bool send_file_piece(Messenger *m, int32_t friendnumber, uint8_t filenumber, void *userdata)
+{
+    struct File_Transfers *const ft = &m->friendlist[friendnumber].file_sending[filenumber];
+
+    if (ft->size == 0) {
+        /* Send 0 data to friend if file is 0 length. */
+        return file_data(m, friendnumber, filenumber, 0, nullptr, 0) == 0;
+    }
+
+    if (ft->direct != FILE_DIRECT_NONE) {
+        return send_direct_file_piece(m, friendnumber, filenumber, userdata) == 0;
+    }
+
+    // Allocate 1 slot to this file transfer.
+    ft->slots_allocated++;
+
+    const uint16_t length = min_u64(ft->size - ft->requested, MAX_FILE_DATA_SIZE);
+    const uint64_t position = ft->requested;
+    ft->requested += length;
+
+    if (m->file_reqchunk) {
+        m->file_reqchunk(m, friendnumber, filenumber, position, length, userdata);
+    }
+
+    return 1;
+}
+
+/**
+ * Go over the queued outgoing file transfers of a friend: end the finished
+ * ones, drop the ended ones from the queues and take the send queue slots
+ * allocated to chunks requested from the client but not sent yet off
+ * free_slots.
  *
  * @return true if there are still file transfers ongoing, false if all file
  *   transfers are complete.
  */
-static bool do_all_filetransfers(Messenger *m, int32_t friendnumber, void *userdata, uint32_t *free_slots)
+static bool update_file_transfers(Messenger *m, int32_t friendnumber, void *userdata, uint32_t *free_slots)
 {
-    Friend *const friendcon = &m->friendlist[friendnumber];
-    uint32_t num = friendcon->num_sending_files;
-
+    Friend *const f = &m->friendlist[friendnumber];
     bool any_active_fts = false;
 
-    // Iterate over all file transfers, including inactive ones. I.e. we always
-    // iterate exactly MAX_CONCURRENT_FILE_PIPES times.
-    for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
-        struct File_Transfers *const ft = &friendcon->file_sending[i];
+    for (uint32_t priority = 0; priority < FILE_PRIORITY_CLASSES; ++priority) {
+        uint32_t i = 0;
 
-        // Any status other than NONE means the file transfer is active.
-        if (ft->status != FILESTATUS_NONE) {
-            any_active_fts = true;
-            --num;
+        while (i < f->file_queue_length[priority]) {
+            const uint8_t filenumber = f->file_queue[priority][i];
+            struct File_Transfers *const ft = &f->file_sending[filenumber];
 
             // If the file transfer is complete, we request a chunk of size 0.
             if (ft->status == FILESTATUS_FINISHED && friend_received_packet(m, friendnumber, ft->last_packet_number) == 0) {
                 if (m->file_reqchunk) {
-                    m->file_reqchunk(m, friendnumber, i, ft->transferred, 0, userdata);
+                    m->file_reqchunk(m, friendnumber, filenumber, ft->transferred, 0, userdata);
                 }
 
                 // Now it's inactive, we're no longer sending this.
                 ft->status = FILESTATUS_NONE;
-                --friendcon->num_sending_files;
+                --f->num_sending_files;
             }
 
+            if (ft->status == FILESTATUS_NONE) {
+                ft->queued = 0;
+                file_queue_remove(f, priority, i);
+                continue;
+            }
+
+            any_active_fts = true;
+
             // Decrease free slots by the number of slots this FT uses.
             *free_slots = max_s32(0, (int32_t) * free_slots - ft->slots_allocated);
+            ++i;
         }
+    }
 
-        if (ft->status == FILESTATUS_TRANSFERRING && ft->paused == FILE_PAUSE_NOT) {
-            if (max_speed_reached(m->net_crypto, friend_connection_crypt_connection_id(
-                                      m->fr_c, friendcon->friendcon_id))) {
-                *free_slots = 0;
-            }
+    return any_active_fts;
+}
 
-            if (*free_slots == 0) {
-                continue;
-            }
+/* Pieces a transfer of each priority class sends per turn. */
+static const uint32_t file_priority_quantum[FILE_PRIORITY_CLASSES] = {4, 2, 1};
 
-            if (ft->size == 0) {
-                /* Send 0 data to friend if file is 0 length. */
-                file_data(m, friendnumber, i, 0, nullptr, 0);
-                continue;
-            }
+/**
+ * Hand out free send queue slots to the outgoing file transfers of a friend
+ * by deficit round robin. Each round serves the priority classes from high
+ * to low, and every transfer of a class gets a turn of up to its quantum of
+ * pieces. A turn cut short by the send queue filling up is continued on the
+ * next call, so no transfer is favoured by its file number.
+ */
+static void schedule_file_transfers(Messenger *m, int32_t friendnumber, void *userdata, uint32_t free_slots)
+{
+    Friend *const f = &m->friendlist[friendnumber];
+    const int crypt_connection_id = friend_connection_crypt_connection_id(m->fr_c, f->friendcon_id);
+    bool progress = 1;
 
-            if (ft->size == ft->requested) {
-                // This file transfer is done.
-                continue;
-            }
+    while (free_slots > 0 && progress) {
+        progress = 0;
+
+        for (uint32_t priority = 0; priority < FILE_PRIORITY_CLASSES; ++priority) {
+            for (uint32_t turns = 0; turns < f->file_queue_length[priority]; ++turns) {
+                if (f->file_queue_next[priority] >= f->file_queue_length[priority]) {
+                    f->file_queue_next[priority] = 0;
+                }
 
-            // Allocate 1 slot to this file transfer.
-            ft->slots_allocated++;
+                const uint8_t filenumber = f->file_queue[priority][f->file_queue_next[priority]];
+                struct File_Transfers *const ft = &f->file_sending[filenumber];
 
-            const uint16_t length = min_u64(ft->size - ft->requested, MAX_FILE_DATA_SIZE);
-            const uint64_t position = ft->requested;
-            ft->requested += length;
+                if (!file_wants_piece(ft)) {
+                    ft->deficit = 0;
+                    ++f->file_queue_next[priority];
+                    continue;
+                }
 
-            if (m->file_reqchunk) {
-                m->file_reqchunk(m, friendnumber, i, position, length, userdata);
-            }
+                if (free_slots == 0 || max_speed_reached(m->net_crypto, crypt_connection_id)) {
+                    return;
+                }
 
-            // The allocated slot is no longer free.
-            --*free_slots;
-        }
+                if (ft->deficit == 0) {
+                    ft->deficit = file_priority_quantum[priority];
+                }
 
-        if (num == 0) {
-            continue;
+                while (ft->deficit > 0 && free_slots > 0 && file_wants_piece(ft)) {
+                    if (!send_file_piece(m, friendnumber, filenumber, userdata)) {
+                        return;
+                    }
+
+                    --ft->deficit;
+                    --free_slots;
+                    progress = 1;
+                }
+
+                if (ft->deficit > 0 && file_wants_piece(ft)) {
+                    /* Out of slots, the turn goes on next time. */
+                    return;
+                }
+
+                ft->deficit = 0;
+                ++f->file_queue_next[priority];
+            }
         }
     }
-
-    return any_active_fts;
 }
 
 static void do_reqchunk_filecb(Messenger *m, int32_t friendnumber, void *userdata)
@@ -1647,19 +2351,8 @@ static void do_reqchunk_filecb(Messenger *m, int32_t friendnumber, void *userdat
     // transfers might block other traffic for a long time.
     free_slots = max_s32(0, (int32_t)free_slots - MIN_SLOTS_FREE);
 
-    bool any_active_fts = true;
-    uint32_t loop_counter = 0;
-    // Maximum number of outer loops below. If the client doesn't send file
-    // chunks from within the chunk request callback handler, we never realise
-    // that the file transfer has finished and may end up in an infinite loop.
-    //
-    // TODO(zoff99): Fix this to exit the loop properly when we're done
-    // requesting all chunks for all file transfers.
-    const uint32_t MAX_FT_LOOPS = 4;
-
-    while (((free_slots > 0) || loop_counter == 0) && any_active_fts && (loop_counter < MAX_FT_LOOPS)) {
-        any_active_fts = do_all_filetransfers(m, friendnumber, userdata, &free_slots);
-        loop_counter++;
+    if (update_file_transfers(m, friendnumber, userdata, &free_slots)) {
+        schedule_file_transfers(m, friendnumber, userdata, free_slots);
     }
 }
 
@@ -1671,6 +2364,9 @@ static void break_files(const Messenger *m, int32_t friendnumber)
 {
     // TODO(irungentoo): Inform the client which file transfers get killed with a callback?
     for (uint32_t i = 0; i < MAX_CONCURRENT_FILE_PIPES; ++i) {
+        keep_file_resume(&m->friendlist[friendnumber], &m->friendlist[friendnumber].file_sending[i]);
+        keep_file_resume(&m->friendlist[friendnumber], &m->friendlist[friendnumber].file_receiving[i]);
+
         if (m->friendlist[friendnumber].file_sending[i].status != FILESTATUS_NONE) {
             m->friendlist[friendnumber].file_sending[i].status = FILESTATUS_NONE;
         }
@@ -1889,20 +2585,28 @@ int m_callback_rtp_packet(Messenger *m, int32_t friendnumber, uint8_t byte, int
 
 
 int m_send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length)
+{
+    return m_send_custom_lossy_packet_split(m, friendnumber, nullptr, 0, data, length);
+}
+
+int m_send_custom_lossy_packet_split(const Messenger *m, int32_t friendnumber, const uint8_t *header,
+                                     uint32_t header_length, const uint8_t *data, uint32_t length)
 {
     if (friend_not_valid(m, friendnumber)) {
         return -1;
     }
 
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (length > MAX_CRYPTO_DATA_SIZE || header_length > MAX_CRYPTO_DATA_SIZE - length || header_length + length == 0) {
         return -2;
     }
 
-    if (data[0] < PACKET_ID_LOSSY_RANGE_START) {
+    const uint8_t packet_id = header_length ? header[0] : data[0];
+
+    if (packet_id < PACKET_ID_LOSSY_RANGE_START) {
         return -3;
     }
 
-    if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
+    if (packet_id >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
         return -3;
     }
 
@@ -1910,8 +2614,8 @@ int m_send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const u
         return -4;
     }
 
-    if (send_lossy_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                               m->friendlist[friendnumber].friendcon_id), data, length) == -1) {
+    if (send_lossy_cryptpacket_split(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                     m->friendlist[friendnumber].friendcon_id), header, header_length, data, length) == -1) {
         return -5;
     }
 
@@ -2032,6 +2736,8 @@ Messenger *new_messenger(Messenger_Options *options, unsigned int *error)
 
     if (options->udp_disabled) {
         m->net = new_networking_no_udp(log);
+    } else if (options->net_backend) {
+        m->net = new_networking_backend(log, options->net_backend);
     } else {
         IP ip;
         ip_init(&ip, options->ipv6enabled);
@@ -2151,11 +2857,13 @@ void kill_messenger(Messenger *m)
 
     for (i = 0; i < m->numfriends; ++i) {
         clear_receipts(m, i);
+        clear_file_resume(&m->friendlist[i]);
     }
 
     logger_kill(m->log);
     free(m->friendlist);
     friendreq_kill(m->fr);
+    free(m->journal);
     free(m);
 }
 
@@ -2383,8 +3091,19 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
             ft->size = filesize;
             ft->transferred = 0;
             ft->paused = FILE_PAUSE_NOT;
+            ft->direct = FILE_DIRECT_NONE;
             memcpy(ft->id, data + 1 + sizeof(uint32_t) + sizeof(uint64_t), FILE_ID_LENGTH);
 
+            free_file_resume(ft->resume);
+            ft->resume = m->file_resume ? take_file_resume(&m->friendlist[i], 1, ft->id, filesize) : nullptr;
+
+            if (ft->resume) {
+                resume_file_receiving(m, i, filenumber, userdata);
+                break;
+            }
+
+            ft->resume = new_file_resume(m, 1, file_type, filesize, ft->id, nullptr, 0);
+
             VLA(uint8_t, filename_terminated, filename_length + 1);
             uint8_t *filename = nullptr;
 
@@ -2472,10 +3191,24 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
                 file_data_length = ft->size - ft->transferred;
             }
 
-            if (m->file_filedata) {
+            if (ft->direct != FILE_DIRECT_NONE && file_data_length) {
+                if (ft->direct == FILE_DIRECT_BUFFER) {
+                    memcpy(ft->buffer + position, file_data, file_data_length);
+                } else if (write_file_at(ft->fd, file_data, file_data_length, position) == -1) {
+                    LOGGER_WARNING(m->log, "writing file %u from friend %d failed, cancelling it", filenumber, i);
+                    file_control(m, i, real_filenumber, FILECONTROL_KILL);
+
+                    if (m->file_filecontrol) {
+                        (*m->file_filecontrol)(m, i, real_filenumber, FILECONTROL_KILL, userdata);
+                    }
+
+                    break;
+                }
+            } else if (m->file_filedata) {
                 (*m->file_filedata)(m, i, real_filenumber, position, file_data, file_data_length, userdata);
             }
 
+            hash_received_file_data(ft, file_data, file_data_length);
             ft->transferred += file_data_length;
 
             if (file_data_length && (ft->transferred >= ft->size || file_data_length != MAX_FILE_DATA_SIZE)) {
@@ -2518,6 +3251,45 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
     return 0;
 }
 
+/* Friend connections register the friend with the onion and DHT modules, which
+ * takes a while for thousands of friends. Friends loaded from savedata get
+ * theirs in batches over the first iterations instead of all inside tox_new().
+ */
+#define FRIEND_ACTIVATIONS_PER_ITERATION 64
+
+static void activate_deferred_friends(Messenger *m)
+{
+    uint32_t activated = 0;
+    uint32_t n;
+
+    for (n = 0; n < m->numfriends && m->num_deferred_friends != 0
+            && activated < FRIEND_ACTIVATIONS_PER_ITERATION; ++n) {
+        if (m->deferred_friends_index >= m->numfriends) {
+            m->deferred_friends_index = 0;
+        }
+
+        const uint32_t i = m->deferred_friends_index;
+        Friend *f = &m->friendlist[i];
+
+        if (f->status != NOFRIEND && f->connection_deferred) {
+            const int friendcon_id = new_friend_connection(m->fr_c, f->real_pk);
+
+            if (friendcon_id == -1) {
+                /* Try again on the next iteration. */
+                return;
+            }
+
+            f->friendcon_id = friendcon_id;
+            f->connection_deferred = 0;
+            --m->num_deferred_friends;
+            set_friend_connection_callbacks(m, i);
+            ++activated;
+        }
+
+        ++m->deferred_friends_index;
+    }
+}
+
 static void do_friends(Messenger *m, void *userdata)
 {
     uint32_t i;
@@ -2669,9 +3441,11 @@ void do_messenger(Messenger *m, void *userdata)
 
     do_net_crypto(m->net_crypto, userdata);
     do_onion_client(m->onion_c);
+    activate_deferred_friends(m);
     do_friend_connections(m->fr_c, userdata);
     do_friends(m, userdata);
     connection_status_cb(m, userdata);
+    journal_nodes(m);
 
     if (unix_time() > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
         m->lastdump = unix_time();
@@ -2783,22 +3557,6 @@ void do_messenger(Messenger *m, void *userdata)
     }
 }
 
-/* new messenger format for load/save, more robust and forward compatible */
-
-#define MESSENGER_STATE_COOKIE_GLOBAL 0x15ed1b1f
-
-#define MESSENGER_STATE_COOKIE_TYPE      0x01ce
-#define MESSENGER_STATE_TYPE_NOSPAMKEYS    1
-#define MESSENGER_STATE_TYPE_DHT           2
-#define MESSENGER_STATE_TYPE_FRIENDS       3
-#define MESSENGER_STATE_TYPE_NAME          4
-#define MESSENGER_STATE_TYPE_STATUSMESSAGE 5
-#define MESSENGER_STATE_TYPE_STATUS        6
-#define MESSENGER_STATE_TYPE_TCP_RELAY     10
-#define MESSENGER_STATE_TYPE_PATH_NODE     11
-#define MESSENGER_STATE_TYPE_CONFERENCES   100
-#define MESSENGER_STATE_TYPE_END           255
-
 #define SAVED_FRIEND_REQUEST_SIZE 1024
 #define NUM_SAVED_PATH_NODES 8
 
@@ -2883,6 +3641,33 @@ static uint8_t *friend_save(const struct SAVED_FRIEND *temp, uint8_t *data)
     return data;
 }
 
+static void saved_friend_from(const Friend *f, struct SAVED_FRIEND *temp)
+{
+    temp->status = f->status;
+    memcpy(temp->real_pk, f->real_pk, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (temp->status < 3) {
+        const size_t friendrequest_length =
+            MIN(f->info_size,
+                MIN(SAVED_FRIEND_REQUEST_SIZE, MAX_FRIEND_REQUEST_DATA_SIZE));
+        memcpy(temp->info, f->info, friendrequest_length);
+
+        temp->info_size = net_htons(f->info_size);
+        temp->friendrequest_nospam = f->friendrequest_nospam;
+    } else {
+        memcpy(temp->name, f->name, f->name_length);
+        temp->name_length = net_htons(f->name_length);
+        memcpy(temp->statusmessage, f->statusmessage, f->statusmessage_length);
+        temp->statusmessage_length = net_htons(f->statusmessage_length);
+        temp->userstatus = f->userstatus;
+
+        uint8_t last_seen_time[sizeof(uint64_t)];
+        memcpy(last_seen_time, &f->last_seen_time, sizeof(uint64_t));
+        host_to_net(last_seen_time, sizeof(uint64_t));
+        memcpy(&temp->last_seen_time, last_seen_time, sizeof(uint64_t));
+    }
+}
+
 static uint32_t friends_list_save(const Messenger *m, uint8_t *data)
 {
     uint32_t i;
@@ -2892,29 +3677,7 @@ static uint32_t friends_list_save(const Messenger *m, uint8_t *data)
     for (i = 0; i < m->numfriends; i++) {
         if (m->friendlist[i].status > 0) {
             struct SAVED_FRIEND temp = { 0 };
-            temp.status = m->friendlist[i].status;
-            memcpy(temp.real_pk, m->friendlist[i].real_pk, CRYPTO_PUBLIC_KEY_SIZE);
-
-            if (temp.status < 3) {
-                const size_t friendrequest_length =
-                    MIN(m->friendlist[i].info_size,
-                        MIN(SAVED_FRIEND_REQUEST_SIZE, MAX_FRIEND_REQUEST_DATA_SIZE));
-                memcpy(temp.info, m->friendlist[i].info, friendrequest_length);
-
-                temp.info_size = net_htons(m->friendlist[i].info_size);
-                temp.friendrequest_nospam = m->friendlist[i].friendrequest_nospam;
-            } else {
-                memcpy(temp.name, m->friendlist[i].name, m->friendlist[i].name_length);
-                temp.name_length = net_htons(m->friendlist[i].name_length);
-                memcpy(temp.statusmessage, m->friendlist[i].statusmessage, m->friendlist[i].statusmessage_length);
-                temp.statusmessage_length = net_htons(m->friendlist[i].statusmessage_length);
-                temp.userstatus = m->friendlist[i].userstatus;
-
-                uint8_t last_seen_time[sizeof(uint64_t)];
-                memcpy(last_seen_time, &m->friendlist[i].last_seen_time, sizeof(uint64_t));
-                host_to_net(last_seen_time, sizeof(uint64_t));
-                memcpy(&temp.last_seen_time, last_seen_time, sizeof(uint64_t));
-            }
+            saved_friend_from(&m->friendlist[i], &temp);
 
             uint8_t *next_data = friend_save(&temp, cur_data);
             assert(next_data - cur_data == friend_size());
@@ -2956,10 +3719,113 @@ static const uint8_t *friend_load(struct SAVED_FRIEND *temp, const uint8_t *data
     VALUE_MEMBER(friendrequest_nospam);
     VALUE_MEMBER(last_seen_time);
 
-#undef VALUE_MEMBER
-#undef ARRAY_MEMBER
+#undef VALUE_MEMBER
+#undef ARRAY_MEMBER
+
+    return data;
+}
+
+/* Hash table from public keys to friend numbers, so that loading a friend
+ * list doesn't scan the friend list once per saved friend.
+ */
+typedef struct Friend_Index {
+    int32_t *slots; /* friend numbers, -1 if the slot is empty */
+    uint32_t mask;
+} Friend_Index;
+
+/* Create an index of the friends of m with room for num more.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int friend_index_init(Friend_Index *index, const Messenger *m, uint32_t num)
+{
+    const uint64_t max = (uint64_t)m->numfriends + num;
+    uint32_t size = 16;
+
+    while (size < max * 2) {
+        if (size >= (1U << 30)) {
+            return -1;
+        }
+
+        size *= 2;
+    }
+
+    index->slots = (int32_t *)malloc(size * sizeof(int32_t));
+
+    if (index->slots == nullptr) {
+        return -1;
+    }
+
+    memset(index->slots, 0xff, size * sizeof(int32_t));
+    index->mask = size - 1;
+    return 0;
+}
+
+/* return the slot of real_pk in index, or the empty slot where it goes.
+ */
+static uint32_t friend_index_slot(const Friend_Index *index, const Messenger *m, const uint8_t *real_pk)
+{
+    uint32_t hash;
+    memcpy(&hash, real_pk, sizeof(hash));
+    uint32_t slot = hash & index->mask;
+
+    while (index->slots[slot] != -1 && !id_equal(m->friendlist[index->slots[slot]].real_pk, real_pk)) {
+        slot = (slot + 1) & index->mask;
+    }
+
+    return slot;
+}
+
+/* Add the saved friend, or update it if it is already in the friend list.
+ * index is used to find it if not NULL, and the friend is added to it.
+ */
+static void friend_load_saved(Messenger *m, const struct SAVED_FRIEND *temp, Friend_Index *index)
+{
+    uint32_t slot = 0;
+
+    if (index != nullptr) {
+        slot = friend_index_slot(index, m, temp->real_pk);
+    }
+
+    if (temp->status >= 3) {
+        int fnum = index ? index->slots[slot] : getfriend_id(m, temp->real_pk);
 
-    return data;
+        if (fnum == -1) {
+            fnum = add_friend_norequest(m, temp->real_pk);
+
+            if (fnum < 0) {
+                return;
+            }
+
+            if (index != nullptr) {
+                index->slots[slot] = fnum;
+            }
+        } else if (m->friendlist[fnum].status < FRIEND_CONFIRMED) {
+            m->friendlist[fnum].status = FRIEND_CONFIRMED;
+        }
+
+        setfriendname(m, fnum, temp->name, net_ntohs(temp->name_length));
+        set_friend_statusmessage(m, fnum, temp->statusmessage, net_ntohs(temp->statusmessage_length));
+        set_friend_userstatus(m, fnum, temp->userstatus);
+        uint8_t last_seen_time[sizeof(uint64_t)];
+        memcpy(last_seen_time, &temp->last_seen_time, sizeof(uint64_t));
+        net_to_host(last_seen_time, sizeof(uint64_t));
+        memcpy(&m->friendlist[fnum].last_seen_time, last_seen_time, sizeof(uint64_t));
+    } else if (temp->status != 0) {
+        /* TODO(irungentoo): This is not a good way to do this. */
+        uint8_t address[FRIEND_ADDRESS_SIZE];
+        id_copy(address, temp->real_pk);
+        memcpy(address + CRYPTO_PUBLIC_KEY_SIZE, &temp->friendrequest_nospam, sizeof(uint32_t));
+        uint16_t checksum = address_checksum(address, FRIEND_ADDRESS_SIZE - sizeof(checksum));
+        memcpy(address + CRYPTO_PUBLIC_KEY_SIZE + sizeof(uint32_t), &checksum, sizeof(checksum));
+        const int32_t fid = index ? index->slots[slot] : getfriend_id(m, temp->real_pk);
+        const int32_t fnum = add_friend(m, address, temp->info, net_ntohs(temp->info_size), fid);
+
+        if (index != nullptr && fnum >= 0) {
+            index->slots[slot] = fnum;
+        }
+    }
 }
 
 static int friends_list_load(Messenger *m, const uint8_t *data, uint32_t length)
@@ -2972,6 +3838,20 @@ static int friends_list_load(Messenger *m, const uint8_t *data, uint32_t length)
     uint32_t i;
     const uint8_t *cur_data = data;
 
+    /* Without the room or the index, friends are added one by one as usual. */
+    if (m->friendlist_size < m->numfriends + num) {
+        realloc_friendlist(m, m->numfriends + num);
+    }
+
+    Friend_Index index;
+    Friend_Index *const index_ptr = friend_index_init(&index, m, num) == 0 ? &index : nullptr;
+
+    for (i = 0; i < m->numfriends && index_ptr; ++i) {
+        if (m->friendlist[i].status != NOFRIEND) {
+            index.slots[friend_index_slot(&index, m, m->friendlist[i].real_pk)] = i;
+        }
+    }
+
     for (i = 0; i < num; ++i) {
         struct SAVED_FRIEND temp = { 0 };
         const uint8_t *next_data = friend_load(&temp, cur_data);
@@ -2981,29 +3861,11 @@ static int friends_list_load(Messenger *m, const uint8_t *data, uint32_t length)
 #endif
         cur_data = next_data;
 
-        if (temp.status >= 3) {
-            int fnum = m_addfriend_norequest(m, temp.real_pk);
-
-            if (fnum < 0) {
-                continue;
-            }
+        friend_load_saved(m, &temp, index_ptr);
+    }
 
-            setfriendname(m, fnum, temp.name, net_ntohs(temp.name_length));
-            set_friend_statusmessage(m, fnum, temp.statusmessage, net_ntohs(temp.statusmessage_length));
-            set_friend_userstatus(m, fnum, temp.userstatus);
-            uint8_t last_seen_time[sizeof(uint64_t)];
-            memcpy(last_seen_time, &temp.last_seen_time, sizeof(uint64_t));
-            net_to_host(last_seen_time, sizeof(uint64_t));
-            memcpy(&m->friendlist[fnum].last_seen_time, last_seen_time, sizeof(uint64_t));
-        } else if (temp.status != 0) {
-            /* TODO(irungentoo): This is not a good way to do this. */
-            uint8_t address[FRIEND_ADDRESS_SIZE];
-            id_copy(address, temp.real_pk);
-            memcpy(address + CRYPTO_PUBLIC_KEY_SIZE, &temp.friendrequest_nospam, sizeof(uint32_t));
-            uint16_t checksum = address_checksum(address, FRIEND_ADDRESS_SIZE - sizeof(checksum));
-            memcpy(address + CRYPTO_PUBLIC_KEY_SIZE + sizeof(uint32_t), &checksum, sizeof(checksum));
-            m_addfriend(m, address, temp.info, net_ntohs(temp.info_size));
-        }
+    if (index_ptr) {
+        free(index.slots);
     }
 
     return num;
@@ -3012,6 +3874,177 @@ static int friends_list_load(Messenger *m, const uint8_t *data, uint32_t length)
 uint32_t saved_conferences_size(const Messenger *m);
 void conferences_save(const Messenger *m, uint8_t *data);
 int conferences_load(Messenger *m, const uint8_t *data, uint32_t length);
+int conference_journal_load(Messenger *m, const uint8_t *data, uint32_t length);
+int conference_journal_remove(Messenger *m, const uint8_t *data, uint32_t length);
+
+/* Saved resume record: [friend real_pk][send_receive (1)][file id][file type (4)][file size (8)][position (8)]
+ * [filename length (2)][filename][number of hashes (4)][hashes (4 each)]
+ */
+#define FILE_RESUME_SAVED_SIZE (CRYPTO_PUBLIC_KEY_SIZE + 1 + FILE_ID_LENGTH + sizeof(uint32_t) + sizeof(uint64_t) * 2 \
+                                + sizeof(uint16_t) + sizeof(uint32_t))
+
+/* Write one resume record to *data and move it past the record, if *data is
+ * not NULL.
+ *
+ * return the size of the saved record.
+ */
+static uint32_t file_resume_save_one(uint8_t **data, const uint8_t *real_pk, const struct File_Resume *resume,
+                                     uint64_t position)
+{
+    const uint32_t size = FILE_RESUME_SAVED_SIZE + resume->filename_length + resume->num_hashes * sizeof(uint32_t);
+
+    if (*data == nullptr) {
+        return size;
+    }
+
+    uint8_t *cur = *data;
+    memcpy(cur, real_pk, CRYPTO_PUBLIC_KEY_SIZE);
+    cur += CRYPTO_PUBLIC_KEY_SIZE;
+    *cur = resume->send_receive;
+    ++cur;
+    memcpy(cur, resume->id, FILE_ID_LENGTH);
+    cur += FILE_ID_LENGTH;
+
+    const uint32_t file_type = net_htonl(resume->file_type);
+    memcpy(cur, &file_type, sizeof(file_type));
+    cur += sizeof(file_type);
+
+    uint64_t value = resume->size;
+    host_to_net((uint8_t *)&value, sizeof(value));
+    memcpy(cur, &value, sizeof(value));
+    cur += sizeof(value);
+
+    value = position;
+    host_to_net((uint8_t *)&value, sizeof(value));
+    memcpy(cur, &value, sizeof(value));
+    cur += sizeof(value);
+
+    const uint16_t filename_length = net_htons(resume->filename_length);
+    memcpy(cur, &filename_length, sizeof(filename_length));
+    cur += sizeof(filename_length);
+    memcpy(cur, resume->filename, resume->filename_length);
+    cur += resume->filename_length;
+
+    const uint32_t num_hashes = net_htonl(resume->num_hashes);
+    memcpy(cur, &num_hashes, sizeof(num_hashes));
+    cur += sizeof(num_hashes);
+
+    for (uint32_t i = 0; i < resume->num_hashes; ++i) {
+        const uint32_t hash = net_htonl(resume->hashes[i]);
+        memcpy(cur, &hash, sizeof(hash));
+        cur += sizeof(hash);
+    }
+
+    *data = cur;
+    return size;
+}
+
+/* Save the kept records and those of transfers running right now, so that
+ * they are resumed after a restart too. With data NULL, only the size is
+ * computed.
+ *
+ * return the size of the saved records.
+ */
+static uint32_t file_resume_save(const Messenger *m, uint8_t *data)
+{
+    uint32_t size = 0;
+
+    for (uint32_t i = 0; i < m->numfriends; ++i) {
+        const Friend *f = &m->friendlist[i];
+
+        if (f->status == NOFRIEND) {
+            continue;
+        }
+
+        for (uint32_t j = 0; j < f->num_file_resume; ++j) {
+            size += file_resume_save_one(&data, f->real_pk, f->file_resume[j], f->file_resume[j]->position);
+        }
+
+        for (uint32_t j = 0; j < MAX_CONCURRENT_FILE_PIPES; ++j) {
+            if (file_resumable(&f->file_sending[j])) {
+                size += file_resume_save_one(&data, f->real_pk, f->file_sending[j].resume, 0);
+            }
+
+            if (file_resumable(&f->file_receiving[j])) {
+                size += file_resume_save_one(&data, f->real_pk, f->file_receiving[j].resume,
+                                             f->file_receiving[j].transferred);
+            }
+        }
+    }
+
+    return size;
+}
+
+static int file_resume_load(Messenger *m, const uint8_t *data, uint32_t length)
+{
+    while (length >= FILE_RESUME_SAVED_SIZE) {
+        const uint8_t *cur = data + CRYPTO_PUBLIC_KEY_SIZE;
+        struct File_Resume temp = {{0}};
+
+        temp.send_receive = *cur;
+        ++cur;
+        memcpy(temp.id, cur, FILE_ID_LENGTH);
+        cur += FILE_ID_LENGTH;
+        memcpy(&temp.file_type, cur, sizeof(temp.file_type));
+        temp.file_type = net_ntohl(temp.file_type);
+        cur += sizeof(temp.file_type);
+        memcpy(&temp.size, cur, sizeof(temp.size));
+        net_to_host((uint8_t *)&temp.size, sizeof(temp.size));
+        cur += sizeof(temp.size);
+        memcpy(&temp.position, cur, sizeof(temp.position));
+        net_to_host((uint8_t *)&temp.position, sizeof(temp.position));
+        cur += sizeof(temp.position);
+        memcpy(&temp.filename_length, cur, sizeof(temp.filename_length));
+        temp.filename_length = net_ntohs(temp.filename_length);
+        cur += sizeof(temp.filename_length);
+
+        if (temp.filename_length > MAX_FILENAME_LENGTH
+                || length < FILE_RESUME_SAVED_SIZE + (uint32_t)temp.filename_length) {
+            return -1;
+        }
+
+        memcpy(temp.filename, cur, temp.filename_length);
+        cur += temp.filename_length;
+        memcpy(&temp.num_hashes, cur, sizeof(temp.num_hashes));
+        temp.num_hashes = net_ntohl(temp.num_hashes);
+        cur += sizeof(temp.num_hashes);
+
+        if (temp.num_hashes > FILE_RESUME_MAX_BLOCKS
+                || (length - FILE_RESUME_SAVED_SIZE - temp.filename_length) / sizeof(uint32_t) < temp.num_hashes) {
+            return -1;
+        }
+
+        const uint32_t record_size = FILE_RESUME_SAVED_SIZE + temp.filename_length + temp.num_hashes * sizeof(uint32_t);
+        const int32_t friendnumber = getfriend_id(m, data);
+
+        if (friendnumber != -1 && temp.size != 0 && temp.size != UINT64_MAX && temp.position <= temp.size
+                && temp.num_hashes <= resume_num_blocks(temp.size)) {
+            struct File_Resume *resume = (struct File_Resume *)malloc(sizeof(struct File_Resume));
+
+            if (resume) {
+                *resume = temp;
+                resume->hashes = (uint32_t *)calloc(resume_num_blocks(temp.size), sizeof(uint32_t));
+
+                if (resume->hashes) {
+                    for (uint32_t i = 0; i < temp.num_hashes; ++i) {
+                        memcpy(&resume->hashes[i], cur + i * sizeof(uint32_t), sizeof(uint32_t));
+                        resume->hashes[i] = net_ntohl(resume->hashes[i]);
+                    }
+                } else {
+                    resume->num_hashes = 0;
+                }
+
+                resume->block_hash = 1;
+                add_file_resume(&m->friendlist[friendnumber], resume);
+            }
+        }
+
+        data += record_size;
+        length -= record_size;
+    }
+
+    return length == 0 ? 0 : -1;
+}
 
 
 /*  return size of the messenger data (for saving) */
@@ -3028,6 +4061,7 @@ uint32_t messenger_size(const Messenger *m, bool save_friends)
              + sizesubhead + NUM_SAVED_TCP_RELAYS * packed_node_size(TCP_INET6) //TCP relays
              + sizesubhead + NUM_SAVED_PATH_NODES * packed_node_size(TCP_INET6) //saved path nodes
              + sizesubhead + saved_conferences_size(m)           // old group chats
+             + (save_friends ? (sizesubhead + file_resume_save(m, nullptr)) : 0)  // interrupted file transfers
              + sizesubhead;
 }
 
@@ -3128,6 +4162,14 @@ void messenger_save(const Messenger *m, uint8_t *data, bool save_friends)
     conferences_save(m, data);
     data += len;
 
+    if (save_friends) {
+        len = file_resume_save(m, nullptr);
+        type = MESSENGER_STATE_TYPE_FILE_RESUME;
+        data = messenger_save_subheader(data, len, type);
+        file_resume_save(m, data);
+        data += len;
+    }
+
     messenger_save_subheader(data, 0, MESSENGER_STATE_TYPE_END);
 }
 
@@ -3215,6 +4257,14 @@ static int messenger_load_state_callback(void *outer, const uint8_t *data, uint3
             break;
         }
 
+        case MESSENGER_STATE_TYPE_FILE_RESUME:
+            if (file_resume_load(m, data, length) != 0) {
+                /* The records before the damaged one are kept. */
+                LOGGER_WARNING(m->log, "Load state: damaged file resume records (len %u)\n", length);
+            }
+
+            break;
+
         case MESSENGER_STATE_TYPE_END: {
             if (length != 0) {
                 return -1;
@@ -3246,13 +4296,323 @@ int messenger_load(Messenger *m, const uint8_t *data, uint32_t length)
     lendian_to_host32(data32 + 1, data + sizeof(uint32_t));
 
     if (!data32[0] && (data32[1] == MESSENGER_STATE_COOKIE_GLOBAL)) {
-        return load_state(messenger_load_state_callback, m->log, m, data + cookie_len,
-                          length - cookie_len, MESSENGER_STATE_COOKIE_TYPE);
+        m->defer_friend_connections = 1;
+        const int ret = load_state(messenger_load_state_callback, m->log, m, data + cookie_len,
+                                   length - cookie_len, MESSENGER_STATE_COOKIE_TYPE);
+        m->defer_friend_connections = 0;
+        return ret;
     }
 
     return -1;
 }
 
+/* Savedata journal. */
+
+#define MESSENGER_JOURNAL_NODES_INTERVAL 600 // Seconds between journaling DHT, relay and path nodes.
+#define MESSENGER_JOURNAL_INITIAL_CAPACITY 1024
+#define MESSENGER_JOURNAL_MIN_COMPACT_SIZE (64 * 1024)
+
+int messenger_journal_append(Messenger *m, uint16_t type, const uint8_t *data, uint32_t length)
+{
+    if (!m->journal_enabled) {
+        return 0;
+    }
+
+    const uint32_t size_head = sizeof(uint32_t) * 2;
+
+    if (length > UINT32_MAX / 2 - size_head - m->journal_length) {
+        return -1;
+    }
+
+    const uint32_t record_length = size_head + length;
+
+    if (m->journal_capacity - m->journal_length < record_length) {
+        uint32_t capacity = m->journal_capacity ? m->journal_capacity : MESSENGER_JOURNAL_INITIAL_CAPACITY;
+
+        while (capacity - m->journal_length < record_length) {
+            capacity *= 2;
+        }
+
+        uint8_t *temp = (uint8_t *)realloc(m->journal, capacity);
+
+        if (temp == nullptr) {
+            LOGGER_ERROR(m->log, "Journal: out of memory, dropping record (len %u, type %u)", length, type);
+            return -1;
+        }
+
+        m->journal = temp;
+        m->journal_capacity = capacity;
+    }
+
+    uint8_t *dest = messenger_save_subheader(m->journal + m->journal_length, length, type);
+
+    if (length) {
+        memcpy(dest, data, length);
+    }
+
+    m->journal_length += record_length;
+    m->journal_total += record_length;
+    return 0;
+}
+
+static void journal_friend(Messenger *m, int32_t friendnumber, uint16_t type)
+{
+    if (!m->journal_enabled) {
+        return;
+    }
+
+    const Friend *f = &m->friendlist[friendnumber];
+
+    if (type == MESSENGER_JOURNAL_TYPE_FRIEND) {
+        struct SAVED_FRIEND temp = { 0 };
+        uint8_t entry[sizeof(struct SAVED_FRIEND)];
+        saved_friend_from(f, &temp);
+        const uint8_t *end = friend_save(&temp, entry);
+        assert(end - entry == friend_size());
+        messenger_journal_append(m, type, entry, end - entry);
+        return;
+    }
+
+    uint8_t data[CRYPTO_PUBLIC_KEY_SIZE + MAX_STATUSMESSAGE_LENGTH];
+    uint32_t length = CRYPTO_PUBLIC_KEY_SIZE;
+    id_copy(data, f->real_pk);
+
+    switch (type) {
+        case MESSENGER_JOURNAL_TYPE_FRIEND_NAME:
+            memcpy(data + length, f->name, f->name_length);
+            length += f->name_length;
+            break;
+
+        case MESSENGER_JOURNAL_TYPE_FRIEND_STATUSMESSAGE:
+            memcpy(data + length, f->statusmessage, f->statusmessage_length);
+            length += f->statusmessage_length;
+            break;
+
+        case MESSENGER_JOURNAL_TYPE_FRIEND_STATUS: {
+            data[length] = f->userstatus;
+            ++length;
+            memcpy(data + length, &f->last_seen_time, sizeof(uint64_t));
+            host_to_net(data + length, sizeof(uint64_t));
+            length += sizeof(uint64_t);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    messenger_journal_append(m, type, data, length);
+}
+
+static void journal_self(Messenger *m, uint16_t type)
+{
+    if (!m->journal_enabled) {
+        return;
+    }
+
+    switch (type) {
+        case MESSENGER_STATE_TYPE_NOSPAMKEYS: {
+            uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SECRET_KEY_SIZE];
+            const uint32_t nospam = get_nospam(m->fr);
+            memcpy(data, &nospam, sizeof(uint32_t));
+            save_keys(m->net_crypto, data + sizeof(uint32_t));
+            messenger_journal_append(m, type, data, sizeof(data));
+            crypto_memzero(data, sizeof(data));
+            break;
+        }
+
+        case MESSENGER_STATE_TYPE_NAME:
+            messenger_journal_append(m, type, m->name, m->name_length);
+            break;
+
+        case MESSENGER_STATE_TYPE_STATUSMESSAGE:
+            messenger_journal_append(m, type, m->statusmessage, m->statusmessage_length);
+            break;
+
+        case MESSENGER_STATE_TYPE_STATUS: {
+            const uint8_t status = m->userstatus;
+            messenger_journal_append(m, type, &status, 1);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+/* Node lists change all the time, so they are refreshed periodically instead of on every change. */
+static void journal_nodes(Messenger *m)
+{
+    if (!m->journal_enabled || !is_timeout(m->journal_last_nodes, MESSENGER_JOURNAL_NODES_INTERVAL)) {
+        return;
+    }
+
+    m->journal_last_nodes = unix_time();
+
+    const uint32_t dht_length = DHT_size(m->dht);
+    uint8_t *dht_data = (uint8_t *)malloc(dht_length);
+
+    if (dht_data) {
+        DHT_save(m->dht, dht_data);
+        messenger_journal_append(m, MESSENGER_STATE_TYPE_DHT, dht_data, dht_length);
+        free(dht_data);
+    }
+
+    Node_format relays[NUM_SAVED_TCP_RELAYS];
+    uint8_t data[NUM_SAVED_TCP_RELAYS * (SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE)];
+
+    unsigned int num = copy_connected_tcp_relays(m->net_crypto, relays, NUM_SAVED_TCP_RELAYS);
+    int l = pack_nodes(data, sizeof(data), relays, num);
+
+    if (l > 0) {
+        messenger_journal_append(m, MESSENGER_STATE_TYPE_TCP_RELAY, data, l);
+    }
+
+    Node_format nodes[NUM_SAVED_PATH_NODES];
+    uint8_t path_data[NUM_SAVED_PATH_NODES * (SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE)];
+
+    num = onion_backup_nodes(m->onion_c, nodes, NUM_SAVED_PATH_NODES);
+    l = pack_nodes(path_data, sizeof(path_data), nodes, num);
+
+    if (l > 0) {
+        messenger_journal_append(m, MESSENGER_STATE_TYPE_PATH_NODE, path_data, l);
+    }
+}
+
+void messenger_journal_nospam_keys(Messenger *m)
+{
+    journal_self(m, MESSENGER_STATE_TYPE_NOSPAMKEYS);
+}
+
+void messenger_journal_enable(Messenger *m, bool enabled)
+{
+    if (enabled && !m->journal_enabled) {
+        m->journal_last_nodes = unix_time();
+    }
+
+    m->journal_enabled = enabled;
+
+    if (!enabled) {
+        free(m->journal);
+        m->journal = nullptr;
+        m->journal_length = 0;
+        m->journal_capacity = 0;
+    }
+}
+
+uint32_t messenger_journal_size(const Messenger *m)
+{
+    return m->journal_length;
+}
+
+void messenger_journal_take(Messenger *m, uint8_t *data)
+{
+    if (m->journal_length) {
+        memcpy(data, m->journal, m->journal_length);
+    }
+
+    m->journal_length = 0;
+}
+
+bool messenger_journal_needs_compaction(const Messenger *m)
+{
+    if (m->journal_total < MESSENGER_JOURNAL_MIN_COMPACT_SIZE) {
+        return 0;
+    }
+
+    /* Replaying a journal larger than half a snapshot costs more than writing the snapshot. */
+    return m->journal_total > messenger_size(m, 1) / 2;
+}
+
+void messenger_journal_compacted(Messenger *m)
+{
+    m->journal_length = 0;
+    m->journal_total = 0;
+}
+
+static int messenger_journal_load_callback(void *outer, const uint8_t *data, uint32_t length, uint16_t type)
+{
+    Messenger *m = (Messenger *)outer;
+
+    switch (type) {
+        case MESSENGER_JOURNAL_TYPE_FRIEND: {
+            if (length != friend_size()) {
+                return -1;
+            }
+
+            struct SAVED_FRIEND temp = { 0 };
+            friend_load(&temp, data);
+            friend_load_saved(m, &temp, nullptr);
+            break;
+        }
+
+        case MESSENGER_JOURNAL_TYPE_FRIEND_REMOVED:
+        case MESSENGER_JOURNAL_TYPE_FRIEND_NAME:
+        case MESSENGER_JOURNAL_TYPE_FRIEND_STATUSMESSAGE:
+        case MESSENGER_JOURNAL_TYPE_FRIEND_STATUS: {
+            if (length < CRYPTO_PUBLIC_KEY_SIZE) {
+                return -1;
+            }
+
+            const int32_t friendnumber = getfriend_id(m, data);
+            const uint8_t *value = data + CRYPTO_PUBLIC_KEY_SIZE;
+            const uint32_t value_length = length - CRYPTO_PUBLIC_KEY_SIZE;
+
+            if (friendnumber == -1) {
+                /* Removed later on or saved without friends, nothing to update. */
+                break;
+            }
+
+            if (type == MESSENGER_JOURNAL_TYPE_FRIEND_REMOVED) {
+                m_delfriend(m, friendnumber);
+            } else if (type == MESSENGER_JOURNAL_TYPE_FRIEND_NAME) {
+                setfriendname(m, friendnumber, value, value_length);
+            } else if (type == MESSENGER_JOURNAL_TYPE_FRIEND_STATUSMESSAGE) {
+                set_friend_statusmessage(m, friendnumber, value, value_length);
+            } else if (value_length == 1 + sizeof(uint64_t)) {
+                set_friend_userstatus(m, friendnumber, value[0]);
+                uint8_t last_seen_time[sizeof(uint64_t)];
+                memcpy(last_seen_time, value + 1, sizeof(uint64_t));
+                net_to_host(last_seen_time, sizeof(uint64_t));
+                memcpy(&m->friendlist[friendnumber].last_seen_time, last_seen_time, sizeof(uint64_t));
+            }
+
+            break;
+        }
+
+        case MESSENGER_JOURNAL_TYPE_CONFERENCE:
+            conference_journal_load(m, data, length);
+            break;
+
+        case MESSENGER_JOURNAL_TYPE_CONFERENCE_REMOVED:
+            conference_journal_remove(m, data, length);
+            break;
+
+        case MESSENGER_STATE_TYPE_END:
+            /* Not part of a journal. */
+            return -1;
+
+        default:
+            return messenger_load_state_callback(outer, data, length, type);
+    }
+
+    return 0;
+}
+
+int messenger_journal_load(Messenger *m, const uint8_t *data, uint32_t length)
+{
+    /* Replaying must not record the same changes again. */
+    const bool enabled = m->journal_enabled;
+    m->journal_enabled = 0;
+    m->defer_friend_connections = 1;
+
+    const int ret = load_state(messenger_journal_load_callback, m->log, m, data, length, MESSENGER_STATE_COOKIE_TYPE);
+
+    m->defer_friend_connections = 0;
+    m->journal_enabled = enabled;
+    return ret;
+}
+
 /* Return the number of friends in the instance m.
  * You should use this to determine how much memory to allocate
  * for copy_friendlist. */
@@ -86,13 +86,15 @@ typedef struct {
 
     logger_cb *log_callback;
     void *log_user_data;
+
+    /* If set, UDP packets go through this backend instead of a socket. */
+    const Net_Backend *net_backend;
 } Messenger_Options;
 
 
-struct Receipts {
+struct Receipt {
     uint32_t packet_num;
     uint32_t msg_id;
-    struct Receipts *next;
 };
 
 /* Status definitions. */
@@ -141,6 +143,37 @@ typedef enum {
 USERSTATUS;
 
 #define FILE_ID_LENGTH 32
+#define MAX_FILENAME_LENGTH 255
+
+/* Interrupted transfers are resumed from a multiple of the block size. Blocks
+ * of received data are hashed so that data already written can be checked
+ * before resuming.
+ */
+#define FILE_RESUME_BLOCK_SIZE (1024 * 1024)
+#define FILE_RESUME_MAX_BLOCKS 4096
+
+/* Interrupted transfers kept per friend. */
+#define MAX_FILE_RESUME_RECORDS 32
+
+/* What is needed to resume a transfer: sending, to offer it again with the
+ * same file id; receiving, to seek past the data already received.
+ */
+struct File_Resume {
+    uint8_t id[FILE_ID_LENGTH];
+    uint8_t send_receive; /* 0 if sending, 1 if receiving. */
+    uint32_t file_type;
+    uint64_t size;
+    uint64_t position; /* receiving: bytes received */
+    uint8_t filename[MAX_FILENAME_LENGTH];
+    uint16_t filename_length;
+
+    /* Receiving: hashes of the complete blocks, and the running hash of the
+     * current one, which covers the data up to hashed. */
+    uint32_t *hashes;
+    uint32_t num_hashes;
+    uint32_t block_hash;
+    uint64_t hashed;
+};
 
 struct File_Transfers {
     uint64_t size;
@@ -151,7 +184,39 @@ struct File_Transfers {
     uint64_t requested; /* total data requested by the request chunk callback */
     unsigned int slots_allocated; /* number of slots allocated to this transfer. */
     uint8_t id[FILE_ID_LENGTH];
+
+    /* Where the data is read from (sending) or written to (receiving) when the
+     * client handed the transfer over with file_set_buffer() or file_set_fd().
+     */
+    uint8_t direct;
+    uint8_t *buffer;
+    int fd;
+
+    /* Set while the file resume callback is registered and the transfer can be resumed. */
+    struct File_Resume *resume;
+
+    /* Sending: scheduling state, see file_set_priority(). */
+    uint8_t priority;
+    bool queued;
+    uint32_t deficit;
 };
+/* Priority classes of outgoing transfers. Every round, the send queue slots
+ * go to the higher classes first, and their transfers send more pieces per
+ * turn (4, 2 and 1).
+ */
+enum {
+    FILE_PRIORITY_HIGH,
+    FILE_PRIORITY_NORMAL,
+    FILE_PRIORITY_LOW
+};
+#define FILE_PRIORITY_CLASSES 3
+
+enum {
+    FILE_DIRECT_NONE,
+    FILE_DIRECT_BUFFER,
+    FILE_DIRECT_FD
+};
+
 enum {
     FILESTATUS_NONE,
     FILESTATUS_NOT_ACCEPTED,
@@ -207,17 +272,30 @@ typedef struct {
     uint32_t friendrequest_nospam; // The nospam number used in the friend request.
     uint64_t last_seen_time;
     uint8_t last_connection_udp_tcp;
+    bool connection_deferred; // Loaded from savedata, the friend connection is created later by do_messenger().
     struct File_Transfers file_sending[MAX_CONCURRENT_FILE_PIPES];
     uint32_t num_sending_files;
     struct File_Transfers file_receiving[MAX_CONCURRENT_FILE_PIPES];
 
+    /* File numbers of the outgoing transfers per priority class, and the next one to get a turn. */
+    uint8_t file_queue[FILE_PRIORITY_CLASSES][MAX_CONCURRENT_FILE_PIPES];
+    uint16_t file_queue_length[FILE_PRIORITY_CLASSES];
+    uint16_t file_queue_next[FILE_PRIORITY_CLASSES];
+    struct File_Resume *file_resume[MAX_FILE_RESUME_RECORDS]; // Interrupted transfers, oldest first.
+    uint32_t num_file_resume;
+
     struct {
         int (*function)(Messenger *m, uint32_t friendnumber, const uint8_t *data, uint16_t len, void *object);
         void *object;
     } lossy_rtp_packethandlers[PACKET_LOSSY_AV_RESERVED];
 
-    struct Receipts *receipts_start;
-    struct Receipts *receipts_end;
+    /* Read receipts waiting for their packet to be acknowledged, in sending
+     * order. A ring of receipts_size (a power of 2) entries; start and end
+     * count up and are masked to index it. */
+    struct Receipt *receipts;
+    uint32_t receipts_size;
+    uint32_t receipts_start;
+    uint32_t receipts_end;
 } Friend;
 
 struct Messenger {
@@ -245,6 +323,8 @@ struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    uint32_t friendlist_size; // Allocated entries of friendlist, at least numfriends.
+    uint32_t friendlist_free; // NOFRIEND entries below numfriends.
 
     time_t lastdump;
 
@@ -253,6 +333,10 @@ struct Messenger {
     uint8_t has_added_relays; // If the first connection has occurred in do_messenger
     Node_format loaded_relays[NUM_SAVED_TCP_RELAYS]; // Relays loaded from config
 
+    bool defer_friend_connections; // Set while loading, see activate_deferred_friends().
+    uint32_t num_deferred_friends;
+    uint32_t deferred_friends_index;
+
     void (*friend_message)(struct Messenger *m, uint32_t, unsigned int, const uint8_t *, size_t, void *);
     void (*friend_namechange)(struct Messenger *m, uint32_t, const uint8_t *, size_t, void *);
     void (*friend_statusmessagechange)(struct Messenger *m, uint32_t, const uint8_t *, size_t, void *);
@@ -272,6 +356,7 @@ struct Messenger {
     void (*file_filecontrol)(struct Messenger *m, uint32_t, uint32_t, unsigned int, void *);
     void (*file_filedata)(struct Messenger *m, uint32_t, uint32_t, uint64_t, const uint8_t *, size_t, void *);
     void (*file_reqchunk)(struct Messenger *m, uint32_t, uint32_t, uint64_t, size_t, void *);
+    void (*file_resume)(struct Messenger *m, uint32_t, uint32_t, uint64_t, void *);
 
     void (*msi_packet)(struct Messenger *m, uint32_t, const uint8_t *, uint16_t, void *);
     void *msi_packet_userdata;
@@ -282,6 +367,14 @@ struct Messenger {
     void (*core_connection_change)(struct Messenger *m, unsigned int, void *);
     unsigned int last_connection_status;
 
+    /* Savedata journal, see messenger_journal_enable(). */
+    bool journal_enabled;
+    uint8_t *journal;
+    uint32_t journal_length;
+    uint32_t journal_capacity;
+    uint64_t journal_total; // Bytes of journal records produced since the last compaction.
+    uint64_t journal_last_nodes; // Time at which DHT, relay and path nodes were last journaled.
+
     Messenger_Options options;
 };
 
@@ -599,6 +692,23 @@ void callback_file_data(Messenger *m, void (*function)(Messenger *m, uint32_t, u
  */
 void callback_file_reqchunk(Messenger *m, void (*function)(Messenger *m, uint32_t, uint32_t, uint64_t, size_t, void *));
 
+/* Set the callback for resumed file transfers. While it is set, transfers
+ * interrupted by the friend going offline are kept, and saved by
+ * messenger_save(). When the friend comes back, outgoing transfers are offered
+ * again with the same file id and incoming ones offered again are accepted
+ * from the position reached, instead of going through the file send request
+ * callback.
+ *
+ * The callback is called before the transfer is accepted, so that the client
+ * can set the data source or destination (file_set_buffer(), file_set_fd()).
+ * The ones set before the interruption are not kept. Transfers without one
+ * go through the chunk request and file data callbacks. Position is the
+ * number of bytes already received, 0 when sending.
+ *
+ *  Function(Messenger *m, uint32_t friendnumber, uint32_t filenumber, uint64_t position, void *userdata)
+ */
+void callback_file_resume(Messenger *m, void (*function)(Messenger *m, uint32_t, uint32_t, uint64_t, void *));
+
 
 /* Copy the file transfer file id to file_id
  *
@@ -620,6 +730,16 @@ int file_get_id(const Messenger *m, int32_t friendnumber, uint32_t filenumber, u
 long int new_filesender(const Messenger *m, int32_t friendnumber, uint32_t file_type, uint64_t filesize,
                         const uint8_t *file_id, const uint8_t *filename, uint16_t filename_length);
 
+/* Set the priority class (FILE_PRIORITY_*) of an outgoing file transfer.
+ * Avatars and files of up to 64 KiB start out high, others normal.
+ *
+ *  return 0 on success.
+ *  return -1 if friend not valid.
+ *  return -2 if filenumber not valid.
+ *  return -3 if priority not valid.
+ */
+int file_set_priority(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t priority);
+
 /* Send a file control request.
  *
  *  return 0 on success
@@ -661,6 +781,38 @@ int file_seek(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
 int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint64_t position, const uint8_t *data,
               uint16_t length);
 
+/* Let Messenger move the data of a file transfer itself: it reads the data to
+ * send from buffer, or writes received data to buffer, instead of going
+ * through the chunk request and file data callbacks. Pieces are sent as send
+ * queue slots free up, several per iteration.
+ *
+ * buffer must hold the whole file and stay valid until the transfer ends. It
+ * is only read from when sending. The completion callbacks (a chunk request of
+ * length 0, file data of length 0) are still called.
+ *
+ * Must be called before the transfer is accepted.
+ *
+ *  return 0 on success.
+ *  return -1 if friend not valid.
+ *  return -2 if filenumber invalid.
+ *  return -3 if the transfer was already accepted.
+ *  return -4 if the file size is unknown or buffer is smaller than the file.
+ */
+int file_set_buffer(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t *buffer, uint64_t length);
+
+/* Same as file_set_buffer(), but with data read from or written to the file
+ * open as fd, at the position in the transfer. The file position of fd is
+ * not used. If reading or writing fails the transfer is cancelled and the
+ * file control callback gets FILECONTROL_KILL.
+ *
+ *  return 0 on success.
+ *  return -1 if friend not valid.
+ *  return -2 if filenumber invalid.
+ *  return -3 if the transfer was already accepted.
+ *  return -4 if the file size is unknown or fd is invalid.
+ */
+int file_set_fd(const Messenger *m, int32_t friendnumber, uint32_t filenumber, int fd);
+
 /* Give the number of bytes left to be sent/received.
  *
  *  send_receive is 0 if we want the sending files, 1 if we want the receiving.
@@ -713,6 +865,14 @@ void custom_lossy_packet_registerhandler(Messenger *m, void (*packet_handler_cal
  */
 int m_send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length);
 
+/* Like m_send_custom_lossy_packet, but the packet is header followed by data.
+ * Lets large payloads be sent in slices without copying each one behind its header.
+ *
+ * return values are the same as for m_send_custom_lossy_packet.
+ */
+int m_send_custom_lossy_packet_split(const Messenger *m, int32_t friendnumber, const uint8_t *header,
+                                     uint32_t header_length, const uint8_t *data, uint32_t length);
+
 
 /* Set handlers for custom lossless packets.
  *
@@ -769,6 +929,23 @@ uint32_t messenger_run_interval(const Messenger *m);
 
 /* SAVING AND LOADING FUNCTIONS: */
 
+/* new messenger format for load/save, more robust and forward compatible */
+
+#define MESSENGER_STATE_COOKIE_GLOBAL 0x15ed1b1f
+
+#define MESSENGER_STATE_COOKIE_TYPE      0x01ce
+#define MESSENGER_STATE_TYPE_NOSPAMKEYS    1
+#define MESSENGER_STATE_TYPE_DHT           2
+#define MESSENGER_STATE_TYPE_FRIENDS       3
+#define MESSENGER_STATE_TYPE_NAME          4
+#define MESSENGER_STATE_TYPE_STATUSMESSAGE 5
+#define MESSENGER_STATE_TYPE_STATUS        6
+#define MESSENGER_STATE_TYPE_TCP_RELAY     10
+#define MESSENGER_STATE_TYPE_PATH_NODE     11
+#define MESSENGER_STATE_TYPE_FILE_RESUME   12
+#define MESSENGER_STATE_TYPE_CONFERENCES   100
+#define MESSENGER_STATE_TYPE_END           255
+
 /* return size of the messenger data (for saving). */
 uint32_t messenger_size(const Messenger *m, bool save_friends);
 
@@ -778,6 +955,63 @@ void messenger_save(const Messenger *m, uint8_t *data, bool save_friends);
 /* Load the messenger from data of size length. */
 int messenger_load(Messenger *m, const uint8_t *data, uint32_t length);
 
+/* SAVEDATA JOURNAL:
+ *
+ * While enabled, every change to the saved state is recorded as a small
+ * record using the same section framing as messenger_save(). A client appends
+ * the records to a journal file next to the last snapshot; loading the snapshot
+ * and then replaying the journal with messenger_journal_load() restores the
+ * current state. Records with the MESSENGER_STATE_TYPE_* types of the snapshot
+ * replace that section, the types below describe a single friend or conference.
+ */
+#define MESSENGER_JOURNAL_TYPE_FRIEND               200 // One saved friend entry, added or replaced.
+#define MESSENGER_JOURNAL_TYPE_FRIEND_REMOVED       201 // [real_pk]
+#define MESSENGER_JOURNAL_TYPE_FRIEND_NAME          202 // [real_pk][name]
+#define MESSENGER_JOURNAL_TYPE_FRIEND_STATUSMESSAGE 203 // [real_pk][status message]
+#define MESSENGER_JOURNAL_TYPE_FRIEND_STATUS        204 // [real_pk][userstatus (1)][last seen time (8)]
+#define MESSENGER_JOURNAL_TYPE_CONFERENCE           210 // One saved conference entry, added or replaced.
+#define MESSENGER_JOURNAL_TYPE_CONFERENCE_REMOVED   211 // [conference identifier]
+
+/* Start or stop recording journal records. Disabling discards pending records. */
+void messenger_journal_enable(Messenger *m, bool enabled);
+
+/* return the size of the journal records not yet taken. */
+uint32_t messenger_journal_size(const Messenger *m);
+
+/* Copy the pending journal records (messenger_journal_size() bytes) into data
+ * and clear them.
+ */
+void messenger_journal_take(Messenger *m, uint8_t *data);
+
+/* return true if the journal produced since the last compaction has grown large
+ * compared to a snapshot and should be replaced by a fresh messenger_save().
+ */
+bool messenger_journal_needs_compaction(const Messenger *m);
+
+/* Mark the journal as compacted. Called after saving a fresh snapshot, which
+ * already contains every pending record, so those are discarded.
+ */
+void messenger_journal_compacted(Messenger *m);
+
+/* Record the current nospam and keys, after the nospam was changed. */
+void messenger_journal_nospam_keys(Messenger *m);
+
+/* Append a record of length bytes of the given type to the journal.
+ *
+ *  return 0 on success (or if the journal is disabled).
+ *  return -1 on failure.
+ */
+int messenger_journal_append(Messenger *m, uint16_t type, const uint8_t *data, uint32_t length);
+
+/* Replay journal records of size length on top of a loaded snapshot.
+ * The journal has no global cookie, so chunks taken with
+ * messenger_journal_take() can simply be concatenated.
+ *
+ *  return 0 on success.
+ *  return -1 if the journal is damaged; records before the damage are applied.
+ */
+int messenger_journal_load(Messenger *m, const uint8_t *data, uint32_t length);
+
 /* Return the number of friends in the instance m.
  * You should use this to determine how much memory to allocate
  * for copy_friendlist. */
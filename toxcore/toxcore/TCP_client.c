@@ -57,6 +57,8 @@ struct TCP_Client_Connection {
 
     uint64_t last_pinged;
     uint64_t ping_id;
+    uint64_t ping_sent_time; /* when the ping with ping_id was sent, in ms */
+    uint64_t rtt;
 
     uint64_t ping_response_id;
     uint64_t ping_request_id;
@@ -98,6 +100,11 @@ TCP_CLIENT_STATUS tcp_con_status(const TCP_Client_Connection *con)
 {
     return con->status;
 }
+
+uint64_t tcp_con_rtt(const TCP_Client_Connection *con)
+{
+    return con->rtt;
+}
 void *tcp_con_custom_object(const TCP_Client_Connection *con)
 {
     return con->custom_object;
@@ -627,6 +634,7 @@ static int tcp_send_ping_request(TCP_Client_Connection *con)
 
     if ((ret = write_packet_TCP_client_secure_connection(con, packet, sizeof(packet), 1)) == 1) {
         con->ping_request_id = 0;
+        con->ping_sent_time = current_time_monotonic();
     }
 
     return ret;
@@ -885,6 +893,16 @@ static int handle_TCP_client_packet(TCP_Client_Connection *conn, const uint8_t *
             if (ping_id) {
                 if (ping_id == conn->ping_id) {
                     conn->ping_id = 0;
+
+                    /* Smoothed like TCP's SRTT, the first sample is taken as is. A
+                     * relay on the same host counts as 1 ms since 0 means unmeasured. */
+                    uint64_t rtt = current_time_monotonic() - conn->ping_sent_time;
+
+                    if (rtt == 0) {
+                        rtt = 1;
+                    }
+
+                    conn->rtt = conn->rtt ? (conn->rtt * 7 + rtt) / 8 : rtt;
                 }
 
                 return 0;
@@ -56,6 +56,11 @@ const uint8_t *tcp_con_public_key(const TCP_Client_Connection *con);
 IP_Port tcp_con_ip_port(const TCP_Client_Connection *con);
 TCP_CLIENT_STATUS tcp_con_status(const TCP_Client_Connection *con);
 
+/* return the smoothed round trip time to the relay in ms, measured with pings.
+ * return 0 if no ping was answered yet.
+ */
+uint64_t tcp_con_rtt(const TCP_Client_Connection *con);
+
 void *tcp_con_custom_object(const TCP_Client_Connection *con);
 uint32_t tcp_con_custom_uint(const TCP_Client_Connection *con);
 void tcp_con_set_custom_object(TCP_Client_Connection *con, void *object);
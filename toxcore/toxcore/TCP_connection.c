@@ -262,6 +262,14 @@ TCP_con *get_tcp_connection(const TCP_Connections *tcp_c, int tcp_connections_nu
     return &tcp_c->tcp_connections[tcp_connections_number];
 }
 
+/* return true if relay a has a lower round trip time than relay b.
+ * Relays that weren't measured yet are the slowest.
+ */
+static bool tcp_relay_faster(const TCP_con *a, const TCP_con *b)
+{
+    return a->rtt != 0 && (b->rtt == 0 || a->rtt < b->rtt);
+}
+
 /* Send a packet to the TCP connection.
  *
  * return -1 on failure.
@@ -282,6 +290,11 @@ int send_packet_tcp_connection(TCP_Connections *tcp_c, int connections_number, c
 
     bool limit_reached = 0;
 
+    /* Online relays sorted by round trip time, the fastest is tried first. */
+    TCP_con *online[MAX_FRIEND_TCP_CONNECTIONS];
+    uint8_t online_ids[MAX_FRIEND_TCP_CONNECTIONS];
+    unsigned int num_online = 0;
+
     for (i = 0; i < MAX_FRIEND_TCP_CONNECTIONS; ++i) {
         uint32_t tcp_con_num = con_to->connections[i].tcp_connection;
         uint8_t status = con_to->connections[i].status;
@@ -295,15 +308,29 @@ int send_packet_tcp_connection(TCP_Connections *tcp_c, int connections_number, c
                 continue;
             }
 
-            ret = send_data(tcp_con->connection, connection_id, packet, length);
+            unsigned int pos = num_online;
 
-            if (ret == 0) {
-                limit_reached = 1;
+            while (pos > 0 && tcp_relay_faster(tcp_con, online[pos - 1])) {
+                online[pos] = online[pos - 1];
+                online_ids[pos] = online_ids[pos - 1];
+                --pos;
             }
 
-            if (ret == 1) {
-                break;
-            }
+            online[pos] = tcp_con;
+            online_ids[pos] = connection_id;
+            ++num_online;
+        }
+    }
+
+    for (i = 0; i < num_online; ++i) {
+        ret = send_data(online[i]->connection, online_ids[i], packet, length);
+
+        if (ret == 0) {
+            limit_reached = 1;
+        }
+
+        if (ret == 1) {
+            break;
         }
     }
 
@@ -1224,6 +1251,7 @@ int add_tcp_number_relay_connection(TCP_Connections *tcp_c, int connections_numb
 /* Add a TCP relay tied to a connection.
  *
  * This should be called with the same relay by two peers who want to create a TCP connection with each other.
+ * A relay we are already connected to, e.g. one in the warm pool, is used without a new handshake.
  *
  * return 0 on success.
  * return -1 on failure.
@@ -1283,27 +1311,46 @@ unsigned int tcp_connection_to_online_tcp_relays(TCP_Connections *tcp_c, int con
  */
 unsigned int tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_relays, uint16_t max_num)
 {
-    unsigned int i, copied = 0, r = rand();
+    if (tcp_c->tcp_connections_length == 0) {
+        return 0;
+    }
 
-    for (i = 0; (i < tcp_c->tcp_connections_length) && (copied < max_num); ++i) {
+    unsigned int i, num = 0, copied = 0, r = rand();
+    VLA(TCP_con *, connected, tcp_c->tcp_connections_length);
+
+    /* Sorted by round trip time, relays that weren't measured yet stay in
+     * random order at the end. */
+    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
         TCP_con *tcp_con = get_tcp_connection(tcp_c, (i + r) % tcp_c->tcp_connections_length);
 
-        if (!tcp_con) {
+        if (!tcp_con || tcp_con->status != TCP_CONN_CONNECTED) {
             continue;
         }
 
-        if (tcp_con->status == TCP_CONN_CONNECTED) {
-            memcpy(tcp_relays[copied].public_key, tcp_con_public_key(tcp_con->connection), CRYPTO_PUBLIC_KEY_SIZE);
-            tcp_relays[copied].ip_port = tcp_con_ip_port(tcp_con->connection);
+        unsigned int pos = num;
 
-            if (tcp_relays[copied].ip_port.ip.family == TOX_AF_INET) {
-                tcp_relays[copied].ip_port.ip.family = TCP_INET;
-            } else if (tcp_relays[copied].ip_port.ip.family == TOX_AF_INET6) {
-                tcp_relays[copied].ip_port.ip.family = TCP_INET6;
-            }
+        while (pos > 0 && tcp_relay_faster(tcp_con, connected[pos - 1])) {
+            connected[pos] = connected[pos - 1];
+            --pos;
+        }
+
+        connected[pos] = tcp_con;
+        ++num;
+    }
+
+    for (i = 0; (i < num) && (copied < max_num); ++i) {
+        const TCP_con *tcp_con = connected[i];
 
-            ++copied;
+        memcpy(tcp_relays[copied].public_key, tcp_con_public_key(tcp_con->connection), CRYPTO_PUBLIC_KEY_SIZE);
+        tcp_relays[copied].ip_port = tcp_con_ip_port(tcp_con->connection);
+
+        if (tcp_relays[copied].ip_port.ip.family == TOX_AF_INET) {
+            tcp_relays[copied].ip_port.ip.family = TCP_INET;
+        } else if (tcp_relays[copied].ip_port.ip.family == TOX_AF_INET6) {
+            tcp_relays[copied].ip_port.ip.family = TCP_INET6;
         }
+
+        ++copied;
     }
 
     return copied;
@@ -1432,11 +1479,17 @@ static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
                     continue;
                 }
 
+                const uint64_t rtt = tcp_con_rtt(tcp_con->connection);
+
+                if (rtt != 0) {
+                    tcp_con->rtt = rtt;
+                }
+
                 if (tcp_con->status == TCP_CONN_VALID && tcp_con_status(tcp_con->connection) == TCP_CLIENT_CONFIRMED) {
                     tcp_relay_on_online(tcp_c, i);
                 }
 
-                if (tcp_con->status == TCP_CONN_CONNECTED && !tcp_con->onion && tcp_con->lock_count
+                if (tcp_con->status == TCP_CONN_CONNECTED && !tcp_con->onion && !tcp_con->warm && tcp_con->lock_count
                         && tcp_con->lock_count == tcp_con->sleep_count
                         && is_timeout(tcp_con->connected_time, TCP_CONNECTION_ANNOUNCE_TIMEOUT)) {
                     sleep_tcp_relay_connection(tcp_c, i);
@@ -1450,6 +1503,52 @@ static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
     }
 }
 
+/* Put the TCP_WARM_POOL_SIZE connected relays with the lowest round trip times
+ * in the warm pool.
+ */
+static void update_warm_pool(TCP_Connections *tcp_c)
+{
+    TCP_con *pool[TCP_WARM_POOL_SIZE];
+    unsigned int i, num = 0;
+
+    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (!tcp_con) {
+            continue;
+        }
+
+        tcp_con->warm = 0;
+
+        if (tcp_con->status != TCP_CONN_CONNECTED) {
+            continue;
+        }
+
+        /* Insertion into the sorted pool, it is small. */
+        unsigned int pos = num;
+
+        while (pos > 0 && tcp_relay_faster(tcp_con, pool[pos - 1])) {
+            if (pos < TCP_WARM_POOL_SIZE) {
+                pool[pos] = pool[pos - 1];
+            }
+
+            --pos;
+        }
+
+        if (pos < TCP_WARM_POOL_SIZE) {
+            pool[pos] = tcp_con;
+
+            if (num < TCP_WARM_POOL_SIZE) {
+                ++num;
+            }
+        }
+    }
+
+    for (i = 0; i < num; ++i) {
+        pool[i]->warm = 1;
+    }
+}
+
 static void kill_nonused_tcp(TCP_Connections *tcp_c)
 {
     if (tcp_c->tcp_connections_length == 0) {
@@ -1466,7 +1565,8 @@ static void kill_nonused_tcp(TCP_Connections *tcp_c)
 
         if (tcp_con) {
             if (tcp_con->status == TCP_CONN_CONNECTED) {
-                if (!tcp_con->onion && !tcp_con->lock_count && is_timeout(tcp_con->connected_time, TCP_CONNECTION_ANNOUNCE_TIMEOUT)) {
+                if (!tcp_con->onion && !tcp_con->warm && !tcp_con->lock_count
+                        && is_timeout(tcp_con->connected_time, TCP_CONNECTION_ANNOUNCE_TIMEOUT)) {
                     to_kill[num_kill] = i;
                     ++num_kill;
                 }
@@ -1494,6 +1594,7 @@ static void kill_nonused_tcp(TCP_Connections *tcp_c)
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata)
 {
     do_tcp_conns(tcp_c, userdata);
+    update_warm_pool(tcp_c);
     kill_nonused_tcp(tcp_c);
 }
 
@@ -51,6 +51,11 @@
 /* Number of TCP connections used for onion purposes. */
 #define NUM_ONION_TCP_CONNECTIONS RECOMMENDED_FRIEND_TCP_CONNECTIONS
 
+/* Number of connected relays with the lowest round trip times that are kept
+ * connected even when no connection uses them, so that a peer announcing one
+ * of them is reached without a new relay handshake. */
+#define TCP_WARM_POOL_SIZE RECOMMENDED_FRIEND_TCP_CONNECTIONS
+
 typedef struct {
     uint8_t status;
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The dht public key of the peer */
@@ -71,6 +76,8 @@ typedef struct {
     uint32_t lock_count;
     uint32_t sleep_count;
     bool onion;
+    bool warm; /* in the warm pool, see TCP_WARM_POOL_SIZE */
+    uint64_t rtt; /* last tcp_con_rtt() of the relay, kept while sleeping */
 
     /* Only used when connection is sleeping. */
     IP_Port ip_port;
@@ -186,6 +193,7 @@ int add_tcp_number_relay_connection(TCP_Connections *tcp_c, int connections_numb
 /* Add a TCP relay tied to a connection.
  *
  * This should be called with the same relay by two peers who want to create a TCP connection with each other.
+ * A relay we are already connected to, e.g. one in the warm pool, is used without a new handshake.
  *
  * return 0 on success.
  * return -1 on failure.
@@ -199,7 +207,8 @@ int add_tcp_relay_connection(TCP_Connections *tcp_c, int connections_number, IP_
  */
 int add_tcp_relay_global(TCP_Connections *tcp_c, IP_Port ip_port, const uint8_t *relay_pk);
 
-/* Copy a maximum of max_num TCP relays we are connected to to tcp_relays.
+/* Copy a maximum of max_num TCP relays we are connected to to tcp_relays, the
+ * ones with the lowest round trip times first.
  * NOTE that the family of the copied ip ports will be set to TCP_INET or TCP_INET6.
  *
  * return number of relays copied to tcp_relays on success.
@@ -52,6 +52,7 @@ typedef struct TCP_Secure_Connection {
     uint16_t last_packet_sent;
 
     TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    uint32_t priority_queue_length;
 
     uint64_t identifier;
 
@@ -62,6 +63,7 @@ typedef struct TCP_Secure_Connection {
 
 struct TCP_Server {
     Onion *onion;
+    Metrics *metrics; /* NULL if there is no onion to take them from */
 
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
@@ -400,6 +402,7 @@ static int send_pending_data(TCP_Secure_Connection *con)
         TCP_Priority_List *pp = p;
         p = p->next;
         free(pp);
+        --con->priority_queue_length;
     }
 
     con->priority_queue_start = p;
@@ -436,6 +439,7 @@ static bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint
     }
 
     con->priority_queue_end = new_list;
+    ++con->priority_queue_length;
     return 1;
 }
 
@@ -824,6 +828,10 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
 
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[con_id];
 
+    if (TCP_server->metrics) {
+        metrics_inc(TCP_server->metrics, METRIC_TCP_SERVER_PACKETS_RECV);
+    }
+
     switch (data[0]) {
         case TCP_PACKET_ROUTING_REQUEST: {
             if (length != 1 + CRYPTO_PUBLIC_KEY_SIZE) {
@@ -1108,6 +1116,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 
     if (onion) {
         temp->onion = onion;
+        temp->metrics = net_metrics(onion->net);
         set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
     }
 
@@ -1237,6 +1246,7 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
     TCP_server->last_run_pinged = unix_time();
 #endif
     uint32_t i;
+    uint64_t priority_queue_length = 0;
 
     for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
         TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
@@ -1274,6 +1284,7 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
         }
 
         send_pending_data(conn);
+        priority_queue_length += conn->priority_queue_length;
 
 #ifndef TCP_SERVER_USE_EPOLL
 
@@ -1281,6 +1292,11 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
 
 #endif
     }
+
+    if (TCP_server->metrics) {
+        metrics_set(TCP_server->metrics, METRIC_TCP_SERVER_CONNECTIONS, TCP_server->num_accepted_connections);
+        metrics_set(TCP_server->metrics, METRIC_TCP_SERVER_PRIORITY_QUEUE, priority_queue_length);
+    }
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -129,15 +129,42 @@ int32_t encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key,
 int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain, size_t length,
                                uint8_t *encrypted)
 {
-    if (length == 0 || !secret_key || !nonce || !plain || !encrypted) {
+    return encrypt_data_symmetric_gather(secret_key, nonce, &plain, &length, 1, encrypted);
+}
+
+int32_t encrypt_data_symmetric_gather(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *const *parts,
+                                      const size_t *lengths, uint16_t num_parts, uint8_t *encrypted)
+{
+    if (!secret_key || !nonce || !parts || !lengths || !encrypted) {
+        return -1;
+    }
+
+    size_t length = 0;
+
+    for (uint16_t i = 0; i < num_parts; ++i) {
+        if (lengths[i] != 0 && !parts[i]) {
+            return -1;
+        }
+
+        length += lengths[i];
+    }
+
+    if (length == 0) {
         return -1;
     }
 
     VLA(uint8_t, temp_plain, length + crypto_box_ZEROBYTES);
     VLA(uint8_t, temp_encrypted, length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES);
 
-    memset(temp_plain, 0, crypto_box_ZEROBYTES);
-    memcpy(temp_plain + crypto_box_ZEROBYTES, plain, length); // Pad the message with 32 0 bytes.
+    memset(temp_plain, 0, crypto_box_ZEROBYTES); // Pad the message with 32 0 bytes.
+    size_t offset = crypto_box_ZEROBYTES;
+
+    for (uint16_t i = 0; i < num_parts; ++i) {
+        if (lengths[i] != 0) {
+            memcpy(temp_plain + offset, parts[i], lengths[i]);
+            offset += lengths[i];
+        }
+    }
 
     if (crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce, secret_key) != 0) {
         return -1;
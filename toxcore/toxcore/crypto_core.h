@@ -212,6 +212,18 @@ int32_t encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key,
 int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *plain, size_t length,
                                uint8_t *encrypted);
 
+/**
+ * Like encrypt_data_symmetric, but the plain text is the concatenation of the
+ * num_parts byte arrays in parts, each lengths[i] bytes long. The parts are
+ * gathered straight into the padded encryption buffer, so callers don't have
+ * to join them first.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+int32_t encrypt_data_symmetric_gather(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *const *parts,
+                                      const size_t *lengths, uint16_t num_parts, uint8_t *encrypted);
+
 /**
  * Decrypts encrypted of length length to plain of length length -
  * CRYPTO_MAC_SIZE using a shared key CRYPTO_SHARED_KEY_SIZE big and a
@@ -31,6 +31,11 @@
 
 #define PORTS_PER_DISCOVERY 10
 
+/* LAN discovery packets sent, one every LAN_DISCOVERY_BURST_INTERVAL seconds,
+ * after the network interfaces changed. */
+#define LAN_DISCOVERY_BURST 4
+#define LAN_DISCOVERY_BURST_INTERVAL 1
+
 typedef struct {
     uint8_t status;
 
@@ -78,6 +83,8 @@ struct Friend_Connections {
 
     uint64_t last_LANdiscovery;
     uint16_t next_LANport;
+    uint8_t LANdiscovery_burst;
+    Lan_Monitor *lan_monitor;
 
     bool local_discovery_enabled;
 };
@@ -866,15 +873,30 @@ Friend_Connections *new_friend_connections(Onion_Client *onion_c, bool local_dis
 
     if (temp->local_discovery_enabled) {
         lan_discovery_init(temp->dht);
+        temp->lan_monitor = new_lan_monitor();
     }
 
     return temp;
 }
 
-/* Send a LAN discovery packet every LAN_DISCOVERY_INTERVAL seconds. */
+/* Send a LAN discovery packet every LAN_DISCOVERY_INTERVAL seconds.
+ *
+ * When the network changes a burst is sent right away so that peers on the new
+ * network bootstrap to us and friends among them get a direct UDP path instead
+ * of staying on TCP relays until the next interval.
+ */
 static void LANdiscovery(Friend_Connections *fr_c)
 {
-    if (fr_c->last_LANdiscovery + LAN_DISCOVERY_INTERVAL < unix_time()) {
+    if (lan_monitor_changed(fr_c->lan_monitor)) {
+        fr_c->LANdiscovery_burst = LAN_DISCOVERY_BURST;
+        fr_c->last_LANdiscovery = 0;
+    }
+
+    const bool due = fr_c->LANdiscovery_burst
+                     ? is_timeout(fr_c->last_LANdiscovery, LAN_DISCOVERY_BURST_INTERVAL)
+                     : fr_c->last_LANdiscovery + LAN_DISCOVERY_INTERVAL < unix_time();
+
+    if (due) {
         const uint16_t first = fr_c->next_LANport;
         uint16_t last = first + PORTS_PER_DISCOVERY;
         last = last > TOX_PORTRANGE_TO ? TOX_PORTRANGE_TO : last;
@@ -890,6 +912,10 @@ static void LANdiscovery(Friend_Connections *fr_c)
         // Don't include default port in port range
         fr_c->next_LANport = last != TOX_PORTRANGE_TO ? last : TOX_PORTRANGE_FROM + 1;
         fr_c->last_LANdiscovery = unix_time();
+
+        if (fr_c->LANdiscovery_burst) {
+            --fr_c->LANdiscovery_burst;
+        }
     }
 }
 
@@ -958,6 +984,7 @@ void kill_friend_connections(Friend_Connections *fr_c)
 
     if (fr_c->local_discovery_enabled) {
         lan_discovery_kill(fr_c->dht);
+        kill_lan_monitor(fr_c->lan_monitor);
     }
 
     free(fr_c);
@@ -792,6 +792,7 @@ static void addjoinpeer(Group_c *g, const uint8_t *real_pk)
         g->joinpeers = temp;
         temp = g->joinpeers + g->numjoinpeers;
         ++g->numjoinpeers;
+        g->journal_dirty = true;
 
         memset(temp, 0, sizeof(Group_Join_Peer));
         id_copy(temp->real_pk, real_pk);
@@ -999,6 +1000,7 @@ static aint settitle(Group_c *g, aint peer_index, const uint8_t *title, aint tit
     memcpy(g->title, title, title_len);
     g->title_len = (uint8_t)title_len;
     g->title_changed = true;
+    g->journal_dirty = true;
 
     if (peer_index >= 0) {
         g->peers[peer_index].title_changed = true;
@@ -1043,6 +1045,7 @@ int add_groupchat(Group_Chats *g_c, uint8_t type, const uint8_t *uid)
     g->peers[peer_index].group_number = (uint16_t)groupnumber;
 
     setnick(g, peer_index, g_c->m->name, g_c->m->name_length);
+    g->journal_dirty = true;
 
     return (int)groupnumber;
 }
@@ -1147,6 +1150,7 @@ static Group_c *disconnect_conference(const Group_Chats *g_c, aint groupnumber,
     g->peer_on_leave = NULL;
     g->peer_on_join = NULL;
     g->group_on_delete = NULL;
+    g->group_on_iterate = NULL;
 
     return g;
 }
@@ -1159,6 +1163,10 @@ int leave_conference(Group_Chats *g_c, int groupnumber, bool keep_leave)
         return -1;
     }
 
+    if (g->keep_leave != keep_leave) {
+        g->journal_dirty = true;
+    }
+
     g->keep_leave = keep_leave;
 
     if (g->disable_auto_join) {
@@ -1213,6 +1221,12 @@ static int del_groupchat_internal(Group_Chats *g_c, aint groupnumber, Unsubscrib
 
 int del_groupchat(Group_Chats *g_c, int groupnumber)
 {
+    Group_c *g = get_group_c(g_c, groupnumber);
+
+    if (g) {
+        messenger_journal_append(g_c->m, MESSENGER_JOURNAL_TYPE_CONFERENCE_REMOVED, g->identifier, GROUP_IDENTIFIER_LENGTH);
+    }
+
     return del_groupchat_internal(g_c, groupnumber, UNS_FOREVER);
 }
 
@@ -1638,13 +1652,15 @@ int join_groupchat(Group_Chats *g_c, int32_t friendnumber, uint8_t expected_type
 void group_lossy_packet_registerhandler(Group_Chats *g_c, uint8_t byte, int (*function)(void *, int, int, void *,
                                         const uint8_t *, uint16_t))
 {
-    /* g_c->lossy_packethandlers[byte].function = function; */
+    size_t i;
 
-    if (192 /* GROUP_AUDIO_PACKET_ID */ == byte) {
-        g_c->lossy_packethandler = function;
+    for (i = 0; i < MAX_GROUP_LOSSY_HANDLERS; ++i) {
+        if (g_c->lossy_packethandlers[i].id == byte || !g_c->lossy_packethandlers[i].function) {
+            g_c->lossy_packethandlers[i].id = byte;
+            g_c->lossy_packethandlers[i].function = function;
+            return;
+        }
     }
-
-
 }
 
 /* Set the callback for group invites.
@@ -1756,6 +1772,25 @@ int callback_groupchat_delete(Group_Chats *g_c, int groupnumber, void (*function
     return 0;
 }
 
+/* Set a function to be called on every do_groupchats() iteration of a live group chat.
+ *
+ * Function(void *group object (set with group_set_object), int groupnumber, void *userdata)
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int callback_groupchat_iterate(Group_Chats *g_c, int groupnumber, void (*function)(void *, int, void *))
+{
+    Group_c *g = get_group_c(g_c, groupnumber);
+
+    if (!g) {
+        return -1;
+    }
+
+    g->group_on_iterate = function;
+    return 0;
+}
+
 static int group_ping_send(const Group_Chats *g_c, int groupnumber)
 {
     if (send_message_group(g_c, groupnumber, GROUP_MESSAGE_PING_ID, 0, 0) > 0) {
@@ -1986,6 +2021,7 @@ int group_title_send(const Group_Chats *g_c, int groupnumber, const uint8_t *tit
 
     memcpy(g->title, title, title_len);
     g->title_len = title_len;
+    g->journal_dirty = true;
 
     if (g->numpeers == 1) {
         return 0;
@@ -2055,6 +2091,7 @@ static void unsubscribe_peer(Group_Chats *g_c, const uint8_t *conf_id, const uin
 
                 if (UNS_FOREVER == u) {
                     --g->numjoinpeers;
+                    g->journal_dirty = true;
 
                     if (g->numjoinpeers > 0) {
                         memcpy(jp, g->joinpeers + g->numjoinpeers, sizeof(Group_Join_Peer));
@@ -3326,23 +3363,18 @@ static int handle_lossy(void *object, int friendcon_id, const uint8_t *data, uin
         return -1;
     }
 
-    /*
-    if (g_c->lossy_packethandlers[message_id].function) {
-        if (g_c->lossy_packethandlers[message_id].function(g->object, (int)groupnumber, index_in_list, g->peers[peer_index].object,
-                lossy_data, lossy_length) == -1) {
-            return -1;
+    for (i = 0; i < MAX_GROUP_LOSSY_HANDLERS; ++i) {
+        if (g_c->lossy_packethandlers[i].id == message_id && g_c->lossy_packethandlers[i].function) {
+            break;
         }
-    } else {
+    }
+
+    if (i == MAX_GROUP_LOSSY_HANDLERS) {
         return -1;
     }
-    */
 
-    if (192 /*GROUP_AUDIO_PACKET_ID*/ == message_id && g_c->lossy_packethandler) {
-        if (g_c->lossy_packethandler(g->object, (int)groupnumber, index_in_list, g->peers[peer_index].object,
-                                     lossy_data, lossy_length) == -1) {
-            return -1;
-        }
-    } else {
+    if (g_c->lossy_packethandlers[i].function(g->object, (int)groupnumber, index_in_list, g->peers[peer_index].object,
+            lossy_data, lossy_length) == -1) {
         return -1;
     }
 
@@ -3824,11 +3856,15 @@ Group_Chats *new_groupchats(Messenger *m)
 }
 
 /* main groupchats loop. */
+static void journal_conferences(Group_Chats *g_c);
+
 void do_groupchats(Group_Chats *g_c, void *userdata)
 {
     unsigned i;
     bool is_online = onion_connection_status(g_c->m->onion_c) != 0;
 
+    journal_conferences(g_c);
+
     if (!is_online && g_c->is_online) {
         /* to offline */
 
@@ -3862,13 +3898,16 @@ void do_groupchats(Group_Chats *g_c, void *userdata)
         if (g->disable_auto_join) {
             groupchat_clear_timedout(g_c, i, userdata);
             apply_changes_in_peers(g_c, i, userdata);
-            continue;
+        } else {
+            apply_changes_in_peers(g_c, i, userdata);
+            connect_to_closest(g_c, i, userdata);
+            ping_groupchat(g_c, i);
+            groupchat_clear_timedout(g_c, i, userdata);
         }
 
-        apply_changes_in_peers(g_c, i, userdata);
-        connect_to_closest(g_c, i, userdata);
-        ping_groupchat(g_c, i);
-        groupchat_clear_timedout(g_c, i, userdata);
+        if (g->group_on_iterate) {
+            g->group_on_iterate(g->object, i, userdata);
+        }
     }
 
     restore_conference(g_c);     /* always do something to restore contacts */
@@ -3937,6 +3976,13 @@ uint32_t copy_chatlist(Group_Chats *g_c, uint32_t *out_list, uint32_t list_size)
     return ret;
 }
 
+static uint32_t saved_conference_size(const Group_c *g)
+{
+    return GROUP_IDENTIFIER_LENGTH + 1 + 1 + sizeof(uint16_t)  /* +1 byte for options, +1 byte for title len, +2 bytes for count of joinpeers */
+           + g->title_len
+           + g->numjoinpeers * CRYPTO_PUBLIC_KEY_SIZE;
+}
+
 uint32_t saved_conferences_size(const Messenger *m)
 {
     Group_Chats *g_c = (Group_Chats *)m->conferences_object;
@@ -3952,10 +3998,7 @@ uint32_t saved_conferences_size(const Messenger *m)
             continue;
         }
 
-        sz += GROUP_IDENTIFIER_LENGTH + 1 + 1 + sizeof(
-                  uint16_t); /* +1 byte for options, +1 byte for title len, +2 bytes for count of joinpeers */
-        sz += g->title_len; /* +1 byte for title len */
-        sz += g->numjoinpeers * CRYPTO_PUBLIC_KEY_SIZE;
+        sz += saved_conference_size(g);
     }
 
     return (uint32_t)sz;
@@ -3964,6 +4007,34 @@ uint32_t saved_conferences_size(const Messenger *m)
 #define put16(v) { *((uint16_t *)data) = host_tolendian16( (uint16_t)(v) ); data += sizeof( uint16_t ); }
 #define putbytes( p, sz ) {memcpy(data,p, sz); data += sz;}
 
+static uint8_t *save_conference(const Group_c *g, uint8_t *data)
+{
+    putbytes(g->identifier, GROUP_IDENTIFIER_LENGTH);
+
+    uint8_t options = 0;
+
+    if (g->keep_leave) {
+        options = 1;
+    }
+
+    *data = options;
+    ++data;
+
+    *data = g->title_len;
+    ++data;
+    putbytes(g->title, g->title_len);
+
+    put16(g->numjoinpeers);
+
+    size_t j;
+
+    for (j = 0; j < g->numjoinpeers; ++j) {
+        putbytes(g->joinpeers[j].real_pk, CRYPTO_PUBLIC_KEY_SIZE);
+    }
+
+    return data;
+}
+
 void conferences_save(const Messenger *m, uint8_t *data)
 {
     Group_Chats *g_c = (Group_Chats *)m->conferences_object;
@@ -3982,32 +4053,94 @@ void conferences_save(const Messenger *m, uint8_t *data)
             continue;
         }
 
-        putbytes(g->identifier, GROUP_IDENTIFIER_LENGTH);
+        data = save_conference(g, data);
 
-        uint8_t options = 0;
+        ++(*num);
+    }
 
-        if (g->keep_leave) {
-            options = 1;
-        }
+}
 
-        *data = options;
-        ++data;
+/* Load one conference saved by save_conference(), advancing data and length past it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int load_conference(Group_Chats *g_c, const uint8_t **data_ptr, uint32_t *length_ptr)
+{
+    const uint8_t *data = *data_ptr;
+    uint32_t length = *length_ptr;
 
-        *data = g->title_len;
-        ++data;
-        putbytes(g->title, g->title_len);
+    if (length < GROUP_IDENTIFIER_LENGTH + 4) {
+        return -1;
+    }
 
-        put16(g->numjoinpeers);
+    int grounumber = add_groupchat(g_c, *data, data + 1);
+    data += GROUP_IDENTIFIER_LENGTH;
+    length -= GROUP_IDENTIFIER_LENGTH;
 
-        size_t j;
+    Group_c *g = get_group_c(g_c, grounumber);
 
-        for (j = 0; j < g->numjoinpeers; ++j) {
-            putbytes(g->joinpeers[j].real_pk, CRYPTO_PUBLIC_KEY_SIZE);
-        }
+    if (!g) {
+        return -1;
+    }
 
-        ++(*num);
+    g->invite_called = false;
+    g->journal_dirty = false;
+
+    if (*data & 1) {
+        g->keep_leave = true;
+        g->disable_auto_join = true;
+    } else {
+        g->join_mode = true;
+    }
+
+
+    ++data;
+    --length;
+
+    if (*data > sizeof(g->title)) {
+        del_groupchat_internal(g_c, grounumber, UNS_NONE);
+        return -1;
+    }
+
+    g->title_len = *data;
+    ++data;
+    --length;
+
+    if (length < g->title_len) {
+        del_groupchat_internal(g_c, grounumber, UNS_NONE);
+        return -1;
+    }
+
+    memcpy(g->title, data, g->title_len);
+    data += g->title_len;
+    length -= g->title_len;
+
+    g->numjoinpeers = lendian_to_host16(*(const uint16_t *)data);
+    data += sizeof(uint16_t);
+    length -= sizeof(uint16_t);
+
+    g->joinpeers = (Group_Join_Peer *)calloc(g->numjoinpeers, sizeof(Group_Join_Peer));
+
+    if (length < g->numjoinpeers * CRYPTO_PUBLIC_KEY_SIZE) {
+        del_groupchat_internal(g_c, grounumber, UNS_NONE);
+        return -1;
     }
 
+    length -= g->numjoinpeers * CRYPTO_PUBLIC_KEY_SIZE;
+
+    uint64_t t = current_time_monotonic() + 5000;
+    size_t j;
+
+    for (j = 0; j < g->numjoinpeers; ++j) {
+        memcpy(g->joinpeers[j].real_pk, data, CRYPTO_PUBLIC_KEY_SIZE);
+        data += CRYPTO_PUBLIC_KEY_SIZE;
+        g->joinpeers[j].next_try_time = t;
+    }
+
+    *data_ptr = data;
+    *length_ptr = length;
+    return 0;
 }
 
 int conferences_load(Messenger *m, const uint8_t *data, uint32_t length)
@@ -4026,78 +4159,91 @@ int conferences_load(Messenger *m, const uint8_t *data, uint32_t length)
 
     g_c->num_chats = 0;
 
-    size_t numgchats = lendian_to_host16(*(uint16_t *)data);
+    size_t numgchats = lendian_to_host16(*(const uint16_t *)data);
     data += sizeof(uint16_t), length -= sizeof(uint16_t);
 
     for (i = 0; i < numgchats; ++i) {
-
-        if (length < GROUP_IDENTIFIER_LENGTH + 4) {
+        if (load_conference(g_c, &data, &length) == -1) {
             return -1;
         }
+    }
 
-        int grounumber = add_groupchat(g_c, *data, data + 1);
-        data += GROUP_IDENTIFIER_LENGTH;
-        length -= GROUP_IDENTIFIER_LENGTH;
+    return 0;
+}
 
-        Group_c *g = get_group_c(g_c, grounumber);
+/* Replay a MESSENGER_JOURNAL_TYPE_CONFERENCE record, replacing the conference
+ * with the same identifier.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int conference_journal_load(Messenger *m, const uint8_t *data, uint32_t length)
+{
+    Group_Chats *g_c = (Group_Chats *)m->conferences_object;
 
-        if (!g) {
-            return -1;
-        }
+    if (length < GROUP_IDENTIFIER_LENGTH) {
+        return -1;
+    }
 
-        g->invite_called = false;
+    int groupnumber = get_group_num(g_c, data);
 
-        if (*data & 1) {
-            g->keep_leave = true;
-            g->disable_auto_join = true;
-        } else {
-            g->join_mode = true;
-        }
+    if (groupnumber != -1) {
+        del_groupchat_internal(g_c, groupnumber, UNS_NONE);
+    }
 
+    return load_conference(g_c, &data, &length);
+}
 
-        ++data;
-        --length;
+/* Replay a MESSENGER_JOURNAL_TYPE_CONFERENCE_REMOVED record.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int conference_journal_remove(Messenger *m, const uint8_t *data, uint32_t length)
+{
+    Group_Chats *g_c = (Group_Chats *)m->conferences_object;
 
-        if (*data > sizeof(g->title)) {
-            del_groupchat_internal(g_c, grounumber, UNS_NONE);
-            return -1;
-        }
+    if (length != GROUP_IDENTIFIER_LENGTH) {
+        return -1;
+    }
 
-        g->title_len = *data;
-        ++data;
-        --length;
+    int groupnumber = get_group_num(g_c, data);
 
-        if (length < g->title_len) {
-            del_groupchat_internal(g_c, grounumber, UNS_NONE);
-            return -1;
-        }
+    if (groupnumber == -1) {
+        return -1;
+    }
 
-        memcpy(g->title, data, g->title_len);
-        data += g->title_len;
-        length -= g->title_len;
+    return del_groupchat_internal(g_c, groupnumber, UNS_NONE);
+}
 
-        g->numjoinpeers = lendian_to_host16(*(uint16_t *)data);
-        data += sizeof(uint16_t);
-        length -= sizeof(uint16_t);
+/* Record the conferences whose saved state changed since they were last saved or journaled. */
+static void journal_conferences(Group_Chats *g_c)
+{
+    uint16_t i;
 
-        g->joinpeers = (Group_Join_Peer *)calloc(g->numjoinpeers, sizeof(Group_Join_Peer));
+    for (i = 0; i < g_c->num_chats; ++i) {
+        Group_c *g = g_c->chats + i;
 
-        if (length < g->numjoinpeers * CRYPTO_PUBLIC_KEY_SIZE) {
-            del_groupchat_internal(g_c, grounumber, UNS_NONE);
-            return -1;
+        if (!g->live || !g->journal_dirty) {
+            continue;
         }
 
-        length -= g->numjoinpeers * CRYPTO_PUBLIC_KEY_SIZE;
+        g->journal_dirty = false;
+
+        if (!g_c->m->journal_enabled) {
+            continue;
+        }
 
-        uint64_t t = current_time_monotonic() + 5000;
-        size_t j;
+        const uint32_t length = saved_conference_size(g);
+        uint8_t *data = (uint8_t *)malloc(length);
 
-        for (j = 0; j < g->numjoinpeers; ++j) {
-            memcpy(g->joinpeers[j].real_pk, data, CRYPTO_PUBLIC_KEY_SIZE);
-            data += CRYPTO_PUBLIC_KEY_SIZE;
-            g->joinpeers[j].next_try_time = t;
+        if (data == NULL) {
+            g->journal_dirty = true;
+            continue;
         }
-    }
 
-    return 0;
+        save_conference(g, data);
+        messenger_journal_append(g_c->m, MESSENGER_JOURNAL_TYPE_CONFERENCE, data, length);
+        free(data);
+    }
 }
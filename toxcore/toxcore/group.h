@@ -33,6 +33,7 @@ enum {
 };
 
 #define MAX_LOSSY_COUNT 256
+#define MAX_GROUP_LOSSY_HANDLERS 4
 
 typedef struct {
 
@@ -100,6 +101,7 @@ typedef struct {
     void (*peer_on_join)(void *, int, int);
     void (*peer_on_leave)(void *, int, void *);
     void (*group_on_delete)(void *, int);
+    void (*group_on_iterate)(void *, int, void *);
 
     uint8_t identifier[GROUP_IDENTIFIER_LENGTH];
 
@@ -121,6 +123,7 @@ typedef struct {
     unsigned keep_leave : 1;
     unsigned disable_auto_join : 1;
     unsigned nick_changed : 1;
+    unsigned journal_dirty : 1; /* saved state changed, see MESSENGER_JOURNAL_TYPE_CONFERENCE */
 
 } Group_c;
 
@@ -141,18 +144,14 @@ typedef struct {
 
 
     /*
-    there is only one value currently used: 192 (GROUP_AUDIO_PACKET_ID)
-    no need to reserve 255 addition pointers to handlers never used
-    that is why irungentoo's array of pointers was replaced with only one ptr
-    if someone in future want to use another id of packet in addition to the 192
-    just return back this array... or write better code
-                                                            isotoxin.dev
-    struct {
-        int (*function)(void *, int, int, void *, const uint8_t *, uint16_t);
-    } lossy_packethandlers[256];
+    only a couple of ids are currently used: 192 (GROUP_AUDIO_PACKET_ID) and 193 (GROUP_AUDIO_LEVEL_PACKET_ID)
+    no need to reserve 256 pointers to handlers never used
+    that is why irungentoo's array of 256 pointers was replaced with a small id -> handler table
     */
-
-    int(*lossy_packethandler)(void *, int, int, void *, const uint8_t *, uint16_t);
+    struct {
+        uint8_t id;
+        int(*function)(void *, int, int, void *, const uint8_t *, uint16_t);
+    } lossy_packethandlers[MAX_GROUP_LOSSY_HANDLERS];
 } Group_Chats;
 
 
@@ -425,6 +424,15 @@ int callback_groupchat_peer_delete(Group_Chats *g_c, int groupnumber, void (*fun
  */
 int callback_groupchat_delete(Group_Chats *g_c, int groupnumber, void (*function)(void *, int));
 
+/* Set a function to be called on every do_groupchats() iteration of a live group chat.
+ *
+ * Function(void *group object (set with group_set_object), int groupnumber, void *userdata)
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int callback_groupchat_iterate(Group_Chats *g_c, int groupnumber, void (*function)(void *, int, void *));
+
 /* Create new groupchat instance. */
 Group_Chats *new_groupchats(Messenger *m);
 
@@ -0,0 +1,276 @@
+/*
+ * Lock-free counters, gauges and histograms describing what a Tox instance does.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+static const char *const metric_names[METRIC_COUNT] = {
+    "net.packets_recv",
+    "net.bytes_recv",
+    "net.packets_sent",
+    "net.bytes_sent",
+    "net.packets_unhandled",
+    "net.send_failures",
+    "net.packets_rate_limited",
+
+    "dht.shared_key_hits",
+    "dht.shared_key_misses",
+    "dht.lookups_sent",
+    "dht.lookups_coalesced",
+    "dht.lookups_dropped",
+    "ping_array.overwritten",
+
+    "crypto.packets_resent",
+    "crypto.connections_timedout",
+    "crypto.packet_send_rate",
+    "crypto.handshakes_dropped",
+    "crypto.cookie_cache_hits",
+
+    "tcp_server.packets_recv",
+    "tcp_server.connections",
+    "tcp_server.priority_queue",
+
+    "onion.announces_sent",
+    "onion.announce_responses",
+    "onion.paths_created",
+    "onion.path_timeouts",
+    "onion.path_failures",
+    "onion.path_pool_hits",
+    "onion.packets_relayed",
+    "onion.friend_searches",
+    "onion.friend_searches_deferred",
+
+    "av.audio_frames_sent",
+    "av.video_frames_sent",
+    "av.video_frames_dropped",
+    "av.send_failures",
+};
+
+static const char *const metric_histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "crypto.rtt_ms",
+    "av.audio_encode_us",
+    "av.video_encode_us",
+    "onion.relay_batch_size",
+    "crypto.handshake_wait_ms",
+};
+
+const char *metrics_name(Metric_Id id)
+{
+    if ((unsigned int)id >= METRIC_COUNT) {
+        return nullptr;
+    }
+
+    return metric_names[id];
+}
+
+const char *metrics_histogram_name(Metric_Histogram_Id id)
+{
+    if ((unsigned int)id >= METRIC_HISTOGRAM_COUNT) {
+        return nullptr;
+    }
+
+    return metric_histogram_names[id];
+}
+
+void metrics_snapshot(const Metrics *metrics, uint64_t *values)
+{
+    for (uint32_t i = 0; i < METRIC_COUNT; ++i) {
+        values[i] = metrics_atomic_load(&metrics->values[i]);
+    }
+
+    /* Totals are not counted separately to keep networking_poll() and
+     * sendpacket() down to two atomic adds per packet. */
+    values[METRIC_NET_PACKETS_RECV] = 0;
+    values[METRIC_NET_BYTES_RECV] = 0;
+    values[METRIC_NET_PACKETS_SENT] = 0;
+    values[METRIC_NET_BYTES_SENT] = 0;
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        values[METRIC_NET_PACKETS_RECV] += metrics_atomic_load(&metrics->packets_recv[i]);
+        values[METRIC_NET_BYTES_RECV] += metrics_atomic_load(&metrics->bytes_recv[i]);
+        values[METRIC_NET_PACKETS_SENT] += metrics_atomic_load(&metrics->packets_sent[i]);
+        values[METRIC_NET_BYTES_SENT] += metrics_atomic_load(&metrics->bytes_sent[i]);
+    }
+}
+
+void metrics_histogram_snapshot(const Metrics *metrics, Metric_Histogram_Id id, uint64_t *buckets)
+{
+    const Metric_Histogram *histogram = &metrics->histograms[id];
+
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+        buckets[i] = metrics_atomic_load(&histogram->buckets[i]);
+    }
+}
+
+uint64_t metrics_time_ns(void)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL
+           + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+int metrics_set_handler_timing(Metrics *metrics, bool enabled)
+{
+    if (enabled && !metrics->handler_times) {
+        metrics->handler_times = (Metric_Handler_Times *)calloc(1, sizeof(Metric_Handler_Times));
+
+        if (!metrics->handler_times) {
+            return -1;
+        }
+    }
+
+    metrics->handler_timing = enabled;
+    return 0;
+}
+
+uint64_t metrics_handler_snapshot(const Metrics *metrics, Metric_Dispatch dispatch, uint8_t packet_id,
+                                  uint64_t *buckets)
+{
+    if (!metrics->handler_times) {
+        if (buckets) {
+            memset(buckets, 0, METRIC_HISTOGRAM_BUCKETS * sizeof(uint64_t));
+        }
+
+        return 0;
+    }
+
+    const Metric_Histogram *histogram = &metrics->handler_times->histograms[dispatch][packet_id];
+
+    if (buckets) {
+        for (uint32_t i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+            buckets[i] = metrics_atomic_load(&histogram->buckets[i]);
+        }
+    }
+
+    return metrics_atomic_load(&histogram->sum);
+}
+
+static void handler_stat(const Metrics *metrics, Metric_Dispatch dispatch, uint8_t packet_id,
+                         Metric_Handler_Stat *stat)
+{
+    uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+
+    stat->dispatch = dispatch;
+    stat->packet_id = packet_id;
+    stat->total_ns = metrics_handler_snapshot(metrics, dispatch, packet_id, buckets);
+    stat->count = 0;
+    stat->p99_ns = 0;
+
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+        stat->count += buckets[i];
+    }
+
+    const uint64_t rank = stat->count - stat->count / 100;
+    uint64_t seen = 0;
+
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_BUCKETS && stat->count; ++i) {
+        seen += buckets[i];
+
+        if (seen >= rank) {
+            stat->p99_ns = (1ULL << i) - 1;
+            break;
+        }
+    }
+}
+
+uint32_t metrics_handler_top(const Metrics *metrics, Metric_Handler_Stat *top, uint32_t max)
+{
+    uint32_t num = 0;
+
+    if (!metrics->handler_times) {
+        return 0;
+    }
+
+    for (uint32_t dispatch = 0; dispatch < METRIC_DISPATCH_COUNT; ++dispatch) {
+        for (uint32_t id = 0; id < 256; ++id) {
+            Metric_Handler_Stat stat;
+            handler_stat(metrics, (Metric_Dispatch)dispatch, id, &stat);
+
+            if (stat.count == 0) {
+                continue;
+            }
+
+            /* Insertion into the sorted top list, max is small. */
+            uint32_t pos = num;
+
+            while (pos > 0 && top[pos - 1].total_ns < stat.total_ns) {
+                if (pos < max) {
+                    top[pos] = top[pos - 1];
+                }
+
+                --pos;
+            }
+
+            if (pos < max) {
+                top[pos] = stat;
+
+                if (num < max) {
+                    ++num;
+                }
+            }
+        }
+    }
+
+    return num;
+}
+
+void metrics_kill(Metrics *metrics)
+{
+    free(metrics->handler_times);
+    metrics->handler_times = nullptr;
+    metrics->handler_timing = 0;
+}
@@ -0,0 +1,300 @@
+/*
+ * Lock-free counters, gauges and histograms describing what a Tox instance does.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ccompat.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Scalar metrics. Counters only ever go up, gauges are overwritten with the
+ * current value by the subsystem owning them.
+ */
+typedef enum Metric_Id {
+    /* Sums of the per packet id counters, filled in by metrics_snapshot(). */
+    METRIC_NET_PACKETS_RECV,
+    METRIC_NET_BYTES_RECV,
+    METRIC_NET_PACKETS_SENT,
+    METRIC_NET_BYTES_SENT,
+
+    METRIC_NET_PACKETS_UNHANDLED,
+    METRIC_NET_SEND_FAILURES,
+    METRIC_NET_PACKETS_RATE_LIMITED,        /* dropped by networking_set_rate_limit() budgets */
+
+    METRIC_DHT_SHARED_KEY_HITS,
+    METRIC_DHT_SHARED_KEY_MISSES,
+    METRIC_DHT_LOOKUPS_SENT,                /* get nodes requests sent from the lookup queue */
+    METRIC_DHT_LOOKUPS_COALESCED,           /* queued requests an outstanding one made redundant */
+    METRIC_DHT_LOOKUPS_DROPPED,             /* queued requests dropped because they got too old */
+    METRIC_PING_ARRAY_OVERWRITTEN,          /* ping ids reused before their reply came or timed out */
+
+    METRIC_CRYPTO_PACKETS_RESENT,
+    METRIC_CRYPTO_CONNECTIONS_TIMEDOUT,
+    METRIC_CRYPTO_PACKET_SEND_RATE,         /* gauge, packets per second over all connections */
+    METRIC_CRYPTO_HANDSHAKES_DROPPED,       /* new connection handshakes that found the queue full */
+    METRIC_CRYPTO_COOKIE_CACHE_HITS,        /* cookie requests answered from the cache */
+
+    METRIC_TCP_SERVER_PACKETS_RECV,
+    METRIC_TCP_SERVER_CONNECTIONS,          /* gauge */
+    METRIC_TCP_SERVER_PRIORITY_QUEUE,       /* gauge, packets waiting in priority queues */
+
+    METRIC_ONION_ANNOUNCES_SENT,
+    METRIC_ONION_ANNOUNCE_RESPONSES,
+    METRIC_ONION_PATHS_CREATED,
+    METRIC_ONION_PATH_TIMEOUTS,
+    METRIC_ONION_PATH_FAILURES,
+    METRIC_ONION_PATH_POOL_HITS,            /* new paths taken from the precomputed pool */
+    METRIC_ONION_PACKETS_RELAYED,           /* onion packets forwarded for other nodes */
+    METRIC_ONION_FRIEND_SEARCHES,           /* runs of the search for one offline friend */
+    METRIC_ONION_FRIEND_SEARCHES_DEFERRED,  /* seconds in which due searches hit the search rate */
+
+    METRIC_AV_AUDIO_FRAMES_SENT,
+    METRIC_AV_VIDEO_FRAMES_SENT,
+    METRIC_AV_VIDEO_FRAMES_DROPPED,
+    METRIC_AV_SEND_FAILURES,
+
+    METRIC_COUNT
+} Metric_Id;
+
+typedef enum Metric_Histogram_Id {
+    METRIC_HISTOGRAM_CRYPTO_RTT_MS,
+    METRIC_HISTOGRAM_AV_AUDIO_ENCODE_US,
+    METRIC_HISTOGRAM_AV_VIDEO_ENCODE_US,
+    METRIC_HISTOGRAM_ONION_RELAY_BATCH,     /* packets relayed per onion_set_relay_threads() batch */
+    METRIC_HISTOGRAM_CRYPTO_HANDSHAKE_WAIT_MS, /* time new connection handshakes spent queued */
+
+    METRIC_HISTOGRAM_COUNT
+} Metric_Histogram_Id;
+
+/* Bucket 0 counts the value 0, bucket n counts values in [2^(n-1), 2^n) and
+ * the last bucket also counts everything above.
+ */
+#define METRIC_HISTOGRAM_BUCKETS 32
+
+typedef struct Metric_Histogram {
+    uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+    uint64_t sum;
+} Metric_Histogram;
+
+/* Packet dispatch points whose handlers can be timed. */
+typedef enum Metric_Dispatch {
+    METRIC_DISPATCH_NET,        /* networking_poll(), by UDP packet id */
+    METRIC_DISPATCH_CRYPTO,     /* cryptopacket_handle(), by crypto request id */
+    METRIC_DISPATCH_DATA,       /* handle_data_packet_core(), by lossless/lossy packet id */
+
+    METRIC_DISPATCH_COUNT
+} Metric_Dispatch;
+
+/* Time spent in each handler, in nanoseconds. Times are inclusive: a
+ * NET_PACKET_CRYPTO_DATA handler also counts the data handlers it calls.
+ */
+typedef struct Metric_Handler_Times {
+    Metric_Histogram histograms[METRIC_DISPATCH_COUNT][256];
+} Metric_Handler_Times;
+
+typedef struct Metrics {
+    uint64_t values[METRIC_COUNT];
+
+    /* Indexed by the first byte of the UDP packet. */
+    uint64_t packets_recv[256];
+    uint64_t bytes_recv[256];
+    uint64_t packets_sent[256];
+    uint64_t bytes_sent[256];
+
+    Metric_Histogram histograms[METRIC_HISTOGRAM_COUNT];
+
+    /* Allocated the first time handler timing is enabled, kept until metrics_kill(). */
+    Metric_Handler_Times *handler_times;
+    bool handler_timing;
+} Metrics;
+
+/* Updates are relaxed atomic operations: they are safe to do from any thread
+ * (toxav sends from client threads) and cost a single locked add.
+ */
+#ifdef _MSC_VER
+#define metrics_atomic_add(p, n) _InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(n))
+#define metrics_atomic_load(p) ((uint64_t)_InterlockedCompareExchange64((volatile __int64 *)(p), 0, 0))
+#else
+#define metrics_atomic_add(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define metrics_atomic_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+static inline void metrics_add(Metrics *metrics, Metric_Id id, uint64_t n)
+{
+    metrics_atomic_add(&metrics->values[id], n);
+}
+
+static inline void metrics_inc(Metrics *metrics, Metric_Id id)
+{
+    metrics_atomic_add(&metrics->values[id], 1);
+}
+
+static inline void metrics_set(Metrics *metrics, Metric_Id id, uint64_t value)
+{
+#ifdef _MSC_VER
+    volatile __int64 *p = (volatile __int64 *)&metrics->values[id];
+    __int64 old = *p;
+    __int64 prev;
+
+    while ((prev = _InterlockedCompareExchange64(p, (__int64)value, old)) != old) {
+        old = prev;
+    }
+
+#else
+    __atomic_store_n(&metrics->values[id], value, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void metrics_packet_recv(Metrics *metrics, uint8_t packet_id, uint32_t length)
+{
+    metrics_atomic_add(&metrics->packets_recv[packet_id], 1);
+    metrics_atomic_add(&metrics->bytes_recv[packet_id], length);
+}
+
+static inline void metrics_packet_sent(Metrics *metrics, uint8_t packet_id, uint32_t length)
+{
+    metrics_atomic_add(&metrics->packets_sent[packet_id], 1);
+    metrics_atomic_add(&metrics->bytes_sent[packet_id], length);
+}
+
+/* return the histogram bucket value falls into.
+ */
+static inline uint32_t metrics_bucket(uint64_t value)
+{
+    uint32_t bits = 0;
+
+#ifdef __GNUC__
+
+    if (value) {
+        bits = 64 - __builtin_clzll(value);
+    }
+
+#else
+
+    while (value) {
+        ++bits;
+        value >>= 1;
+    }
+
+#endif
+
+    return bits < METRIC_HISTOGRAM_BUCKETS ? bits : METRIC_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void metrics_observe(Metrics *metrics, Metric_Histogram_Id id, uint64_t value)
+{
+    Metric_Histogram *histogram = &metrics->histograms[id];
+    metrics_atomic_add(&histogram->buckets[metrics_bucket(value)], 1);
+    metrics_atomic_add(&histogram->sum, value);
+}
+
+/* return the name of the metric, e.g. "net.packets_recv".
+ * return NULL if id is not a valid metric.
+ */
+const char *metrics_name(Metric_Id id);
+
+/* return the name of the histogram, e.g. "crypto.rtt_ms".
+ * return NULL if id is not a valid histogram.
+ */
+const char *metrics_histogram_name(Metric_Histogram_Id id);
+
+/* Copy the current value of all METRIC_COUNT metrics to values.
+ */
+void metrics_snapshot(const Metrics *metrics, uint64_t *values);
+
+/* Copy the METRIC_HISTOGRAM_BUCKETS buckets of histogram id to buckets.
+ */
+void metrics_histogram_snapshot(const Metrics *metrics, Metric_Histogram_Id id, uint64_t *buckets);
+
+/* return a monotonic timestamp in nanoseconds for timing short operations.
+ */
+uint64_t metrics_time_ns(void);
+
+/* Turn timing of packet handlers on or off. Must be called from the thread
+ * running the dispatch loops.
+ *
+ * return 0 on success.
+ * return -1 if memory for the histograms could not be allocated.
+ */
+int metrics_set_handler_timing(Metrics *metrics, bool enabled);
+
+/* Copy the METRIC_HISTOGRAM_BUCKETS buckets of the handler time histogram of
+ * packet_id to buckets, if buckets is not NULL.
+ *
+ * return the total number of nanoseconds spent in the handler.
+ */
+uint64_t metrics_handler_snapshot(const Metrics *metrics, Metric_Dispatch dispatch, uint8_t packet_id,
+                                  uint64_t *buckets);
+
+typedef struct Metric_Handler_Stat {
+    Metric_Dispatch dispatch;
+    uint8_t packet_id;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t p99_ns; /* upper bound of the bucket holding the 99th percentile */
+} Metric_Handler_Stat;
+
+/* Fill top with the (at most) max handlers that used the most time in total,
+ * most expensive first.
+ *
+ * return the number of entries written.
+ */
+uint32_t metrics_handler_top(const Metrics *metrics, Metric_Handler_Stat *top, uint32_t max);
+
+/* Free memory held by metrics. */
+void metrics_kill(Metrics *metrics);
+
+/* return the time to pass to metrics_handler_done() when handler timing is on.
+ * return 0 if it is off.
+ */
+static inline uint64_t metrics_handler_start(const Metrics *metrics)
+{
+    return metrics->handler_timing ? metrics_time_ns() : 0;
+}
+
+/* Count the time since start in the histogram of handler packet_id of dispatch.
+ */
+static inline void metrics_handler_done(Metrics *metrics, Metric_Dispatch dispatch, uint8_t packet_id, uint64_t start)
+{
+    if (start != 0) {
+        Metric_Histogram *histogram = &metrics->handler_times->histograms[dispatch][packet_id];
+        const uint64_t time = metrics_time_ns() - start;
+        metrics_atomic_add(&histogram->buckets[metrics_bucket(time)], 1);
+        metrics_atomic_add(&histogram->sum, time);
+    }
+}
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* METRICS_H */
@@ -124,6 +124,40 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 } Crypto_Connection;
 
+/* cookie timeout in seconds */
+#define COOKIE_TIMEOUT 15
+#define COOKIE_DATA_LENGTH (CRYPTO_PUBLIC_KEY_SIZE * 2)
+#define COOKIE_CONTENTS_LENGTH (sizeof(uint64_t) + COOKIE_DATA_LENGTH)
+#define COOKIE_LENGTH (CRYPTO_NONCE_SIZE + COOKIE_CONTENTS_LENGTH + CRYPTO_MAC_SIZE)
+
+#define COOKIE_REQUEST_PLAIN_LENGTH (COOKIE_DATA_LENGTH + sizeof(uint64_t))
+#define COOKIE_REQUEST_LENGTH (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + COOKIE_REQUEST_PLAIN_LENGTH + CRYPTO_MAC_SIZE)
+#define COOKIE_RESPONSE_LENGTH (1 + CRYPTO_NONCE_SIZE + COOKIE_LENGTH + sizeof(uint64_t) + CRYPTO_MAC_SIZE)
+
+/* Seconds a cached cookie response is resent for, leaving the cookie in it
+ * most of COOKIE_TIMEOUT to be used in a handshake. */
+#define COOKIE_CACHE_TIMEOUT (COOKIE_TIMEOUT / 3)
+
+#define HANDSHAKE_PACKET_LENGTH (1 + COOKIE_LENGTH + CRYPTO_NONCE_SIZE + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SHA512_SIZE + COOKIE_LENGTH + CRYPTO_MAC_SIZE)
+
+/* A handshake from a peer we have no connection with, waiting for
+ * do_net_crypto() to handle it.
+ */
+typedef struct {
+    IP_Port source;
+    uint64_t time; /* when it was queued, for the crypto.handshake_wait_ms histogram */
+    uint8_t packet[HANDSHAKE_PACKET_LENGTH];
+} Handshake_Request;
+
+/* A cookie request and the response sent to it. Peers resend the same request
+ * until they get a response and often send it over several paths at once.
+ */
+typedef struct {
+    uint64_t time; /* 0 if the entry is empty */
+    uint8_t request[COOKIE_REQUEST_LENGTH];
+    uint8_t response[COOKIE_RESPONSE_LENGTH];
+} Cookie_Cache_Entry;
+
 struct Net_Crypto {
     Logger *log;
 
@@ -152,6 +186,18 @@ struct Net_Crypto {
     uint32_t current_sleep_time;
 
     BS_LIST ip_port_list;
+
+    /* Ring buffer of handshakes starting new connections, allocated while it
+     * isn't empty and grown up to CRYPTO_HANDSHAKE_QUEUE_SIZE entries.
+     */
+    Handshake_Request *handshake_queue;
+    uint32_t handshake_queue_size;
+    uint32_t handshake_queue_start;
+    uint32_t handshake_queue_num;
+    /* Cookie nonces of the queued handshakes. */
+    BS_LIST handshake_nonces;
+
+    Cookie_Cache_Entry cookie_cache[CRYPTO_COOKIE_CACHE_SIZE];
 };
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c)
@@ -191,16 +237,6 @@ static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_conn
     return 0;
 }
 
-/* cookie timeout in seconds */
-#define COOKIE_TIMEOUT 15
-#define COOKIE_DATA_LENGTH (CRYPTO_PUBLIC_KEY_SIZE * 2)
-#define COOKIE_CONTENTS_LENGTH (sizeof(uint64_t) + COOKIE_DATA_LENGTH)
-#define COOKIE_LENGTH (CRYPTO_NONCE_SIZE + COOKIE_CONTENTS_LENGTH + CRYPTO_MAC_SIZE)
-
-#define COOKIE_REQUEST_PLAIN_LENGTH (COOKIE_DATA_LENGTH + sizeof(uint64_t))
-#define COOKIE_REQUEST_LENGTH (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + COOKIE_REQUEST_PLAIN_LENGTH + CRYPTO_MAC_SIZE)
-#define COOKIE_RESPONSE_LENGTH (1 + CRYPTO_NONCE_SIZE + COOKIE_LENGTH + sizeof(uint64_t) + CRYPTO_MAC_SIZE)
-
 /* Create a cookie request packet and put it in packet.
  * dht_public_key is the dht public key of the other
  *
@@ -342,23 +378,59 @@ static int handle_cookie_request(const Net_Crypto *c, uint8_t *request_plain, ui
     return 0;
 }
 
-/* Handle the cookie request packet (for raw UDP)
+/* Create the response to the cookie request packet of length length and put
+ * it in response. Resent requests are answered from the cookie cache.
+ * response must be of size COOKIE_RESPONSE_LENGTH or bigger.
+ *
+ * return -1 on failure.
+ * return COOKIE_RESPONSE_LENGTH on success.
  */
-static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
-                                     void *userdata)
+static int get_cookie_response(Net_Crypto *c, uint8_t *response, const uint8_t *packet, uint16_t length)
 {
-    Net_Crypto *c = (Net_Crypto *)object;
+    if (length != COOKIE_REQUEST_LENGTH) {
+        return -1;
+    }
+
+    /* The nonce of the request is random, so any of its bytes make a good index. */
+    uint32_t index;
+    memcpy(&index, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, sizeof(index));
+    Cookie_Cache_Entry *entry = &c->cookie_cache[index % CRYPTO_COOKIE_CACHE_SIZE];
+    const uint64_t temp_time = unix_time();
+
+    if (entry->time != 0 && entry->time + COOKIE_CACHE_TIMEOUT >= temp_time
+            && memcmp(entry->request, packet, COOKIE_REQUEST_LENGTH) == 0) {
+        metrics_inc(net_metrics(dht_get_net(c->dht)), METRIC_CRYPTO_COOKIE_CACHE_HITS);
+        memcpy(response, entry->response, COOKIE_RESPONSE_LENGTH);
+        return COOKIE_RESPONSE_LENGTH;
+    }
+
     uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
 
     if (handle_cookie_request(c, request_plain, shared_key, dht_public_key, packet, length) != 0) {
-        return 1;
+        return -1;
     }
 
+    if (create_cookie_response(c, response, request_plain, shared_key, dht_public_key) != COOKIE_RESPONSE_LENGTH) {
+        return -1;
+    }
+
+    entry->time = temp_time;
+    memcpy(entry->request, packet, COOKIE_REQUEST_LENGTH);
+    memcpy(entry->response, response, COOKIE_RESPONSE_LENGTH);
+    return COOKIE_RESPONSE_LENGTH;
+}
+
+/* Handle the cookie request packet (for raw UDP)
+ */
+static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                     void *userdata)
+{
+    Net_Crypto *c = (Net_Crypto *)object;
     uint8_t data[COOKIE_RESPONSE_LENGTH];
 
-    if (create_cookie_response(c, data, request_plain, shared_key, dht_public_key) != sizeof(data)) {
+    if (get_cookie_response(c, data, packet, length) != sizeof(data)) {
         return 1;
     }
 
@@ -373,17 +445,9 @@ static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t
  */
 static int tcp_handle_cookie_request(Net_Crypto *c, int connections_number, const uint8_t *packet, uint16_t length)
 {
-    uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
-
-    if (handle_cookie_request(c, request_plain, shared_key, dht_public_key, packet, length) != 0) {
-        return -1;
-    }
-
     uint8_t data[COOKIE_RESPONSE_LENGTH];
 
-    if (create_cookie_response(c, data, request_plain, shared_key, dht_public_key) != sizeof(data)) {
+    if (get_cookie_response(c, data, packet, length) != sizeof(data)) {
         return -1;
     }
 
@@ -393,24 +457,16 @@ static int tcp_handle_cookie_request(Net_Crypto *c, int connections_number, cons
 
 /* Handle the cookie request packet (for TCP oob packets)
  */
-static int tcp_oob_handle_cookie_request(const Net_Crypto *c, unsigned int tcp_connections_number,
+static int tcp_oob_handle_cookie_request(Net_Crypto *c, unsigned int tcp_connections_number,
         const uint8_t *dht_public_key, const uint8_t *packet, uint16_t length)
 {
-    uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint8_t dht_public_key_temp[CRYPTO_PUBLIC_KEY_SIZE];
-
-    if (handle_cookie_request(c, request_plain, shared_key, dht_public_key_temp, packet, length) != 0) {
-        return -1;
-    }
-
-    if (public_key_cmp(dht_public_key, dht_public_key_temp) != 0) {
+    if (length != COOKIE_REQUEST_LENGTH || public_key_cmp(dht_public_key, packet + 1) != 0) {
         return -1;
     }
 
     uint8_t data[COOKIE_RESPONSE_LENGTH];
 
-    if (create_cookie_response(c, data, request_plain, shared_key, dht_public_key) != sizeof(data)) {
+    if (get_cookie_response(c, data, packet, length) != sizeof(data)) {
         return -1;
     }
 
@@ -446,8 +502,6 @@ static int handle_cookie_response(uint8_t *cookie, uint64_t *number, const uint8
     return COOKIE_LENGTH;
 }
 
-#define HANDSHAKE_PACKET_LENGTH (1 + COOKIE_LENGTH + CRYPTO_NONCE_SIZE + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SHA512_SIZE + COOKIE_LENGTH + CRYPTO_MAC_SIZE)
-
 /* Create a handshake packet and put it in packet.
  * cookie must be COOKIE_LENGTH bytes.
  * packet must be of size HANDSHAKE_PACKET_LENGTH or bigger.
@@ -1030,8 +1084,15 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *const *parts, const size_t *lengths,
+                            uint16_t num_parts)
 {
+    size_t length = 0;
+
+    for (uint16_t i = 0; i < num_parts; ++i) {
+        length += lengths[i];
+    }
+
     if (length == 0 || length + (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE) > MAX_CRYPTO_PACKET_SIZE) {
         return -1;
     }
@@ -1046,7 +1107,8 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
     VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
     packet[0] = NET_PACKET_CRYPTO_DATA;
     memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    int len = encrypt_data_symmetric_gather(conn->shared_key, conn->sent_nonce, parts, lengths, num_parts,
+                                            packet + 1 + sizeof(uint16_t));
 
     if (len + 1 + sizeof(uint16_t) != SIZEOF_VLA(packet)) {
         pthread_mutex_unlock(&conn->mutex);
@@ -1060,27 +1122,45 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
 }
 
 /* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ *
+ * The packet data is header followed by data. header may be NULL if header_length is 0.
+ * Both are handed to the encryption as they are instead of being joined first.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static int send_data_packet_helper_split(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+        const uint8_t *header, uint16_t header_length, const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    const uint32_t total_length = (uint32_t)header_length + length;
+
+    if (total_length == 0 || total_length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
     num = net_htonl(num);
     buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - total_length) % CRYPTO_MAX_PADDING;
+    uint8_t prefix[sizeof(uint32_t) + sizeof(uint32_t) + CRYPTO_MAX_PADDING];
+    memcpy(prefix, &buffer_start, sizeof(uint32_t));
+    memcpy(prefix + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(prefix + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
 
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    const uint8_t *const parts[3] = {prefix, header, data};
+    const size_t lengths[3] = {(sizeof(uint32_t) * 2) + padding_length, header_length, length};
+
+    return send_data_packet(c, crypt_connection_id, parts, lengths, 3);
+}
+
+/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    return send_data_packet_helper_split(c, crypt_connection_id, buffer_start, num, nullptr, 0, data, length);
 }
 
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
@@ -1504,6 +1584,7 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
 
     uint8_t *real_data = data + (sizeof(uint32_t) * 2);
     uint16_t real_length = len - (sizeof(uint32_t) * 2);
+    Metrics *metrics = net_metrics(dht_get_net(c->dht));
 
     while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
         ++real_data;
@@ -1564,8 +1645,10 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             }
 
             if (conn->connection_data_callback) {
+                const uint64_t start = metrics_handler_start(metrics);
                 conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
                                                dt.length, userdata);
+                metrics_handler_done(metrics, METRIC_DISPATCH_DATA, dt.data[0], start);
             }
 
             /* conn might get killed in callback. */
@@ -1584,8 +1667,10 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         set_buffer_end(&conn->recv_array, num);
 
         if (conn->connection_lossy_data_callback) {
+            const uint64_t start = metrics_handler_start(metrics);
             conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
                                                  conn->connection_lossy_data_callback_id, real_data, real_length, userdata);
+            metrics_handler_done(metrics, METRIC_DISPATCH_DATA, real_data[0], start);
         }
     } else {
         return -1;
@@ -1593,6 +1678,7 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
 
     if (rtt_calc_time != 0) {
         uint64_t rtt_time = current_time_monotonic() - rtt_calc_time;
+        metrics_observe(metrics, METRIC_HISTOGRAM_CRYPTO_RTT_MS, rtt_time);
 
         if (rtt_time < conn->rtt_time) {
             conn->rtt_time = rtt_time;
@@ -1930,6 +2016,113 @@ static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const
     return ret;
 }
 
+/* Put a handshake by someone who wants to initiate a new connection with us in
+ * the handshake queue. Only the cookie is checked here, that is cheap and keeps
+ * handshakes that don't carry one of our cookies out of the queue. Resent
+ * handshakes that are still queued are ignored. The queue grows as needed, as
+ * a handshake that finds it full waits for the next resend.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+/* Double the size of the handshake queue.
+ *
+ * return -1 if it has CRYPTO_HANDSHAKE_QUEUE_SIZE entries already or on failure.
+ * return 0 on success.
+ */
+static int grow_handshake_queue(Net_Crypto *c)
+{
+    const uint32_t old_size = c->handshake_queue_size;
+    const uint32_t new_size = old_size == 0 ? 16 : old_size * 2;
+
+    if (new_size > CRYPTO_HANDSHAKE_QUEUE_SIZE) {
+        return -1;
+    }
+
+    Handshake_Request *new_queue = (Handshake_Request *)realloc(c->handshake_queue,
+                                   new_size * sizeof(Handshake_Request));
+
+    if (new_queue == nullptr) {
+        return -1;
+    }
+
+    /* The queue is full, so the entries that wrapped around to the start of it
+     * are the ones before handshake_queue_start. Move them after the old end.
+     */
+    memcpy(&new_queue[old_size], new_queue, c->handshake_queue_start * sizeof(Handshake_Request));
+
+    c->handshake_queue = new_queue;
+    c->handshake_queue_size = new_size;
+    return 0;
+}
+
+static int queue_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    if (length != HANDSHAKE_PACKET_LENGTH) {
+        return -1;
+    }
+
+    uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+
+    if (open_cookie(cookie_plain, data + 1, c->secret_symmetric_key) != 0) {
+        return -1;
+    }
+
+    /* Resent handshakes are identical, the random nonce of the cookie is enough to tell. */
+    if (bs_list_find(&c->handshake_nonces, data + 1) != -1) {
+        return 0;
+    }
+
+    if (c->handshake_queue_num == c->handshake_queue_size && grow_handshake_queue(c) != 0) {
+        /* The peer resends it in CRYPTO_SEND_PACKET_INTERVAL. */
+        metrics_inc(net_metrics(dht_get_net(c->dht)), METRIC_CRYPTO_HANDSHAKES_DROPPED);
+        return -1;
+    }
+
+    if (!bs_list_add(&c->handshake_nonces, data + 1, 0)) {
+        return -1;
+    }
+
+    Handshake_Request *request = &c->handshake_queue[(c->handshake_queue_start + c->handshake_queue_num) %
+                                 c->handshake_queue_size];
+    request->source = source;
+    request->time = current_time_monotonic();
+    memcpy(request->packet, data, HANDSHAKE_PACKET_LENGTH);
+    ++c->handshake_queue_num;
+    return 0;
+}
+
+/* Handle at most CRYPTO_HANDSHAKE_BUDGET queued handshakes, oldest first.
+ */
+static void do_handshake_queue(Net_Crypto *c, void *userdata)
+{
+    if (c->handshake_queue_num == 0) {
+        return;
+    }
+
+    Metrics *metrics = net_metrics(dht_get_net(c->dht));
+    const uint64_t temp_time = current_time_monotonic();
+    uint32_t budget = CRYPTO_HANDSHAKE_BUDGET;
+
+    while (c->handshake_queue_num > 0 && budget > 0) {
+        const Handshake_Request *request = &c->handshake_queue[c->handshake_queue_start];
+        metrics_observe(metrics, METRIC_HISTOGRAM_CRYPTO_HANDSHAKE_WAIT_MS, temp_time - request->time);
+        handle_new_connection_handshake(c, request->source, request->packet, HANDSHAKE_PACKET_LENGTH, userdata);
+        bs_list_remove(&c->handshake_nonces, request->packet + 1, 0);
+
+        c->handshake_queue_start = (c->handshake_queue_start + 1) % c->handshake_queue_size;
+        --c->handshake_queue_num;
+        --budget;
+    }
+
+    if (c->handshake_queue_num == 0) {
+        free(c->handshake_queue);
+        c->handshake_queue = nullptr;
+        c->handshake_queue_size = 0;
+        c->handshake_queue_start = 0;
+    }
+}
+
 /* Accept a crypto connection.
  *
  * return -1 on failure.
@@ -2136,7 +2329,7 @@ static int tcp_oob_callback(void *object, const uint8_t *public_key, unsigned in
         source.ip.family = TCP_FAMILY;
         source.ip.ip.v6.uint32[0] = tcp_connections_number;
 
-        if (handle_new_connection_handshake(c, source, data, length, userdata) != 0) {
+        if (queue_new_connection_handshake(c, source, data, length) != 0) {
             return -1;
         }
 
@@ -2392,7 +2585,7 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
             return 1;
         }
 
-        if (handle_new_connection_handshake(c, source, packet, length, userdata) != 0) {
+        if (queue_new_connection_handshake(c, source, packet, length) != 0) {
             return 1;
         }
 
@@ -2444,6 +2637,7 @@ static void send_crypto_packets(Net_Crypto *c)
     uint32_t i;
     uint64_t temp_time = current_time_monotonic();
     double total_send_rate = 0;
+    double metrics_send_rate = 0;
     uint32_t peak_request_packet_interval = ~0;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
@@ -2635,6 +2829,7 @@ static void send_crypto_packets(Net_Crypto *c)
             if (ret != -1) {
                 conn->packets_left_requested -= ret;
                 conn->packets_resent += ret;
+                metrics_add(net_metrics(dht_get_net(c->dht)), METRIC_CRYPTO_PACKETS_RESENT, ret);
 
                 if ((unsigned int)ret < conn->packets_left) {
                     conn->packets_left -= ret;
@@ -2647,9 +2842,13 @@ static void send_crypto_packets(Net_Crypto *c)
             if (conn->packet_send_rate > CRYPTO_PACKET_MIN_RATE * 1.5) {
                 total_send_rate += conn->packet_send_rate;
             }
+
+            metrics_send_rate += conn->packet_send_rate;
         }
     }
 
+    metrics_set(net_metrics(dht_get_net(c->dht)), METRIC_CRYPTO_PACKET_SEND_RATE, metrics_send_rate);
+
     c->current_sleep_time = ~0;
     uint32_t sleep_time = peak_request_packet_interval;
 
@@ -2776,6 +2975,19 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
     return -1;
 }
 
+int crypto_send_window(const Net_Crypto *c, int crypt_connection_id, uint32_t *buffer_start, uint32_t *buffer_end)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    *buffer_start = conn->send_array.buffer_start;
+    *buffer_end = conn->send_array.buffer_end;
+    return 0;
+}
+
 /* return -1 on failure.
  * return 0 on success.
  *
@@ -2783,15 +2995,25 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    return send_lossy_cryptpacket_split(c, crypt_connection_id, nullptr, 0, data, length);
+}
+
+int send_lossy_cryptpacket_split(Net_Crypto *c, int crypt_connection_id, const uint8_t *header, uint16_t header_length,
+                                 const uint8_t *data, uint16_t length)
+{
+    const uint32_t total_length = (uint32_t)header_length + length;
+
+    if (total_length == 0 || total_length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
-    if (data[0] < PACKET_ID_LOSSY_RANGE_START) {
+    const uint8_t packet_id = header_length ? header[0] : data[0];
+
+    if (packet_id < PACKET_ID_LOSSY_RANGE_START) {
         return -1;
     }
 
-    if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
+    if (packet_id >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
         return -1;
     }
 
@@ -2808,7 +3030,8 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         uint32_t buffer_start = conn->recv_array.buffer_start;
         uint32_t buffer_end = conn->send_array.buffer_end;
         pthread_mutex_unlock(&conn->mutex);
-        ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
+        ret = send_data_packet_helper_split(c, crypt_connection_id, buffer_start, buffer_end, header, header_length, data,
+                                            length);
     }
 
     pthread_mutex_lock(&c->connections_mutex);
@@ -2968,8 +3191,13 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
     networking_registerhandler(dht_get_net(dht), NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
+    networking_set_rate_limit(dht_get_net(dht), NET_PACKET_COOKIE_REQUEST, CRYPTO_COOKIE_REQUEST_RATE,
+                              CRYPTO_COOKIE_REQUEST_BURST, CRYPTO_COOKIE_REQUEST_TOTAL_RATE);
+    networking_set_rate_limit(dht_get_net(dht), NET_PACKET_CRYPTO_HS, CRYPTO_HANDSHAKE_RATE, CRYPTO_HANDSHAKE_BURST,
+                              CRYPTO_HANDSHAKE_TOTAL_RATE);
 
     bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
+    bs_list_init(&temp->handshake_nonces, CRYPTO_NONCE_SIZE, 8);
 
     return temp;
 }
@@ -2996,6 +3224,7 @@ static void kill_timedout(Net_Crypto *c, void *userdata)
                 continue;
             }
 
+            metrics_inc(net_metrics(dht_get_net(c->dht)), METRIC_CRYPTO_CONNECTIONS_TIMEDOUT);
             connection_kill(c, i, userdata);
         }
 
@@ -3013,6 +3242,11 @@ static void kill_timedout(Net_Crypto *c, void *userdata)
  */
 uint32_t crypto_run_interval(const Net_Crypto *c)
 {
+    /* Queued handshakes only wait for the budget of the next call, not for a sleep. */
+    if (c->handshake_queue_num != 0) {
+        return 0;
+    }
+
     return c->current_sleep_time;
 }
 
@@ -3022,6 +3256,7 @@ void do_net_crypto(Net_Crypto *c, void *userdata)
     unix_time_update();
     kill_timedout(c, userdata);
     do_tcp(c, userdata);
+    do_handshake_queue(c, userdata);
     send_crypto_packets(c);
 }
 
@@ -3038,6 +3273,8 @@ void kill_net_crypto(Net_Crypto *c)
 
     kill_tcp_connections(c->tcp_c);
     bs_list_free(&c->ip_port_list);
+    bs_list_free(&c->handshake_nonces);
+    free(c->handshake_queue);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_REQUEST, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_HS, nullptr, nullptr);
@@ -43,6 +43,27 @@
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
+/* Cookie requests and handshakes handled per second from one UDP source and
+ * from all of them, see networking_set_rate_limit().
+ */
+#define CRYPTO_COOKIE_REQUEST_RATE 32
+#define CRYPTO_COOKIE_REQUEST_BURST 128
+#define CRYPTO_COOKIE_REQUEST_TOTAL_RATE 2048
+#define CRYPTO_HANDSHAKE_RATE 32
+#define CRYPTO_HANDSHAKE_BURST 128
+#define CRYPTO_HANDSHAKE_TOTAL_RATE 1024
+
+/* Handshakes starting new connections wait in a queue of up to this many
+ * (a power of two) and at most CRYPTO_HANDSHAKE_BUDGET of them are handled per
+ * do_net_crypto() call, so that a storm of reconnecting peers can't stall the
+ * thread running it.
+ */
+#define CRYPTO_HANDSHAKE_QUEUE_SIZE 4096
+#define CRYPTO_HANDSHAKE_BUDGET 32
+
+/* Number of recent cookie responses kept to answer resent cookie requests. */
+#define CRYPTO_COOKIE_CACHE_SIZE 32
+
 /* Minimum packet queue max length. */
 #define CRYPTO_MIN_QUEUE_LENGTH 64
 
@@ -224,6 +245,16 @@ inline int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const u
  */
 int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet_number);
 
+/* Copy the send window of the connection: packets from buffer_start up to (not
+ * including) buffer_end were sent but not acknowledged yet. Every other packet
+ * number sent before buffer_end was received, so a single call can be used to
+ * check many packets (see cryptpacket_received()).
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_send_window(const Net_Crypto *c, int crypt_connection_id, uint32_t *buffer_start, uint32_t *buffer_end);
+
 /* return -1 on failure.
  * return 0 on success.
  *
@@ -231,6 +262,16 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length);
 
+/* return -1 on failure.
+ * return 0 on success.
+ *
+ * Sends a lossy cryptopacket made of header followed by data, without joining them
+ * into one buffer first. (first byte of header, or of data if header_length is 0,
+ * must in the PACKET_ID_LOSSY_RANGE_*)
+ */
+int send_lossy_cryptpacket_split(Net_Crypto *c, int crypt_connection_id, const uint8_t *header, uint16_t header_length,
+                                 const uint8_t *data, uint16_t length);
+
 /* Add a tcp relay, associating it to a crypt_connection_id.
  *
  * return 0 if it was added.
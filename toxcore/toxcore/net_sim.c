@@ -0,0 +1,606 @@
+/*
+ * Deterministic in-process network with virtual time for running many
+ * instances without sockets.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "net_sim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* First external port handed out by simulated NATs. */
+#define NET_SIM_NAT_PORT_START 20000
+
+typedef struct Net_Sim_Packet {
+    struct Net_Sim_Packet *next; /* in the inbox of the receiver */
+    Net_Sim_Host *to;
+    IP_Port from;
+    uint64_t deliver_time;
+    uint64_t seq; /* keeps delivery order stable for equal times */
+    uint16_t length;
+    uint8_t data[];
+} Net_Sim_Packet;
+
+typedef struct Net_Sim_Mapping {
+    IP_Port remote;
+    uint16_t port; /* external port, network byte order */
+} Net_Sim_Mapping;
+
+struct Net_Sim_Host {
+    Net_Sim *sim;
+    Net_Backend backend;
+
+    IP ip;
+    uint16_t port;        /* network byte order */
+    Net_Sim_Nat nat;
+    uint16_t mapped_port; /* cone NATs, network byte order */
+    bool online;
+
+    /* Remote addresses allowed in (restricted) or port per remote (symmetric). */
+    Net_Sim_Mapping *mappings;
+    uint32_t num_mappings;
+
+    uint64_t uplink_busy_until;
+
+    Net_Sim_Packet *inbox_head;
+    Net_Sim_Packet *inbox_tail;
+};
+
+typedef struct Net_Sim_Link_Entry {
+    const Net_Sim_Host *from;
+    const Net_Sim_Host *to;
+    Net_Sim_Link link;
+    uint64_t busy_until;
+} Net_Sim_Link_Entry;
+
+struct Net_Sim {
+    uint64_t time;
+    uint64_t rng;
+    uint64_t seq;
+    uint16_t next_nat_port;
+
+    Net_Sim_Link default_link;
+    Net_Sim_Link_Entry *links;
+    uint32_t num_links;
+
+    Net_Sim_Host **hosts;
+    uint32_t num_hosts;
+
+    /* Packets in flight, a binary min-heap on (deliver_time, seq). */
+    Net_Sim_Packet **queue;
+    uint32_t queue_length;
+    uint32_t queue_size;
+
+    Net_Sim_Stats stats;
+};
+
+static uint64_t sim_random(Net_Sim *sim)
+{
+    /* xorshift64* */
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 2685821657736338717ULL;
+}
+
+static bool packet_before(const Net_Sim_Packet *a, const Net_Sim_Packet *b)
+{
+    if (a->deliver_time != b->deliver_time) {
+        return a->deliver_time < b->deliver_time;
+    }
+
+    return a->seq < b->seq;
+}
+
+static int queue_push(Net_Sim *sim, Net_Sim_Packet *packet)
+{
+    if (sim->queue_length == sim->queue_size) {
+        const uint32_t new_size = sim->queue_size ? sim->queue_size * 2 : 256;
+        Net_Sim_Packet **new_queue = (Net_Sim_Packet **)realloc(sim->queue, new_size * sizeof(Net_Sim_Packet *));
+
+        if (!new_queue) {
+            return -1;
+        }
+
+        sim->queue = new_queue;
+        sim->queue_size = new_size;
+    }
+
+    uint32_t i = sim->queue_length++;
+
+    while (i > 0) {
+        const uint32_t parent = (i - 1) / 2;
+
+        if (!packet_before(packet, sim->queue[parent])) {
+            break;
+        }
+
+        sim->queue[i] = sim->queue[parent];
+        i = parent;
+    }
+
+    sim->queue[i] = packet;
+    return 0;
+}
+
+static Net_Sim_Packet *queue_pop(Net_Sim *sim)
+{
+    Net_Sim_Packet *top = sim->queue[0];
+    Net_Sim_Packet *last = sim->queue[--sim->queue_length];
+    uint32_t i = 0;
+
+    while (1) {
+        uint32_t child = i * 2 + 1;
+
+        if (child >= sim->queue_length) {
+            break;
+        }
+
+        if (child + 1 < sim->queue_length && packet_before(sim->queue[child + 1], sim->queue[child])) {
+            ++child;
+        }
+
+        if (!packet_before(sim->queue[child], last)) {
+            break;
+        }
+
+        sim->queue[i] = sim->queue[child];
+        i = child;
+    }
+
+    if (sim->queue_length) {
+        sim->queue[i] = last;
+    }
+
+    return top;
+}
+
+static Net_Sim_Mapping *find_mapping(const Net_Sim_Host *host, const IP_Port *remote)
+{
+    for (uint32_t i = 0; i < host->num_mappings; ++i) {
+        if (ipport_equal(&host->mappings[i].remote, remote)) {
+            return &host->mappings[i];
+        }
+    }
+
+    return nullptr;
+}
+
+static Net_Sim_Mapping *add_mapping(Net_Sim_Host *host, const IP_Port *remote, uint16_t port)
+{
+    Net_Sim_Mapping *new_mappings = (Net_Sim_Mapping *)realloc(host->mappings,
+                                    (host->num_mappings + 1) * sizeof(Net_Sim_Mapping));
+
+    if (!new_mappings) {
+        return nullptr;
+    }
+
+    host->mappings = new_mappings;
+    Net_Sim_Mapping *mapping = &host->mappings[host->num_mappings++];
+    mapping->remote = *remote;
+    mapping->port = port;
+    return mapping;
+}
+
+/* Work out the source address packets from host to dest appear to come from,
+ * opening the NAT for replies.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int nat_outgoing(Net_Sim_Host *host, const IP_Port *dest, IP_Port *source)
+{
+    source->ip = host->ip;
+
+    switch (host->nat) {
+        case NET_SIM_NAT_NONE:
+            source->port = host->port;
+            return 0;
+
+        case NET_SIM_NAT_FULL_CONE:
+            source->port = host->mapped_port;
+            return 0;
+
+        case NET_SIM_NAT_PORT_RESTRICTED:
+            source->port = host->mapped_port;
+
+            if (!find_mapping(host, dest) && !add_mapping(host, dest, host->mapped_port)) {
+                return -1;
+            }
+
+            return 0;
+
+        case NET_SIM_NAT_SYMMETRIC: {
+            const Net_Sim_Mapping *mapping = find_mapping(host, dest);
+
+            if (!mapping) {
+                mapping = add_mapping(host, dest, net_htons(host->sim->next_nat_port++));
+
+                if (!mapping) {
+                    return -1;
+                }
+            }
+
+            source->port = mapping->port;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* return the host a packet from source to dest is delivered to.
+ * return NULL if there is none or its NAT does not let the packet in.
+ */
+static Net_Sim_Host *nat_incoming(const Net_Sim *sim, const IP_Port *source, const IP_Port *dest)
+{
+    for (uint32_t i = 0; i < sim->num_hosts; ++i) {
+        Net_Sim_Host *host = sim->hosts[i];
+
+        if (!ip_equal(&host->ip, &dest->ip)) {
+            continue;
+        }
+
+        switch (host->nat) {
+            case NET_SIM_NAT_NONE:
+                if (host->port == dest->port) {
+                    return host;
+                }
+
+                break;
+
+            case NET_SIM_NAT_FULL_CONE:
+                if (host->mapped_port == dest->port) {
+                    return host;
+                }
+
+                break;
+
+            case NET_SIM_NAT_PORT_RESTRICTED:
+                if (host->mapped_port == dest->port) {
+                    return find_mapping(host, source) ? host : nullptr;
+                }
+
+                break;
+
+            case NET_SIM_NAT_SYMMETRIC: {
+                const Net_Sim_Mapping *mapping = find_mapping(host, source);
+
+                if (mapping && mapping->port == dest->port) {
+                    return host;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+static Net_Sim_Link_Entry *find_link(Net_Sim *sim, const Net_Sim_Host *from, const Net_Sim_Host *to)
+{
+    for (uint32_t i = 0; i < sim->num_links; ++i) {
+        if (sim->links[i].from == from && sim->links[i].to == to) {
+            return &sim->links[i];
+        }
+    }
+
+    return nullptr;
+}
+
+static int sim_send(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    Net_Sim_Host *host = (Net_Sim_Host *)object;
+    Net_Sim *sim = host->sim;
+
+    if (!host->online) {
+        return -1;
+    }
+
+    ++sim->stats.packets_sent;
+    sim->stats.bytes_sent += length;
+
+    IP_Port source;
+
+    if (nat_outgoing(host, &ip_port, &source) == -1) {
+        return -1;
+    }
+
+    Net_Sim_Host *to = nat_incoming(sim, &source, &ip_port);
+
+    if (!to || !to->online) {
+        /* Like UDP, sending to nobody still succeeds. */
+        ++sim->stats.packets_unreachable;
+        return length;
+    }
+
+    Net_Sim_Link_Entry *entry = find_link(sim, host, to);
+    const Net_Sim_Link *link = entry ? &entry->link : &sim->default_link;
+    uint64_t *busy_until = entry ? &entry->busy_until : &host->uplink_busy_until;
+
+    if (link->loss && sim_random(sim) % 10000 < link->loss) {
+        ++sim->stats.packets_lost;
+        return length;
+    }
+
+    uint64_t send_time = sim->time;
+
+    if (link->bandwidth) {
+        if (*busy_until > send_time) {
+            send_time = *busy_until;
+        }
+
+        send_time += ((uint64_t)length * 1000) / link->bandwidth;
+        *busy_until = send_time;
+    }
+
+    Net_Sim_Packet *packet = (Net_Sim_Packet *)malloc(sizeof(Net_Sim_Packet) + length);
+
+    if (!packet) {
+        return -1;
+    }
+
+    packet->next = nullptr;
+    packet->to = to;
+    packet->from = source;
+    packet->deliver_time = send_time + link->latency;
+    packet->seq = sim->seq++;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+
+    if (link->jitter) {
+        packet->deliver_time += sim_random(sim) % (link->jitter + 1);
+    }
+
+    if (queue_push(sim, packet) == -1) {
+        free(packet);
+        return -1;
+    }
+
+    return length;
+}
+
+static int sim_recv(void *object, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    Net_Sim_Host *host = (Net_Sim_Host *)object;
+    Net_Sim_Packet *packet = host->inbox_head;
+
+    if (!packet) {
+        return -1;
+    }
+
+    host->inbox_head = packet->next;
+
+    if (!host->inbox_head) {
+        host->inbox_tail = nullptr;
+    }
+
+    /* Zero the padding like receivepacket() does, some code hashes IP_Port. */
+    memset(ip_port, 0, sizeof(IP_Port));
+    ip_port->ip.family = packet->from.ip.family;
+    ip_port->ip.ip = packet->from.ip.ip;
+    ip_port->port = packet->from.port;
+    *length = packet->length;
+    memcpy(data, packet->data, packet->length);
+    free(packet);
+    return 0;
+}
+
+static void clear_inbox(Net_Sim_Host *host)
+{
+    while (host->inbox_head) {
+        Net_Sim_Packet *next = host->inbox_head->next;
+        free(host->inbox_head);
+        host->inbox_head = next;
+    }
+
+    host->inbox_tail = nullptr;
+}
+
+Net_Sim *new_net_sim(uint64_t seed)
+{
+    Net_Sim *sim = (Net_Sim *)calloc(1, sizeof(Net_Sim));
+
+    if (!sim) {
+        return nullptr;
+    }
+
+    sim->time = NET_SIM_START_TIME;
+    /* xorshift must not start at 0 */
+    sim->rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    sim->next_nat_port = NET_SIM_NAT_PORT_START;
+    return sim;
+}
+
+void kill_net_sim(Net_Sim *sim)
+{
+    if (!sim) {
+        return;
+    }
+
+    while (sim->queue_length) {
+        free(queue_pop(sim));
+    }
+
+    for (uint32_t i = 0; i < sim->num_hosts; ++i) {
+        clear_inbox(sim->hosts[i]);
+        free(sim->hosts[i]->mappings);
+        free(sim->hosts[i]);
+    }
+
+    free(sim->queue);
+    free(sim->hosts);
+    free(sim->links);
+    free(sim);
+}
+
+static uint64_t sim_clock(void *user_data)
+{
+    const Net_Sim *sim = (const Net_Sim *)user_data;
+    return sim->time;
+}
+
+void net_sim_use_clock(Net_Sim *sim)
+{
+    set_monotonic_time_source(&sim_clock, sim);
+}
+
+uint64_t net_sim_time(const Net_Sim *sim)
+{
+    return sim->time;
+}
+
+uint64_t net_sim_next_delivery(const Net_Sim *sim)
+{
+    if (sim->queue_length == 0) {
+        return UINT64_MAX;
+    }
+
+    return sim->queue[0]->deliver_time;
+}
+
+void net_sim_advance(Net_Sim *sim, uint64_t ms)
+{
+    sim->time += ms;
+
+    while (sim->queue_length && sim->queue[0]->deliver_time <= sim->time) {
+        Net_Sim_Packet *packet = queue_pop(sim);
+        Net_Sim_Host *to = packet->to;
+
+        if (!to->online) {
+            ++sim->stats.packets_unreachable;
+            free(packet);
+            continue;
+        }
+
+        if (to->inbox_tail) {
+            to->inbox_tail->next = packet;
+        } else {
+            to->inbox_head = packet;
+        }
+
+        to->inbox_tail = packet;
+        ++sim->stats.packets_delivered;
+    }
+}
+
+void net_sim_set_default_link(Net_Sim *sim, const Net_Sim_Link *link)
+{
+    sim->default_link = *link;
+}
+
+int net_sim_set_link(Net_Sim *sim, const Net_Sim_Host *from, const Net_Sim_Host *to, const Net_Sim_Link *link)
+{
+    Net_Sim_Link_Entry *entry = find_link(sim, from, to);
+
+    if (!entry) {
+        Net_Sim_Link_Entry *new_links = (Net_Sim_Link_Entry *)realloc(sim->links,
+                                        (sim->num_links + 1) * sizeof(Net_Sim_Link_Entry));
+
+        if (!new_links) {
+            return -1;
+        }
+
+        sim->links = new_links;
+        entry = &sim->links[sim->num_links++];
+        entry->from = from;
+        entry->to = to;
+        entry->busy_until = 0;
+    }
+
+    entry->link = *link;
+    return 0;
+}
+
+Net_Sim_Host *net_sim_add_host(Net_Sim *sim, IP ip, uint16_t port, Net_Sim_Nat nat)
+{
+    if (ip.family != TOX_AF_INET && ip.family != TOX_AF_INET6) {
+        return nullptr;
+    }
+
+    Net_Sim_Host **new_hosts = (Net_Sim_Host **)realloc(sim->hosts, (sim->num_hosts + 1) * sizeof(Net_Sim_Host *));
+
+    if (!new_hosts) {
+        return nullptr;
+    }
+
+    sim->hosts = new_hosts;
+
+    Net_Sim_Host *host = (Net_Sim_Host *)calloc(1, sizeof(Net_Sim_Host));
+
+    if (!host) {
+        return nullptr;
+    }
+
+    host->sim = sim;
+    host->ip = ip;
+    host->port = net_htons(port);
+    host->nat = nat;
+    host->online = 1;
+
+    if (nat == NET_SIM_NAT_FULL_CONE || nat == NET_SIM_NAT_PORT_RESTRICTED) {
+        host->mapped_port = net_htons(sim->next_nat_port++);
+    }
+
+    host->backend.send = &sim_send;
+    host->backend.recv = &sim_recv;
+    host->backend.object = host;
+    host->backend.family = ip.family;
+    host->backend.port = host->port;
+
+    sim->hosts[sim->num_hosts++] = host;
+    return host;
+}
+
+void net_sim_host_set_online(Net_Sim_Host *host, bool online)
+{
+    host->online = online;
+
+    if (!online) {
+        clear_inbox(host);
+    }
+}
+
+const Net_Backend *net_sim_host_backend(const Net_Sim_Host *host)
+{
+    return &host->backend;
+}
+
+Networking_Core *net_sim_new_networking(Net_Sim *sim, Logger *log, IP ip, uint16_t port, Net_Sim_Nat nat)
+{
+    Net_Sim_Host *host = net_sim_add_host(sim, ip, port, nat);
+
+    if (!host) {
+        return nullptr;
+    }
+
+    return new_networking_backend(log, &host->backend);
+}
+
+void net_sim_get_stats(const Net_Sim *sim, Net_Sim_Stats *stats)
+{
+    *stats = sim->stats;
+}
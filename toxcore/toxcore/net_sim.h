@@ -0,0 +1,136 @@
+/*
+ * Deterministic in-process network with virtual time for running many
+ * instances without sockets.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef NET_SIM_H
+#define NET_SIM_H
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Virtual time the simulation starts at, in ms. Not 0 so that timestamps of 0,
+ * which toxcore uses for "never", are in the past.
+ */
+#define NET_SIM_START_TIME (1000ULL * 60 * 60 * 24)
+
+typedef struct Net_Sim Net_Sim;
+typedef struct Net_Sim_Host Net_Sim_Host;
+
+/* Properties of the path packets take from one host to another. */
+typedef struct Net_Sim_Link {
+    uint32_t latency;   /* one way delay in ms */
+    uint32_t jitter;    /* up to this many ms are added at random to each packet */
+    uint16_t loss;      /* packets lost out of 10000 */
+    uint32_t bandwidth; /* bytes per second, 0 for unlimited */
+} Net_Sim_Link;
+
+typedef enum Net_Sim_Nat {
+    /* The host has a public address. */
+    NET_SIM_NAT_NONE,
+
+    /* One external port, anyone can send to it. */
+    NET_SIM_NAT_FULL_CONE,
+
+    /* One external port, only addresses the host sent to can send to it. */
+    NET_SIM_NAT_PORT_RESTRICTED,
+
+    /* A new external port for every destination, only that destination can use it. */
+    NET_SIM_NAT_SYMMETRIC,
+} Net_Sim_Nat;
+
+/* Create a simulation. All randomness of the simulated network (loss, jitter,
+ * NAT ports) comes from seed.
+ *
+ * return NULL on failure.
+ */
+Net_Sim *new_net_sim(uint64_t seed);
+
+/* Free the simulation and every host in it. Networking_Core objects using its
+ * hosts must be killed first.
+ */
+void kill_net_sim(Net_Sim *sim);
+
+/* Use the virtual time of sim for current_time_monotonic() and unix_time().
+ * Call before creating instances.
+ */
+void net_sim_use_clock(Net_Sim *sim);
+
+/* return the current virtual time in ms. */
+uint64_t net_sim_time(const Net_Sim *sim);
+
+/* return the virtual time the next packet is delivered at.
+ * return UINT64_MAX if no packet is in flight.
+ */
+uint64_t net_sim_next_delivery(const Net_Sim *sim);
+
+/* Move virtual time forward by ms and deliver all packets that arrive until then.
+ */
+void net_sim_advance(Net_Sim *sim, uint64_t ms);
+
+/* Set the link used between hosts without a link of their own. */
+void net_sim_set_default_link(Net_Sim *sim, const Net_Sim_Link *link);
+
+/* Set the link used for packets sent from host from to host to.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int net_sim_set_link(Net_Sim *sim, const Net_Sim_Host *from, const Net_Sim_Host *to, const Net_Sim_Link *link);
+
+/* Add a host with address ip behind nat, listening on port (host byte order).
+ * For hosts behind a NAT, ip is the public address of the NAT. Several hosts
+ * can share one NAT address.
+ *
+ * return NULL on failure.
+ */
+Net_Sim_Host *net_sim_add_host(Net_Sim *sim, IP ip, uint16_t port, Net_Sim_Nat nat);
+
+/* Offline hosts neither send nor receive. Packets already queued for them are dropped. */
+void net_sim_host_set_online(Net_Sim_Host *host, bool online);
+
+/* return the backend to pass to new_networking_backend() or Messenger_Options. */
+const Net_Backend *net_sim_host_backend(const Net_Sim_Host *host);
+
+/* Add a host and create a Networking_Core on it.
+ *
+ * return NULL on failure.
+ */
+Networking_Core *net_sim_new_networking(Net_Sim *sim, Logger *log, IP ip, uint16_t port, Net_Sim_Nat nat);
+
+typedef struct Net_Sim_Stats {
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t packets_delivered;
+    uint64_t packets_lost;          /* dropped by link loss */
+    uint64_t packets_unreachable;   /* no host, host offline or filtered by a NAT */
+} Net_Sim_Stats;
+
+void net_sim_get_stats(const Net_Sim *sim, Net_Sim_Stats *stats);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* NET_SIM_H */
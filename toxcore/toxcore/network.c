@@ -41,6 +41,7 @@
 #include "network.h"
 
 #include "logger.h"
+#include "rate_limit.h"
 #include "util.h"
 
 #include <assert.h>
@@ -63,6 +64,11 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#if defined(__linux__) && !defined(SO_REUSEPORT)
+/* glibc only defines it with _DEFAULT_SOURCE. */
+#include <asm/socket.h>
+#endif
+
 #else
 
 #ifndef IPV6_V6ONLY
@@ -273,6 +279,21 @@ int set_socket_reuseaddr(Socket sock)
     return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&set, sizeof(set)) == 0);
 }
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure
+ */
+int set_socket_reuseport(Socket sock)
+{
+#ifdef SO_REUSEPORT
+    int set = 1;
+    return (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char *)&set, sizeof(set)) == 0);
+#else
+    return 0;
+#endif
+}
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -320,9 +341,22 @@ static uint64_t last_monotime;
 static uint64_t add_monotime;
 #endif
 
+static monotonic_time_cb *monotonic_time_source;
+static void *monotonic_time_source_data;
+
+void set_monotonic_time_source(monotonic_time_cb *time_cb, void *user_data)
+{
+    monotonic_time_source = time_cb;
+    monotonic_time_source_data = user_data;
+}
+
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void)
 {
+    if (monotonic_time_source) {
+        return monotonic_time_source(monotonic_time_source_data);
+    }
+
     uint64_t time;
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
     uint64_t old_add_monotime = add_monotime;
@@ -402,10 +436,23 @@ struct Networking_Core {
     Logger *log;
     Packet_Handler packethandlers[256];
 
+    poll_done_callback *poll_done;
+    void *poll_done_object;
+
     Family family;
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+    /* Used instead of sock if backend.send is set. */
+    Net_Backend backend;
+
+    /* NULL until networking_set_rate_limit() is first called. */
+    Rate_Limit *rate_limit;
+    /* rate_limit belongs to another Networking_Core, see networking_share_rate_limit(). */
+    bool rate_limit_shared;
+
+    Metrics metrics;
 };
 
 Family net_family(const Networking_Core *net)
@@ -418,6 +465,11 @@ uint16_t net_port(const Networking_Core *net)
     return net->port;
 }
 
+Metrics *net_metrics(Networking_Core *net)
+{
+    return &net->metrics;
+}
+
 /* Basic network functions:
  * Function to send packet(data) of length length to ip_port.
  */
@@ -432,6 +484,19 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         return -1;
     }
 
+    if (net->backend.send) {
+        int res = net->backend.send(net->backend.object, ip_port, data, length);
+        loglogdata(net->log, "O=>", data, length, ip_port, res);
+
+        if (res == length) {
+            metrics_packet_sent(&net->metrics, data[0], length);
+        } else {
+            metrics_inc(&net->metrics, METRIC_NET_SEND_FAILURES);
+        }
+
+        return res;
+    }
+
     struct sockaddr_storage addr;
 
     size_t addrsize = 0;
@@ -484,6 +549,12 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
 
     loglogdata(net->log, "O=>", data, length, ip_port, res);
 
+    if (res == length) {
+        metrics_packet_sent(&net->metrics, data[0], length);
+    } else {
+        metrics_inc(&net->metrics, METRIC_NET_SEND_FAILURES);
+    }
+
     return res;
 }
 
@@ -546,6 +617,12 @@ void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handl
     net->packethandlers[byte].object = object;
 }
 
+void networking_register_poll_done(Networking_Core *net, poll_done_callback *cb, void *object)
+{
+    net->poll_done = cb;
+    net->poll_done_object = object;
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net->family == 0) { /* Socket not initialized */
@@ -558,18 +635,81 @@ void networking_poll(Networking_Core *net, void *userdata)
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
-    while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
+    /* Read once, floods make the loop long which only makes the limit stricter. */
+    const uint64_t now = net->rate_limit ? current_time_monotonic() : 0;
+
+    while ((net->backend.recv ? net->backend.recv(net->backend.object, &ip_port, data, &length)
+            : receivepacket(net->log, net->sock, &ip_port, data, &length)) != -1) {
         if (length < 1) {
             continue;
         }
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        metrics_packet_recv(&net->metrics, data[0], length);
+
+        if (net->rate_limit && !rate_limit_take(net->rate_limit, &ip_port.ip, data[0], now)) {
+            metrics_inc(&net->metrics, METRIC_NET_PACKETS_RATE_LIMITED);
             continue;
         }
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        networking_handle_packet(net, ip_port, data, length, userdata);
+    }
+
+    if (net->poll_done) {
+        net->poll_done(net->poll_done_object, userdata);
+    }
+}
+
+int networking_set_rate_limit(Networking_Core *net, uint8_t packet_id, uint32_t rate, uint32_t burst,
+                              uint32_t total_rate)
+{
+    if (net->rate_limit == nullptr) {
+        net->rate_limit = new_rate_limit();
+
+        if (net->rate_limit == nullptr) {
+            return -1;
+        }
+    }
+
+    rate_limit_set(net->rate_limit, packet_id, rate, burst, total_rate);
+    return 0;
+}
+
+int networking_share_rate_limit(Networking_Core *net, Networking_Core *owner)
+{
+    if (owner->rate_limit == nullptr) {
+        owner->rate_limit = new_rate_limit();
+
+        if (owner->rate_limit == nullptr) {
+            return -1;
+        }
+    }
+
+    if (!net->rate_limit_shared) {
+        kill_rate_limit(net->rate_limit);
     }
+
+    net->rate_limit = owner->rate_limit;
+    net->rate_limit_shared = 1;
+    return 0;
+}
+
+uint64_t networking_rate_limited(const Networking_Core *net, uint8_t packet_id)
+{
+    return net->rate_limit ? rate_limit_dropped(net->rate_limit, packet_id) : 0;
+}
+
+void networking_handle_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata)
+{
+    if (!(net->packethandlers[data[0]].function)) {
+        metrics_inc(&net->metrics, METRIC_NET_PACKETS_UNHANDLED);
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    const uint64_t start = metrics_handler_start(&net->metrics);
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+    metrics_handler_done(&net->metrics, METRIC_DISPATCH_NET, data[0], start);
 }
 
 #ifndef VANILLA_NACL
@@ -639,7 +779,8 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port)
  *
  * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
  */
-Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+static Networking_Core *new_networking_internal(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, bool reuseport,
+        unsigned int *error)
 {
     /* If both from and to are 0, use default port range
      * If one is 0 and the other is non-0, use the non-0 value as only port
@@ -730,6 +871,17 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
         return nullptr;
     }
 
+    if (reuseport && !set_socket_reuseport(temp->sock)) {
+        LOGGER_ERROR(log, "Failed to set SO_REUSEPORT: %u, %s", errno, strerror(errno));
+        kill_networking(temp);
+
+        if (error) {
+            *error = 1;
+        }
+
+        return nullptr;
+    }
+
     /* Bind our socket to port PORT and the given IP address (usually 0.0.0.0 or ::) */
     uint16_t *portptr = nullptr;
     struct sockaddr_storage addr;
@@ -846,6 +998,16 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
     return nullptr;
 }
 
+Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+{
+    return new_networking_internal(log, ip, port_from, port_to, 0, error);
+}
+
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error)
+{
+    return new_networking_internal(log, ip, port, port, 1, error);
+}
+
 Networking_Core *new_networking_no_udp(Logger *log)
 {
     /* this is the easiest way to completely disable UDP without changing too much code. */
@@ -860,6 +1022,31 @@ Networking_Core *new_networking_no_udp(Logger *log)
     return net;
 }
 
+Networking_Core *new_networking_backend(Logger *log, const Net_Backend *backend)
+{
+    if (!backend->send || !backend->recv) {
+        return nullptr;
+    }
+
+    if (backend->family != TOX_AF_INET && backend->family != TOX_AF_INET6) {
+        return nullptr;
+    }
+
+    Networking_Core *net = (Networking_Core *)calloc(1, sizeof(Networking_Core));
+
+    if (net == nullptr) {
+        return nullptr;
+    }
+
+    net->log = log;
+    net->family = backend->family;
+    net->port = backend->port;
+    net->sock = -1;
+    net->backend = *backend;
+
+    return net;
+}
+
 /* Function to cleanup networking stuff. */
 void kill_networking(Networking_Core *net)
 {
@@ -867,10 +1054,15 @@ void kill_networking(Networking_Core *net)
         return;
     }
 
-    if (net->family != 0) { /* Socket not initialized */
+    if (net->family != 0 && !net->backend.send) { /* Socket not initialized */
         kill_sock(net->sock);
     }
 
+    if (!net->rate_limit_shared) {
+        kill_rate_limit(net->rate_limit);
+    }
+
+    metrics_kill(&net->metrics);
     free(net);
 }
 
@@ -32,6 +32,7 @@
 
 #include "ccompat.h"
 #include "logger.h"
+#include "metrics.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -319,6 +320,9 @@ typedef struct Networking_Core Networking_Core;
 Family net_family(const Networking_Core *net);
 uint16_t net_port(const Networking_Core *net);
 
+/* return the metrics registry shared by everything built on top of net. */
+Metrics *net_metrics(Networking_Core *net);
+
 /* Run this before creating sockets.
  *
  * return 0 on success
@@ -358,6 +362,14 @@ int set_socket_nosigpipe(Socket sock);
  */
 int set_socket_reuseaddr(Socket sock);
 
+/* Enable SO_REUSEPORT on socket, letting several sockets bind the same port
+ * and the kernel spread incoming packets over them.
+ *
+ * return 1 on success
+ * return 0 on failure or if the platform has no SO_REUSEPORT
+ */
+int set_socket_reuseport(Socket sock);
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -368,6 +380,16 @@ int set_socket_dualstack(Socket sock);
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void);
 
+typedef uint64_t monotonic_time_cb(void *user_data);
+
+/* Replace the system clock behind current_time_monotonic() and unix_time() with
+ * time_cb, which returns milliseconds. Pass NULL to go back to the system clock.
+ *
+ * This is process wide and meant for simulations: set it before creating any
+ * instance, unix_time() picks its base time on first use.
+ */
+void set_monotonic_time_source(monotonic_time_cb *time_cb, void *user_data);
+
 /* Basic network functions: */
 
 /* Function to send packet(data) of length length to ip_port. */
@@ -376,9 +398,53 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
+typedef void poll_done_callback(void *object, void *userdata);
+
+/* Function to call at the end of every networking_poll(), after the handlers
+ * of all packets received by it ran. Lets handlers queue packets and process
+ * them together.
+ */
+void networking_register_poll_done(Networking_Core *net, poll_done_callback *cb, void *object);
+
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/* Drop packets with first byte packet_id in networking_poll(), before their
+ * handler runs, when a source sends more than rate per second of them with
+ * bursts of up to burst, or all sources together more than total_rate per
+ * second. Sources are IPv4 addresses and IPv6 /64 networks, loopback addresses
+ * are never limited. New sources start with RATE_LIMIT_INITIAL packets rather
+ * than a full burst. A rate of 0 removes the limit, a total_rate of 0 only the
+ * cap on all sources.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_rate_limit(Networking_Core *net, uint8_t packet_id, uint32_t rate, uint32_t burst,
+                              uint32_t total_rate);
+
+/* Make net take packets out of the rate limit buckets of owner, so that
+ * sockets of one node bound to the same port with SO_REUSEPORT give each
+ * source one budget rather than one per socket. The limits set on owner
+ * apply, and networking_set_rate_limit() on either changes them for both.
+ * owner must be killed after net. Call before either is polled on another
+ * thread.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_share_rate_limit(Networking_Core *net, Networking_Core *owner);
+
+/* return the number of packets with first byte packet_id dropped by the rate limit.
+ */
+uint64_t networking_rate_limited(const Networking_Core *net, uint8_t packet_id);
+
+/* Run the handler of a packet that was received by another Networking_Core,
+ * as if it had been received by net.
+ */
+void networking_handle_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                              void *userdata);
+
 /* Connect a socket to the address specified by the ip_port. */
 int net_connect(Socket sock, IP_Port ip_port);
 
@@ -418,6 +484,44 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port);
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error);
 Networking_Core *new_networking_no_udp(Logger *log);
 
+/* Like new_networking_ex() with a single port, but with SO_REUSEPORT set so
+ * that several Networking_Core objects can bind the same ip and port. The
+ * kernel picks one of them for each sender, so replies to packets sent from
+ * one of them may be received by another.
+ */
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error);
+
+/* Send length bytes of data to ip_port.
+ *
+ * return length on success.
+ * return -1 on failure.
+ */
+typedef int net_backend_send_cb(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
+/* Take the next received packet, at most MAX_UDP_PACKET_SIZE bytes, and its sender.
+ *
+ * return 0 if a packet was received.
+ * return -1 if there is none.
+ */
+typedef int net_backend_recv_cb(void *object, IP_Port *ip_port, uint8_t *data, uint32_t *length);
+
+/* Packet I/O used in place of a UDP socket, e.g. by a network simulator. */
+typedef struct Net_Backend {
+    net_backend_send_cb *send;
+    net_backend_recv_cb *recv;
+    void *object;
+
+    Family family;
+    uint16_t port; /* in network byte order, as returned by net_port() */
+} Net_Backend;
+
+/* Create a Networking_Core that sends and receives through backend instead of
+ * a socket. The backend is copied.
+ *
+ * return NULL on failure.
+ */
+Networking_Core *new_networking_backend(Logger *log, const Net_Backend *backend);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
@@ -27,6 +27,7 @@
 
 #include "onion.h"
 
+#include "thread_pool.h"
 #include "util.h"
 
 #define RETURN_1 ONION_RETURN_1
@@ -322,23 +323,25 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
-static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+/* Send a packet relayed by us, counting it in the metrics.
+ *
+ * return 1 on failure.
+ * return 0 on success.
+ */
+static int relay_send(const Onion *onion, IP_Port dest, const uint8_t *data, uint16_t length)
 {
-    Onion *onion = (Onion *)object;
-
-    if (length > ONION_MAX_PACKET_SIZE) {
+    if ((uint32_t)sendpacket(onion->net, dest, data, length) != length) {
         return 1;
     }
 
-    if (length <= 1 + SEND_1) {
-        return 1;
-    }
-
-    change_symmetric_key(onion);
+    metrics_inc(net_metrics(onion->net), METRIC_ONION_PACKETS_RELAYED);
+    return 0;
+}
 
+static int forward_send_initial(const Onion *onion, IP_Port source, const uint8_t *packet, uint16_t length,
+                                const uint8_t *shared_key)
+{
     uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_1, shared_key, dht_get_self_secret_key(onion->dht), packet + 1 + CRYPTO_NONCE_SIZE);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
 
@@ -384,30 +387,13 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 
     data_len += CRYPTO_NONCE_SIZE + len;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
-        return 1;
-    }
-
-    return 0;
+    return relay_send(onion, send_to, data, data_len);
 }
 
-static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int forward_send_1(const Onion *onion, IP_Port source, const uint8_t *packet, uint16_t length,
+                          const uint8_t *shared_key)
 {
-    Onion *onion = (Onion *)object;
-
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
-
-    if (length <= 1 + SEND_2) {
-        return 1;
-    }
-
-    change_symmetric_key(onion);
-
     uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_2, shared_key, dht_get_self_secret_key(onion->dht), packet + 1 + CRYPTO_NONCE_SIZE);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
 
@@ -440,30 +426,13 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     data_len += CRYPTO_NONCE_SIZE + len;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
-        return 1;
-    }
-
-    return 0;
+    return relay_send(onion, send_to, data, data_len);
 }
 
-static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int forward_send_2(const Onion *onion, IP_Port source, const uint8_t *packet, uint16_t length,
+                          const uint8_t *shared_key)
 {
-    Onion *onion = (Onion *)object;
-
-    if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
-    }
-
-    if (length <= 1 + SEND_3) {
-        return 1;
-    }
-
-    change_symmetric_key(onion);
-
     uint8_t plain[ONION_MAX_PACKET_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion->shared_keys_3, shared_key, dht_get_self_secret_key(onion->dht), packet + 1 + CRYPTO_NONCE_SIZE);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
 
@@ -494,13 +463,290 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
 
     data_len += RETURN_3;
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
-        return 1;
+    return relay_send(onion, send_to, data, data_len);
+}
+
+/* Decrypt packet, a NET_PACKET_ONION_SEND_* packet, with shared_key and send it on. */
+static int forward_packet(const Onion *onion, IP_Port source, const uint8_t *packet, uint16_t length,
+                          const uint8_t *shared_key)
+{
+    switch (packet[0]) {
+        case NET_PACKET_ONION_SEND_INITIAL:
+            return forward_send_initial(onion, source, packet, length, shared_key);
+
+        case NET_PACKET_ONION_SEND_1:
+            return forward_send_1(onion, source, packet, length, shared_key);
+
+        default:
+            return forward_send_2(onion, source, packet, length, shared_key);
+    }
+}
+
+/* Each hop of a path has its own cache: the ephemeral keys of a path are
+ * different at each hop, mixing them would only evict useful keys.
+ */
+static Shared_Keys *relay_shared_keys(Onion *onion, uint8_t packet_id)
+{
+    switch (packet_id) {
+        case NET_PACKET_ONION_SEND_INITIAL:
+            return &onion->shared_keys_1;
+
+        case NET_PACKET_ONION_SEND_1:
+            return &onion->shared_keys_2;
+
+        default:
+            return &onion->shared_keys_3;
+    }
+}
+
+#define ONION_RELAY_BATCH_SIZE 64
+
+typedef struct {
+    IP_Port source;
+    uint16_t length;
+    uint8_t packet[ONION_MAX_PACKET_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    int32_t key; /* index in keys of the batch, -1 if shared_key came from a cache */
+} Onion_Relay_Packet;
+
+typedef struct {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t stored; /* bit n is set once added to the cache of NET_PACKET_ONION_SEND_INITIAL + n */
+} Onion_Relay_Key;
+
+struct Onion_Relay_Batch {
+    Thread_Pool *workers;
+
+    Onion_Relay_Packet packets[ONION_RELAY_BATCH_SIZE];
+    uint32_t num_packets;
+
+    /* Distinct ephemeral keys of the batch missing from the caches. */
+    Onion_Relay_Key keys[ONION_RELAY_BATCH_SIZE];
+    uint32_t num_keys;
+};
+
+typedef struct {
+    Onion_Relay_Key *keys;
+    uint32_t num_keys;
+    const uint8_t *secret_key;
+} Onion_Relay_Key_Job;
+
+static void compute_relay_keys(void *object, void *data)
+{
+    const Onion_Relay_Key_Job *job = (const Onion_Relay_Key_Job *)data;
+
+    for (uint32_t i = 0; i < job->num_keys; ++i) {
+        encrypt_precompute(job->keys[i].public_key, job->secret_key, job->keys[i].shared_key);
+    }
+}
+
+/* Relay all queued packets. Keys missing from the caches are computed once
+ * each, split between the worker threads and this one.
+ */
+static void onion_relay_flush(Onion *onion)
+{
+    Onion_Relay_Batch *batch = onion->relay_batch;
+
+    if (batch->num_packets == 0) {
+        return;
+    }
+
+    metrics_observe(net_metrics(onion->net), METRIC_HISTOGRAM_ONION_RELAY_BATCH, batch->num_packets);
+    batch->num_keys = 0;
+
+    for (uint32_t i = 0; i < batch->num_packets; ++i) {
+        Onion_Relay_Packet *relay = &batch->packets[i];
+        const uint8_t *public_key = relay->packet + 1 + CRYPTO_NONCE_SIZE;
+
+        relay->key = -1;
+
+        if (find_shared_key(relay_shared_keys(onion, relay->packet[0]), relay->shared_key, public_key)) {
+            count_shared_key_lookup(onion->net, 1);
+            continue;
+        }
+
+        uint32_t k;
+
+        for (k = 0; k < batch->num_keys; ++k) {
+            if (id_equal(batch->keys[k].public_key, public_key)) {
+                break;
+            }
+        }
+
+        if (k == batch->num_keys) {
+            memcpy(batch->keys[k].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            batch->keys[k].stored = 0;
+            ++batch->num_keys;
+        }
+
+        relay->key = k;
+    }
+
+    if (batch->num_keys != 0) {
+        Onion_Relay_Key_Job jobs[ONION_RELAY_BATCH_SIZE];
+        uint32_t num_jobs = thread_pool_num_threads(batch->workers) + 1;
+
+        if (num_jobs > batch->num_keys) {
+            num_jobs = batch->num_keys;
+        }
+
+        for (uint32_t j = 0; j < num_jobs; ++j) {
+            const uint32_t first = batch->num_keys * j / num_jobs;
+            jobs[j].keys = &batch->keys[first];
+            jobs[j].num_keys = batch->num_keys * (j + 1) / num_jobs - first;
+            jobs[j].secret_key = dht_get_self_secret_key(onion->dht);
+        }
+
+        /* Job 0 is done here while the workers do the others. */
+        for (uint32_t j = 1; j < num_jobs; ++j) {
+            if (thread_pool_add_job(batch->workers, &compute_relay_keys, nullptr, &jobs[j]) == -1) {
+                compute_relay_keys(nullptr, &jobs[j]);
+            }
+        }
+
+        compute_relay_keys(nullptr, &jobs[0]);
+        thread_pool_wait(batch->workers);
     }
 
+    for (uint32_t i = 0; i < batch->num_packets; ++i) {
+        Onion_Relay_Packet *relay = &batch->packets[i];
+
+        if (relay->key != -1) {
+            Onion_Relay_Key *key = &batch->keys[relay->key];
+            const uint8_t bit = 1 << (relay->packet[0] - NET_PACKET_ONION_SEND_INITIAL);
+
+            memcpy(relay->shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
+            count_shared_key_lookup(onion->net, key->stored & bit);
+
+            if (!(key->stored & bit)) {
+                store_shared_key(relay_shared_keys(onion, relay->packet[0]), key->shared_key, key->public_key);
+                key->stored |= bit;
+            }
+        }
+
+        forward_packet(onion, relay->source, relay->packet, relay->length, relay->shared_key);
+        crypto_memzero(relay->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    }
+
+    crypto_memzero(batch->keys, batch->num_keys * sizeof(Onion_Relay_Key));
+    batch->num_packets = 0;
+    batch->num_keys = 0;
+}
+
+static void onion_relay_poll_done(void *object, void *userdata)
+{
+    onion_relay_flush((Onion *)object);
+}
+
+/* Relay a NET_PACKET_ONION_SEND_* packet now, or queue it for the end of the
+ * poll if batching is on.
+ */
+static int relay_packet(Onion *onion, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Onion_Relay_Batch *batch = onion->relay_batch;
+
+    if (batch == nullptr) {
+        uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+        count_shared_key_lookup(onion->net, get_shared_key(relay_shared_keys(onion, packet[0]), shared_key,
+                                dht_get_self_secret_key(onion->dht), packet + 1 + CRYPTO_NONCE_SIZE));
+        return forward_packet(onion, source, packet, length, shared_key);
+    }
+
+    if (batch->num_packets == ONION_RELAY_BATCH_SIZE) {
+        onion_relay_flush(onion);
+    }
+
+    Onion_Relay_Packet *relay = &batch->packets[batch->num_packets];
+    relay->source = source;
+    relay->length = length;
+    memcpy(relay->packet, packet, length);
+    ++batch->num_packets;
     return 0;
 }
 
+static void kill_relay_batch(Onion *onion)
+{
+    if (onion->relay_batch == nullptr) {
+        return;
+    }
+
+    onion_relay_flush(onion);
+    networking_register_poll_done(onion->net, nullptr, nullptr);
+    kill_thread_pool(onion->relay_batch->workers);
+    free(onion->relay_batch);
+    onion->relay_batch = nullptr;
+}
+
+int onion_set_relay_threads(Onion *onion, uint32_t num_threads)
+{
+    Onion_Relay_Batch *batch = (Onion_Relay_Batch *)calloc(1, sizeof(Onion_Relay_Batch));
+
+    if (batch == nullptr) {
+        return -1;
+    }
+
+    batch->workers = new_thread_pool(num_threads, ONION_RELAY_BATCH_SIZE);
+
+    if (batch->workers == nullptr) {
+        free(batch);
+        return -1;
+    }
+
+    kill_relay_batch(onion);
+    onion->relay_batch = batch;
+    networking_register_poll_done(onion->net, &onion_relay_poll_done, onion);
+    return 0;
+}
+
+static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (length > ONION_MAX_PACKET_SIZE) {
+        return 1;
+    }
+
+    if (length <= 1 + SEND_1) {
+        return 1;
+    }
+
+    change_symmetric_key(onion);
+    return relay_packet(onion, source, packet, length);
+}
+
+static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (length > ONION_MAX_PACKET_SIZE) {
+        return 1;
+    }
+
+    if (length <= 1 + SEND_2) {
+        return 1;
+    }
+
+    change_symmetric_key(onion);
+    return relay_packet(onion, source, packet, length);
+}
+
+static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Onion *onion = (Onion *)object;
+
+    if (length > ONION_MAX_PACKET_SIZE) {
+        return 1;
+    }
+
+    if (length <= 1 + SEND_3) {
+        return 1;
+    }
+
+    change_symmetric_key(onion);
+    return relay_packet(onion, source, packet, length);
+}
+
 
 static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
 {
@@ -536,11 +782,7 @@ static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, ui
     memcpy(data + 1 + RETURN_2, packet + 1 + RETURN_3, length - (1 + RETURN_3));
     uint16_t data_len = 1 + RETURN_2 + (length - (1 + RETURN_3));
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
-        return 1;
-    }
-
-    return 0;
+    return relay_send(onion, send_to, data, data_len);
 }
 
 static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
@@ -577,11 +819,7 @@ static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, ui
     memcpy(data + 1 + RETURN_1, packet + 1 + RETURN_2, length - (1 + RETURN_2));
     uint16_t data_len = 1 + RETURN_1 + (length - (1 + RETURN_2));
 
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len) {
-        return 1;
-    }
-
-    return 0;
+    return relay_send(onion, send_to, data, data_len);
 }
 
 static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
@@ -620,11 +858,7 @@ static int handle_recv_1(void *object, IP_Port source, const uint8_t *packet, ui
         return onion->recv_1_function(onion->callback_object, send_to, packet + (1 + RETURN_1), data_len);
     }
 
-    if ((uint32_t)sendpacket(onion->net, send_to, packet + (1 + RETURN_1), data_len) != data_len) {
-        return 1;
-    }
-
-    return 0;
+    return relay_send(onion, send_to, packet + (1 + RETURN_1), data_len);
 }
 
 void set_callback_handle_recv_1(Onion *onion, int (*function)(void *, IP_Port, const uint8_t *, uint16_t), void *object)
@@ -667,6 +901,8 @@ void kill_onion(Onion *onion)
         return;
     }
 
+    kill_relay_batch(onion);
+
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, nullptr, nullptr);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, nullptr, nullptr);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, nullptr, nullptr);
@@ -38,8 +38,13 @@ typedef struct {
 
     int (*recv_1_function)(void *, IP_Port, const uint8_t *, uint16_t);
     void *callback_object;
+
+    /* Packets waiting to be relayed, NULL unless onion_set_relay_threads() was called. */
+    struct Onion_Relay_Batch *relay_batch;
 } Onion;
 
+typedef struct Onion_Relay_Batch Onion_Relay_Batch;
+
 #define ONION_MAX_PACKET_SIZE 1400
 
 #define ONION_RETURN_1 (CRYPTO_NONCE_SIZE + SIZE_IPPORT + CRYPTO_MAC_SIZE)
@@ -157,6 +162,17 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
 void set_callback_handle_recv_1(Onion *onion, int (*function)(void *, IP_Port, const uint8_t *, uint16_t),
                                 void *object);
 
+/* Relay the onion packets received during a networking_poll() together at the
+ * end of it instead of one at a time. Shared keys missing from the caches are
+ * then computed once per distinct key, spread over num_threads worker threads
+ * and the thread calling networking_poll(). Meant for public nodes relaying a
+ * lot of onion traffic.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int onion_set_relay_threads(Onion *onion, uint32_t num_threads);
+
 Onion *new_onion(DHT *dht);
 
 void kill_onion(Onion *onion);
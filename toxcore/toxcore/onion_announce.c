@@ -30,6 +30,8 @@
 #include "LAN_discovery.h"
 #include "util.h"
 
+#include <pthread.h>
+
 #define PING_ID_TIMEOUT ONION_ANNOUNCE_TIMEOUT
 
 #define ANNOUNCE_REQUEST_SIZE_RECV (ONION_ANNOUNCE_REQUEST_SIZE + ONION_RETURN_3)
@@ -53,16 +55,23 @@ struct Onion_Announce {
     uint8_t secret_bytes[CRYPTO_SYMMETRIC_KEY_SIZE];
 
     Shared_Keys shared_keys_recv;
+
+    /* The instance whose entries and secret_bytes are used, this one unless
+     * onion_announce_share() was called. mutex of the owner is held while
+     * using its entries.
+     */
+    Onion_Announce *owner;
+    pthread_mutex_t mutex;
 };
 
 uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry)
 {
-    return onion_a->entries[entry].public_key;
+    return onion_a->owner->entries[entry].public_key;
 }
 
 void onion_announce_entry_set_time(Onion_Announce *onion_a, uint32_t entry, uint64_t time)
 {
-    onion_a->entries[entry].time = time;
+    onion_a->owner->entries[entry].time = time;
 }
 
 /* Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
@@ -235,7 +244,7 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
 {
     time /= PING_ID_TIMEOUT;
     uint8_t data[CRYPTO_SYMMETRIC_KEY_SIZE + sizeof(time) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(ret_ip_port)];
-    memcpy(data, onion_a->secret_bytes, CRYPTO_SYMMETRIC_KEY_SIZE);
+    memcpy(data, onion_a->owner->secret_bytes, CRYPTO_SYMMETRIC_KEY_SIZE);
     memcpy(data + CRYPTO_SYMMETRIC_KEY_SIZE, &time, sizeof(time));
     memcpy(data + CRYPTO_SYMMETRIC_KEY_SIZE + sizeof(time), public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(data + CRYPTO_SYMMETRIC_KEY_SIZE + sizeof(time) + CRYPTO_PUBLIC_KEY_SIZE, &ret_ip_port, sizeof(ret_ip_port));
@@ -251,9 +260,11 @@ static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
 {
     unsigned int i;
 
+    const Onion_Announce_Entry *entries = onion_a->owner->entries;
+
     for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
-                && public_key_cmp(onion_a->entries[i].public_key, public_key) == 0) {
+        if (!is_timeout(entries[i].time, ONION_ANNOUNCE_TIMEOUT)
+                && public_key_cmp(entries[i].public_key, public_key) == 0) {
             return i;
         }
     }
@@ -329,19 +340,19 @@ static void sort_onion_announce_list(Onion_Announce_Entry *list, unsigned int le
 static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
                           const uint8_t *data_public_key, const uint8_t *ret)
 {
-
+    Onion_Announce_Entry *entries = onion_a->owner->entries;
     int pos = in_entries(onion_a, public_key);
 
     if (pos == -1) {
         for (unsigned i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
+            if (is_timeout(entries[i].time, ONION_ANNOUNCE_TIMEOUT)) {
                 pos = i;
             }
         }
     }
 
     if (pos == -1) {
-        if (id_closest(dht_get_self_public_key(onion_a->dht), public_key, onion_a->entries[0].public_key) == 1) {
+        if (id_closest(dht_get_self_public_key(onion_a->dht), public_key, entries[0].public_key) == 1) {
             pos = 0;
         }
     }
@@ -350,13 +361,13 @@ static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const ui
         return -1;
     }
 
-    memcpy(onion_a->entries[pos].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].ret_ip_port = ret_ip_port;
-    memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
-    memcpy(onion_a->entries[pos].data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    onion_a->entries[pos].time = unix_time();
+    memcpy(entries[pos].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entries[pos].ret_ip_port = ret_ip_port;
+    memcpy(entries[pos].ret, ret, ONION_RETURN_3);
+    memcpy(entries[pos].data_public_key, data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entries[pos].time = unix_time();
 
-    sort_onion_announce_list(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, dht_get_self_public_key(onion_a->dht));
+    sort_onion_announce_list(entries, ONION_ANNOUNCE_MAX_ENTRIES, dht_get_self_public_key(onion_a->dht));
     return in_entries(onion_a, public_key);
 }
 
@@ -370,7 +381,8 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
 
     const uint8_t *packet_public_key = packet + 1 + CRYPTO_NONCE_SIZE;
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(&onion_a->shared_keys_recv, shared_key, dht_get_self_secret_key(onion_a->dht), packet_public_key);
+    count_shared_key_lookup(onion_a->net, get_shared_key(&onion_a->shared_keys_recv, shared_key,
+                            dht_get_self_secret_key(onion_a->dht), packet_public_key));
 
     uint8_t plain[ONION_PING_ID_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_PUBLIC_KEY_SIZE +
                                      ONION_ANNOUNCE_SENDBACK_DATA_LENGTH];
@@ -388,9 +400,21 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
     uint8_t ping_id2[ONION_PING_ID_SIZE];
     generate_ping_id(onion_a, unix_time() + PING_ID_TIMEOUT, packet_public_key, source, ping_id2);
 
+    /*Respond with a announce response packet*/
+    Node_format nodes_list[MAX_SENT_NODES];
+    unsigned int num_nodes = get_close_nodes(onion_a->dht, plain + ONION_PING_ID_SIZE, nodes_list, 0,
+                             ip_is_lan(source.ip) == 0, 1);
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    random_nonce(nonce);
+
+    uint8_t pl[1 + ONION_PING_ID_SIZE + sizeof(nodes_list)];
+
     int index;
 
     uint8_t *data_public_key = plain + ONION_PING_ID_SIZE + CRYPTO_PUBLIC_KEY_SIZE;
+    const Onion_Announce_Entry *entries = onion_a->owner->entries;
+
+    pthread_mutex_lock(&onion_a->owner->mutex);
 
     if (crypto_memcmp(ping_id1, plain, ONION_PING_ID_SIZE) == 0
             || crypto_memcmp(ping_id2, plain, ONION_PING_ID_SIZE) == 0) {
@@ -400,21 +424,12 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
         index = in_entries(onion_a, plain + ONION_PING_ID_SIZE);
     }
 
-    /*Respond with a announce response packet*/
-    Node_format nodes_list[MAX_SENT_NODES];
-    unsigned int num_nodes = get_close_nodes(onion_a->dht, plain + ONION_PING_ID_SIZE, nodes_list, 0,
-                             ip_is_lan(source.ip) == 0, 1);
-    uint8_t nonce[CRYPTO_NONCE_SIZE];
-    random_nonce(nonce);
-
-    uint8_t pl[1 + ONION_PING_ID_SIZE + sizeof(nodes_list)];
-
     if (index == -1) {
         pl[0] = 0;
         memcpy(pl + 1, ping_id2, ONION_PING_ID_SIZE);
     } else {
-        if (public_key_cmp(onion_a->entries[index].public_key, packet_public_key) == 0) {
-            if (public_key_cmp(onion_a->entries[index].data_public_key, data_public_key) != 0) {
+        if (public_key_cmp(entries[index].public_key, packet_public_key) == 0) {
+            if (public_key_cmp(entries[index].data_public_key, data_public_key) != 0) {
                 pl[0] = 0;
                 memcpy(pl + 1, ping_id2, ONION_PING_ID_SIZE);
             } else {
@@ -423,10 +438,12 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
             }
         } else {
             pl[0] = 1;
-            memcpy(pl + 1, onion_a->entries[index].data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(pl + 1, entries[index].data_public_key, CRYPTO_PUBLIC_KEY_SIZE);
         }
     }
 
+    pthread_mutex_unlock(&onion_a->owner->mutex);
+
     int nodes_length = 0;
 
     if (num_nodes != 0) {
@@ -471,8 +488,19 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
         return 1;
     }
 
+    IP_Port ret_ip_port;
+    uint8_t ret[ONION_RETURN_3];
+
+    pthread_mutex_lock(&onion_a->owner->mutex);
     int index = in_entries(onion_a, packet + 1);
 
+    if (index != -1) {
+        ret_ip_port = onion_a->owner->entries[index].ret_ip_port;
+        memcpy(ret, onion_a->owner->entries[index].ret, ONION_RETURN_3);
+    }
+
+    pthread_mutex_unlock(&onion_a->owner->mutex);
+
     if (index == -1) {
         return 1;
     }
@@ -481,8 +509,7 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
     data[0] = NET_PACKET_ONION_DATA_RESPONSE;
     memcpy(data + 1, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, length - (1 + CRYPTO_PUBLIC_KEY_SIZE + ONION_RETURN_3));
 
-    if (send_onion_response(onion_a->net, onion_a->entries[index].ret_ip_port, data, SIZEOF_VLA(data),
-                            onion_a->entries[index].ret) == -1) {
+    if (send_onion_response(onion_a->net, ret_ip_port, data, SIZEOF_VLA(data), ret) == -1) {
         return 1;
     }
 
@@ -501,12 +528,20 @@ Onion_Announce *new_onion_announce(DHT *dht)
         return nullptr;
     }
 
+    if (pthread_mutex_init(&onion_a->mutex, nullptr) != 0) {
+        free(onion_a);
+        return nullptr;
+    }
+
     onion_a->dht = dht;
     onion_a->net = dht_get_net(dht);
+    onion_a->owner = onion_a;
     new_symmetric_key(onion_a->secret_bytes);
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
+    networking_set_rate_limit(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, ONION_ANNOUNCE_REQUEST_RATE,
+                              ONION_ANNOUNCE_REQUEST_BURST, ONION_ANNOUNCE_REQUEST_TOTAL_RATE);
 
     return onion_a;
 }
@@ -519,5 +554,11 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, nullptr, nullptr);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, nullptr, nullptr);
+    pthread_mutex_destroy(&onion_a->mutex);
     free(onion_a);
 }
+
+void onion_announce_share(Onion_Announce *onion_a, Onion_Announce *owner)
+{
+    onion_a->owner = owner->owner;
+}
@@ -28,6 +28,14 @@
 
 #define ONION_ANNOUNCE_MAX_ENTRIES 160
 #define ONION_ANNOUNCE_TIMEOUT 300
+
+/* Announce requests answered per second from one source and from all of
+ * them. They come from the last node of onion paths, which relays for many
+ * clients.
+ */
+#define ONION_ANNOUNCE_REQUEST_RATE 128
+#define ONION_ANNOUNCE_REQUEST_BURST 512
+#define ONION_ANNOUNCE_REQUEST_TOTAL_RATE 4096
 #define ONION_PING_ID_SIZE CRYPTO_SHA256_SIZE
 
 #define ONION_ANNOUNCE_SENDBACK_DATA_LENGTH (sizeof(uint64_t))
@@ -122,6 +130,14 @@ int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest
 
 Onion_Announce *new_onion_announce(DHT *dht);
 
+/* Make onion_a use the announce entries and ping id secret of owner, so that
+ * announce and data requests received by different sockets of one node see
+ * the same announcements. Both must have DHT instances with the same keys and
+ * owner must be killed after onion_a. Call before the handlers of either run
+ * on another thread.
+ */
+void onion_announce_share(Onion_Announce *onion_a, Onion_Announce *owner);
+
 void kill_onion_announce(Onion_Announce *onion_a);
 
 
@@ -29,13 +29,19 @@
 #include "onion_client.h"
 
 #include "LAN_discovery.h"
+#include "thread_pool.h"
 #include "util.h"
 
+#include <pthread.h>
+
 /* defines for the array size and
    timeout for onion announce packets. */
 #define ANNOUNCE_ARRAY_SIZE 256
 #define ANNOUNCE_TIMEOUT 10
 
+/* Friend number, node public key and address, and path number of an announce request. */
+#define ANNOUNCE_SENDBACK_DATA_SIZE (sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t))
+
 typedef struct {
     uint8_t     public_key[CRYPTO_PUBLIC_KEY_SIZE];
     IP_Port     ip_port;
@@ -63,6 +69,11 @@ typedef struct {
     unsigned int last_path_used_times[NUMBER_ONION_PATHS];
 } Onion_Client_Paths;
 
+typedef struct {
+    Onion_Path path;
+    uint64_t created;
+} Onion_Pool_Path;
+
 typedef struct {
     uint8_t     public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint64_t    timestamp;
@@ -101,6 +112,9 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 
     uint32_t run_count;
+
+    uint64_t next_search;   /* when do_friend() has to run again */
+    uint32_t search_index;  /* position in search_heap + 1, 0 if not scheduled */
 } Onion_Friend;
 
 struct Onion_Client {
@@ -141,6 +155,24 @@ struct Onion_Client {
 
     unsigned int onion_connected;
     bool UDP_connected;
+
+    /* Paths built ahead of time for random_path(). The nodes are picked on
+     * the main thread, path_worker does the key exchanges. The mutex guards
+     * path_pool, path_pool_size and path_job_queued.
+     */
+    Thread_Pool *path_worker;
+    pthread_mutex_t path_pool_mutex;
+    Onion_Pool_Path path_pool[ONION_PATH_POOL_SIZE];
+    uint32_t path_pool_size;
+    bool path_job_queued;
+
+    /* Offline friends ordered by next_search, so that do_onion_client() only
+     * touches the friends whose search is due.
+     */
+    uint16_t *search_heap;
+    uint16_t search_heap_size;
+    uint32_t search_rate;
+    int64_t search_budget;  /* packets friend searches may still send this second */
 };
 
 DHT *onion_get_dht(const Onion_Client *onion_c)
@@ -352,6 +384,152 @@ static bool onion_node_timed_out(const Onion_Node *node)
                 && is_timeout(node->last_pinged, ONION_NODE_TIMEOUT)));
 }
 
+typedef struct {
+    Onion_Client *onion_c;
+    Node_format nodes[ONION_PATH_POOL_SIZE][ONION_PATH_LENGTH];
+    uint32_t num_paths;
+    uint64_t created;
+} Onion_Path_Job;
+
+/* Remove entry index from the path pool. Must be called with the pool mutex held.
+ */
+static void path_pool_remove(Onion_Client *onion_c, uint32_t index)
+{
+    --onion_c->path_pool_size;
+    onion_c->path_pool[index] = onion_c->path_pool[onion_c->path_pool_size];
+    crypto_memzero(&onion_c->path_pool[onion_c->path_pool_size], sizeof(Onion_Pool_Path));
+}
+
+/* return true if the pooled path can still be used: it is not too old and its
+ * first hop is of the kind random_nodes_path_onion() would pick right now.
+ */
+static bool pool_path_usable(const Onion_Pool_Path *pooled, bool dht_connected)
+{
+    if (is_timeout(pooled->created, ONION_PATH_POOL_MAX_AGE)) {
+        return 0;
+    }
+
+    const bool tcp = pooled->path.ip_port1.ip.family == TCP_FAMILY;
+    return tcp != dht_connected;
+}
+
+static void path_pool_job(void *object, void *data)
+{
+    Onion_Client *onion_c = (Onion_Client *)object;
+    Onion_Path_Job *job = (Onion_Path_Job *)data;
+    Onion_Pool_Path paths[ONION_PATH_POOL_SIZE];
+    uint32_t num = 0;
+
+    for (uint32_t i = 0; i < job->num_paths; ++i) {
+        if (create_onion_path(onion_c->dht, &paths[num].path, job->nodes[i]) == 0) {
+            paths[num].created = job->created;
+            ++num;
+        }
+    }
+
+    pthread_mutex_lock(&onion_c->path_pool_mutex);
+
+    for (uint32_t i = 0; i < num && onion_c->path_pool_size < ONION_PATH_POOL_SIZE; ++i) {
+        onion_c->path_pool[onion_c->path_pool_size] = paths[i];
+        ++onion_c->path_pool_size;
+    }
+
+    onion_c->path_job_queued = 0;
+    pthread_mutex_unlock(&onion_c->path_pool_mutex);
+
+    crypto_memzero(paths, sizeof(paths));
+    free(job);
+}
+
+/* Drop pooled paths that can no longer be used and, if the pool is running
+ * low, give the path worker a set of node triples to build paths from.
+ */
+static void fill_path_pool(Onion_Client *onion_c)
+{
+    if (onion_c->path_worker == nullptr) {
+        return;
+    }
+
+    const bool dht_connected = DHT_isconnected(onion_c->dht);
+    uint32_t wanted = 0;
+
+    pthread_mutex_lock(&onion_c->path_pool_mutex);
+
+    for (uint32_t i = onion_c->path_pool_size; i != 0; --i) {
+        if (!pool_path_usable(&onion_c->path_pool[i - 1], dht_connected)) {
+            path_pool_remove(onion_c, i - 1);
+        }
+    }
+
+    if (!onion_c->path_job_queued && onion_c->path_pool_size < ONION_PATH_POOL_LOW) {
+        wanted = ONION_PATH_POOL_SIZE - onion_c->path_pool_size;
+        onion_c->path_job_queued = 1;
+    }
+
+    pthread_mutex_unlock(&onion_c->path_pool_mutex);
+
+    if (wanted == 0) {
+        return;
+    }
+
+    Onion_Path_Job *job = (Onion_Path_Job *)calloc(1, sizeof(Onion_Path_Job));
+
+    if (job != nullptr) {
+        job->onion_c = onion_c;
+        job->created = unix_time();
+
+        for (uint32_t i = 0; i < wanted; ++i) {
+            if (random_nodes_path_onion(onion_c, job->nodes[job->num_paths], ONION_PATH_LENGTH) == ONION_PATH_LENGTH) {
+                ++job->num_paths;
+            }
+        }
+    }
+
+    if (job == nullptr || job->num_paths == 0
+            || thread_pool_add_job(onion_c->path_worker, &path_pool_job, onion_c, job) == -1) {
+        free(job);
+        pthread_mutex_lock(&onion_c->path_pool_mutex);
+        onion_c->path_job_queued = 0;
+        pthread_mutex_unlock(&onion_c->path_pool_mutex);
+    }
+}
+
+/* Take a precomputed path whose nodes are not already used by onion_paths.
+ *
+ * return -1 if the pool holds no suitable path.
+ * return 0 on success.
+ */
+static int take_pool_path(Onion_Client *onion_c, const Onion_Client_Paths *onion_paths, Onion_Path *path)
+{
+    if (onion_c->path_worker == nullptr) {
+        return -1;
+    }
+
+    const bool dht_connected = DHT_isconnected(onion_c->dht);
+    int ret = -1;
+
+    pthread_mutex_lock(&onion_c->path_pool_mutex);
+
+    for (uint32_t i = 0; i < onion_c->path_pool_size; ++i) {
+        const Onion_Pool_Path *pooled = &onion_c->path_pool[i];
+        Node_format nodes[ONION_PATH_LENGTH];
+
+        if (!pool_path_usable(pooled, dht_connected)
+                || onion_path_to_nodes(nodes, ONION_PATH_LENGTH, &pooled->path) == -1
+                || is_path_used(onion_paths, nodes) != -1) {
+            continue;
+        }
+
+        *path = pooled->path;
+        path_pool_remove(onion_c, i);
+        ret = 0;
+        break;
+    }
+
+    pthread_mutex_unlock(&onion_c->path_pool_mutex);
+    return ret;
+}
+
 /* Create a new path or use an old suitable one (if pathnum is valid)
  * or a random one from onion_paths.
  *
@@ -361,7 +539,7 @@ static bool onion_node_timed_out(const Onion_Node *node)
  * TODO(irungentoo): Make this function better, it currently probably is
  * vulnerable to some attacks that could deanonimize us.
  */
-static int random_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_paths, uint32_t pathnum, Onion_Path *path)
+static int random_path(Onion_Client *onion_c, Onion_Client_Paths *onion_paths, uint32_t pathnum, Onion_Path *path)
 {
     if (pathnum == UINT32_MAX) {
         pathnum = rand() % NUMBER_ONION_PATHS;
@@ -370,19 +548,35 @@ static int random_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_pa
     }
 
     if (path_timed_out(onion_paths, pathnum)) {
-        Node_format nodes[ONION_PATH_LENGTH];
+        Metrics *metrics = net_metrics(onion_c->net);
+        int n = -1;
 
-        if (random_nodes_path_onion(onion_c, nodes, ONION_PATH_LENGTH) != ONION_PATH_LENGTH) {
-            return -1;
-        }
+        if (take_pool_path(onion_c, onion_paths, &onion_paths->paths[pathnum]) == 0) {
+            metrics_inc(metrics, METRIC_ONION_PATH_POOL_HITS);
+        } else {
+            Node_format nodes[ONION_PATH_LENGTH];
+
+            if (random_nodes_path_onion(onion_c, nodes, ONION_PATH_LENGTH) != ONION_PATH_LENGTH) {
+                metrics_inc(metrics, METRIC_ONION_PATH_FAILURES);
+                return -1;
+            }
 
-        int n = is_path_used(onion_paths, nodes);
+            n = is_path_used(onion_paths, nodes);
 
-        if (n == -1) {
-            if (create_onion_path(onion_c->dht, &onion_paths->paths[pathnum], nodes) == -1) {
+            if (n == -1 && create_onion_path(onion_c->dht, &onion_paths->paths[pathnum], nodes) == -1) {
+                metrics_inc(metrics, METRIC_ONION_PATH_FAILURES);
                 return -1;
             }
+        }
+
+        if (n == -1) {
+            /* An old path replaced before the end of its lifetime stopped getting responses. */
+            if (onion_paths->path_creation_time[pathnum] != 0
+                    && !is_timeout(onion_paths->path_creation_time[pathnum], ONION_PATH_MAX_LIFETIME)) {
+                metrics_inc(metrics, METRIC_ONION_PATH_TIMEOUTS);
+            }
 
+            metrics_inc(metrics, METRIC_ONION_PATHS_CREATED);
             onion_paths->path_creation_time[pathnum] = unix_time();
             onion_paths->last_path_success[pathnum] = onion_paths->path_creation_time[pathnum];
             onion_paths->last_path_used_times[pathnum] = ONION_PATH_MAX_NO_RESPONSE_USES / 2;
@@ -509,7 +703,7 @@ static int send_onion_packet_tcp_udp(const Onion_Client *onion_c, const Onion_Pa
 static int new_sendback(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
                         uint32_t path_num, uint64_t *sendback)
 {
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
     memcpy(data, &num, sizeof(uint32_t));
     memcpy(data + sizeof(uint32_t), public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(data + sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE, &ip_port, sizeof(IP_Port));
@@ -538,7 +732,7 @@ static uint32_t check_sendback(Onion_Client *onion_c, const uint8_t *sendback, u
 {
     uint64_t sback;
     memcpy(&sback, sendback, sizeof(uint64_t));
-    uint8_t data[sizeof(uint32_t) + CRYPTO_PUBLIC_KEY_SIZE + sizeof(IP_Port) + sizeof(uint32_t)];
+    uint8_t data[ANNOUNCE_SENDBACK_DATA_SIZE];
 
     if (ping_array_check(onion_c->announce_ping_array, data, sizeof(data), sback) != sizeof(data)) {
         return ~0;
@@ -600,6 +794,7 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, IP_
         return -1;
     }
 
+    metrics_inc(net_metrics(onion_c->net), METRIC_ONION_ANNOUNCES_SENT);
     return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
 }
 
@@ -663,6 +858,102 @@ static void sort_onion_node_list(Onion_Node *list, unsigned int length, const ui
     }
 }
 
+static void search_heap_set(Onion_Client *onion_c, uint32_t index, uint16_t friendnum)
+{
+    onion_c->search_heap[index] = friendnum;
+    onion_c->friends_list[friendnum].search_index = index + 1;
+}
+
+static bool search_heap_less(const Onion_Client *onion_c, uint32_t a, uint32_t b)
+{
+    return onion_c->friends_list[onion_c->search_heap[a]].next_search
+           < onion_c->friends_list[onion_c->search_heap[b]].next_search;
+}
+
+static void search_heap_swap(Onion_Client *onion_c, uint32_t a, uint32_t b)
+{
+    const uint16_t friendnum = onion_c->search_heap[a];
+    search_heap_set(onion_c, a, onion_c->search_heap[b]);
+    search_heap_set(onion_c, b, friendnum);
+}
+
+/* Move the entry at index up or down until the heap is ordered again. */
+static void search_heap_fix(Onion_Client *onion_c, uint32_t index)
+{
+    while (index > 0 && search_heap_less(onion_c, index, (index - 1) / 2)) {
+        search_heap_swap(onion_c, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+
+    while (1) {
+        const uint32_t left = index * 2 + 1;
+        uint32_t smallest = index;
+
+        if (left < onion_c->search_heap_size && search_heap_less(onion_c, left, smallest)) {
+            smallest = left;
+        }
+
+        if (left + 1 < onion_c->search_heap_size && search_heap_less(onion_c, left + 1, smallest)) {
+            smallest = left + 1;
+        }
+
+        if (smallest == index) {
+            return;
+        }
+
+        search_heap_swap(onion_c, index, smallest);
+        index = smallest;
+    }
+}
+
+/* Run do_friend() for friendnum at time. */
+static void schedule_friend_search(Onion_Client *onion_c, uint16_t friendnum, uint64_t time)
+{
+    Onion_Friend *onion_friend = &onion_c->friends_list[friendnum];
+    onion_friend->next_search = time;
+
+    if (onion_friend->search_index == 0) {
+        search_heap_set(onion_c, onion_c->search_heap_size, friendnum);
+        ++onion_c->search_heap_size;
+    }
+
+    search_heap_fix(onion_c, onion_friend->search_index - 1);
+}
+
+static void unschedule_friend_search(Onion_Client *onion_c, uint16_t friendnum)
+{
+    Onion_Friend *onion_friend = &onion_c->friends_list[friendnum];
+
+    if (onion_friend->search_index == 0) {
+        return;
+    }
+
+    const uint32_t index = onion_friend->search_index - 1;
+    onion_friend->search_index = 0;
+    --onion_c->search_heap_size;
+
+    if (index != onion_c->search_heap_size) {
+        search_heap_set(onion_c, index, onion_c->search_heap[onion_c->search_heap_size]);
+        search_heap_fix(onion_c, index);
+    }
+}
+
+/* Something do_friend() reacts to changed for friendnum: search for them
+ * in the next do_onion_client() if they are offline.
+ */
+static void wake_friend_search(Onion_Client *onion_c, uint16_t friendnum)
+{
+    const Onion_Friend *onion_friend = &onion_c->friends_list[friendnum];
+
+    if (onion_friend->status == 0 || onion_friend->is_online) {
+        return;
+    }
+
+    if (onion_friend->search_index == 0 || onion_friend->next_search > unix_time()) {
+        schedule_friend_search(onion_c, friendnum, unix_time());
+    }
+}
+
 static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
                               uint8_t is_stored, const uint8_t *pingid_or_key, uint32_t path_used)
 {
@@ -740,6 +1031,11 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
     }
 
     list_nodes[index].path_used = path_used;
+
+    if (num != 0) {
+        wake_friend_search(onion_c, num - 1);
+    }
+
     return 0;
 }
 
@@ -867,6 +1163,7 @@ static int handle_announce_response(void *object, IP_Port source, const uint8_t
         return 1;
     }
 
+    metrics_inc(net_metrics(onion_c->net), METRIC_ONION_ANNOUNCE_RESPONSES);
     uint32_t path_used = set_path_timeouts(onion_c, num, path_num);
 
     if (client_add_to_list(onion_c, num, public_key, ip_port, plain[0], plain + 1, path_used) == -1) {
@@ -1261,9 +1558,19 @@ static int realloc_onion_friends(Onion_Client *onion_c, uint32_t num)
     if (num == 0) {
         free(onion_c->friends_list);
         onion_c->friends_list = nullptr;
+        free(onion_c->search_heap);
+        onion_c->search_heap = nullptr;
         return 0;
     }
 
+    uint16_t *new_search_heap = (uint16_t *)realloc(onion_c->search_heap, num * sizeof(uint16_t));
+
+    if (new_search_heap == nullptr) {
+        return -1;
+    }
+
+    onion_c->search_heap = new_search_heap;
+
     Onion_Friend *newonion_friends = (Onion_Friend *)realloc(onion_c->friends_list, num * sizeof(Onion_Friend));
 
     if (newonion_friends == nullptr) {
@@ -1309,6 +1616,7 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
     crypto_new_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
+    wake_friend_search(onion_c, index);
     return index;
 }
 
@@ -1326,6 +1634,7 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num)
     //if (onion_c->friends_list[friend_num].know_dht_public_key)
     //    DHT_delfriend(onion_c->dht, onion_c->friends_list[friend_num].dht_public_key, 0);
 
+    unschedule_friend_search(onion_c, friend_num);
     crypto_memzero(&onion_c->friends_list[friend_num], sizeof(Onion_Friend));
     unsigned int i;
 
@@ -1411,6 +1720,7 @@ int onion_set_friend_DHT_pubkey(Onion_Client *onion_c, int friend_num, const uin
     onion_c->friends_list[friend_num].last_seen = unix_time();
     onion_c->friends_list[friend_num].know_dht_public_key = 1;
     memcpy(onion_c->friends_list[friend_num].dht_public_key, dht_key, CRYPTO_PUBLIC_KEY_SIZE);
+    wake_friend_search(onion_c, friend_num);
 
     return 0;
 }
@@ -1482,6 +1792,9 @@ int onion_set_friend_online(Onion_Client *onion_c, int friend_num, uint8_t is_on
     if (!is_online) {
         onion_c->friends_list[friend_num].last_noreplay = 0;
         onion_c->friends_list[friend_num].run_count = 0;
+        wake_friend_search(onion_c, friend_num);
+    } else {
+        unschedule_friend_search(onion_c, friend_num);
     }
 
     return 0;
@@ -1520,14 +1833,33 @@ static void populate_path_nodes_tcp(Onion_Client *onion_c)
 #define ONION_FRIEND_BACKOFF_FACTOR 4
 #define ONION_FRIEND_MAX_PING_INTERVAL (5*60*MAX_ONION_CLIENTS)
 
-static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
+/* Seconds before sending our DHT public key through the DHT is tried again
+ * when there was no route to the friend. */
+#define DHT_DHTPK_RETRY_INTERVAL ANNOUNCE_FRIEND_BEGINNING
+
+static void search_again_at(uint64_t *next, uint64_t time)
 {
+    if (time < *next) {
+        *next = time;
+    }
+}
+
+/* Search for friend friendnum, using up the search budget for the packets sent.
+ *
+ * return the time do_friend() has to run again.
+ * return UINT64_MAX if only an event such as new announce nodes or the
+ * friend going offline can give it something to do.
+ */
+static uint64_t do_friend(Onion_Client *onion_c, uint16_t friendnum)
+{
+    uint64_t next = UINT64_MAX;
+
     if (friendnum >= onion_c->num_friends) {
-        return;
+        return next;
     }
 
     if (onion_c->friends_list[friendnum].status == 0) {
-        return;
+        return next;
     }
 
     unsigned int interval = ANNOUNCE_FRIEND;
@@ -1577,10 +1909,13 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
 
             if (list_nodes[i].last_pinged == 0) {
                 list_nodes[i].last_pinged = unix_time();
+                search_again_at(&next, list_nodes[i].last_pinged + interval);
                 continue;
             }
 
             if (list_nodes[i].unsuccessful_pings >= ONION_NODE_MAX_PINGS) {
+                /* Timing out may make room for a better node. */
+                search_again_at(&next, list_nodes[i].last_pinged + ONION_NODE_TIMEOUT);
                 continue;
             }
 
@@ -1590,11 +1925,31 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
                                                  list_nodes[i].public_key, nullptr, ~0) == 0) {
                     list_nodes[i].last_pinged = unix_time();
                     ++list_nodes[i].unsuccessful_pings;
+                    --onion_c->search_budget;
                     ping_random = false;
                 }
             }
+
+            search_again_at(&next, list_nodes[i].last_pinged + interval);
+        }
+
+        /* When the random ping above is due next. */
+        uint64_t random_ping = 0;
+
+        for (unsigned i = 0; i < MAX_ONION_CLIENTS; ++i) {
+            uint64_t node_due = list_nodes[i].timestamp + interval / MAX_ONION_CLIENTS;
+
+            if (node_due < list_nodes[i].last_pinged + ONION_NODE_PING_INTERVAL) {
+                node_due = list_nodes[i].last_pinged + ONION_NODE_PING_INTERVAL;
+            }
+
+            if (random_ping < node_due) {
+                random_ping = node_due;
+            }
         }
 
+        search_again_at(&next, random_ping);
+
         if (count != MAX_ONION_CLIENTS) {
             unsigned int num_nodes = (onion_c->path_nodes_index < MAX_PATH_NODES) ? onion_c->path_nodes_index : MAX_PATH_NODES;
 
@@ -1610,30 +1965,91 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
 
                     for (j = 0; j < n; ++j) {
                         unsigned int num = rand() % num_nodes;
-                        client_send_announce_request(onion_c, friendnum + 1, onion_c->path_nodes[num].ip_port,
-                                                     onion_c->path_nodes[num].public_key, nullptr, ~0);
+
+                        if (client_send_announce_request(onion_c, friendnum + 1, onion_c->path_nodes[num].ip_port,
+                                                         onion_c->path_nodes[num].public_key, nullptr, ~0) == 0) {
+                            --onion_c->search_budget;
+                        }
                     }
 
                     ++onion_c->friends_list[friendnum].run_count;
                 }
             }
+
+            /* Keep looking for nodes every second until the list is full. */
+            search_again_at(&next, unix_time() + 1);
         } else {
             ++onion_c->friends_list[friendnum].run_count;
         }
 
         /* send packets to friend telling them our DHT public key. */
         if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL)) {
-            if (send_dhtpk_announce(onion_c, friendnum, 0) >= 1) {
+            const int sent = send_dhtpk_announce(onion_c, friendnum, 0);
+
+            /* On failure the friend has too few announced nodes, adding one wakes us up. */
+            if (sent >= 1) {
                 onion_c->friends_list[friendnum].last_dht_pk_onion_sent = unix_time();
+                onion_c->search_budget -= sent;
             }
         }
 
+        if (!is_timeout(onion_c->friends_list[friendnum].last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL)) {
+            search_again_at(&next, onion_c->friends_list[friendnum].last_dht_pk_onion_sent + ONION_DHTPK_SEND_INTERVAL);
+        }
+
         if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL)) {
-            if (send_dhtpk_announce(onion_c, friendnum, 1) >= 1) {
+            const int sent = send_dhtpk_announce(onion_c, friendnum, 1);
+
+            if (sent >= 1) {
                 onion_c->friends_list[friendnum].last_dht_pk_dht_sent = unix_time();
+                onion_c->search_budget -= sent;
+            } else if (onion_c->friends_list[friendnum].know_dht_public_key) {
+                search_again_at(&next, unix_time() + DHT_DHTPK_RETRY_INTERVAL);
             }
         }
+
+        if (!is_timeout(onion_c->friends_list[friendnum].last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL)) {
+            search_again_at(&next, onion_c->friends_list[friendnum].last_dht_pk_dht_sent + DHT_DHTPK_SEND_INTERVAL);
+        }
     }
+
+    return next;
+}
+
+/* Run do_friend() for the friends whose search is due, most overdue first,
+ * until the packets sent reach the search rate for this second.
+ */
+static void do_friend_searches(Onion_Client *onion_c)
+{
+    const uint64_t now = unix_time();
+    onion_c->search_budget = onion_c->search_rate;
+
+    while (onion_c->search_heap_size != 0) {
+        const uint16_t friendnum = onion_c->search_heap[0];
+
+        if (onion_c->friends_list[friendnum].next_search > now) {
+            break;
+        }
+
+        if (onion_c->search_rate != 0 && onion_c->search_budget <= 0) {
+            metrics_inc(net_metrics(onion_c->net), METRIC_ONION_FRIEND_SEARCHES_DEFERRED);
+            break;
+        }
+
+        const uint64_t next = do_friend(onion_c, friendnum);
+        metrics_inc(net_metrics(onion_c->net), METRIC_ONION_FRIEND_SEARCHES);
+
+        if (next == UINT64_MAX) {
+            unschedule_friend_search(onion_c, friendnum);
+        } else {
+            schedule_friend_search(onion_c, friendnum, next > now ? next : now + 1);
+        }
+    }
+}
+
+void onion_set_friend_search_rate(Onion_Client *onion_c, uint32_t rate)
+{
+    onion_c->search_rate = rate;
 }
 
 
@@ -1806,6 +2222,7 @@ void do_onion_client(Onion_Client *onion_c)
 
     if (is_timeout(onion_c->first_run, ONION_CONNECTION_SECONDS)) {
         populate_path_nodes(onion_c);
+        fill_path_pool(onion_c);
         do_announce(onion_c);
     }
 
@@ -1831,9 +2248,7 @@ void do_onion_client(Onion_Client *onion_c)
                              || get_random_tcp_onion_conn_number(nc_get_tcp_c(onion_c->c)) == -1; /* Check if connected to any TCP relays. */
 
     if (onion_connection_status(onion_c)) {
-        for (unsigned i = 0; i < onion_c->num_friends; ++i) {
-            do_friend(onion_c, i);
-        }
+        do_friend_searches(onion_c);
     }
 
     if (onion_c->last_run == 0) {
@@ -1855,13 +2270,24 @@ Onion_Client *new_onion_client(Net_Crypto *c)
         return nullptr;
     }
 
-    onion_c->announce_ping_array = ping_array_new(ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT);
+    onion_c->announce_ping_array = ping_array_new(ANNOUNCE_ARRAY_SIZE, ANNOUNCE_TIMEOUT, ANNOUNCE_SENDBACK_DATA_SIZE,
+                                   net_metrics(dht_get_net(nc_get_dht(c))));
 
     if (onion_c->announce_ping_array == nullptr) {
         free(onion_c);
         return nullptr;
     }
 
+    if (pthread_mutex_init(&onion_c->path_pool_mutex, nullptr) != 0) {
+        ping_array_kill(onion_c->announce_ping_array);
+        free(onion_c);
+        return nullptr;
+    }
+
+    /* Without a worker random_path() builds every path itself. */
+    onion_c->path_worker = new_thread_pool(1, 1);
+    onion_c->search_rate = ONION_FRIEND_SEARCH_RATE;
+
     onion_c->dht = nc_get_dht(c);
     onion_c->net = dht_get_net(onion_c->dht);
     onion_c->c = c;
@@ -1882,6 +2308,10 @@ void kill_onion_client(Onion_Client *onion_c)
         return;
     }
 
+    /* Waits for a path job still running, it uses the DHT keys. */
+    kill_thread_pool(onion_c->path_worker);
+    pthread_mutex_destroy(&onion_c->path_pool_mutex);
+
     ping_array_kill(onion_c->announce_ping_array);
     realloc_onion_friends(onion_c, 0);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, nullptr, nullptr);
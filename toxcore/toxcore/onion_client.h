@@ -47,6 +47,19 @@
 #define ONION_PATH_MAX_LIFETIME 1200
 #define ONION_PATH_MAX_NO_RESPONSE_USES 4
 
+/* Number of paths kept ready by the path worker, and the size below which it
+ * is asked to build more. Pooled paths older than ONION_PATH_POOL_MAX_AGE
+ * seconds are dropped since their nodes may have gone away.
+ */
+#define ONION_PATH_POOL_SIZE 8
+#define ONION_PATH_POOL_LOW 4
+#define ONION_PATH_POOL_MAX_AGE 60
+
+/* Announce and DHT public key packets per second that searches for offline
+ * friends may send by default, see onion_set_friend_search_rate().
+ */
+#define ONION_FRIEND_SEARCH_RATE 256
+
 #define MAX_STORED_PINGED_NODES 9
 #define MIN_NODE_PING_TIME 10
 
@@ -183,6 +196,12 @@ typedef int (*oniondata_handler_callback)(void *object, const uint8_t *source_pu
 /* Function to call when onion data packet with contents beginning with byte is received. */
 void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_handler_callback cb, void *object);
 
+/* Limit the packets sent to search for offline friends to rate per second.
+ * Friends that are due when the limit is reached are searched for first in
+ * the next second. 0 removes the limit.
+ */
+void onion_set_friend_search_rate(Onion_Client *onion_c, uint32_t rate);
+
 void do_onion_client(Onion_Client *onion_c);
 
 Onion_Client *new_onion_client(Net_Crypto *c);
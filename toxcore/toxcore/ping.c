@@ -30,6 +30,7 @@
 #include "ping.h"
 
 #include "DHT.h"
+#include "LAN_discovery.h"
 #include "network.h"
 #include "ping_array.h"
 #include "util.h"
@@ -44,6 +45,11 @@
 /* Ping newly announced nodes to ping per TIME_TO_PING seconds*/
 #define TIME_TO_PING 2
 
+/* Ping requests answered per second from one source and from all of them. */
+#define PING_REQUEST_RATE 32
+#define PING_REQUEST_BURST 128
+#define PING_REQUEST_TOTAL_RATE 4096
+
 
 struct Ping {
     DHT *dht;
@@ -51,6 +57,9 @@ struct Ping {
     Ping_Array  *ping_array;
     Node_format to_ping[MAX_TO_PING];
     uint64_t    last_to_ping;
+
+    ping_add_cb *add_callback;
+    void        *add_callback_object;
 };
 
 
@@ -280,6 +289,11 @@ int32_t ping_add(Ping *ping, const uint8_t *public_key, IP_Port ip_port)
         return -1;
     }
 
+    if (ping->add_callback) {
+        ping->add_callback(ping->add_callback_object, public_key, ip_port);
+        return -1;
+    }
+
     if (!node_addable_to_close_list(ping->dht, public_key, ip_port)) {
         return -1;
     }
@@ -289,8 +303,12 @@ int32_t ping_add(Ping *ping, const uint8_t *public_key, IP_Port ip_port)
     }
 
     IP_Port temp;
+    const int friend_ip = DHT_getfriendip(ping->dht, public_key, &temp);
 
-    if (DHT_getfriendip(ping->dht, public_key, &temp) == 0) {
+    /* Friends are pinged right away when we don't know where they are or when
+     * they reach us from a new LAN address, so a friend that answered our LAN
+     * discovery gets a direct path without waiting for ping_iterate(). */
+    if (friend_ip == 0 || (friend_ip == 1 && ip_is_lan(ip_port.ip) == 0 && !ipport_equal(&temp, &ip_port))) {
         ping_send_request(ping, ip_port, public_key);
         return -1;
     }
@@ -316,6 +334,11 @@ int32_t ping_add(Ping *ping, const uint8_t *public_key, IP_Port ip_port)
     return -1;
 }
 
+void ping_set_add_callback(Ping *ping, ping_add_cb *function, void *object)
+{
+    ping->add_callback = function;
+    ping->add_callback_object = object;
+}
 
 /* Ping all the valid nodes in the to_ping list every TIME_TO_PING seconds.
  * This function must be run at least once every TIME_TO_PING seconds.
@@ -359,7 +382,7 @@ Ping *ping_new(DHT *dht)
         return nullptr;
     }
 
-    ping->ping_array = ping_array_new(PING_NUM_MAX, PING_TIMEOUT);
+    ping->ping_array = ping_array_new(PING_NUM_MAX, PING_TIMEOUT, PING_DATA_SIZE, net_metrics(dht_get_net(dht)));
 
     if (ping->ping_array == nullptr) {
         free(ping);
@@ -369,6 +392,8 @@ Ping *ping_new(DHT *dht)
     ping->dht = dht;
     networking_registerhandler(dht_get_net(ping->dht), NET_PACKET_PING_REQUEST, &handle_ping_request, dht);
     networking_registerhandler(dht_get_net(ping->dht), NET_PACKET_PING_RESPONSE, &handle_ping_response, dht);
+    networking_set_rate_limit(dht_get_net(ping->dht), NET_PACKET_PING_REQUEST, PING_REQUEST_RATE, PING_REQUEST_BURST,
+                              PING_REQUEST_TOTAL_RATE);
 
     return ping;
 }
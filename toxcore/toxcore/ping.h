@@ -62,6 +62,14 @@ void ping_kill(Ping *ping);
  */
 int32_t ping_add(Ping *ping, const uint8_t *public_key, struct IP_Port ip_port);
 
+typedef void ping_add_cb(void *object, const uint8_t *public_key, struct IP_Port ip_port);
+
+/** Pass the nodes given to ping_add() to function instead of adding them to
+ * the to_ping list. For a Ping whose DHT never runs ping_iterate(), so that
+ * another Ping can add them.
+ */
+void ping_set_add_callback(Ping *ping, ping_add_cb *function, void *object);
+
 void ping_iterate(Ping *ping);
 
 int32_t ping_send_request(Ping *ping, struct IP_Port ipp, const uint8_t *public_key);
@@ -31,32 +31,61 @@
 #include "util.h"
 
 
+/* Entries are used in the order they are added, so they also time out in that
+ * order. Entry number n lives in slot n % total_size and its ping_id carries
+ * n in the bits below max_size, so it still finds its slot after the array
+ * grew. The payloads are stored inline in data, data_size bytes per slot.
+ */
 typedef struct {
-    void *data;
-    uint32_t length;
+    uint64_t ping_id; /* 0 once the entry was checked. */
     uint64_t time;
-    uint64_t ping_id;
+    uint32_t length;
 } Ping_Array_Entry;
 
 struct Ping_Array {
     Ping_Array_Entry *entries;
+    uint8_t *data;
 
     uint32_t last_deleted; /* number representing the next entry to be deleted. */
     uint32_t last_added; /* number representing the last entry to be added. */
     uint32_t total_size; /* The length of entries */
+    uint32_t max_size; /* total_size never grows beyond this. */
+    uint32_t data_size; /* Space for the data of each entry. */
     uint32_t timeout; /* The timeout after which entries are cleared. */
+
+    /* The number of the first entry added in each of the last timeout + 1
+     * seconds, indexed by the second modulo timeout + 1. Lets timed out
+     * entries be dropped without looking at them.
+     */
+    uint64_t *bucket_time;
+    uint32_t *bucket_first;
+
+    Metrics *metrics;
 };
 
+static uint32_t round_up_pow2(uint32_t n)
+{
+    uint32_t pow2 = 1;
+
+    while (pow2 < n && pow2 < (1U << 31)) {
+        pow2 <<= 1;
+    }
+
+    return pow2;
+}
+
 /* Initialize a Ping_Array.
- * size represents the total size of the array and should be a power of 2.
+ * size is the number of entries it starts with, rounded up to a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * data_size is the largest length passed to ping_array_add().
+ * metrics may be NULL.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-Ping_Array *ping_array_new(uint32_t size, uint32_t timeout)
+Ping_Array *ping_array_new(uint32_t size, uint32_t timeout, uint32_t data_size, Metrics *metrics)
 {
-    if (size == 0 || timeout == 0) {
+    if (size == 0 || timeout == 0 || data_size == 0 || size > (1U << 31) / PING_ARRAY_MAX_GROWTH) {
         return nullptr;
     }
 
@@ -66,56 +95,95 @@ Ping_Array *ping_array_new(uint32_t size, uint32_t timeout)
         return nullptr;
     }
 
+    size = round_up_pow2(size);
     empty_array->entries = (Ping_Array_Entry *)calloc(size, sizeof(Ping_Array_Entry));
+    empty_array->data = (uint8_t *)malloc((size_t)size * data_size);
+    empty_array->bucket_time = (uint64_t *)calloc(timeout + 1, sizeof(uint64_t));
+    empty_array->bucket_first = (uint32_t *)calloc(timeout + 1, sizeof(uint32_t));
 
-    if (empty_array->entries == nullptr) {
-        free(empty_array);
+    if (empty_array->entries == nullptr || empty_array->data == nullptr
+            || empty_array->bucket_time == nullptr || empty_array->bucket_first == nullptr) {
+        ping_array_kill(empty_array);
         return nullptr;
     }
 
     empty_array->last_deleted = empty_array->last_added = 0;
     empty_array->total_size = size;
+    empty_array->max_size = size * PING_ARRAY_MAX_GROWTH;
+    empty_array->data_size = data_size;
     empty_array->timeout = timeout;
+    empty_array->metrics = metrics;
     return empty_array;
 }
 
-static void clear_entry(Ping_Array *array, uint32_t index)
-{
-    free(array->entries[index].data);
-    array->entries[index].data = nullptr;
-    array->entries[index].length =
-        array->entries[index].time =
-            array->entries[index].ping_id = 0;
-}
-
 /* Free all the allocated memory in a Ping_Array.
  */
 void ping_array_kill(Ping_Array *array)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-        clear_entry(array, index);
-        ++array->last_deleted;
-    }
-
     free(array->entries);
+    free(array->data);
+    free(array->bucket_time);
+    free(array->bucket_first);
     free(array);
 }
 
-/* Clear timed out entries.
+/* Drop the entries added before the oldest second that has not timed out.
  */
 static void ping_array_clear_timedout(Ping_Array *array)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
+    const uint64_t now = unix_time();
+    const uint32_t num_buckets = array->timeout + 1;
 
-        if (!is_timeout(array->entries[index].time, array->timeout)) {
-            break;
+    const uint64_t first_second = now >= array->timeout ? now + 1 - array->timeout : 0;
+
+    for (uint64_t second = first_second; second <= now; ++second) {
+        const uint32_t bucket = second % num_buckets;
+
+        if (array->bucket_time[bucket] != second) {
+            continue;
         }
 
-        clear_entry(array, index);
-        ++array->last_deleted;
+        if ((int32_t)(array->bucket_first[bucket] - array->last_deleted) > 0) {
+            array->last_deleted = array->bucket_first[bucket];
+        }
+
+        return;
+    }
+
+    array->last_deleted = array->last_added;
+}
+
+/* Double the number of slots, moving the entries to their new slots.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int ping_array_grow(Ping_Array *array)
+{
+    const uint32_t new_size = array->total_size * 2;
+    Ping_Array_Entry *entries = (Ping_Array_Entry *)calloc(new_size, sizeof(Ping_Array_Entry));
+    uint8_t *data = (uint8_t *)malloc((size_t)new_size * array->data_size);
+
+    if (entries == nullptr || data == nullptr) {
+        free(entries);
+        free(data);
+        return -1;
     }
+
+    for (uint32_t i = array->last_deleted; i != array->last_added; ++i) {
+        const uint32_t old_index = i % array->total_size;
+        const uint32_t new_index = i % new_size;
+        entries[new_index] = array->entries[old_index];
+        memcpy(data + (size_t)new_index * array->data_size, array->data + (size_t)old_index * array->data_size,
+               array->entries[old_index].length);
+    }
+
+    free(array->entries);
+    free(array->data);
+    array->entries = entries;
+    array->data = data;
+    array->total_size = new_size;
+    return 0;
 }
 
 /* Add a data with length to the Ping_Array list and return a ping_id.
@@ -125,34 +193,52 @@ static void ping_array_clear_timedout(Ping_Array *array)
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 {
+    if (length > array->data_size) {
+        return 0;
+    }
+
     ping_array_clear_timedout(array);
-    uint32_t index = array->last_added % array->total_size;
 
-    if (array->entries[index].data != nullptr) {
-        array->last_deleted = array->last_added - array->total_size;
-        clear_entry(array, index);
-    }
+    if (array->last_added - array->last_deleted == array->total_size) {
+        /* Every slot holds an entry that has not timed out yet. Only grow if
+         * the oldest one is still waiting for its reply.
+         */
+        const bool oldest_waiting = array->entries[array->last_deleted % array->total_size].ping_id != 0;
 
-    array->entries[index].data = malloc(length);
+        if (!oldest_waiting || array->total_size == array->max_size || ping_array_grow(array) == -1) {
+            if (oldest_waiting && array->metrics != nullptr) {
+                metrics_inc(array->metrics, METRIC_PING_ARRAY_OVERWRITTEN);
+            }
 
-    if (array->entries[index].data == nullptr) {
-        return 0;
+            ++array->last_deleted;
+        }
     }
 
-    memcpy(array->entries[index].data, data, length);
-    array->entries[index].length = length;
-    array->entries[index].time = unix_time();
-    ++array->last_added;
-    uint64_t ping_id = random_u64();
-    ping_id /= array->total_size;
-    ping_id *= array->total_size;
-    ping_id += index;
+    const uint32_t index = array->last_added % array->total_size;
+    Ping_Array_Entry *const entry = &array->entries[index];
+    const uint64_t now = unix_time();
+    const uint32_t bucket = now % (array->timeout + 1);
 
-    if (ping_id == 0) {
-        ping_id += array->total_size;
+    if (array->bucket_time[bucket] != now) {
+        array->bucket_time[bucket] = now;
+        array->bucket_first[bucket] = array->last_added;
     }
 
-    array->entries[index].ping_id = ping_id;
+    memcpy(array->data + (size_t)index * array->data_size, data, length);
+    entry->length = length;
+    entry->time = now;
+
+    uint64_t ping_id;
+
+    do {
+        ping_id = random_u64();
+        ping_id /= array->max_size;
+        ping_id *= array->max_size;
+        ping_id += array->last_added % array->max_size;
+    } while (ping_id == 0);
+
+    entry->ping_id = ping_id;
+    ++array->last_added;
     return ping_id;
 }
 
@@ -170,26 +256,22 @@ int32_t ping_array_check(Ping_Array *array, uint8_t *data, size_t length, uint64
         return -1;
     }
 
-    uint32_t index = ping_id % array->total_size;
-
-    if (array->entries[index].ping_id != ping_id) {
-        return -1;
-    }
+    const uint32_t index = ping_id % array->total_size;
+    Ping_Array_Entry *const entry = &array->entries[index];
 
-    if (is_timeout(array->entries[index].time, array->timeout)) {
+    if (entry->ping_id != ping_id) {
         return -1;
     }
 
-    if (array->entries[index].length > length) {
+    if (is_timeout(entry->time, array->timeout)) {
         return -1;
     }
 
-    if (array->entries[index].data == nullptr) {
+    if (entry->length > length) {
         return -1;
     }
 
-    memcpy(data, array->entries[index].data, array->entries[index].length);
-    uint32_t len = array->entries[index].length;
-    clear_entry(array, index);
-    return len;
+    memcpy(data, array->data + (size_t)index * array->data_size, entry->length);
+    entry->ping_id = 0;
+    return entry->length;
 }
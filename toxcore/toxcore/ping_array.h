@@ -31,15 +31,23 @@
 typedef struct Ping_Array Ping_Array;
 #endif /* PING_ARRAY_DEFINED */
 
+/* When all entries of a Ping_Array are waiting for replies, it doubles in size
+ * up to this many times the size it was created with. After that the oldest
+ * entry is overwritten.
+ */
+#define PING_ARRAY_MAX_GROWTH 16
+
 /**
  * Initialize a Ping_Array.
- * size represents the total size of the array and should be a power of 2.
+ * size is the number of entries it starts with, rounded up to a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
+ * data_size is the largest length that will be passed to ping_array_add().
+ * metrics counts entries overwritten before their reply, it may be NULL.
  *
  * return 0 on success.
  * return -1 on failure.
  */
-struct Ping_Array *ping_array_new(uint32_t size, uint32_t timeout);
+struct Ping_Array *ping_array_new(uint32_t size, uint32_t timeout, uint32_t data_size, Metrics *metrics);
 
 /**
  * Free all the allocated memory in a Ping_Array.
@@ -48,6 +56,7 @@ void ping_array_kill(struct Ping_Array *_array);
 
 /**
  * Add a data with length to the Ping_Array list and return a ping_id.
+ * length must not be larger than the data_size the array was created with.
  *
  * return ping_id on success.
  * return 0 on failure.
@@ -0,0 +1,231 @@
+/*
+ * Per source token buckets for shedding request floods before the packet
+ * handlers do any crypto work for them.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "rate_limit.h"
+
+#include "crypto_core.h"
+
+#include <pthread.h>
+
+/* Buckets a source can go in. */
+#define RATE_LIMIT_WAYS 4
+
+/* Tokens are counted in thousandths so that a rate in packets per second
+ * refills rate of them per millisecond. */
+#define TOKEN 1000
+
+typedef struct Rate_Limit_Budget {
+    uint32_t rate;
+    uint32_t burst;         /* in thousandths of a token */
+    uint32_t total_rate;    /* of all sources, 0 if not capped */
+    uint32_t total_burst;   /* in thousandths of a token */
+} Rate_Limit_Budget;
+
+typedef struct Rate_Limit_Entry {
+    uint64_t key;   /* hash of the source and packet id, 0 if unused */
+    uint32_t tokens;
+    uint32_t time;  /* low 32 bits of the time of the last refill in ms */
+} Rate_Limit_Entry;
+
+struct Rate_Limit {
+    /* Held while taking a packet, the sockets sharing a limit may be polled
+     * by different threads. */
+    pthread_mutex_t mutex;
+
+    /* Keys the hash so that sources can't be picked to push out each other. */
+    uint64_t seed;
+
+    Rate_Limit_Budget budgets[256];
+    uint64_t dropped[256];
+
+    /* Buckets of all sources, the key is not used. */
+    Rate_Limit_Entry totals[256];
+
+    Rate_Limit_Entry entries[RATE_LIMIT_ENTRIES];
+};
+
+Rate_Limit *new_rate_limit(void)
+{
+    Rate_Limit *limit = (Rate_Limit *)calloc(1, sizeof(Rate_Limit));
+
+    if (limit == nullptr) {
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&limit->mutex, nullptr) != 0) {
+        free(limit);
+        return nullptr;
+    }
+
+    limit->seed = random_u64();
+    return limit;
+}
+
+void kill_rate_limit(Rate_Limit *limit)
+{
+    if (limit == nullptr) {
+        return;
+    }
+
+    pthread_mutex_destroy(&limit->mutex);
+    free(limit);
+}
+
+void rate_limit_set(Rate_Limit *limit, uint8_t packet_id, uint32_t rate, uint32_t burst, uint32_t total_rate)
+{
+    limit->budgets[packet_id].rate = rate;
+    limit->budgets[packet_id].burst = (burst ? burst : 1) * TOKEN;
+    limit->budgets[packet_id].total_rate = total_rate;
+    limit->budgets[packet_id].total_burst = total_rate * TOKEN;
+}
+
+uint64_t rate_limit_dropped(const Rate_Limit *limit, uint8_t packet_id)
+{
+    return limit->dropped[packet_id];
+}
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* return the address or network ip is limited as, 0 if it is not limited.
+ */
+static uint64_t source_of(const IP *ip)
+{
+    if (ip->family == TOX_AF_INET || (ip->family == TOX_AF_INET6 && IPV6_IPV4_IN_V6(ip->ip.v6))) {
+        IP4 ip4;
+
+        if (ip->family == TOX_AF_INET) {
+            ip4 = ip->ip.v4;
+        } else {
+            ip4.uint32 = ip->ip.v6.uint32[3];
+        }
+
+        if (ip4.uint8[0] == 127) {
+            return 0;
+        }
+
+        return 0x100000000ULL | ip4.uint32;
+    }
+
+    if (ip->family == TOX_AF_INET6) {
+        if (ip->ip.v6.uint64[0] == 0 && ip->ip.v6.uint32[2] == 0 && ip->ip.v6.uint32[3] == net_htonl(1)) {
+            return 0;
+        }
+
+        /* One /64 is what a single host or home network usually gets. */
+        return ip->ip.v6.uint64[0];
+    }
+
+    return 0;
+}
+
+/* Add the tokens entry earned at rate since its last refill at now.
+ */
+static void refill(Rate_Limit_Entry *entry, uint32_t rate, uint32_t burst, uint32_t now)
+{
+    const uint64_t tokens = entry->tokens + (uint64_t)(uint32_t)(now - entry->time) * rate;
+    entry->tokens = tokens < burst ? tokens : burst;
+    entry->time = now;
+}
+
+static bool take(Rate_Limit *limit, uint64_t source, uint8_t packet_id, uint64_t now)
+{
+    const Rate_Limit_Budget *budget = &limit->budgets[packet_id];
+    const uint64_t key = mix(mix(source ^ limit->seed) + packet_id) | 1;
+    Rate_Limit_Entry *set = &limit->entries[(key >> 32) & (RATE_LIMIT_ENTRIES - RATE_LIMIT_WAYS)];
+    Rate_Limit_Entry *entry = nullptr;
+    Rate_Limit_Entry *oldest = &set[0];
+
+    for (uint32_t i = 0; i < RATE_LIMIT_WAYS; ++i) {
+        if (set[i].key == key) {
+            entry = &set[i];
+            break;
+        }
+
+        if (set[i].key == 0 || (oldest->key != 0 && (uint32_t)(now - set[i].time) > (uint32_t)(now - oldest->time))) {
+            oldest = &set[i];
+        }
+    }
+
+    if (entry == nullptr) {
+        /* Addresses are cheap to come by, so a new source only gets a few
+         * packets and earns the rest of its burst over time. */
+        entry = oldest;
+        entry->key = key;
+        entry->tokens = RATE_LIMIT_INITIAL * TOKEN < budget->burst ? RATE_LIMIT_INITIAL * TOKEN : budget->burst;
+        entry->time = (uint32_t)now;
+    } else {
+        refill(entry, budget->rate, budget->burst, (uint32_t)now);
+    }
+
+    if (entry->tokens < TOKEN) {
+        ++limit->dropped[packet_id];
+        return 0;
+    }
+
+    Rate_Limit_Entry *total = &limit->totals[packet_id];
+
+    if (budget->total_rate != 0) {
+        refill(total, budget->total_rate, budget->total_burst, (uint32_t)now);
+
+        /* The source keeps its token, it was not the one sending too much. */
+        if (total->tokens < TOKEN) {
+            ++limit->dropped[packet_id];
+            return 0;
+        }
+
+        total->tokens -= TOKEN;
+    }
+
+    entry->tokens -= TOKEN;
+    return 1;
+}
+
+bool rate_limit_take(Rate_Limit *limit, const IP *ip, uint8_t packet_id, uint64_t now)
+{
+    if (limit->budgets[packet_id].rate == 0) {
+        return 1;
+    }
+
+    const uint64_t source = source_of(ip);
+
+    if (source == 0) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&limit->mutex);
+    const bool ret = take(limit, source, packet_id, now);
+    pthread_mutex_unlock(&limit->mutex);
+    return ret;
+}
@@ -0,0 +1,78 @@
+/*
+ * Per source token buckets for shedding request floods before the packet
+ * handlers do any crypto work for them.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Buckets in the table, a power of 2. Sources that don't fit push out the
+ * bucket that was used least recently among the few they can go in.
+ */
+#define RATE_LIMIT_ENTRIES 4096
+
+/* Packets a source that has no bucket yet may send at once. Less than the
+ * burst, so that a flood from many addresses gets little through each of
+ * them.
+ */
+#define RATE_LIMIT_INITIAL 8
+
+typedef struct Rate_Limit Rate_Limit;
+
+/* return NULL on failure.
+ */
+Rate_Limit *new_rate_limit(void);
+
+void kill_rate_limit(Rate_Limit *limit);
+
+/* Allow each source rate packets per second with first byte packet_id, and
+ * bursts of up to burst packets. All sources together may send total_rate of
+ * them per second, with bursts of up to one second's worth. A rate of 0
+ * removes the limit, a total_rate of 0 removes the cap on all sources.
+ */
+void rate_limit_set(Rate_Limit *limit, uint8_t packet_id, uint32_t rate, uint32_t burst, uint32_t total_rate);
+
+/* Take a packet with first byte packet_id from ip out of the bucket of its
+ * source and the bucket of all sources. Sources are IPv4 addresses and IPv6
+ * /64 networks, loopback addresses are never limited. now is the current time
+ * in milliseconds.
+ *
+ * return true if the packet is within the budget of its source and of all sources.
+ * return false if it should be dropped.
+ */
+bool rate_limit_take(Rate_Limit *limit, const IP *ip, uint8_t packet_id, uint64_t now);
+
+/* return the number of packets with first byte packet_id rate_limit_take()
+ * told to drop.
+ */
+uint64_t rate_limit_dropped(const Rate_Limit *limit, uint8_t packet_id);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* RATE_LIMIT_H */
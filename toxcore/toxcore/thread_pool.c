@@ -0,0 +1,231 @@
+/*
+ * Small fixed-size pool of worker threads for offloading CPU heavy jobs.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    thread_pool_job_cb *function;
+    void *object;
+    void *data;
+} Thread_Pool_Job;
+
+struct Thread_Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t job_available;
+    pthread_cond_t jobs_done;
+
+    pthread_t *threads;
+    uint32_t num_threads;
+
+    Thread_Pool_Job *jobs;
+    uint32_t queue_size;
+    uint32_t bottom; /* next job to be taken by a worker */
+    uint32_t num_queued;
+    uint32_t num_pending; /* queued + currently running */
+
+    bool stop;
+};
+
+static void *thread_pool_worker(void *arg)
+{
+    Thread_Pool *pool = (Thread_Pool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (1) {
+        while (pool->num_queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->job_available, &pool->mutex);
+        }
+
+        if (pool->num_queued == 0) {
+            /* stop requested and nothing left to do */
+            break;
+        }
+
+        Thread_Pool_Job job = pool->jobs[pool->bottom];
+        pool->bottom = (pool->bottom + 1) % pool->queue_size;
+        --pool->num_queued;
+
+        pthread_mutex_unlock(&pool->mutex);
+        job.function(job.object, job.data);
+        pthread_mutex_lock(&pool->mutex);
+
+        --pool->num_pending;
+
+        if (pool->num_pending == 0) {
+            pthread_cond_broadcast(&pool->jobs_done);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return nullptr;
+}
+
+Thread_Pool *new_thread_pool(uint32_t num_threads, uint32_t queue_size)
+{
+    if (queue_size == 0) {
+        return nullptr;
+    }
+
+    Thread_Pool *pool = (Thread_Pool *)calloc(1, sizeof(Thread_Pool));
+
+    if (!pool) {
+        return nullptr;
+    }
+
+    if (num_threads == 0) {
+        /* synchronous pool, nothing else to set up */
+        pool->queue_size = queue_size;
+        return pool;
+    }
+
+    pool->jobs = (Thread_Pool_Job *)calloc(queue_size, sizeof(Thread_Pool_Job));
+    pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+
+    if (!pool->jobs || !pool->threads) {
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        goto fail_mutex;
+    }
+
+    if (pthread_cond_init(&pool->job_available, nullptr) != 0) {
+        goto fail_cond1;
+    }
+
+    if (pthread_cond_init(&pool->jobs_done, nullptr) != 0) {
+        goto fail_cond2;
+    }
+
+    pool->queue_size = queue_size;
+
+    for (; pool->num_threads < num_threads; ++pool->num_threads) {
+        if (pthread_create(&pool->threads[pool->num_threads], nullptr, thread_pool_worker, pool) != 0) {
+            break;
+        }
+    }
+
+    if (pool->num_threads == 0) {
+        pthread_cond_destroy(&pool->jobs_done);
+        goto fail_cond2;
+    }
+
+    return pool;
+
+fail_cond2:
+    pthread_cond_destroy(&pool->job_available);
+fail_cond1:
+    pthread_mutex_destroy(&pool->mutex);
+fail_mutex:
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+    return nullptr;
+}
+
+void kill_thread_pool(Thread_Pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    if (pool->num_threads) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->job_available);
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (uint32_t i = 0; i < pool->num_threads; ++i) {
+            pthread_join(pool->threads[i], nullptr);
+        }
+
+        pthread_cond_destroy(&pool->jobs_done);
+        pthread_cond_destroy(&pool->job_available);
+        pthread_mutex_destroy(&pool->mutex);
+    }
+
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+}
+
+uint32_t thread_pool_num_threads(const Thread_Pool *pool)
+{
+    return pool->num_threads;
+}
+
+int thread_pool_add_job(Thread_Pool *pool, thread_pool_job_cb *function, void *object, void *data)
+{
+    if (!function) {
+        return -1;
+    }
+
+    if (pool->num_threads == 0) {
+        function(object, data);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->num_queued == pool->queue_size) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    Thread_Pool_Job *job = &pool->jobs[(pool->bottom + pool->num_queued) % pool->queue_size];
+    job->function = function;
+    job->object = object;
+    job->data = data;
+    ++pool->num_queued;
+    ++pool->num_pending;
+
+    pthread_cond_signal(&pool->job_available);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+void thread_pool_wait(Thread_Pool *pool)
+{
+    if (pool->num_threads == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (pool->num_pending != 0) {
+        pthread_cond_wait(&pool->jobs_done, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
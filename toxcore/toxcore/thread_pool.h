@@ -0,0 +1,69 @@
+/*
+ * Small fixed-size pool of worker threads for offloading CPU heavy jobs.
+ */
+
+/*
+ * Copyright  2016-2017 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+
+#include "ccompat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Thread_Pool Thread_Pool;
+
+typedef void thread_pool_job_cb(void *object, void *data);
+
+/* Create a new pool of num_threads workers able to hold queue_size pending jobs.
+ *
+ * If num_threads is 0 jobs are run synchronously by thread_pool_add_job().
+ *
+ * return NULL on failure.
+ */
+Thread_Pool *new_thread_pool(uint32_t num_threads, uint32_t queue_size);
+
+/* Finish all queued jobs, stop the workers and free the pool.
+ */
+void kill_thread_pool(Thread_Pool *pool);
+
+/* return the number of worker threads in the pool.
+ */
+uint32_t thread_pool_num_threads(const Thread_Pool *pool);
+
+/* Queue function(object, data) to be run on one of the workers.
+ *
+ * return 0 on success.
+ * return -1 if the job queue is full.
+ */
+int thread_pool_add_job(Thread_Pool *pool, thread_pool_job_cb *function, void *object, void *data);
+
+/* Block until every job queued so far has finished running.
+ */
+void thread_pool_wait(Thread_Pool *pool);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* THREAD_POOL_H */
@@ -34,6 +34,7 @@ typedef struct Messenger Tox;
 #include "Messenger.h"
 #include "group.h"
 #include "logger.h"
+#include "util.h"
 
 #include "../toxencryptsave/defines.h"
 
@@ -71,6 +72,10 @@ typedef struct Messenger Tox;
 #error TOX_MAX_STATUS_MESSAGE_LENGTH is assumed to be equal to MAX_STATUSMESSAGE_LENGTH
 #endif
 
+#if TOX_STATS_HISTOGRAM_BUCKETS != METRIC_HISTOGRAM_BUCKETS
+#error TOX_STATS_HISTOGRAM_BUCKETS is assumed to be equal to METRIC_HISTOGRAM_BUCKETS
+#endif
+
 
 bool tox_version_is_compatible(uint32_t major, uint32_t minor, uint32_t patch)
 {
@@ -82,7 +87,7 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
 {
     Messenger_Options m_options = {0};
 
-    bool load_savedata_sk = false, load_savedata_tox = false;
+    bool load_savedata_sk = false, load_savedata_tox = false, load_savedata_file = false;
 
     m_options.client_caps = options->client_capabilities;
 
@@ -115,6 +120,8 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
             }
 
             load_savedata_tox = true;
+        } else if (tox_options_get_savedata_type(options) == TOX_SAVEDATA_TYPE_TOX_SAVE_FILE) {
+            load_savedata_file = true;
         }
 
         m_options.ipv6enabled = tox_options_get_ipv6_enabled(options);
@@ -185,8 +192,33 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         return nullptr;
     }
 
-    if (load_savedata_tox
-            && messenger_load(m, tox_options_get_savedata_data(options), tox_options_get_savedata_length(options)) == -1) {
+    if (load_savedata_file) {
+        const uint8_t *savedata;
+        size_t savedata_length;
+
+        if (map_state_file((const char *)tox_options_get_savedata_data(options), &savedata, &savedata_length) == -1) {
+            tox_kill(m);
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_LOAD_FILE);
+            return nullptr;
+        }
+
+        if (savedata_length >= TOX_ENC_SAVE_MAGIC_LENGTH
+                && crypto_memcmp(savedata, TOX_ENC_SAVE_MAGIC_NUMBER, TOX_ENC_SAVE_MAGIC_LENGTH) == 0) {
+            unmap_state_file(savedata, savedata_length);
+            tox_kill(m);
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_LOAD_ENCRYPTED);
+            return nullptr;
+        }
+
+        if (savedata_length > UINT32_MAX || messenger_load(m, savedata, savedata_length) == -1) {
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_LOAD_BAD_FORMAT);
+        } else {
+            SET_ERROR_PARAMETER(error, TOX_ERR_NEW_OK);
+        }
+
+        unmap_state_file(savedata, savedata_length);
+    } else if (load_savedata_tox
+               && messenger_load(m, tox_options_get_savedata_data(options), tox_options_get_savedata_length(options)) == -1) {
         SET_ERROR_PARAMETER(error, TOX_ERR_NEW_LOAD_BAD_FORMAT);
     } else if (load_savedata_sk) {
         load_secret_key(m->net_crypto, tox_options_get_savedata_data(options));
@@ -223,6 +255,48 @@ void tox_get_savedata(const Tox *tox, uint8_t *savedata, uint8_t save_friends)
     }
 }
 
+void tox_journal_enable(Tox *tox, bool enabled)
+{
+    Messenger *m = tox;
+    messenger_journal_enable(m, enabled);
+}
+
+size_t tox_journal_size(const Tox *tox)
+{
+    const Messenger *m = tox;
+    return messenger_journal_size(m);
+}
+
+void tox_journal_take(Tox *tox, uint8_t *journal)
+{
+    if (journal) {
+        Messenger *m = tox;
+        messenger_journal_take(m, journal);
+    }
+}
+
+bool tox_journal_needs_compaction(const Tox *tox)
+{
+    const Messenger *m = tox;
+    return messenger_journal_needs_compaction(m);
+}
+
+void tox_journal_compacted(Tox *tox)
+{
+    Messenger *m = tox;
+    messenger_journal_compacted(m);
+}
+
+bool tox_journal_load(Tox *tox, const uint8_t *journal, size_t length)
+{
+    if (!journal || length > UINT32_MAX) {
+        return 0;
+    }
+
+    Messenger *m = tox;
+    return messenger_journal_load(m, journal, length) == 0;
+}
+
 bool tox_bootstrap(Tox *tox, const char *address, uint16_t port, const uint8_t *public_key, TOX_ERR_BOOTSTRAP *error)
 {
     if (!address || !public_key) {
@@ -358,6 +432,7 @@ void tox_self_set_nospam(Tox *tox, uint32_t nospam)
 {
     Messenger *m = tox;
     set_nospam(m->fr, net_htonl(nospam));
+    messenger_journal_nospam_keys(m);
 }
 
 uint32_t tox_self_get_nospam(const Tox *tox)
@@ -988,6 +1063,81 @@ bool tox_file_get_file_id(const Tox *tox, uint32_t friend_number, uint32_t file_
     return 0;
 }
 
+static bool set_file_direct_error(int ret, TOX_ERR_FILE_SET_DIRECT *error)
+{
+    switch (ret) {
+        case 0:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_DIRECT_OK);
+            return 1;
+
+        case -1:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_DIRECT_FRIEND_NOT_FOUND);
+            return 0;
+
+        case -2:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_DIRECT_NOT_FOUND);
+            return 0;
+
+        case -3:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_DIRECT_DENIED);
+            return 0;
+
+        default:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_DIRECT_INVALID);
+            return 0;
+    }
+}
+
+bool tox_file_set_buffer(Tox *tox, uint32_t friend_number, uint32_t file_number, uint8_t *buffer, uint64_t length,
+                         TOX_ERR_FILE_SET_DIRECT *error)
+{
+    Messenger *m = tox;
+    return set_file_direct_error(file_set_buffer(m, friend_number, file_number, buffer, length), error);
+}
+
+bool tox_file_set_fd(Tox *tox, uint32_t friend_number, uint32_t file_number, int fd, TOX_ERR_FILE_SET_DIRECT *error)
+{
+    Messenger *m = tox;
+    return set_file_direct_error(file_set_fd(m, friend_number, file_number, fd), error);
+}
+
+bool tox_file_set_priority(Tox *tox, uint32_t friend_number, uint32_t file_number, TOX_FILE_PRIORITY priority,
+                           TOX_ERR_FILE_SET_PRIORITY *error)
+{
+    /* Checked here, file_set_priority() takes a uint8_t which would wrap. */
+    if ((uint32_t)priority > TOX_FILE_PRIORITY_LOW) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_PRIORITY_INVALID);
+        return 0;
+    }
+
+    Messenger *m = tox;
+    int ret = file_set_priority(m, friend_number, file_number, priority);
+
+    switch (ret) {
+        case 0:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_PRIORITY_OK);
+            return 1;
+
+        case -1:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_PRIORITY_FRIEND_NOT_FOUND);
+            return 0;
+
+        case -2:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_PRIORITY_NOT_FOUND);
+            return 0;
+
+        default:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_SET_PRIORITY_INVALID);
+            return 0;
+    }
+}
+
+void tox_callback_file_resume(Tox *tox, tox_file_resume_cb *callback)
+{
+    Messenger *m = tox;
+    callback_file_resume(m, callback);
+}
+
 uint32_t tox_file_send(Tox *tox, uint32_t friend_number, uint32_t kind, uint64_t file_size, const uint8_t *file_id,
                        const uint8_t *filename, size_t filename_length, TOX_ERR_FILE_SEND *error)
 {
@@ -1637,3 +1787,100 @@ uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error)
     SET_ERROR_PARAMETER(error, TOX_ERR_GET_PORT_NOT_BOUND);
     return 0;
 }
+
+uint32_t tox_stats_histogram_buckets(void)
+{
+    return TOX_STATS_HISTOGRAM_BUCKETS;
+}
+
+uint32_t tox_stats_count(void)
+{
+    return METRIC_COUNT;
+}
+
+const char *tox_stats_name(uint32_t index)
+{
+    return metrics_name((Metric_Id)index);
+}
+
+void tox_get_stats(const Tox *tox, uint64_t *stats)
+{
+    if (stats) {
+        const Messenger *m = tox;
+        metrics_snapshot(net_metrics(m->net), stats);
+    }
+}
+
+uint64_t tox_get_packet_stat(const Tox *tox, uint8_t packet_id, TOX_PACKET_STAT stat)
+{
+    const Messenger *m = tox;
+    const Metrics *metrics = net_metrics(m->net);
+
+    switch (stat) {
+        case TOX_PACKET_STAT_PACKETS_RECV:
+            return metrics_atomic_load(&metrics->packets_recv[packet_id]);
+
+        case TOX_PACKET_STAT_BYTES_RECV:
+            return metrics_atomic_load(&metrics->bytes_recv[packet_id]);
+
+        case TOX_PACKET_STAT_PACKETS_SENT:
+            return metrics_atomic_load(&metrics->packets_sent[packet_id]);
+
+        case TOX_PACKET_STAT_BYTES_SENT:
+            return metrics_atomic_load(&metrics->bytes_sent[packet_id]);
+    }
+
+    return 0;
+}
+
+uint32_t tox_stats_histogram_count(void)
+{
+    return METRIC_HISTOGRAM_COUNT;
+}
+
+const char *tox_stats_histogram_name(uint32_t index)
+{
+    return metrics_histogram_name((Metric_Histogram_Id)index);
+}
+
+bool tox_get_stats_histogram(const Tox *tox, uint32_t index, uint64_t *buckets)
+{
+    if (index >= METRIC_HISTOGRAM_COUNT || !buckets) {
+        return 0;
+    }
+
+    const Messenger *m = tox;
+    metrics_histogram_snapshot(net_metrics(m->net), (Metric_Histogram_Id)index, buckets);
+    return 1;
+}
+
+bool tox_stats_set_handler_timing(Tox *tox, bool enabled)
+{
+    Messenger *m = tox;
+    return metrics_set_handler_timing(net_metrics(m->net), enabled) == 0;
+}
+
+uint64_t tox_get_handler_stats(const Tox *tox, TOX_HANDLER_DISPATCH dispatch, uint8_t packet_id, uint64_t *buckets)
+{
+    const Messenger *m = tox;
+    Metric_Dispatch metric_dispatch;
+
+    switch (dispatch) {
+        case TOX_HANDLER_DISPATCH_UDP:
+            metric_dispatch = METRIC_DISPATCH_NET;
+            break;
+
+        case TOX_HANDLER_DISPATCH_CRYPTO_REQUEST:
+            metric_dispatch = METRIC_DISPATCH_CRYPTO;
+            break;
+
+        case TOX_HANDLER_DISPATCH_CONNECTION_DATA:
+            metric_dispatch = METRIC_DISPATCH_DATA;
+            break;
+
+        default:
+            return 0;
+    }
+
+    return metrics_handler_snapshot(net_metrics(m->net), metric_dispatch, packet_id, buckets);
+}
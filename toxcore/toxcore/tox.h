@@ -449,6 +449,14 @@ typedef enum TOX_SAVEDATA_TYPE {
      */
     TOX_SAVEDATA_TYPE_SECRET_KEY,
 
+    /**
+     * Savedata is the NUL terminated path of a file holding data obtained
+     * from tox_get_savedata; the length is the length of the path without
+     * the terminator. The file is memory mapped while tox_new loads it,
+     * instead of the client reading it into a buffer.
+     */
+    TOX_SAVEDATA_TYPE_TOX_SAVE_FILE,
+
 } TOX_SAVEDATA_TYPE;
 
 
@@ -848,6 +856,12 @@ typedef enum TOX_ERR_NEW {
      */
     TOX_ERR_NEW_LOAD_BAD_FORMAT,
 
+    /**
+     * The savedata file passed with TOX_SAVEDATA_TYPE_TOX_SAVE_FILE could not
+     * be opened or was empty.
+     */
+    TOX_ERR_NEW_LOAD_FILE,
+
 } TOX_ERR_NEW;
 
 
@@ -895,6 +909,58 @@ size_t tox_get_savedata_size(const Tox *tox, uint8_t save_friends);
  */
 void tox_get_savedata(const Tox *tox, uint8_t *savedata, uint8_t save_friends);
 
+/**
+ * Start or stop recording savedata journal records.
+ *
+ * Writing the whole savedata after every change gets expensive with many
+ * friends and conferences. With the journal enabled, each change (friend
+ * added or removed, name changed, conference peers changed, periodic DHT node
+ * refresh, ...) is recorded as a small record instead. The client appends the
+ * records returned by tox_journal_take to a journal file kept next to the last
+ * savedata snapshot. On startup the snapshot is passed to tox_new and the
+ * journal to tox_journal_load.
+ *
+ * Disabling the journal discards records not yet taken.
+ */
+void tox_journal_enable(Tox *tox, bool enabled);
+
+/**
+ * Return the size of the journal records not yet taken. Check this after
+ * tox_iterate and after calls changing the saved state.
+ */
+size_t tox_journal_size(const Tox *tox);
+
+/**
+ * Copy the journal records not yet taken into journal and clear them.
+ *
+ * @param journal A memory region of at least tox_journal_size bytes. The
+ *   records must be appended to the journal file as-is.
+ */
+void tox_journal_take(Tox *tox, uint8_t *journal);
+
+/**
+ * Return true if the journal written since the last snapshot has grown large
+ * enough that it should be compacted: store a fresh tox_get_savedata snapshot,
+ * truncate the journal file and call tox_journal_compacted.
+ */
+bool tox_journal_needs_compaction(const Tox *tox);
+
+/**
+ * Tell the instance that a fresh snapshot was stored and the journal file was
+ * truncated. Records not yet taken are part of the snapshot and are discarded.
+ */
+void tox_journal_compacted(Tox *tox);
+
+/**
+ * Replay a journal on top of the savedata the instance was created from.
+ *
+ * If the journal ends with a partially written record, for example after a
+ * crash, all complete records before it are applied and false is returned.
+ *
+ * @return true if the whole journal was replayed.
+ */
+bool tox_journal_load(Tox *tox, const uint8_t *journal, size_t length);
+
 
 /*******************************************************************************
  *
@@ -2083,6 +2149,119 @@ typedef enum TOX_ERR_FILE_GET {
 bool tox_file_get_file_id(const Tox *tox, uint32_t friend_number, uint32_t file_number, uint8_t *file_id,
                           TOX_ERR_FILE_GET *error);
 
+typedef enum TOX_ERR_FILE_SET_DIRECT {
+
+    /**
+     * The function returned successfully.
+     */
+    TOX_ERR_FILE_SET_DIRECT_OK,
+
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    TOX_ERR_FILE_SET_DIRECT_FRIEND_NOT_FOUND,
+
+    /**
+     * No file transfer with the given file number was found for the given friend.
+     */
+    TOX_ERR_FILE_SET_DIRECT_NOT_FOUND,
+
+    /**
+     * The transfer was already accepted.
+     */
+    TOX_ERR_FILE_SET_DIRECT_DENIED,
+
+    /**
+     * The file size is unknown (UINT64_MAX), the buffer is smaller than the
+     * file or the file descriptor is invalid.
+     */
+    TOX_ERR_FILE_SET_DIRECT_INVALID,
+
+} TOX_ERR_FILE_SET_DIRECT;
+
+
+/**
+ * Let toxcore move the data of a file transfer itself.
+ *
+ * For an outgoing transfer, toxcore reads the data from the buffer and sends
+ * it as fast as the connection allows, several pieces per iteration, instead
+ * of triggering `file_chunk_request` for every piece. For an incoming
+ * transfer, received data is written to the buffer instead of triggering
+ * `file_recv_chunk`. Both events are still triggered with length 0 when the
+ * transfer is complete.
+ *
+ * This function must be called before the transfer is accepted: right after
+ * tox_file_send, or from the `file_recv` callback before resuming it. The
+ * buffer may be a memory mapped file. It must hold the whole file and stay
+ * valid until the transfer completes or is cancelled. It is only read from
+ * for outgoing transfers.
+ *
+ * @param friend_number The friend number of the friend the file is being
+ *   transferred to or received from.
+ * @param file_number The friend-specific identifier for the file transfer.
+ * @param buffer Memory region holding (or receiving) the file data.
+ * @param length The size of the memory region.
+ *
+ * @return true on success.
+ */
+bool tox_file_set_buffer(Tox *tox, uint32_t friend_number, uint32_t file_number, uint8_t *buffer, uint64_t length,
+                         TOX_ERR_FILE_SET_DIRECT *error);
+
+/**
+ * Same as tox_file_set_buffer, but data is read from or written to an open
+ * file descriptor at the offset of each piece. The file descriptor must
+ * stay open until the transfer completes or is cancelled.
+ *
+ * If reading or writing fails, the transfer is cancelled and the
+ * `file_recv_control` event is triggered with TOX_FILE_CONTROL_CANCEL.
+ *
+ * @param fd A file descriptor opened for reading (outgoing transfers) or
+ *   writing (incoming transfers).
+ *
+ * @return true on success.
+ */
+bool tox_file_set_fd(Tox *tox, uint32_t friend_number, uint32_t file_number, int fd, TOX_ERR_FILE_SET_DIRECT *error);
+
+/**
+ * @param friend_number The friend number of the friend the file is being
+ *   transferred to or received from.
+ * @param file_number The new identifier for the resumed file transfer. Use
+ *   tox_file_get_file_id to find out which file it is.
+ * @param position For incoming transfers, the number of bytes already
+ *   received. Data is received from this position on. 0 for outgoing
+ *   transfers, whose position is set by the receiver.
+ */
+typedef void tox_file_resume_cb(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                                void *user_data);
+
+
+/**
+ * Set the callback for the `file_resume` event. Pass NULL to unset.
+ *
+ * While this callback is set, file transfers (except avatars and streams)
+ * interrupted by the friend going offline are kept. They are also stored in
+ * the savedata, together with the transfers running when it is saved, so they
+ * survive a restart.
+ *
+ * When the friend comes back online, toxcore offers the outgoing transfers
+ * again with the same file id. When the friend offers an interrupted incoming
+ * transfer again, toxcore seeks past the data already received and accepts
+ * it, instead of triggering `file_recv`. Both trigger this event first, so
+ * that the client can set up the data source or destination, e.g. with
+ * tox_file_set_fd. A source or destination set before the interruption is not
+ * kept, so it must be set again here; otherwise the transfer uses the
+ * `file_chunk_request` and `file_recv_chunk` events. The client may also
+ * cancel the transfer or, for incoming transfers, seek back with
+ * tox_file_seek.
+ *
+ * Received data is hashed in blocks of at least 1 MiB. Transfers are resumed
+ * from the start of the block being received. If the destination was set
+ * with tox_file_set_buffer or tox_file_set_fd, the blocks already written are
+ * checked against their hashes, and the transfer is resumed from the first
+ * one that does not match.
+ */
+void tox_callback_file_resume(Tox *tox, tox_file_resume_cb *callback);
+
 
 /*******************************************************************************
  *
@@ -2190,6 +2369,69 @@ typedef enum TOX_ERR_FILE_SEND {
 uint32_t tox_file_send(Tox *tox, uint32_t friend_number, uint32_t kind, uint64_t file_size, const uint8_t *file_id,
                        const uint8_t *filename, size_t filename_length, TOX_ERR_FILE_SEND *error);
 
+/**
+ * Priority classes of outgoing file transfers.
+ *
+ * The send window of a friend connection is shared by all transfers to that
+ * friend. In every scheduling round, higher classes are served first and send
+ * more chunks per turn; transfers of the same class take turns.
+ */
+typedef enum TOX_FILE_PRIORITY {
+
+    /**
+     * Interactive transfers. Default for avatars and files up to 64 KiB.
+     */
+    TOX_FILE_PRIORITY_HIGH,
+
+    /**
+     * Default for other files.
+     */
+    TOX_FILE_PRIORITY_NORMAL,
+
+    /**
+     * Background transfers.
+     */
+    TOX_FILE_PRIORITY_LOW,
+
+} TOX_FILE_PRIORITY;
+
+
+typedef enum TOX_ERR_FILE_SET_PRIORITY {
+
+    /**
+     * The function returned successfully.
+     */
+    TOX_ERR_FILE_SET_PRIORITY_OK,
+
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    TOX_ERR_FILE_SET_PRIORITY_FRIEND_NOT_FOUND,
+
+    /**
+     * No outgoing file transfer with the given file number was found for the
+     * given friend.
+     */
+    TOX_ERR_FILE_SET_PRIORITY_NOT_FOUND,
+
+    /**
+     * The priority was not a valid TOX_FILE_PRIORITY.
+     */
+    TOX_ERR_FILE_SET_PRIORITY_INVALID,
+
+} TOX_ERR_FILE_SET_PRIORITY;
+
+
+/**
+ * Change the priority class of an outgoing file transfer.
+ *
+ * @param friend_number The friend number of the receiving friend for this file.
+ * @param file_number The file transfer identifier returned by tox_file_send.
+ * @return true on success.
+ */
+bool tox_file_set_priority(Tox *tox, uint32_t friend_number, uint32_t file_number, TOX_FILE_PRIORITY priority,
+                           TOX_ERR_FILE_SET_PRIORITY *error);
+
 typedef enum TOX_ERR_FILE_SEND_CHUNK {
 
     /**
@@ -3109,6 +3351,148 @@ uint16_t tox_self_get_udp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
  */
 uint16_t tox_self_get_tcp_port(const Tox *tox, TOX_ERR_GET_PORT *error);
 
+
+/*******************************************************************************
+ *
+ * :: Statistics
+ *
+ ******************************************************************************/
+
+
+
+/**
+ * Number of buckets filled in by tox_get_stats_histogram.
+ *
+ * Bucket 0 counts the value 0, bucket n counts values in [2^(n-1), 2^n) and
+ * the last bucket also counts all larger values.
+ */
+#define TOX_STATS_HISTOGRAM_BUCKETS    32
+
+/**
+ * Return TOX_STATS_HISTOGRAM_BUCKETS, for bindings that cannot use the macro.
+ */
+uint32_t tox_stats_histogram_buckets(void);
+
+/**
+ * Return the number of counters and gauges in a tox_get_stats snapshot.
+ */
+uint32_t tox_stats_count(void);
+
+/**
+ * Return the name of the statistic at index in a tox_get_stats snapshot,
+ * e.g. "net.packets_recv" or "crypto.packets_resent", or NULL if the index is
+ * out of range. Names stay the same between versions, indices may not.
+ */
+const char *tox_stats_name(uint32_t index);
+
+/**
+ * Copy a snapshot of all counters and gauges of this instance.
+ *
+ * Counters count up from 0 since tox_new. Gauges hold the value last measured
+ * by the subsystem they belong to. Counting is always on and costs one atomic
+ * add per event, so this can be polled at any rate and from any thread.
+ *
+ * @param stats A memory region of at least tox_stats_count() values. If this
+ *   parameter is NULL, this function has no effect.
+ */
+void tox_get_stats(const Tox *tox, uint64_t *stats);
+
+typedef enum TOX_PACKET_STAT {
+
+    /**
+     * Number of UDP packets received with this packet id.
+     */
+    TOX_PACKET_STAT_PACKETS_RECV,
+
+    /**
+     * Number of bytes received in UDP packets with this packet id.
+     */
+    TOX_PACKET_STAT_BYTES_RECV,
+
+    /**
+     * Number of UDP packets sent with this packet id.
+     */
+    TOX_PACKET_STAT_PACKETS_SENT,
+
+    /**
+     * Number of bytes sent in UDP packets with this packet id.
+     */
+    TOX_PACKET_STAT_BYTES_SENT,
+
+} TOX_PACKET_STAT;
+
+/**
+ * Return one of the per packet id counters. The packet id is the first byte of
+ * the UDP packet.
+ */
+uint64_t tox_get_packet_stat(const Tox *tox, uint8_t packet_id, TOX_PACKET_STAT stat);
+
+/**
+ * Return the number of latency histograms kept by the instance.
+ */
+uint32_t tox_stats_histogram_count(void);
+
+/**
+ * Return the name of the histogram at index, e.g. "crypto.rtt_ms", or NULL if
+ * the index is out of range. The name ends with the unit of the values.
+ */
+const char *tox_stats_histogram_name(uint32_t index);
+
+/**
+ * Copy a snapshot of the histogram at index.
+ *
+ * @param buckets A memory region of at least TOX_STATS_HISTOGRAM_BUCKETS values.
+ *
+ * @return true on success, false if the index is out of range.
+ */
+bool tox_get_stats_histogram(const Tox *tox, uint32_t index, uint64_t *buckets);
+
+/**
+ * Places where incoming packets are handed to a handler chosen by packet id.
+ */
+typedef enum TOX_HANDLER_DISPATCH {
+
+    /**
+     * UDP packets, by the first byte of the packet.
+     */
+    TOX_HANDLER_DISPATCH_UDP,
+
+    /**
+     * Encrypted DHT requests (NET_PACKET_CRYPTO) addressed to us, by request id.
+     */
+    TOX_HANDLER_DISPATCH_CRYPTO_REQUEST,
+
+    /**
+     * Lossless and lossy data received on friend connections, by packet id.
+     */
+    TOX_HANDLER_DISPATCH_CONNECTION_DATA,
+
+} TOX_HANDLER_DISPATCH;
+
+/**
+ * Turn timing of packet handlers on or off. Timing is off by default because it
+ * reads the clock twice per packet.
+ *
+ * This must be called from the thread that calls tox_iterate, since the
+ * handlers read the flag and the histograms without locking.
+ *
+ * Times include nested handlers: time spent handling friend connection data
+ * is also counted for the UDP packet that carried it.
+ *
+ * @return true on success, false if memory for the histograms could not be
+ *   allocated.
+ */
+bool tox_stats_set_handler_timing(Tox *tox, bool enabled);
+
+/**
+ * Return the total time in nanoseconds spent in the handler of packet_id, and
+ * copy its histogram of times per packet in nanoseconds to buckets.
+ *
+ * @param buckets A memory region of at least TOX_STATS_HISTOGRAM_BUCKETS
+ *   values. If this parameter is NULL only the total is returned.
+ */
+uint64_t tox_get_handler_stats(const Tox *tox, TOX_HANDLER_DISPATCH dispatch, uint8_t packet_id, uint64_t *buckets);
+
 /**
  * @param friend_number The friend number of the friend
  *   return new len
@@ -38,6 +38,17 @@
 
 #include <time.h>
 
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <io.h>
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 /* don't call into system billions of times for no reason */
 static uint64_t unix_time_value;
@@ -156,6 +167,168 @@ int load_state(load_state_callback_func load_state_callback, Logger *log, void *
     return length == 0 ? 0 : -1;
 }
 
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+
+int map_state_file(const char *path, const uint8_t **data, size_t *length)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (uint64_t)size.QuadPart > SIZE_MAX) {
+        CloseHandle(file);
+        return -1;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+
+    if (mapping == nullptr) {
+        return -1;
+    }
+
+    const void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    /* The view keeps the mapping alive. */
+    CloseHandle(mapping);
+
+    if (view == nullptr) {
+        return -1;
+    }
+
+    *data = (const uint8_t *)view;
+    *length = (size_t)size.QuadPart;
+    return 0;
+}
+
+void unmap_state_file(const uint8_t *data, size_t length)
+{
+    UnmapViewOfFile(data);
+}
+
+/* The CRT has no positional I/O, so these move the file position. */
+int read_file_at(int fd, uint8_t *data, uint32_t length, uint64_t offset)
+{
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) == -1) {
+        return -1;
+    }
+
+    while (length > 0) {
+        const int ret = _read(fd, data, length);
+
+        if (ret <= 0) {
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return 0;
+}
+
+int write_file_at(int fd, const uint8_t *data, uint32_t length, uint64_t offset)
+{
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) == -1) {
+        return -1;
+    }
+
+    while (length > 0) {
+        const int ret = _write(fd, data, length);
+
+        if (ret <= 0) {
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return 0;
+}
+
+#else
+
+int map_state_file(const char *path, const uint8_t **data, size_t *length)
+{
+    const int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* The mapping stays valid after closing the descriptor. */
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+
+    *data = (const uint8_t *)addr;
+    *length = (size_t)st.st_size;
+    return 0;
+}
+
+void unmap_state_file(const uint8_t *data, size_t length)
+{
+    munmap((void *)data, length);
+}
+
+int read_file_at(int fd, uint8_t *data, uint32_t length, uint64_t offset)
+{
+    while (length > 0) {
+        const ssize_t ret = pread(fd, data, length, (off_t)offset);
+
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+int write_file_at(int fd, const uint8_t *data, uint32_t length, uint64_t offset)
+{
+    while (length > 0) {
+        const ssize_t ret = pwrite(fd, data, length, (off_t)offset);
+
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+#endif
+
 int create_recursive_mutex(pthread_mutex_t *mutex)
 {
     pthread_mutexattr_t attr;
@@ -77,6 +77,31 @@ typedef int (*load_state_callback_func)(void *outer, const uint8_t *data, uint32
 int load_state(load_state_callback_func load_state_callback, Logger *log, void *outer,
                const uint8_t *data, uint32_t length, uint16_t cookie_inner);
 
+/* Map the state file at path read-only into memory, so that it can be loaded
+ * without reading it into a buffer first.
+ *
+ * return 0 on success.
+ * return -1 on failure, including an empty file.
+ */
+int map_state_file(const char *path, const uint8_t **data, size_t *length);
+
+/* Unmap a file mapped by map_state_file(). */
+void unmap_state_file(const uint8_t *data, size_t length);
+
+/* Read exactly length bytes at offset from the file open as fd.
+ *
+ * return 0 on success.
+ * return -1 on failure, including reading past the end of the file.
+ */
+int read_file_at(int fd, uint8_t *data, uint32_t length, uint64_t offset);
+
+/* Write length bytes at offset to the file open as fd.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int write_file_at(int fd, const uint8_t *data, uint32_t length, uint64_t offset);
+
 /* Returns -1 if failed or 0 if success */
 int create_recursive_mutex(pthread_mutex_t *mutex);
 
@@ -26,10 +26,14 @@
 #endif
 
 #include "../toxcore/crypto_core.h"
+#include "../toxcore/thread_pool.h"
 #include "defines.h"
 #include "toxencryptsave.h"
 #define SET_ERROR_PARAMETER(param, x) {if(param) {*param = x;}}
 
+#include <pthread.h>
+#include <stdlib.h>
+
 #ifdef VANILLA_NACL
 #include <crypto_hash_sha256.h>
 #include "crypto_pwhash_scryptsalsa208sha256/crypto_pwhash_scryptsalsa208sha256.h"
@@ -71,6 +75,9 @@ bool tox_get_salt(const uint8_t *data, uint8_t *salt)
     return 1;
 }
 
+static bool derive_key_from_passkey(uint8_t *passkey, const uint8_t *salt, TOX_PASS_KEY *out_key,
+                                    TOX_ERR_KEY_DERIVATION *error);
+
 /* Generates a secret symmetric key from the given passphrase. out_key must be at least
  * TOX_PASS_KEY_LENGTH bytes long.
  * Be sure to not compromise the key! Only keep it in memory, do not write to disk.
@@ -104,6 +111,15 @@ bool tox_derive_key_with_salt(const uint8_t *passphrase, size_t pplength, const
     uint8_t passkey[crypto_hash_sha256_BYTES];
     crypto_hash_sha256(passkey, passphrase, pplength);
 
+    return derive_key_from_passkey(passkey, salt, out_key, error);
+}
+
+/* The expensive part of tox_derive_key_with_salt, working on the hashed passphrase.
+ * passkey is zeroed afterwards.
+ */
+static bool derive_key_from_passkey(uint8_t *passkey, const uint8_t *salt, TOX_PASS_KEY *out_key,
+                                    TOX_ERR_KEY_DERIVATION *error)
+{
     uint8_t key[crypto_box_KEYBYTES];
 
     /* Derive a key from the password */
@@ -115,6 +131,7 @@ bool tox_derive_key_with_salt(const uint8_t *passphrase, size_t pplength, const
                 crypto_pwhash_scryptsalsa208sha256_OPSLIMIT_INTERACTIVE * 2, /* slightly stronger */
                 crypto_pwhash_scryptsalsa208sha256_MEMLIMIT_INTERACTIVE) != 0) {
         /* out of memory most likely */
+        sodium_memzero(passkey, crypto_hash_sha256_BYTES);
         SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_FAILED);
         return 0;
     }
@@ -122,6 +139,7 @@ bool tox_derive_key_with_salt(const uint8_t *passphrase, size_t pplength, const
     sodium_memzero(passkey, crypto_hash_sha256_BYTES); /* wipe plaintext pw */
     memcpy(out_key->salt, salt, crypto_pwhash_scryptsalsa208sha256_SALTBYTES);
     memcpy(out_key->key, key, crypto_box_KEYBYTES);
+    sodium_memzero(key, sizeof(key));
     SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_OK);
     return 1;
 }
@@ -295,3 +313,542 @@ bool tox_is_data_encrypted(const uint8_t *data)
 
     return 0;
 }
+
+/* Key cache. */
+
+#define PASS_KEY_CACHE_QUEUE_SIZE 16
+
+typedef struct {
+    TOX_PASS_KEY key;
+    uint64_t last_used;
+    bool used;
+} Pass_Key_Cache_Entry;
+
+struct TOX_PASS_KEY_CACHE {
+    pthread_mutex_t mutex;
+
+    uint8_t passkey[crypto_hash_sha256_BYTES];
+
+    Pass_Key_Cache_Entry *entries;
+    uint32_t max_keys;
+    uint64_t use_counter;
+
+    /* Index of the key used for encryption, -1 until derived. */
+    int32_t encryption_key;
+
+    Thread_Pool *worker;
+};
+
+typedef struct {
+    uint8_t salt[TOX_PASS_SALT_LENGTH];
+    bool random_salt;
+    tox_pass_key_derived_cb *callback;
+    void *user_data;
+} Pass_Key_Derive_Job;
+
+TOX_PASS_KEY_CACHE *tox_pass_key_cache_new(const uint8_t *passphrase, size_t pplength, uint32_t max_keys,
+        TOX_ERR_KEY_DERIVATION *error)
+{
+    if ((!passphrase && pplength != 0) || max_keys == 0) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_NULL);
+        return NULL;
+    }
+
+    TOX_PASS_KEY_CACHE *cache = (TOX_PASS_KEY_CACHE *)calloc(1, sizeof(TOX_PASS_KEY_CACHE));
+
+    if (!cache) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_FAILED);
+        return NULL;
+    }
+
+    cache->entries = (Pass_Key_Cache_Entry *)calloc(max_keys, sizeof(Pass_Key_Cache_Entry));
+
+    if (!cache->entries || pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        free(cache->entries);
+        free(cache);
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_FAILED);
+        return NULL;
+    }
+
+    /* Only the hash is kept, it is all key derivation needs. */
+    crypto_hash_sha256(cache->passkey, passphrase, pplength);
+    cache->max_keys = max_keys;
+    cache->encryption_key = -1;
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_OK);
+    return cache;
+}
+
+void tox_pass_key_cache_kill(TOX_PASS_KEY_CACHE *cache)
+{
+    if (!cache) {
+        return;
+    }
+
+    /* Finishes the derivations still queued. */
+    kill_thread_pool(cache->worker);
+
+    pthread_mutex_destroy(&cache->mutex);
+    sodium_memzero(cache->entries, cache->max_keys * sizeof(Pass_Key_Cache_Entry));
+    sodium_memzero(cache->passkey, sizeof(cache->passkey));
+    free(cache->entries);
+    free(cache);
+}
+
+/* return the index of the cached key for salt, or -1 if there is none.
+ * Must be called with the cache mutex held.
+ */
+static int32_t key_cache_find(TOX_PASS_KEY_CACHE *cache, const uint8_t *salt)
+{
+    uint32_t i;
+
+    for (i = 0; i < cache->max_keys; ++i) {
+        Pass_Key_Cache_Entry *entry = &cache->entries[i];
+
+        if (entry->used && memcmp(entry->key.salt, salt, TOX_PASS_SALT_LENGTH) == 0) {
+            entry->last_used = ++cache->use_counter;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Store key, evicting the least recently used key if the cache is full.
+ * Must be called with the cache mutex held.
+ *
+ * return the index of the stored key.
+ */
+static int32_t key_cache_add(TOX_PASS_KEY_CACHE *cache, const TOX_PASS_KEY *key)
+{
+    int32_t index = key_cache_find(cache, key->salt);
+
+    if (index != -1) {
+        return index;
+    }
+
+    uint32_t i;
+    index = 0;
+
+    for (i = 0; i < cache->max_keys; ++i) {
+        if (!cache->entries[i].used) {
+            index = i;
+            break;
+        }
+
+        if (cache->entries[i].last_used < cache->entries[index].last_used) {
+            index = i;
+        }
+    }
+
+    Pass_Key_Cache_Entry *entry = &cache->entries[index];
+    sodium_memzero(entry, sizeof(Pass_Key_Cache_Entry));
+
+    if (cache->encryption_key == index) {
+        cache->encryption_key = -1;
+    }
+
+    entry->key = *key;
+    entry->used = 1;
+    entry->last_used = ++cache->use_counter;
+    return index;
+}
+
+/* Derive the key for salt, or for a new random salt if random_salt is set, and store it in the cache.
+ * The cache mutex is not held during the derivation itself.
+ */
+static bool key_cache_derive(TOX_PASS_KEY_CACHE *cache, const uint8_t *salt, bool random_salt, TOX_PASS_KEY *out_key,
+                             TOX_ERR_KEY_DERIVATION *error)
+{
+    uint8_t new_salt[TOX_PASS_SALT_LENGTH];
+    uint8_t passkey[crypto_hash_sha256_BYTES];
+
+    if (random_salt) {
+        randombytes(new_salt, sizeof(new_salt));
+        salt = new_salt;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    memcpy(passkey, cache->passkey, sizeof(passkey));
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (!derive_key_from_passkey(passkey, salt, out_key, error)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    const int32_t index = key_cache_add(cache, out_key);
+
+    if (random_salt && cache->encryption_key == -1) {
+        cache->encryption_key = index;
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+    return 1;
+}
+
+bool tox_pass_key_cache_get(TOX_PASS_KEY_CACHE *cache, const uint8_t *salt, TOX_PASS_KEY *out_key,
+                            TOX_ERR_KEY_DERIVATION *error)
+{
+    if (!cache || !out_key) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_NULL);
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    int32_t index;
+
+    if (salt) {
+        index = key_cache_find(cache, salt);
+    } else {
+        index = cache->encryption_key;
+    }
+
+    if (index != -1) {
+        *out_key = cache->entries[index].key;
+        cache->entries[index].last_used = ++cache->use_counter;
+        pthread_mutex_unlock(&cache->mutex);
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_OK);
+        return 1;
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    return key_cache_derive(cache, salt, salt == NULL, out_key, error);
+}
+
+static void key_cache_derive_job(void *object, void *data)
+{
+    TOX_PASS_KEY_CACHE *cache = (TOX_PASS_KEY_CACHE *)object;
+    Pass_Key_Derive_Job *job = (Pass_Key_Derive_Job *)data;
+
+    TOX_PASS_KEY key;
+    TOX_ERR_KEY_DERIVATION error;
+
+    if (key_cache_derive(cache, job->salt, job->random_salt, &key, &error)) {
+        job->callback(cache, &key, error, job->user_data);
+    } else {
+        job->callback(cache, NULL, error, job->user_data);
+    }
+
+    sodium_memzero(&key, sizeof(key));
+    free(job);
+}
+
+bool tox_pass_key_cache_derive_async(TOX_PASS_KEY_CACHE *cache, const uint8_t *salt,
+                                     tox_pass_key_derived_cb *callback, void *user_data, TOX_ERR_KEY_DERIVATION *error)
+{
+    if (!cache || !callback) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_NULL);
+        return 0;
+    }
+
+    Pass_Key_Derive_Job *job = (Pass_Key_Derive_Job *)calloc(1, sizeof(Pass_Key_Derive_Job));
+
+    if (!job) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_FAILED);
+        return 0;
+    }
+
+    if (salt) {
+        memcpy(job->salt, salt, TOX_PASS_SALT_LENGTH);
+    } else {
+        job->random_salt = 1;
+    }
+
+    job->callback = callback;
+    job->user_data = user_data;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    if (!cache->worker) {
+        cache->worker = new_thread_pool(1, PASS_KEY_CACHE_QUEUE_SIZE);
+    }
+
+    Thread_Pool *worker = cache->worker;
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (!worker || thread_pool_add_job(worker, &key_cache_derive_job, cache, job) != 0) {
+        free(job);
+        SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_FAILED);
+        return 0;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_KEY_DERIVATION_OK);
+    return 1;
+}
+
+bool tox_pass_key_cache_encrypt(TOX_PASS_KEY_CACHE *cache, const uint8_t *data, size_t data_len, uint8_t *out,
+                                TOX_ERR_ENCRYPTION *error)
+{
+    TOX_PASS_KEY key;
+    TOX_ERR_KEY_DERIVATION _error;
+
+    if (!tox_pass_key_cache_get(cache, NULL, &key, &_error)) {
+        if (_error == TOX_ERR_KEY_DERIVATION_NULL) {
+            SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_NULL);
+        } else {
+            SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_KEY_DERIVATION_FAILED);
+        }
+
+        return 0;
+    }
+
+    const bool ret = tox_pass_key_encrypt(data, data_len, &key, out, error);
+    sodium_memzero(&key, sizeof(key));
+    return ret;
+}
+
+bool tox_pass_key_cache_decrypt(TOX_PASS_KEY_CACHE *cache, const uint8_t *data, size_t length, uint8_t *out,
+                                TOX_ERR_DECRYPTION *error)
+{
+    if (length <= TOX_PASS_ENCRYPTION_EXTRA_LENGTH) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_INVALID_LENGTH);
+        return 0;
+    }
+
+    if (!cache || !data || !out) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_NULL);
+        return 0;
+    }
+
+    uint8_t salt[TOX_PASS_SALT_LENGTH];
+
+    if (!tox_get_salt(data, salt)) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_BAD_FORMAT);
+        return 0;
+    }
+
+    TOX_PASS_KEY key;
+
+    if (!tox_pass_key_cache_get(cache, salt, &key, NULL)) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_KEY_DERIVATION_FAILED);
+        return 0;
+    }
+
+    const bool ret = tox_pass_key_decrypt(data, length, &key, out, error);
+    sodium_memzero(&key, sizeof(key));
+    return ret;
+}
+
+/* Streaming encryption.
+ *
+ * Produces exactly what tox_pass_key_encrypt does: the xsalsa20poly1305
+ * secretbox is computed incrementally. The first 32 bytes of the key stream
+ * are the poly1305 key, the data is xored with the key stream after them.
+ */
+
+#define PASS_STREAM_BLOCK_SIZE 64
+
+struct TOX_PASS_STREAM {
+    uint8_t key[crypto_box_KEYBYTES];
+    uint8_t header[TOX_PASS_ENCRYPTION_EXTRA_LENGTH];
+    uint64_t offset; /* position in the key stream */
+    bool decrypt;
+
+#ifndef VANILLA_NACL
+    crypto_onetimeauth_poly1305_state auth;
+#endif
+};
+
+#define PASS_STREAM_NONCE_OFFSET (TOX_ENC_SAVE_MAGIC_LENGTH + TOX_PASS_SALT_LENGTH)
+#define PASS_STREAM_MAC_OFFSET (PASS_STREAM_NONCE_OFFSET + crypto_box_NONCEBYTES)
+
+#ifndef VANILLA_NACL
+
+static void pass_stream_xor(TOX_PASS_STREAM *stream, uint8_t *out, const uint8_t *in, size_t length)
+{
+    const uint8_t *nonce = stream->header + PASS_STREAM_NONCE_OFFSET;
+
+    while (length) {
+        const size_t block_offset = stream->offset % PASS_STREAM_BLOCK_SIZE;
+        size_t n;
+
+        if (block_offset == 0 && length >= PASS_STREAM_BLOCK_SIZE) {
+            n = length - length % PASS_STREAM_BLOCK_SIZE;
+            crypto_stream_xsalsa20_xor_ic(out, in, n, nonce, stream->offset / PASS_STREAM_BLOCK_SIZE, stream->key);
+        } else {
+            uint8_t block[PASS_STREAM_BLOCK_SIZE] = {0};
+            crypto_stream_xsalsa20_xor_ic(block, block, sizeof(block), nonce, stream->offset / PASS_STREAM_BLOCK_SIZE,
+                                          stream->key);
+
+            n = PASS_STREAM_BLOCK_SIZE - block_offset;
+
+            if (n > length) {
+                n = length;
+            }
+
+            size_t i;
+
+            for (i = 0; i < n; ++i) {
+                out[i] = in[i] ^ block[block_offset + i];
+            }
+
+            sodium_memzero(block, sizeof(block));
+        }
+
+        stream->offset += n;
+        out += n;
+        in += n;
+        length -= n;
+    }
+}
+
+static TOX_PASS_STREAM *pass_stream_new(const TOX_PASS_KEY *key, const uint8_t *header, bool decrypt)
+{
+    TOX_PASS_STREAM *stream = (TOX_PASS_STREAM *)calloc(1, sizeof(TOX_PASS_STREAM));
+
+    if (!stream) {
+        return NULL;
+    }
+
+    memcpy(stream->key, key->key, crypto_box_KEYBYTES);
+    memcpy(stream->header, header, TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+    stream->decrypt = decrypt;
+
+    uint8_t auth_key[crypto_onetimeauth_poly1305_KEYBYTES] = {0};
+    pass_stream_xor(stream, auth_key, auth_key, sizeof(auth_key));
+    crypto_onetimeauth_poly1305_init(&stream->auth, auth_key);
+    sodium_memzero(auth_key, sizeof(auth_key));
+
+    return stream;
+}
+
+#endif /* VANILLA_NACL */
+
+TOX_PASS_STREAM *tox_pass_stream_encrypt_new(const TOX_PASS_KEY *key, TOX_ERR_ENCRYPTION *error)
+{
+    if (!key) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_NULL);
+        return NULL;
+    }
+
+#ifdef VANILLA_NACL
+    /* NaCl has no incremental poly1305 or key stream offsets. */
+    SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_FAILED);
+    return NULL;
+#else
+    uint8_t header[TOX_PASS_ENCRYPTION_EXTRA_LENGTH] = {0};
+    memcpy(header, TOX_ENC_SAVE_MAGIC_NUMBER, TOX_ENC_SAVE_MAGIC_LENGTH);
+    memcpy(header + TOX_ENC_SAVE_MAGIC_LENGTH, key->salt, TOX_PASS_SALT_LENGTH);
+    random_nonce(header + PASS_STREAM_NONCE_OFFSET);
+
+    TOX_PASS_STREAM *stream = pass_stream_new(key, header, 0);
+
+    if (!stream) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_FAILED);
+        return NULL;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_OK);
+    return stream;
+#endif
+}
+
+bool tox_pass_stream_encrypt(TOX_PASS_STREAM *stream, const uint8_t *data, size_t length, uint8_t *out,
+                             TOX_ERR_ENCRYPTION *error)
+{
+    if (!stream || stream->decrypt || (length && (!data || !out))) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_NULL);
+        return 0;
+    }
+
+#ifndef VANILLA_NACL
+    pass_stream_xor(stream, out, data, length);
+    crypto_onetimeauth_poly1305_update(&stream->auth, out, length);
+#endif
+    SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_OK);
+    return 1;
+}
+
+bool tox_pass_stream_encrypt_finish(TOX_PASS_STREAM *stream, uint8_t *header, TOX_ERR_ENCRYPTION *error)
+{
+    if (!stream || stream->decrypt || !header) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_NULL);
+        return 0;
+    }
+
+#ifndef VANILLA_NACL
+    crypto_onetimeauth_poly1305_final(&stream->auth, stream->header + PASS_STREAM_MAC_OFFSET);
+#endif
+    memcpy(header, stream->header, TOX_PASS_ENCRYPTION_EXTRA_LENGTH);
+    SET_ERROR_PARAMETER(error, TOX_ERR_ENCRYPTION_OK);
+    return 1;
+}
+
+TOX_PASS_STREAM *tox_pass_stream_decrypt_new(const TOX_PASS_KEY *key, const uint8_t *header, TOX_ERR_DECRYPTION *error)
+{
+    if (!key || !header) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_NULL);
+        return NULL;
+    }
+
+    if (memcmp(header, TOX_ENC_SAVE_MAGIC_NUMBER, TOX_ENC_SAVE_MAGIC_LENGTH) != 0) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_BAD_FORMAT);
+        return NULL;
+    }
+
+#ifdef VANILLA_NACL
+    SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_FAILED);
+    return NULL;
+#else
+    TOX_PASS_STREAM *stream = pass_stream_new(key, header, 1);
+
+    if (!stream) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_FAILED);
+        return NULL;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_OK);
+    return stream;
+#endif
+}
+
+bool tox_pass_stream_decrypt(TOX_PASS_STREAM *stream, const uint8_t *data, size_t length, uint8_t *out,
+                             TOX_ERR_DECRYPTION *error)
+{
+    if (!stream || !stream->decrypt || (length && (!data || !out))) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_NULL);
+        return 0;
+    }
+
+#ifndef VANILLA_NACL
+    /* Authenticate the ciphertext before out possibly overwrites it. */
+    crypto_onetimeauth_poly1305_update(&stream->auth, data, length);
+    pass_stream_xor(stream, out, data, length);
+#endif
+    SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_OK);
+    return 1;
+}
+
+bool tox_pass_stream_decrypt_finish(TOX_PASS_STREAM *stream, TOX_ERR_DECRYPTION *error)
+{
+    if (!stream || !stream->decrypt) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_NULL);
+        return 0;
+    }
+
+#ifndef VANILLA_NACL
+    uint8_t mac[crypto_box_MACBYTES];
+    crypto_onetimeauth_poly1305_final(&stream->auth, mac);
+
+    if (crypto_verify_16(mac, stream->header + PASS_STREAM_MAC_OFFSET) != 0) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_FAILED);
+        return 0;
+    }
+
+#endif
+    SET_ERROR_PARAMETER(error, TOX_ERR_DECRYPTION_OK);
+    return 1;
+}
+
+void tox_pass_stream_kill(TOX_PASS_STREAM *stream)
+{
+    if (!stream) {
+        return;
+    }
+
+    sodium_memzero(stream, sizeof(TOX_PASS_STREAM));
+    free(stream);
+}
@@ -236,6 +236,127 @@ bool tox_pass_key_decrypt(const uint8_t *data, size_t length, const TOX_PASS_KEY
  */
 bool tox_is_data_encrypted(const uint8_t *data);
 
+
+/******************************* KEY CACHE *******************************
+ * Key derivation is deliberately slow. Clients that encrypt their savedata on
+ * every autosave, or decrypt data written with several salts, can keep the
+ * derived keys in a cache instead. The cache keeps only a hash of the
+ * passphrase and up to max_keys keys, which are zeroed when evicted or when
+ * the cache is freed. A cache may be used from several threads.
+ */
+
+typedef struct TOX_PASS_KEY_CACHE TOX_PASS_KEY_CACHE;
+
+/* Creates a key cache for the given passphrase, holding at most max_keys keys.
+ * The passphrase can be zeroed by the caller once this returns.
+ *
+ * returns NULL on failure
+ */
+TOX_PASS_KEY_CACHE *tox_pass_key_cache_new(const uint8_t *passphrase, size_t pplength, uint32_t max_keys,
+        TOX_ERR_KEY_DERIVATION *error);
+
+/* Waits for pending asynchronous derivations, then zeroes and frees the cache.
+ */
+void tox_pass_key_cache_kill(TOX_PASS_KEY_CACHE *cache);
+
+/* Copies the key for salt into out_key, deriving and caching it first if needed.
+ * If salt is NULL, the key used for encryption is returned: it is derived
+ * with a random salt the first time and reused afterwards.
+ *
+ * returns true on success
+ */
+bool tox_pass_key_cache_get(TOX_PASS_KEY_CACHE *cache, const uint8_t *salt, TOX_PASS_KEY *out_key,
+                            TOX_ERR_KEY_DERIVATION *error);
+
+/* Called on the cache's worker thread when an asynchronous derivation finished.
+ * key is NULL on failure, and only valid for the duration of the callback.
+ */
+typedef void tox_pass_key_derived_cb(TOX_PASS_KEY_CACHE *cache, const TOX_PASS_KEY *key,
+                                     TOX_ERR_KEY_DERIVATION error, void *user_data);
+
+/* Like tox_pass_key_cache_get, but derives the key on a worker thread and
+ * calls callback when done. Use this to derive the keys ahead of time, e.g.
+ * while the client shows its login screen.
+ *
+ * returns true if the derivation was queued
+ */
+bool tox_pass_key_cache_derive_async(TOX_PASS_KEY_CACHE *cache, const uint8_t *salt,
+                                     tox_pass_key_derived_cb *callback, void *user_data, TOX_ERR_KEY_DERIVATION *error);
+
+/* Same as tox_pass_key_encrypt, with the cached encryption key.
+ *
+ * returns true on success
+ */
+bool tox_pass_key_cache_encrypt(TOX_PASS_KEY_CACHE *cache, const uint8_t *data, size_t data_len, uint8_t *out,
+                                TOX_ERR_ENCRYPTION *error);
+
+/* Same as tox_pass_key_decrypt, with the cached key for the salt of data.
+ *
+ * returns true on success
+ */
+bool tox_pass_key_cache_decrypt(TOX_PASS_KEY_CACHE *cache, const uint8_t *data, size_t length, uint8_t *out,
+                                TOX_ERR_DECRYPTION *error);
+
+
+/******************************* STREAMING *******************************
+ * Encrypts or decrypts large data in chunks, without a second buffer of the
+ * full size. The result is the same as that of tox_pass_key_encrypt: a
+ * TOX_PASS_ENCRYPTION_EXTRA_LENGTH byte header followed by the encrypted data.
+ * The header is only known once all data was encrypted, so leave room for it
+ * in front of the data and write it last. Chunks may be encrypted or decrypted
+ * in place (out == data).
+ *
+ * Not available when built with NaCl instead of libsodium.
+ */
+
+typedef struct TOX_PASS_STREAM TOX_PASS_STREAM;
+
+/* Starts encrypting with a key produced by tox_derive_key_* or the key cache.
+ *
+ * returns NULL on failure
+ */
+TOX_PASS_STREAM *tox_pass_stream_encrypt_new(const TOX_PASS_KEY *key, TOX_ERR_ENCRYPTION *error);
+
+/* Encrypts the next length bytes of data into out.
+ *
+ * returns true on success
+ */
+bool tox_pass_stream_encrypt(TOX_PASS_STREAM *stream, const uint8_t *data, size_t length, uint8_t *out,
+                             TOX_ERR_ENCRYPTION *error);
+
+/* Writes the TOX_PASS_ENCRYPTION_EXTRA_LENGTH byte header to header. Call once,
+ * after the last chunk.
+ *
+ * returns true on success
+ */
+bool tox_pass_stream_encrypt_finish(TOX_PASS_STREAM *stream, uint8_t *header, TOX_ERR_ENCRYPTION *error);
+
+/* Starts decrypting data, header being its first TOX_PASS_ENCRYPTION_EXTRA_LENGTH bytes.
+ * The key must have been derived with the salt in the header (see tox_get_salt).
+ *
+ * returns NULL on failure
+ */
+TOX_PASS_STREAM *tox_pass_stream_decrypt_new(const TOX_PASS_KEY *key, const uint8_t *header, TOX_ERR_DECRYPTION *error);
+
+/* Decrypts the next length bytes of data into out. The output is not
+ * authenticated until tox_pass_stream_decrypt_finish succeeded, so it must not
+ * be used before.
+ *
+ * returns true on success
+ */
+bool tox_pass_stream_decrypt(TOX_PASS_STREAM *stream, const uint8_t *data, size_t length, uint8_t *out,
+                             TOX_ERR_DECRYPTION *error);
+
+/* Checks the authentication tag after the last chunk. Call once.
+ *
+ * returns true if the data was not tampered with and the key was correct
+ */
+bool tox_pass_stream_decrypt_finish(TOX_PASS_STREAM *stream, TOX_ERR_DECRYPTION *error);
+
+/* Zeroes and frees the stream.
+ */
+void tox_pass_stream_kill(TOX_PASS_STREAM *stream);
+
 #ifdef __cplusplus
 }
 #endif
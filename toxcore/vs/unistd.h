@@ -1,2 +1,8 @@
 #pragma once
-#include <stdbool.h>
\ No newline at end of file
+#include <stdbool.h>
+
+/* Only Visual Studio lacks unistd.h, other compilers must still see the system
+ * header when this directory is on the include path. */
+#ifndef _MSC_VER
+#include_next <unistd.h>
+#endif